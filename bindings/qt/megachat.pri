@@ -73,6 +73,7 @@ SOURCES += megachatapi.cpp \
             base/logger.cpp \
             base/cservices.cpp \
             net/websocketsIO.cpp \
+            net/wsReplay.cpp \
             karereDbSchema.cpp \
             net/libwebsocketsIO.cpp \
             waiter/libuvWaiter.cpp
@@ -88,6 +89,7 @@ HEADERS  += asyncTest-framework.h \
             chatdICrypto.h \
             db.h \
             karereId.h \
+            idMap.h \
             presenced.h \
             serverListProvider.h \
             autoHandle.h \
@@ -118,15 +120,21 @@ HEADERS  += asyncTest-framework.h \
             base/cservices.h \
             base/gcmpp.h \
             base/logger.h \
+            base/msgPool.h \
+            base/mpscQueue.h \
             base/loggerFile.h \
             base/loggerConsole.h \
+            base/loggerAsync.h \
             base/retryHandler.h \
             base/promise.h \
             base/services.h \
             base/timers.hpp \
+            base/traceSpans.h \
             base/trackDelete.h \
+            base/workerPool.h \
             net/libwebsocketsIO.h \
             net/websocketsIO.h \
+            net/wsReplay.h \
             rtcModule/IDeviceListImpl.h \
             rtcModule/IRtcCrypto.h \
             rtcModule/IRtcStats.h \
@@ -182,4 +190,5 @@ PRE_TARGETDEPS += karereDbSchema.cpp
 QMAKE_EXTRA_TARGETS += karereDbSchemaTarget
 
 DISTFILES += \
-    $$PWD/../../src/dbSchema.sql
+    $$PWD/../../src/dbSchema.sql \
+    $$PWD/../../src/dbMigrations.sql
@@ -1,6 +1,8 @@
 TEMPLATE = subdirs
 
 SUBDIRS += MEGAchatTests \
+    MEGAchatUnitTests \
+    MEGAchatReplayBench \
     MEGAChatQt \
     MEGAclc
 
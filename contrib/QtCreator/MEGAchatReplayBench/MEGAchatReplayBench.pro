@@ -0,0 +1,12 @@
+CONFIG -= qt
+
+include(../../../bindings/qt/megachat.pri)
+
+TARGET = megachat_replay_bench
+DEPENDPATH += ../../../tests/replay_bench
+INCLUDEPATH += ../../../tests/replay_bench
+SOURCES +=  ../../../tests/replay_bench/replay_bench.cpp
+
+macx {
+    CONFIG += nofreeimage # there are symbols duplicated in libwebrtc.a. Discarded for the moment
+}
@@ -0,0 +1,13 @@
+CONFIG -= qt
+
+include(../../../bindings/qt/megachat.pri)
+
+TARGET = megachat_unit_tests
+DEPENDPATH += ../../../tests/unit_test
+INCLUDEPATH += ../../../tests/unit_test
+SOURCES +=  ../../../tests/unit_test/unit_test.cpp
+HEADERS +=  ../../../tests/unit_test/unit_test.h
+
+macx {
+    CONFIG += nofreeimage # there are symbols duplicated in libwebrtc.a. Discarded for the moment
+}
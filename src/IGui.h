@@ -222,6 +222,22 @@ public:
      */
     virtual void onPresenceChanged(Id /*userid*/, Presence /*pres*/, bool /*inProgress*/) {}
 
+    /**
+     * @brief Called with the presence changes of several peers at once, i.e. the ones
+     * received from presenced during the same event loop iteration
+     *
+     * By default, it calls \c onPresenceChanged for each of them
+     *
+     * @param changes Userids and their new presence
+     */
+    virtual void onPresenceChangedBatch(const presenced::PresenceChanges& changes)
+    {
+        for (auto& change: changes)
+        {
+            onPresenceChanged(change.first, change.second, false);
+        }
+    }
+
     /**
      * @brief Called when the presence preferences have changed due to
      * our or another client of our account updating them.
@@ -2,7 +2,8 @@
 #include "gcm.h"
 #include <memory>
 #include <thread>
-#include <unordered_map>
+#include <vector>
+#include <mutex>
 #include <assert.h>
 #include "cservices-thread.h"
 
@@ -47,70 +48,110 @@ MEGAIO_EXPORT int services_shutdown()
 }
 
 //Handle store
-struct HandleItem
+//It's a slot map: a handle has the index of its slot in the low kHandleIndexBits bits,
+//and the generation of the slot in the rest. Lookups are an array access plus a check
+//of the generation, and a stale handle can only match again after its slot has been
+//reused 2^kHandleGenBits - 1 times. Free slots are reused oldest first to make that
+//less likely. Generations start at 1, so 0 is never a valid handle
+enum: uint32_t
+{
+    kHandleIndexBits = 18,
+    kHandleGenBits = 32 - kHandleIndexBits,
+    kHandleIndexMask = (1u << kHandleIndexBits) - 1,
+    kHandleMaxGen = (1u << kHandleGenBits) - 1,
+    kNoFreeSlot = 0xffffffff
+};
+
+struct HandleSlot
 {
-    unsigned short type;
     void* ptr;
-    HandleItem(unsigned short aType, void* aPtr):type(aType), ptr(aPtr){}
-    bool operator==(const HandleItem& other) const
-    {
-        return ((type == other.type) && (ptr == other.ptr));
-    }
+    unsigned short type;    // 0 if the slot is free
+    unsigned short gen;
+    uint32_t nextFree;
+    HandleSlot(): ptr(nullptr), type(0), gen(1), nextFree(kNoFreeSlot) {}
 };
 
-std::unordered_map<megaHandle, HandleItem> gHandleStore;
-megaHandle gHandleCtr = 0;
+std::vector<HandleSlot> gHandleSlots;
+uint32_t gFreeSlotsHead = kNoFreeSlot;
+uint32_t gFreeSlotsTail = kNoFreeSlot;
+std::mutex gHandleMutex;
+
+static HandleSlot* hstore_get_slot(megaHandle handle)
+{
+    uint32_t index = handle & kHandleIndexMask;
+    if (index >= gHandleSlots.size())
+        return nullptr;
+    HandleSlot& slot = gHandleSlots[index];
+    if (!slot.type || slot.gen != (handle >> kHandleIndexBits))
+        return nullptr;
+    return &slot;
+}
 
 MEGAIO_EXPORT void* services_hstore_get_handle(unsigned short type, megaHandle handle)
 {
-    auto it = gHandleStore.find(handle);
-    if ((it == gHandleStore.end()) || (it->second.type != type))
+    std::lock_guard<std::mutex> lock(gHandleMutex);
+    HandleSlot* slot = hstore_get_slot(handle);
+    if (!slot || slot->type != type)
         return nullptr;
-    return it->second.ptr;
+    return slot->ptr;
 }
 
 MEGAIO_EXPORT megaHandle services_hstore_add_handle(unsigned short type, void* ptr)
 {
-#ifndef NDEBUG
-    megaHandle old = gHandleCtr;
-#endif
-    megaHandle id = ++gHandleCtr;
-#ifndef NDEBUG
-    if (id < old)
+    assert(type);
+    std::lock_guard<std::mutex> lock(gHandleMutex);
+    uint32_t index = gFreeSlotsHead;
+    if (index != kNoFreeSlot)
     {
-        fprintf(stderr, "ERROR: megaHandle id generator wrapped around\n");
-        fflush(stderr);
-        abort();
+        gFreeSlotsHead = gHandleSlots[index].nextFree;
+        if (gFreeSlotsHead == kNoFreeSlot)
+            gFreeSlotsTail = kNoFreeSlot;
     }
-    bool inserted =
-#endif
-    gHandleStore.emplace(std::piecewise_construct,
-                         std::forward_as_tuple(id), std::forward_as_tuple(type, ptr))
-#ifndef NDEBUG
-    .second
-#endif
-    ;
-    assert(inserted);
-    return id;
+    else
+    {
+        index = (uint32_t)gHandleSlots.size();
+        if (index > kHandleIndexMask)
+        {
+            fprintf(stderr, "ERROR: megaHandle store is full (%u handles)\n", index);
+            fflush(stderr);
+            abort();
+        }
+        gHandleSlots.emplace_back();
+    }
+    HandleSlot& slot = gHandleSlots[index];
+    slot.ptr = ptr;
+    slot.type = type;
+    slot.nextFree = kNoFreeSlot;
+    return ((megaHandle)slot.gen << kHandleIndexBits) | index;
 }
 
 MEGAIO_EXPORT int services_hstore_remove_handle(unsigned short type, megaHandle handle)
 {
-    auto it = gHandleStore.find(handle);
-    if (it == gHandleStore.end())
+    std::lock_guard<std::mutex> lock(gHandleMutex);
+    HandleSlot* slot = hstore_get_slot(handle);
+    if (!slot)
     {
 #ifndef NDEBUG
         fprintf(stderr, "ERROR: services_hstore_remove_handle: Handle not found (id=%u, type=%d)\n", handle, type);
 #endif
         return 0;
     }
-    if (it->second.type != type)
+    if (slot->type != type)
     {
-        fprintf(stderr, "ERROR: services_hstore_remove_handle: Handle found, but requested type %u does not match actual type %u\n", type, it->second.type);
+        fprintf(stderr, "ERROR: services_hstore_remove_handle: Handle found, but requested type %u does not match actual type %u\n", type, slot->type);
         fflush(stderr);
         return 0;
     }
-    gHandleStore.erase(it);
+    slot->ptr = nullptr;
+    slot->type = 0;
+    slot->gen = (slot->gen < kHandleMaxGen) ? slot->gen + 1 : 1;
+
+    uint32_t index = handle & kHandleIndexMask;
+    if (gFreeSlotsTail != kNoFreeSlot)
+        gHandleSlots[gFreeSlotsTail].nextFree = index;
+    else
+        gFreeSlotsHead = index;
+    gFreeSlotsTail = index;
     return 1;
 }
 
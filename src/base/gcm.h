@@ -46,6 +46,11 @@ typedef void(*megaMessageFunc)(void*);
 struct megaMessage
 {
     megaMessageFunc func;
+    /** Link used by the queue the message is posted to, so that queueing a message
+     * doesn't allocate. It belongs to that queue, and is not initialized here
+     * because the queue always sets it on push.
+     */
+    struct megaMessage* next;
     /** If we don't provide an initializing constructor, operator new() will initialize
      * func to NULL, and then we will overwrite it, which is inefficient. That's why we
      * implement a constructor in case we are included in C++ code
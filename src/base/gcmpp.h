@@ -6,6 +6,7 @@
 #include "karereCommon.h"
 #include "gcm.h"
 #include "logger.h"
+#include "msgPool.h"
 #include <memory>
 #include <assert.h>
 
@@ -26,6 +27,7 @@ static inline void marshallCall(F&& func, void *appCtx)
         F mFunc;
         Msg(F&& aFunc, megaMessageFunc cHandler)
         : megaMessage(cHandler), mFunc(std::forward<F>(aFunc)){}
+        KR_MSGPOOL_ALLOCATED
 #ifndef NDEBUG
         unsigned magic = 0x3e9a3591;
 #endif
@@ -9,6 +9,7 @@
 #include "logger.h"
 #include "loggerFile.h"
 #include "loggerConsole.h"
+#include "loggerAsync.h"
 #include "../stringUtils.h" //needed for parsing the KRLOG env variable
 #include "sdkApi.h"
 
@@ -93,8 +94,43 @@ void Logger::setAutoFlush(bool enable)
         mFlags |= krLogNoAutoFlush;
 }
 
+void Logger::setAsync(bool enable, size_t capacity, OverflowPolicy policy)
+{
+    std::lock_guard<std::mutex> lock(mAsyncMutex);
+    AsyncLogWriter* writer = mAsyncWriter.exchange(nullptr);
+    if (writer)
+    {
+        // wait for the threads that may still be queuing to it, then output everything
+        while (mAsyncProducers.load())
+            std::this_thread::yield();
+        delete writer;
+    }
+    if (!enable)
+        return;
+
+    mAsyncWriter.store(new AsyncLogWriter(capacity, policy, [this](const AsyncLogWriter::Record& rec)
+    {
+        char info[128];
+        size_t infoLen = prependInfo(info, sizeof(info), rec.hasPrefix ? rec.prefix : NULL,
+            severityName(rec.level, rec.flags), rec.flags, rec.ts);
+        std::string line;
+        line.reserve(infoLen + rec.len);
+        line.append(info, infoLen).append(rec.message(), rec.len);
+        logString(rec.level, line.c_str(), rec.flags, line.size());
+    }));
+}
+
+void Logger::flush()
+{
+    mAsyncProducers++;
+    AsyncLogWriter* writer = mAsyncWriter.load();
+    if (writer)
+        writer->flush();
+    mAsyncProducers--;
+}
+
 Logger::Logger(unsigned aFlags, const char* timeFmt)
-    :mTimeFmt(timeFmt), mFlags(aFlags)
+    :mTimeFmt(timeFmt), mFlags(aFlags), mAsyncWriter(nullptr), mAsyncProducers(0)
 {
     setup();
     setupFromEnvVar();
@@ -103,15 +139,14 @@ Logger::Logger(unsigned aFlags, const char* timeFmt)
 }
 
 inline size_t Logger::prependInfo(char* buf, size_t bufSize, const char* prefix, const char* severity,
-                                  unsigned flags)
+                                  unsigned flags, time_t ts)
 {
     size_t bytesLogged = 0;
     if ((mFlags & krLogNoTimestamps) == 0)
     {
         buf[bytesLogged++] = '[';
-        time_t now = time(NULL);
         struct tm tmbuf;
-        struct tm* tmval = gmtime_r(&now, &tmbuf);
+        struct tm* tmval = gmtime_r(&ts, &tmbuf);
         bytesLogged += strftime(buf+bytesLogged, bufSize-bytesLogged, mTimeFmt.c_str(), tmval);
         buf[bytesLogged++] = ']';
     }
@@ -132,16 +167,32 @@ inline size_t Logger::prependInfo(char* buf, size_t bufSize, const char* prefix,
     return bytesLogged;
 }
 
+inline const char* Logger::severityName(krLogLevel level, unsigned flags)
+{
+    return ((flags & krLogNoLevel) && (level > krLogLevelWarn))
+            ? NULL
+            :krLogLevelNames[level][0];
+}
+
 void Logger::logv(const char* prefix, krLogLevel level, unsigned flags, const char* fmtString,
     va_list aVaList)
 {
     flags |= (mFlags & krGlobalFlagMask);
+    if (mAsyncWriter.load(std::memory_order_relaxed))
+    {
+        // setAsync() doesn't destroy the writer while there are producers
+        mAsyncProducers++;
+        AsyncLogWriter* writer = mAsyncWriter.load();
+        bool queued = writer && writer->push(prefix, level, flags, fmtString, aVaList);
+        mAsyncProducers--;
+        if (queued)
+            return;
+    }
+
     char statBuf[LOGGER_SPRINTF_BUF_SIZE];
     char* buf = statBuf;
     size_t bytesLogged = prependInfo(buf, LOGGER_SPRINTF_BUF_SIZE, prefix,
-        ((flags & krLogNoLevel) && (level > krLogLevelWarn))
-            ? NULL
-            :krLogLevelNames[level][0], flags);
+        severityName(level, flags), flags, time(NULL));
 
     va_list vaList;
     va_copy(vaList, aVaList);
@@ -233,12 +284,14 @@ std::shared_ptr<Logger::LogBuffer> Logger::loadLog()
 {
     if (!mFileLogger)
         return NULL;
+    flush();
     LockGuard lock(mMutex);
     return mFileLogger->loadLog();
 }
 
 Logger::~Logger()
 {
+    setAsync(false);
     LockGuard lock(mMutex);
     if (!mUserLoggers.empty())
     {
@@ -71,6 +71,8 @@ enum { krLogChannelCount = 32 };
 #include <memory>
 #include <mutex>
 #include <map>
+#include <atomic>
+#include <time.h>
 
 class MyMegaApi;
 #define CHATLOGS_PORT 0
@@ -79,12 +81,21 @@ namespace karere
 {
 class FileLogger;
 class ConsoleLogger;
+class AsyncLogWriter;
 
 class KRLOGGER_DLLIMPEXP Logger
 {
 public:
     class ILoggerBackend;
     struct LogBuffer;
+
+    /** @brief What to do with a message when the queue of the asynchronous logging is full */
+    enum OverflowPolicy
+    {
+        kOverflowBlock,         // wait until there is room
+        kOverflowDrop,          // drop the message
+        kOverflowDropVerbose    // drop info and debug messages, wait for warnings and errors
+    };
 protected:
     std::string mTimeFmt;
     inline void setup();
@@ -92,12 +103,20 @@ protected:
     std::unique_ptr<FileLogger> mFileLogger;
     std::unique_ptr<ConsoleLogger> mConsoleLogger;
     volatile unsigned mFlags;
-    size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags);
+    size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags,
+                       time_t ts);
+    const char* severityName(krLogLevel level, unsigned flags);
 
     /** This is the low-level log function that does the actual logging
      *  of an assembled single string */
     void logString(krLogLevel level, const char* msg, unsigned flags, size_t len=(size_t)-1);
     std::map<std::string, ILoggerBackend*> mUserLoggers;
+
+    // if not NULL, messages are queued and output by its thread
+    std::atomic<AsyncLogWriter*> mAsyncWriter;
+    // threads that may be queuing a message right now
+    std::atomic<int> mAsyncProducers;
+    std::mutex mAsyncMutex;   // serializes setAsync()
 public:
     std::recursive_mutex mMutex;
     typedef std::lock_guard<std::recursive_mutex> LockGuard;
@@ -113,6 +132,22 @@ public:
     void logToConsoleUseColors(bool useColors);
     void logToFile(const char* fileName, size_t rotateSize);
     void setAutoFlush(bool enable=true);
+
+    /** @brief Enables or disables asynchronous logging
+     *
+     * When enabled, the calling thread only formats the message and queues it, and a
+     * background thread does the rest, including all the output to the console, the log
+     * file and the user loggers. Then, user loggers are called from that thread.
+     * Disabling it outputs any queued message before returning.
+     *
+     * @param capacity Max number of queued messages
+     * @param policy What to do with messages that don't fit in the queue
+     */
+    void setAsync(bool enable, size_t capacity = 4096, OverflowPolicy policy = kOverflowDropVerbose);
+    bool isAsync() const { return mAsyncWriter.load() != nullptr; }
+
+    /** @brief Waits until all the queued messages have been output, if logging is asynchronous */
+    void flush();
     Logger(unsigned flags = 0, const char* timeFmt="%m-%d %H:%M:%S");
     void logv(const char* prefix, krLogLevel level, unsigned flags, const char* fmtString, va_list aVaList);
     void log(const char* prefix, krLogLevel level, unsigned flags,
@@ -0,0 +1,303 @@
+#ifndef LOGGERASYNC_H
+#define LOGGERASYNC_H
+
+#include "logger.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace karere
+{
+/** @brief Queues log records in a bounded lock-free ring, and outputs them from a
+ * background thread
+ *
+ * Producers only format the message itself (its arguments may not outlive the call),
+ * directly into a slot of the ring, which they claim with a CAS. The timestamp, level
+ * and channel prefix, and all the output to the console, the log file (including its
+ * rotation) and the user loggers, are done by the writer thread. Records of the same
+ * thread are output in order.
+ *
+ * When the ring is full, the \c Logger::OverflowPolicy decides whether producers wait for the
+ * writer or the record is dropped. Dropped records are counted and reported in the log.
+ */
+class AsyncLogWriter
+{
+public:
+    typedef Logger::OverflowPolicy OverflowPolicy;
+    enum { kInlineTextSize = 400 };
+
+    struct Record
+    {
+        std::atomic<size_t> seq;
+        krLogLevel level;
+        unsigned flags;
+        time_t ts;
+        bool hasPrefix;
+        char prefix[32];
+        size_t len;
+        char* longText;     // the message, if it doesn't fit in text
+        char text[kInlineTextSize];
+        const char* message() const { return longText ? longText : text; }
+    };
+
+    typedef std::function<void(const Record&)> OutputFunc;
+
+protected:
+    std::vector<Record> mRing;
+    size_t mMask;
+    const OverflowPolicy mPolicy;
+    OutputFunc mOutput;
+    std::atomic<size_t> mEnqueuePos;
+    std::atomic<size_t> mDequeuePos;
+    std::atomic<size_t> mDropped;
+    std::atomic<bool> mSleeping;
+    std::atomic<bool> mStop;
+    std::mutex mMutex;
+    std::condition_variable mWakeCv;
+    std::condition_variable mDrainedCv;
+    std::thread mThread;
+
+    static bool& isWriterThread()
+    {
+        static thread_local bool writer = false;
+        return writer;
+    }
+
+    bool mustWait(krLogLevel level) const
+    {
+        return mPolicy == Logger::kOverflowBlock || (mPolicy == Logger::kOverflowDropVerbose && level <= krLogLevelWarn);
+    }
+
+    // claims the next free slot, or returns NULL if the ring is full
+    Record* tryClaim(size_t& pos)
+    {
+        pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Record& rec = mRing[pos & mMask];
+            size_t seq = rec.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    return &rec;
+                }
+            }
+            else if (diff < 0)
+            {
+                return nullptr;
+            }
+            else
+            {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // the oldest record, if it has been published already
+    Record* front()
+    {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        Record& rec = mRing[pos & mMask];
+        return (rec.seq.load(std::memory_order_acquire) == pos + 1) ? &rec : nullptr;
+    }
+
+    void release(Record& rec)
+    {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        delete[] rec.longText;
+        rec.longText = nullptr;
+        rec.seq.store(pos + mMask + 1, std::memory_order_release);
+        mDequeuePos.store(pos + 1, std::memory_order_release);
+    }
+
+    void wakeWriter()
+    {
+        // pairs with the fence in run(), so either we see it sleeping or it sees our record
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mSleeping.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mWakeCv.notify_one();
+        }
+    }
+
+    void outputDropped()
+    {
+        size_t dropped = mDropped.exchange(0, std::memory_order_relaxed);
+        if (!dropped)
+        {
+            return;
+        }
+        Record rec;
+        rec.level = krLogLevelWarn;
+        rec.flags = 0;
+        rec.ts = time(NULL);
+        rec.hasPrefix = true;
+        strcpy(rec.prefix, "LOGGER");
+        rec.longText = nullptr;
+        rec.len = snprintf(rec.text, sizeof(rec.text), "%zu log messages were dropped, the log queue was full\n", dropped);
+        mOutput(rec);
+    }
+
+    void drain()
+    {
+        outputDropped();
+        while (Record* rec = front())
+        {
+            // flush the output only after the last record of the batch
+            size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+            if (mRing[(pos + 1) & mMask].seq.load(std::memory_order_acquire) == pos + 2)
+            {
+                rec->flags |= krLogNoAutoFlush;
+            }
+            mOutput(*rec);
+            release(*rec);
+        }
+        std::lock_guard<std::mutex> lock(mMutex);
+        mDrainedCv.notify_all();
+    }
+
+    void run()
+    {
+        isWriterThread() = true;
+        for (;;)
+        {
+            // anything queued before stop() is output by the drain that follows
+            bool stop = mStop.load(std::memory_order_acquire);
+            drain();
+            if (stop)
+            {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(mMutex);
+            mSleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!front() && !mStop.load(std::memory_order_acquire))
+            {
+                // the timeout only matters if a wakeup was missed
+                mWakeCv.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            mSleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    /** @param capacity Number of records of the ring. It's rounded up to a power of two */
+    AsyncLogWriter(size_t capacity, OverflowPolicy policy, OutputFunc&& output)
+    : mPolicy(policy), mOutput(std::move(output)), mEnqueuePos(0), mDequeuePos(0),
+      mDropped(0), mSleeping(false), mStop(false)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        std::vector<Record> ring(size);
+        mRing.swap(ring);
+        mMask = size - 1;
+        for (size_t i = 0; i < size; i++)
+        {
+            mRing[i].seq.store(i, std::memory_order_relaxed);
+            mRing[i].longText = nullptr;
+        }
+        mThread = std::thread(&AsyncLogWriter::run, this);
+    }
+
+    AsyncLogWriter(const AsyncLogWriter&) = delete;
+    AsyncLogWriter& operator=(const AsyncLogWriter&) = delete;
+
+    /** @brief Outputs all the queued records and stops the writer thread. Nothing
+     * must be pushed after calling it */
+    ~AsyncLogWriter()
+    {
+        mStop.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mWakeCv.notify_one();
+        }
+        mThread.join();
+    }
+
+    /** @brief Queues a record. Can be called from any thread.
+     * @return false if the record could not be queued, because it's logged from the writer
+     * thread itself (i.e. by a logger backend). In that case the caller must output it.
+     */
+    bool push(const char* prefix, krLogLevel level, unsigned flags, const char* fmtString, va_list aVaList)
+    {
+        if (isWriterThread())
+        {
+            return false;
+        }
+
+        size_t pos;
+        Record* rec;
+        while (!(rec = tryClaim(pos)))
+        {
+            if (!mustWait(level))
+            {
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            wakeWriter();
+            std::this_thread::yield();
+        }
+
+        rec->level = level;
+        rec->flags = flags;
+        rec->ts = time(NULL);
+        rec->hasPrefix = (prefix != nullptr);
+        if (prefix)
+        {
+            strncpy(rec->prefix, prefix, sizeof(rec->prefix) - 1);
+            rec->prefix[sizeof(rec->prefix) - 1] = 0;
+        }
+        va_list vaList;
+        va_copy(vaList, aVaList);
+        int len = vsnprintf(rec->text, kInlineTextSize, fmtString, vaList);
+        va_end(vaList);
+        if (len < 0)
+        {
+            len = 0;
+            rec->text[0] = 0;
+        }
+        else if (len >= kInlineTextSize)
+        {
+            rec->longText = new char[len + 1];
+            va_copy(vaList, aVaList);
+            vsnprintf(rec->longText, len + 1, fmtString, vaList);
+            va_end(vaList);
+        }
+        rec->len = len;
+        rec->seq.store(pos + 1, std::memory_order_release);
+        wakeWriter();
+        return true;
+    }
+
+    /** @brief Waits until everything queued so far has been output */
+    void flush()
+    {
+        if (isWriterThread())
+        {
+            return;
+        }
+        size_t target = mEnqueuePos.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWakeCv.notify_one();
+        mDrainedCv.wait(lock, [this, target]()
+        {
+            return (intptr_t)(mDequeuePos.load(std::memory_order_acquire) - target) >= 0;
+        });
+    }
+};
+}
+#endif // LOGGERASYNC_H
@@ -0,0 +1,267 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+
+namespace karere
+{
+/** @brief Intrusive, lock-free multiple-producer/single-consumer queue
+ *
+ * Items are linked through their own \c Next member, so pushing never allocates.
+ * Producers prepend to a shared list with a CAS. The consumer takes the whole list
+ * with a single exchange and reverses it, which restores the FIFO order and lets it
+ * process everything that was queued in one go (see \c popAll).
+ *
+ * Any thread can \c push. All the other methods belong to the consumer, and callers
+ * must make sure that only one thread at a time uses them.
+ */
+template <class T, T* T::*Next>
+class MpscQueue
+{
+protected:
+    std::atomic<T*> mHead;  // pushed items, newest first
+    T* mReady = nullptr;    // items already taken by the consumer, oldest first
+
+    // Takes all the pushed items and returns them oldest first
+    T* takePushed(size_t* count)
+    {
+        T* item = mHead.exchange(nullptr, std::memory_order_acquire);
+        T* reversed = nullptr;
+        size_t n = 0;
+        while (item)
+        {
+            T* next = item->*Next;
+            item->*Next = reversed;
+            reversed = item;
+            item = next;
+            n++;
+        }
+        if (count)
+        {
+            *count = n;
+        }
+        return reversed;
+    }
+
+public:
+    MpscQueue(): mHead(nullptr) {}
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    /** @brief Queues an item. Can be called from any thread.
+     * @return Whether the queue was empty, as seen by the producers
+     */
+    bool push(T* item)
+    {
+        T* head = mHead.load(std::memory_order_relaxed);
+        do
+        {
+            item->*Next = head;
+        }
+        while (!mHead.compare_exchange_weak(head, item, std::memory_order_release, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    /** @brief Dequeues the oldest item, or returns NULL if the queue is empty
+     * @param count If not NULL, receives the number of pushed items that had
+     * to be taken to serve this call (zero if they were already taken)
+     */
+    T* pop(size_t* count = nullptr)
+    {
+        if (count)
+        {
+            *count = 0;
+        }
+        if (!mReady)
+        {
+            mReady = takePushed(count);
+            if (!mReady)
+            {
+                return nullptr;
+            }
+        }
+        T* item = mReady;
+        mReady = item->*Next;
+        item->*Next = nullptr;
+        return item;
+    }
+
+    /** @brief Dequeues all the items at once.
+     * @return The oldest item, linked to the rest of them in FIFO order
+     * through \c Next, or NULL if the queue is empty.
+     * @param count If not NULL, receives the number of items that were
+     * pushed since the previous call (items left by \c pop not included)
+     */
+    T* popAll(size_t* count = nullptr)
+    {
+        T* batch = takePushed(count);
+        if (!mReady)
+        {
+            return batch;
+        }
+        T* items = mReady;
+        mReady = nullptr;
+        T* last = items;
+        while (last->*Next)
+        {
+            last = last->*Next;
+        }
+        last->*Next = batch;
+        return items;
+    }
+
+    /** @brief Calls \c func for every queued item, without dequeuing them.
+     * Items pushed concurrently may or may not be visited.
+     */
+    template <class F>
+    void forEach(F&& func)
+    {
+        for (T* item = mReady; item; item = item->*Next)
+        {
+            func(item);
+        }
+        // newest first, but producers never modify items already linked
+        for (T* item = mHead.load(std::memory_order_acquire); item; item = item->*Next)
+        {
+            func(item);
+        }
+    }
+
+    bool empty() const
+    {
+        return !mReady && !mHead.load(std::memory_order_acquire);
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        forEach([&n](T*) { n++; });
+        return n;
+    }
+};
+
+/** @brief Histogram with power-of-two buckets: bucket N counts the values in [2^(N-1), 2^N) */
+class Log2Histogram
+{
+public:
+    enum { kBuckets = 32 };
+
+protected:
+    uint64_t mBuckets[kBuckets] = {};
+    uint64_t mCount = 0;
+    uint64_t mMax = 0;
+
+public:
+    void add(uint64_t value)
+    {
+        int bucket = 0;
+        while (bucket < kBuckets - 1 && (value >> bucket))
+        {
+            bucket++;
+        }
+        mBuckets[bucket]++;
+        mCount++;
+        if (value > mMax)
+        {
+            mMax = value;
+        }
+    }
+
+    uint64_t count() const { return mCount; }
+    uint64_t max() const { return mMax; }
+
+    /** @brief Returns an upper bound of the given percentile (0-100) */
+    uint64_t percentile(unsigned pct) const
+    {
+        uint64_t target = (mCount * pct + 99) / 100;
+        uint64_t seen = 0;
+        for (int i = 0; i < kBuckets; i++)
+        {
+            seen += mBuckets[i];
+            if (seen && seen >= target)
+            {
+                uint64_t bound = i ? (((uint64_t)1 << i) - 1) : 0;
+                return bound < mMax ? bound : mMax;
+            }
+        }
+        return mMax;
+    }
+
+    std::string toString() const
+    {
+        return "n=" + std::to_string(mCount)
+                + " p50<=" + std::to_string(percentile(50))
+                + " p90<=" + std::to_string(percentile(90))
+                + " p99<=" + std::to_string(percentile(99))
+                + " max=" + std::to_string(mMax);
+    }
+
+    void reset()
+    {
+        *this = Log2Histogram();
+    }
+};
+
+/** @brief Depth and latency histograms of a queue drained in batches
+ *
+ * The depth is the number of items taken at once by the consumer. The latency is the
+ * time the oldest item of a batch waited (in microseconds), taken from the moment a
+ * producer found the queue empty. If that producer stores the timestamp after the
+ * consumer already drained its item, the sample is skipped.
+ */
+class QueueStats
+{
+protected:
+    std::atomic<int64_t> mNonEmptySince;
+    Log2Histogram mDepth;
+    Log2Histogram mLatency;
+
+    static int64_t nowUs()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    QueueStats(): mNonEmptySince(0) {}
+
+    // producer side, when push() reports that the queue was empty
+    void onFirstPush()
+    {
+        mNonEmptySince.store(nowUs(), std::memory_order_relaxed);
+    }
+
+    // consumer side
+    void onBatch(size_t count)
+    {
+        if (!count)
+        {
+            return;
+        }
+        mDepth.add(count);
+        int64_t since = mNonEmptySince.exchange(0, std::memory_order_relaxed);
+        if (since)
+        {
+            int64_t waited = nowUs() - since;
+            mLatency.add(waited > 0 ? waited : 0);
+        }
+    }
+
+    const Log2Histogram& depth() const { return mDepth; }
+    const Log2Histogram& latency() const { return mLatency; }
+
+    std::string toString() const
+    {
+        return "depth: " + mDepth.toString() + ", latency (us): " + mLatency.toString();
+    }
+
+    void reset()
+    {
+        mDepth.reset();
+        mLatency.reset();
+    }
+};
+}
+#endif // MPSCQUEUE_H
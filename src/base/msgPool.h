@@ -0,0 +1,238 @@
+#ifndef MSGPOOL_H
+#define MSGPOOL_H
+#include <atomic>
+#include <new>
+#include <thread>
+#include <stddef.h>
+
+namespace karere
+{
+/** @brief Recycles the memory of the short-lived objects of the Gui Call Marshaller:
+ * the messages of marshallCall() and the timers of setTimeout()/setInterval().
+ *
+ * Blocks are grouped in a few size classes (64 to 512 bytes). Each thread keeps its own
+ * free list of each class, without locking, as the pool of promises does. But messages
+ * are created by any thread and deleted by the GUI thread, so blocks only flow towards
+ * the GUI thread: a thread that caches more than \c kMaxCachedBlocks of a class moves
+ * \c kBatchBlocks of them to a shared list, protected by a spinlock, and a thread whose
+ * list is empty takes a batch from there. So the lock is taken once per batch. The shared
+ * list of each class keeps at most \c kMaxFreeBlocks blocks, and bigger objects are
+ * allocated normally.
+ *
+ * Classes use it by declaring their operator new/delete with \c KR_MSGPOOL_ALLOCATED.
+ */
+class MsgPool
+{
+public:
+    enum
+    {
+        kClassCount = 4,
+        kMinBlockSize = 64,
+        kMaxBlockSize = kMinBlockSize << (kClassCount - 1),
+        kMaxFreeBlocks = 1024,
+        kMaxCachedBlocks = 64,
+        kBatchBlocks = 32
+    };
+
+    static void* alloc(size_t size)
+    {
+        int cls = sizeClass(size);
+        if (cls < 0)
+        {
+            return ::operator new(size);
+        }
+        ThreadCache& cache = threadCache();
+        if (!cache.heads[cls] && !cache.exited)
+        {
+            ensureReaper(cache);
+            moveBlocks(sharedLists()[cls], cache, cls, kBatchBlocks);
+        }
+        Block* block = cache.heads[cls];
+        if (!block)
+        {
+            return ::operator new(kMinBlockSize << cls);
+        }
+        cache.heads[cls] = block->next;
+        cache.counts[cls]--;
+        return block;
+    }
+
+    static void free(void* ptr, size_t size)
+    {
+        int cls = sizeClass(size);
+        if (cls < 0)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        ThreadCache& cache = threadCache();
+        if (cache.exited)
+        {
+            // the thread is exiting and its cache is gone: straight to the shared list
+            ThreadCache single = ThreadCache();
+            single.heads[cls] = static_cast<Block*>(ptr);
+            single.heads[cls]->next = nullptr;
+            moveBlocks(single, sharedLists()[cls], cls, 1);
+            return;
+        }
+        ensureReaper(cache);
+        Block* block = static_cast<Block*>(ptr);
+        block->next = cache.heads[cls];
+        cache.heads[cls] = block;
+        if (++cache.counts[cls] > kMaxCachedBlocks)
+        {
+            moveBlocks(cache, sharedLists()[cls], cls, kBatchBlocks);
+        }
+    }
+
+protected:
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct ThreadCache
+    {
+        Block* heads[kClassCount];
+        unsigned counts[kClassCount];
+        bool hasReaper;
+        bool exited;
+    };
+
+    struct SharedList
+    {
+        std::atomic<bool> locked;
+        Block* head = nullptr;
+        unsigned count = 0;
+        SharedList(): locked(false) {}
+        void lock()
+        {
+            while (locked.exchange(true, std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+        }
+        void unlock()
+        {
+            locked.store(false, std::memory_order_release);
+        }
+    };
+
+    // returns the cached blocks to the shared lists when the thread exits
+    struct Reaper
+    {
+        ~Reaper()
+        {
+            ThreadCache& cache = threadCache();
+            cache.exited = true;
+            for (int cls = 0; cls < kClassCount; cls++)
+            {
+                moveBlocks(cache, sharedLists()[cls], cls, cache.counts[cls]);
+            }
+        }
+    };
+
+    static void ensureReaper(ThreadCache& cache)
+    {
+        if (!cache.hasReaper)
+        {
+            cache.hasReaper = true;
+            static thread_local Reaper reaper;
+            (void)reaper;
+        }
+    }
+
+    // moves up to \c count blocks of the shared list to the cache of this thread
+    static void moveBlocks(SharedList& from, ThreadCache& to, int cls, unsigned count)
+    {
+        from.lock();
+        for (; count && from.head; count--)
+        {
+            Block* block = from.head;
+            from.head = block->next;
+            from.count--;
+            block->next = to.heads[cls];
+            to.heads[cls] = block;
+            to.counts[cls]++;
+        }
+        from.unlock();
+    }
+
+    // moves \c count blocks of the cache of this thread to the shared list, or frees them
+    // if it's full
+    static void moveBlocks(ThreadCache& from, SharedList& to, int cls, unsigned count)
+    {
+        Block* first = from.heads[cls];
+        Block* last = nullptr;
+        unsigned moved = 0;
+        for (Block* block = first; block && moved < count; block = block->next)
+        {
+            last = block;
+            moved++;
+        }
+        if (!moved)
+        {
+            return;
+        }
+        from.heads[cls] = last->next;
+        from.counts[cls] -= moved;
+
+        to.lock();
+        bool fits = (to.count + moved <= kMaxFreeBlocks);
+        if (fits)
+        {
+            last->next = to.head;
+            to.head = first;
+            to.count += moved;
+        }
+        to.unlock();
+        if (!fits)
+        {
+            last->next = nullptr;
+            while (first)
+            {
+                Block* next = first->next;
+                ::operator delete(first);
+                first = next;
+            }
+        }
+    }
+
+    static int sizeClass(size_t size)
+    {
+        if (size > kMaxBlockSize)
+        {
+            return -1;
+        }
+        int cls = 0;
+        while ((size_t)(kMinBlockSize << cls) < size)
+        {
+            cls++;
+        }
+        return cls;
+    }
+
+    static ThreadCache& threadCache()
+    {
+        static thread_local ThreadCache cache;  // zero-initialized
+        return cache;
+    }
+
+    // Never destroyed, since messages may still be deleted during static destruction
+    static SharedList* sharedLists()
+    {
+        static SharedList* lists = new SharedList[kClassCount];
+        return lists;
+    }
+};
+}
+
+/** Declares class-specific operator new/delete that allocate from karere::MsgPool.
+ * The class must always be deleted through a pointer of its own type (the size of the
+ * block is taken from it), and must not be over-aligned.
+ */
+#define KR_MSGPOOL_ALLOCATED \
+    static void* operator new(size_t size) { return karere::MsgPool::alloc(size); } \
+    static void operator delete(void* ptr, size_t size) { karere::MsgPool::free(ptr, size); }
+
+#endif // MSGPOOL_H
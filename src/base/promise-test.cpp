@@ -5,10 +5,46 @@
 #include <asyncTest-framework.h>
 #define PROMISE_ON_UNHANDLED_ERROR testUnhandledError
 #include <promise.h>
+#include <chrono>
+#include <new>
 
 TESTS_INIT();
 using namespace promise;
 
+// heap allocations made by the benchmarks
+size_t gNumAllocs = 0;
+
+void* operator new(size_t size)
+{
+    gNumAllocs++;
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+// runs \c func \c count times, and logs the operations per second and the allocations per operation
+template <class F>
+size_t benchmark(const char* name, size_t count, F&& func)
+{
+    for (size_t i = 0; i < count / 10; i++) // warm up
+        func(i);
+
+    size_t allocs = gNumAllocs;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+        func(i);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    allocs = gNumAllocs - allocs;
+    TEST_LOG("    %s: %.0f ops/s, %.2f allocations/op", name, count / secs, (double)allocs / count);
+    return allocs;
+}
+
 std::function<void(const std::string&, int, int)> gUnhandledHandler =
 [](const std::string& msg, int type, int code)
 {
@@ -629,6 +665,65 @@ TestGroup("Unhandled promise fail")
         loop.schedCall([pms]() mutable { pms.reject("test"); });
     });
 });
+TestGroup("Benchmark")
+{
+    syncTest("Resolved promise throughput")
+    {
+        size_t sum = 0;
+        size_t allocs = benchmark("Promise<int>(val).then()", 1000000, [&sum](size_t i)
+        {
+            Promise<int> pms((int)i);
+            pms.then([&sum](int x) { sum += (size_t)x; });
+        });
+        benchmark("Promise<void>(Void).then().then()", 1000000, [&sum](size_t)
+        {
+            Promise<void> pms(Void{});
+            pms.then([&sum]() { sum++; return (int)(sum & 0xff); })
+               .then([&sum](int x) { sum += (size_t)x; });
+        });
+        benchmark("Rejected promise fail()", 200000, [&sum](size_t)
+        {
+            Promise<int> pms(Error("benchmark"));
+            pms.fail([&sum](const Error&) { sum++; return 1; });
+        });
+        check(sum != 0);
+#ifndef PROMISE_NO_POOL
+        check(allocs == 0);
+#endif
+    });
+    syncTest("Chained promise throughput")
+    {
+        size_t sum = 0;
+        benchmark("Pending promise with 8 chained then()", 200000, [&sum](size_t i)
+        {
+            Promise<int> pms;
+            Promise<int> chain = pms;
+            for (int n = 0; n < 8; n++)
+                chain = chain.then([](int x) { return x + 1; });
+            chain.then([&sum](int x) { sum += (size_t)x; })
+            .fail([](const Error&) {});
+            pms.resolve((int)i);
+        });
+        benchmark("Pending promise with then() returning a pending promise", 200000, [&sum](size_t i)
+        {
+            Promise<int> pms;
+            Promise<int> inner;
+            pms.then([inner](int) { return inner; })
+            .then([&sum](int x) { sum += (size_t)x; });
+            pms.resolve(1);
+            inner.resolve((int)i);
+        });
+        benchmark("when() of two pending promises", 200000, [&sum](size_t i)
+        {
+            Promise<int> pms1;
+            Promise<void> pms2;
+            when(pms1, pms2).then([&sum]() { sum++; });
+            pms1.resolve((int)i);
+            pms2.resolve();
+        });
+        check(sum != 0);
+    });
+});
 
 return test::gNumFailed;
 }
@@ -7,6 +7,7 @@
 #include <string>
 #include <utility>
 #include <memory>
+#include <new>
 #include <assert.h>
 
 /** @brief The name of the unhandled promise error handler. This handler is
@@ -38,6 +39,106 @@ enum ResolvedState
     #define PROMISE_LOG_REF(fmtString,...)
 #endif
 
+/** @brief Per-thread free lists of the small blocks used by promises: the shared state,
+ * the callbacks and the state of when(). Promises are created and destroyed at a high
+ * rate (several per decrypted message), and recycling their blocks avoids most of the
+ * calls to the heap allocator. Blocks are grouped in size classes of kGranularity bytes,
+ * and at most kMaxFree blocks of each class are kept per thread, so the memory held is
+ * bounded. A block freed by a different thread than the one that allocated it goes to
+ * the free list of the former.
+ * Define PROMISE_NO_POOL to use the heap allocator directly (i.e. for memory debuggers).
+ */
+class BlockPool
+{
+protected:
+    enum { kGranularity = 16, kNumClasses = 16, kMaxFree = 256 };
+    struct Block { Block* next; };
+    // trivially destructible, so it can still be used by promises destroyed after the Reaper
+    struct FreeLists
+    {
+        Block* heads[kNumClasses];
+        unsigned counts[kNumClasses];
+        bool hasReaper;
+        bool exited;
+    };
+    // releases the free blocks when the thread exits
+    struct Reaper
+    {
+        ~Reaper()
+        {
+            FreeLists& lists = freeLists();
+            lists.exited = true;
+            for (int i = 0; i < kNumClasses; i++)
+            {
+                while (Block* block = lists.heads[i])
+                {
+                    lists.heads[i] = block->next;
+                    ::operator delete(block);
+                }
+                lists.counts[i] = 0;
+            }
+        }
+    };
+    static FreeLists& freeLists()
+    {
+        static thread_local FreeLists lists;  // zero-initialized
+        return lists;
+    }
+public:
+    static void* alloc(size_t size)
+    {
+#ifndef PROMISE_NO_POOL
+        size_t cls = (size - 1) / kGranularity;
+        if (size && cls < kNumClasses)
+        {
+            FreeLists& lists = freeLists();
+            if (Block* block = lists.heads[cls])
+            {
+                lists.heads[cls] = block->next;
+                lists.counts[cls]--;
+                return block;
+            }
+            return ::operator new((cls + 1) * kGranularity);
+        }
+#endif
+        return ::operator new(size);
+    }
+    static void free(void* ptr, size_t size)
+    {
+#ifndef PROMISE_NO_POOL
+        size_t cls = (size - 1) / kGranularity;
+        if (ptr && size && cls < kNumClasses)
+        {
+            FreeLists& lists = freeLists();
+            if (lists.counts[cls] < kMaxFree && !lists.exited)
+            {
+                if (!lists.hasReaper)
+                {
+                    lists.hasReaper = true;
+                    static thread_local Reaper reaper;
+                    (void)reaper;
+                }
+                Block* block = static_cast<Block*>(ptr);
+                block->next = lists.heads[cls];
+                lists.heads[cls] = block;
+                lists.counts[cls]++;
+                return;
+            }
+        }
+#endif
+        (void)size;
+        ::operator delete(ptr);
+    }
+};
+
+/** @brief Base of the promise internals allocated from the BlockPool. Classes with a
+ * virtual destructor get the size of the most derived class on delete */
+struct PoolAllocated
+{
+    static void* operator new(size_t size) { return BlockPool::alloc(size); }
+    static void operator delete(void* ptr, size_t size) { BlockPool::free(ptr, size); }
+};
+
 //===
 struct _Void{};
 typedef _Void Void;
@@ -146,7 +247,19 @@ template <class C>
 class CallbackList
 {
 protected:
-    std::vector<C*> items;
+    //most promises have a single then() and fail(), so the first items don't need an allocation
+    enum { kInlineCount = 2 };
+    C* mInline[kInlineCount];
+    std::vector<C*> mMore;  //items after the inline ones
+    int mCount = 0;
+    inline void pushItem(C* item)
+    {
+        if (mCount < kInlineCount)
+            mInline[mCount] = item;
+        else
+            mMore.push_back(item);
+        mCount++;
+    }
 public:
     CallbackList(){}
 /**
@@ -158,45 +271,49 @@ public:
     template<class SP>
     inline void push(SP& cb)
     {
-        items.push_back(cb.release());
+        pushItem(cb.get());
+        cb.release();
     }
 
     inline C*& operator[](int idx)
     {
-        assert((idx >= 0) && (idx < (int)items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < mCount));
+        return (idx < kInlineCount) ? mInline[idx] : mMore[idx - kInlineCount];
     }
-    inline const C*& operator[](int idx) const
+    inline C* const& operator[](int idx) const
     {
-        assert((idx >= 0) && (idx < items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < mCount));
+        return (idx < kInlineCount) ? mInline[idx] : mMore[idx - kInlineCount];
     }
     inline C*& first()
     {
-        assert(!items.empty());
-        return items[0];
+        assert(mCount);
+        return mInline[0];
     }
     inline int count() const
     {
-        return items.size();
+        return mCount;
     }
     inline void addListMoveItems(CallbackList& other)
     {
-        items.insert(items.end(), other.items.begin(), other.items.end());
-        other.items.clear();
+        for (int i = 0; i < other.mCount; i++)
+            pushItem(other[i]);
+        other.mCount = 0;
+        other.mMore.clear();
     }
     void clear()
     {
         static_assert(std::is_base_of<IVirtDtor, C>::value, "Callback type must be inherited from IVirtDtor");
-        for (auto it = items.begin(); it != items.end(); it++)
+        for (int i = 0; i < mCount; i++)
         {
-            delete ((IVirtDtor*)*it); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+            delete ((IVirtDtor*)(*this)[i]); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
         }
-        items.clear();
+        mCount = 0;
+        mMore.clear();
     }
     ~CallbackList()
     {
-        assert(items.empty());
+        assert(!mCount);
     }
 };
 
@@ -209,7 +326,7 @@ class Promise: public PromiseBase
 public:
 protected:
     template<class P>
-    struct ICallback: public IVirtDtor
+    struct ICallback: public IVirtDtor, public PoolAllocated
     {
         virtual void operator()(const P&) = 0;
         virtual void rejectNextPromise(const Error&) = 0;
@@ -261,9 +378,9 @@ protected:
         return new Callback<typename MaskVoid<P>::type, CB, TP>(std::forward<CB>(cb), next);
     }
 //===
-    struct SharedObj
+    struct SharedObj: public PoolAllocated
     {
-        struct CbLists
+        struct CbLists: public PoolAllocated
         {
             CallbackList<ISuccessCb> mSuccessCbs;
             CallbackList<IFailCb> mFailCbs;
@@ -415,7 +532,7 @@ public:
     const typename std::enable_if<!std::is_same<Ret, void>::value, Ret>::type& value() const
     {
         assert(mSharedObj);
-        auto master = mSharedObj->mMaster;
+        auto& master = mSharedObj->mMaster;
         if (master.mSharedObj)
         {
             assert(master.done());
@@ -455,6 +572,34 @@ protected:
         return ret;
     }
 
+/** Calls a then() or fail() handler, and returns the promise it returns or a rejected one if it throws.
+ * \c In is the type of the callback's parameter, \c RealOut is its return type.
+ */
+    template <typename In, typename Out, typename RealOut, class CB>
+    static Promise<Out> callHandler(CB& cb, const In& arg)
+    {
+        try
+        {
+            return CallCbHandleVoids::template call<Out, RealOut, In>(cb, arg);
+        }
+        catch(std::exception& e)
+        {
+            return Error(e.what(), kErrException);
+        }
+        catch(Error& e)
+        {
+            return e;
+        }
+        catch(const char* e)
+        {
+            return Error(e, kErrException);
+        }
+        catch(...)
+        {
+            return Error("(unknown exception type)", kErrException);
+        }
+    }
+
 /** Creates a wrapper function around a then() or fail() handler that handles exceptions and propagates
  * the result to resolve/reject chained promises. \c In is the type of the callback's parameter,
  * \c Out is its return type, \c CB is the type of the callback itself.
@@ -468,29 +613,10 @@ protected:
             mutable->void
         {
             Promise<Out>& next = handler.nextPromise; //the 'chaining' promise
-            Promise<Out> promise((_Empty())); //the promise returned by the user callback
-            try
+            Promise<Out> promise = callHandler<In, Out, RealOut>(cb, result); //the promise returned by the user callback
+            if (promise.failed() && !promise.hasMaster())
             {
-                promise = CallCbHandleVoids::template call<Out, RealOut, In>(cb, result);
-            }
-            catch(std::exception& e)
-            {
-                next.reject(Error(e.what(), kErrException));
-                return;
-            }
-            catch(Error& e)
-            {
-                next.reject(e);
-                return;
-            }
-            catch(const char* e)
-            {
-                next.reject(Error(e, kErrException));
-                return;
-            }
-            catch(...)
-            {
-                next.reject(Error("(unknown exception type)", kErrException));
+                next.reject(promise.error()); //the callback threw or returned an error
                 return;
             }
 
@@ -539,21 +665,19 @@ public:
             return mSharedObj->mError;
 
         typedef typename RemovePromise<typename FuncTraits<F>::RetType>::Type Out;
-        Promise<Out> next;
-
-        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
-            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
-
         if (mSharedObj->mResolved == kSucceeded)
         {
-            (*resolveCb)(mSharedObj->mResult);
-        }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            thenCbs().push(resolveCb);
+            //the promise returned by the callback is equivalent to a chaining one attached to it
+            typename std::decay<F>::type func(std::forward<F>(cb));
+            return callHandler<typename MaskVoid<T>::type, Out,
+                typename FuncTraits<F>::RetType>(func, mSharedObj->mResult);
         }
 
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<Out> next;
+        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
+            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
+        thenCbs().push(resolveCb);
         return next;
     }
 /** Adds a handler to be executed in case the promise is rejected
@@ -576,21 +700,19 @@ public:
         if (mSharedObj->mResolved == kSucceeded)
             return mSharedObj->mResult; //don't call the errorback, just return the successful resolve value
 
-        Promise<T> next;
-        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
-            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
-
         if (mSharedObj->mResolved == kFailed)
         {
-            (*failCb)(mSharedObj->mError);
+            typename std::decay<F>::type func(std::forward<F>(eb));
+            Promise<T> ret = callHandler<Error, T, typename FuncTraits<F>::RetType>(func, mSharedObj->mError);
             mSharedObj->mError.setHandled();
-        }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            failCbs().push(failCb);
+            return ret;
         }
 
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<T> next;
+        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
+            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
+        failCbs().push(failCb);
         return next;
     }
     //val can be a by-value param, const& or &&
@@ -742,17 +864,31 @@ inline Promise<T> reject(const Error& err)
     return Promise<T>(err);
 }
 
-struct WhenStateShared
+struct WhenStateShared: public PoolAllocated
 {
+    int refCount = 1;
     int numready = 0;
     Promise<void> output;
     bool addLast = false;
     int totalCount = 0;
 };
 
-struct WhenState: public std::shared_ptr<WhenStateShared>
+//refcounted like the promises themselves, with a single allocation
+class WhenState
 {
-    WhenState():std::shared_ptr<WhenStateShared>(new WhenStateShared){}
+protected:
+    WhenStateShared* mShared;
+public:
+    WhenState(): mShared(new WhenStateShared){}
+    WhenState(const WhenState& other): mShared(other.mShared) { mShared->refCount++; }
+    WhenState& operator=(const WhenState& other) = delete;
+    ~WhenState()
+    {
+        if (--mShared->refCount == 0)
+            delete mShared;
+    }
+    WhenStateShared* get() const { return mShared; }
+    WhenStateShared* operator->() const { return mShared; }
 };
 
 template <class T, class=typename std::enable_if<!std::is_same<T,void>::value, int>::type>
@@ -24,6 +24,7 @@
 #include "cservices.h"
 #include "gcmpp.h"
 #include <memory>
+#include <atomic>
 #include <assert.h>
 
 namespace karere
@@ -31,23 +32,33 @@ namespace karere
 
 struct TimerMsg: public megaMessage
 {
-    timerevent* timerEvent = nullptr;
+    timerevent timerEvent;
+    bool started = false;   // timerEvent is initialized, and has to be closed before freeing the message
     bool canceled = false;
+    std::atomic<bool> posted; // a repeating timer is not posted again while still queued
     megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
+    void (*destroy)(TimerMsg*); // deletes the actual message type
+    TimerMsg(megaMessageFunc aFunc, void (*aDestroy)(TimerMsg*))
         :megaMessage(aFunc),
-          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
+          posted(false),
+          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this)),
+          destroy(aDestroy)
     {}
-   ~TimerMsg()
+    /** Invalidates the handle and frees the message, once libuv is done with the timer.
+     * Must be called on the thread that runs the timers */
+    void release()
     {
         services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
-        if (timerEvent)
-        {            
-            uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
-            {
-                delete handle;
-            });
+        if (!started)
+        {
+            destroy(this);
+            return;
         }
+        uv_close((uv_handle_t *)&timerEvent, [](uv_handle_t* handle)
+        {
+            TimerMsg* timer = static_cast<TimerMsg*>(handle->data);
+            timer->destroy(timer);
+        });
     }
 };
 
@@ -63,15 +74,17 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
         CB cb;
         void *appCtx;
         Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
+        :TimerMsg(cFunc, [](TimerMsg* timer) { delete static_cast<Msg*>(timer); }), cb(aCb)
         {}
         unsigned time;
         int loop;
+        KR_MSGPOOL_ALLOCATED
     };
     megaMessageFunc cfunc = persist
         ? (megaMessageFunc) [](void* arg)
           {
               Msg* msg = static_cast<Msg*>(arg);
+              msg->posted = false;
               if (msg->canceled)
                   return;
               msg->cb();
@@ -91,7 +104,7 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
                   timerMutex.unlock();
                   return;
               }
-              delete msg;
+              msg->release();
               timerMutex.unlock();
           };
 
@@ -104,13 +117,17 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
     pMsg->loop = persist;  
     marshallCall([pMsg, ctx]()
     {
-        pMsg->timerEvent = new uv_timer_t();
-        pMsg->timerEvent->data = pMsg;
-        init_uv_timer(ctx, pMsg->timerEvent);
-        uv_timer_start(pMsg->timerEvent,
+        pMsg->timerEvent.data = pMsg;
+        init_uv_timer(ctx, &pMsg->timerEvent);
+        pMsg->started = true;
+        uv_timer_start(&pMsg->timerEvent,
                        [](uv_timer_t* handle)
                        {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
+                           Msg* msg = static_cast<Msg*>(handle->data);
+                           if (!msg->posted.exchange(true))
+                           {
+                               megaPostMessageToGui(msg, msg->appCtx);
+                           }
                        }, pMsg->time, pMsg->loop ? pMsg->time : 0);
     }, ctx);    
     return pMsg->handle;
@@ -140,11 +157,11 @@ static inline bool cancelTimeout(megaHandle handle, void *ctx)
     timerMutex.unlock();    
     marshallCall([timer, ctx]()
     {
-        uv_timer_stop(timer->timerEvent);
+        uv_timer_stop(&timer->timerEvent);
 
         marshallCall([timer, ctx]()
         {
-            delete timer;
+            timer->release();
         }, ctx);
     }, ctx);
     return true;
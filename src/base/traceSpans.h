@@ -0,0 +1,217 @@
+#ifndef TRACESPANS_H
+#define TRACESPANS_H
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace karere
+{
+/** @brief Opt-in profiling of the startup and of the message processing hot paths
+ *
+ * Code marks spans with \c KR_TRACE_SPAN(name), which records the start and duration of
+ * the enclosing scope, measured with a monotonic clock. When tracing is disabled (the
+ * default), a span costs a relaxed atomic load. When enabled, each thread appends its
+ * spans to its own buffer without locking: only its thread writes to it, and readers see
+ * the events published by the release store of the event count. Buffers never wrap,
+ * so events are never overwritten while being exported. When a buffer is full, new
+ * events are counted as dropped.
+ *
+ * The recorded spans are exported with toChromeJson(), in the trace-event format
+ * that chrome://tracing and Perfetto can open. karere::Client enables tracing when the
+ * env var KRCHAT_TRACE is set, and writes the spans to the file it names on termination.
+ */
+class Trace
+{
+public:
+    enum { kMaxEventsPerThread = 16384 };
+
+    struct Event
+    {
+        const char* name;   // must have static storage, i.e. a string literal
+        uint64_t startUs;
+        uint64_t durUs;
+        uint64_t arg;       // i.e. a chatid, or 0 if none
+    };
+
+protected:
+    struct ThreadBuffer
+    {
+        std::vector<Event> events;
+        std::atomic<size_t> count;
+        std::atomic<size_t> dropped;
+        unsigned tid;
+        explicit ThreadBuffer(unsigned aTid)
+        : events(kMaxEventsPerThread), count(0), dropped(0), tid(aTid) {}
+    };
+
+    // buffers are kept after their thread exits, so its spans can still be exported
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+        std::atomic<bool> enabled;
+        std::chrono::steady_clock::time_point origin;
+        Registry(): enabled(false), origin(std::chrono::steady_clock::now()) {}
+    };
+
+    static Registry& registry()
+    {
+        static Registry reg;
+        return reg;
+    }
+
+    static ThreadBuffer& threadBuffer()
+    {
+        static thread_local ThreadBuffer* buffer = nullptr;
+        if (!buffer)
+        {
+            Registry& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            reg.buffers.emplace_back(new ThreadBuffer((unsigned)reg.buffers.size() + 1));
+            buffer = reg.buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    static void appendJsonString(std::string& out, const char* str)
+    {
+        out += '"';
+        for (; *str; str++)
+        {
+            if (*str == '"' || *str == '\\')
+            {
+                out += '\\';
+            }
+            out += *str;
+        }
+        out += '"';
+    }
+
+public:
+    static bool enabled() { return registry().enabled.load(std::memory_order_relaxed); }
+
+    /** @brief Starts or stops recording spans. Spans already recorded are kept */
+    static void setEnabled(bool enabled) { registry().enabled.store(enabled, std::memory_order_relaxed); }
+
+    /** @brief Microseconds since the first use of the tracer */
+    static uint64_t now()
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - registry().origin).count();
+    }
+
+    /** @brief Records a span that started at \c startUs and ends now */
+    static void record(const char* name, uint64_t startUs, uint64_t arg = 0)
+    {
+        ThreadBuffer& buf = threadBuffer();
+        size_t count = buf.count.load(std::memory_order_relaxed);
+        if (count >= buf.events.size())
+        {
+            buf.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Event& event = buf.events[count];
+        event.name = name;
+        event.startUs = startUs;
+        event.durUs = now() - startUs;
+        event.arg = arg;
+        buf.count.store(count + 1, std::memory_order_release);
+    }
+
+    /** @brief Number of spans that didn't fit in the buffer of their thread */
+    static size_t droppedCount()
+    {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        size_t dropped = 0;
+        for (auto& buf: reg.buffers)
+        {
+            dropped += buf->dropped.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+    /** @brief Returns the spans recorded so far, as a Chrome trace-event JSON object.
+     * It can be called from any thread, while other threads keep recording */
+    static std::string toChromeJson()
+    {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        std::string out = "{\"traceEvents\":[";
+        bool first = true;
+        char num[128];
+        for (auto& buf: reg.buffers)
+        {
+            size_t count = buf->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; i++)
+            {
+                const Event& event = buf->events[i];
+                out.append(first ? "{\"name\":" : ",{\"name\":");
+                first = false;
+                appendJsonString(out, event.name);
+                snprintf(num, sizeof(num), ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"dur\":%llu",
+                         buf->tid, (unsigned long long)event.startUs, (unsigned long long)event.durUs);
+                out.append(num);
+                if (event.arg)
+                {
+                    snprintf(num, sizeof(num), ",\"args\":{\"id\":\"%016llx\"}", (unsigned long long)event.arg);
+                    out.append(num);
+                }
+                out += '}';
+            }
+        }
+        out.append("],\"displayTimeUnit\":\"ms\"}");
+        return out;
+    }
+
+    /** @brief Writes toChromeJson() to the file \c path, replacing it. Returns false on error */
+    static bool writeChromeJson(const char* path)
+    {
+        FILE* file = fopen(path, "wb");
+        if (!file)
+        {
+            return false;
+        }
+        std::string json = toChromeJson();
+        bool ok = (fwrite(json.data(), 1, json.size(), file) == json.size());
+        return (fclose(file) == 0) && ok;
+    }
+};
+
+/** @brief Records the scope where it lives as a span. See \c KR_TRACE_SPAN */
+class TraceSpan
+{
+protected:
+    const char* mName;  // NULL if tracing was disabled when the span started
+    uint64_t mArg;
+    uint64_t mStart;
+public:
+    explicit TraceSpan(const char* name, uint64_t arg = 0)
+    : mName(Trace::enabled() ? name : nullptr), mArg(arg), mStart(mName ? Trace::now() : 0)
+    {}
+    ~TraceSpan()
+    {
+        if (mName)
+        {
+            Trace::record(mName, mStart, mArg);
+        }
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+}
+
+#define KR_TRACE_CONCAT2(a, b) a##b
+#define KR_TRACE_CONCAT(a, b) KR_TRACE_CONCAT2(a, b)
+
+/** Records the enclosing scope as a span with the given name, which must be a string
+ * literal (or have static storage). KR_TRACE_SPAN_ID also attaches an id, i.e. a chatid */
+#define KR_TRACE_SPAN(name) ::karere::TraceSpan KR_TRACE_CONCAT(krTraceSpan, __LINE__)(name)
+#define KR_TRACE_SPAN_ID(name, id) ::karere::TraceSpan KR_TRACE_CONCAT(krTraceSpan, __LINE__)(name, id)
+
+#endif // TRACESPANS_H
@@ -0,0 +1,117 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+
+namespace karere
+{
+/** @brief Pool of threads that run CPU-bound jobs off the GUI thread
+ *
+ * Threads are started on demand, when there are more queued jobs than idle threads,
+ * up to \c maxThreads. Jobs are started in FIFO order but may complete in any order,
+ * so callers that need ordered results must reorder them. Jobs must not touch state
+ * owned by the GUI thread: they work on their own copy of the data, and post their
+ * results back with marshallCall().
+ *
+ * Jobs that are still queued when the pool is destroyed are discarded.
+ */
+class WorkerPool
+{
+protected:
+    std::mutex mMutex;
+    std::condition_variable mCondVar;
+    std::deque<std::function<void()>> mJobs;
+    std::vector<std::thread> mThreads;
+    size_t mMaxThreads;
+    size_t mIdleThreads = 0;
+    bool mTerminating = false;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            mIdleThreads++;
+            mCondVar.wait(lock, [this]() { return mTerminating || !mJobs.empty(); });
+            mIdleThreads--;
+            if (mTerminating)
+            {
+                return;
+            }
+            std::function<void()> job = std::move(mJobs.front());
+            mJobs.pop_front();
+            lock.unlock();
+            job();
+            job = nullptr;  // release what the job captured before taking the lock again
+            lock.lock();
+        }
+    }
+
+public:
+    /** @param maxThreads Maximum number of threads. If zero, the number of hardware threads */
+    explicit WorkerPool(size_t maxThreads = 0)
+    : mMaxThreads(maxThreads ? maxThreads : defaultThreadCount())
+    {}
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTerminating = true;
+        }
+        mCondVar.notify_all();
+        for (auto& thread: mThreads)
+        {
+            thread.join();
+        }
+    }
+
+    static size_t defaultThreadCount()
+    {
+        unsigned count = std::thread::hardware_concurrency();
+        return count ? count : 2;
+    }
+
+    /** @brief Queues a job. Can be called from any thread. */
+    void post(std::function<void()>&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(std::move(job));
+            if (mIdleThreads < mJobs.size() && mThreads.size() < mMaxThreads)
+            {
+                try
+                {
+                    mThreads.emplace_back(&WorkerPool::run, this);
+                }
+                catch (std::system_error&)
+                {
+                    // the existing threads will run it, if any
+                    if (mThreads.empty())
+                    {
+                        mJobs.pop_back();
+                        throw;
+                    }
+                }
+            }
+        }
+        mCondVar.notify_one();
+    }
+
+    size_t threadCount()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mThreads.size();
+    }
+};
+}
+#endif // WORKERPOOL_H
@@ -5,6 +5,7 @@
 #include <stdexcept>
 #include <string.h>
 #include <vector>
+#include <utility>
 
 #if !defined(__arm__) && !defined(__aarch64__)
     #define BUFFER_ALLOW_UNALIGNED_MEMORY_ACCESS 1
@@ -342,6 +343,13 @@ public:
         memset(appendPtr(count), value, count);
     }
     void clear() { mDataSize = 0; }
+    /** Exchanges the memory blocks of both buffers, without copying their data */
+    void swap(Buffer& other)
+    {
+        std::swap(mBuf, other.mBuf);
+        std::swap(mDataSize, other.mDataSize);
+        std::swap(mBufSize, other.mBufSize);
+    }
     void free()
     {
         if (!mBuf)
@@ -34,6 +34,8 @@
 #include <codecvt> //for nonWhitespaceStr()
 #include <locale>
 #include "strongvelope/strongvelope.h"
+#include <base/workerPool.h>
+#include <base/traceSpans.h>
 #include "base64url.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -77,6 +79,13 @@ Client::Client(::mega::MegaApi& sdk, WebsocketsIO *websocketsIO, IApp& aApp, con
           chats(new ChatRoomList(*this)),
           mPresencedClient(&api, this, *this, caps)
 {
+    mDecryptWorkers.reset(new WorkerPool);
+    const char* tracePath = getenv("KRCHAT_TRACE");
+    if (tracePath && *tracePath)
+    {
+        KR_LOG_WARNING("KRCHAT_TRACE env var detected, recording timing spans to be written to %s on termination (see karere::Trace)", tracePath);
+        Trace::setEnabled(true);
+    }
 }
 
 KARERE_EXPORT const std::string& createAppDir(const char* dirname, const char *envVarName)
@@ -150,6 +159,7 @@ std::string Client::dbPath(const std::string& sid) const
 
 bool Client::openDb(const std::string& sid)
 {
+    KR_TRACE_SPAN("Client::openDb");
     assert(!sid.empty());
     std::string path = dbPath(sid);
     struct stat info;
@@ -166,136 +176,119 @@ bool Client::openDb(const std::string& sid)
         KR_LOG_WARNING("Error opening database");
         return false;
     }
-    SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
-    if (!stmt.step())
+    std::string cachedVersion;
     {
-        db.close();
-        KR_LOG_WARNING("Can't get local database version");
-        return false;
+        SqliteStmt stmt(db, "select value from vars where name = 'schema_version'");
+        if (!stmt.step())
+        {
+            db.close();
+            KR_LOG_WARNING("Can't get local database version");
+            return false;
+        }
+        cachedVersion = stmt.stringCol(0);
     }
 
     std::string currentVersion(gDbSchemaHash);
     currentVersion.append("_").append(gDbSchemaVersionSuffix);    // <hash>_<suffix>
 
-    std::string cachedVersion(stmt.stringCol(0));
     if (cachedVersion != currentVersion)
     {
         ok = false;
 
         // if only version suffix changed, we may be able to provide backwards compatibility without
-        // forcing a full reload, but just porting/adapting data
+        // forcing a full reload, by applying the migrations step by step. If the hash changed but the
+        // suffix didn't, the schema was modified without a migration --> rebuild
         size_t cachedVersionSuffixPos = cachedVersion.find_last_of('_');
         if (cachedVersionSuffixPos != std::string::npos)
         {
-            std::string cachedVersionSuffix = cachedVersion.substr(cachedVersionSuffixPos + 1);
-            if (cachedVersionSuffix == "2" && (strcmp(gDbSchemaVersionSuffix, "3") == 0))
+            int cachedSuffix = atoi(cachedVersion.c_str() + cachedVersionSuffixPos + 1);
+            int currentSuffix = atoi(gDbSchemaVersionSuffix);
+            if (cachedSuffix > 0 && cachedSuffix < currentSuffix)
             {
-                KR_LOG_WARNING("Clearing history from cached chats...");
-
-                // clients with version 2 missed the call-history msgs, need to clear cached history
-                // in order to fetch fresh history including the missing management messages
-                db.query("delete from history");
-                db.query("update chat_vars set value = 0 where name = 'have_all_history'");
-                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
-                db.commit();
-
-                KR_LOG_WARNING("Successfully cleared cached history. Database version has been updated to %s", gDbSchemaVersionSuffix);
-
                 ok = true;
-            }
-            else if (cachedVersionSuffix == "3" && (strcmp(gDbSchemaVersionSuffix, "4") == 0))
-            {
-                // clients with version 3 need to force a full-reload of SDK's cache to retrieve
-                // "deleted" chats from API, since it used to not return them. It should only be
-                // done in case there's at least one chat.
-
-                SqliteStmt stmt(db, "select count(*) from chats");
-                stmt.stepMustHaveData("get chats count");
-                if (stmt.intCol(0) > 0)
+                for (int version = cachedSuffix + 1; ok && version <= currentSuffix; version++)
                 {
-                    KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat caches...");
-                    api.sdk.invalidateCache();
+                    ok = migrateDb(version);
                 }
-                else    // no chats --> only invalidate MEGAchat cache (the schema has changed)
-                {
-                    KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat cache...");
-                }
-
-                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
             }
-            else if (cachedVersionSuffix == "4" && (strcmp(gDbSchemaVersionSuffix, "5") == 0))
+        }
+    }
+
+    if (!ok)
+    {
+        db.close();
+        KR_LOG_WARNING("Database schema version is not compatible with app version, will rebuild it");
+        return false;
+    }
+
+    initSearchIndex();
+    mSid = sid;
+    return true;
+}
+
+bool Client::migrateDb(int version)
+{
+    // migrations that depend on the cached data and may need a full reload
+    switch (version)
+    {
+        case 4:
+        {
+            // clients with version 3 need to force a full-reload of SDK's cache to retrieve
+            // "deleted" chats from API, since it used to not return them. It should only be
+            // done in case there's at least one chat. MEGAchat's cache is always rebuilt.
+            SqliteStmt stmt(db, "select count(*) from chats");
+            stmt.stepMustHaveData("get chats count");
+            if (stmt.intCol(0) > 0)
             {
-                // clients with version 4 need to create a new table `node_history` and populate it with
-                // node's attachments already in cache. Futhermore, the existing types for special messages
-                // (node-attachments, contact-attachments and rich-links) will be updated to a different
-                // range to avoid collissions with the types of upcoming management messages.
-
-                // Update obsolete type of special messages
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgAttachment, 0x10);
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgRevokeAttachment, 0x11);
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgContact, 0x12);
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgContainsMeta, 0x13);
-
-                // Create new table for node history
-                db.simpleQuery("CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,"
-                               "    userid int64, keyid int not null, type tinyint, updated smallint, ts int,"
-                               "    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx))");
-
-                // Populate new table with existing node-attachments
-                db.query("insert into node_history select * from history where type=?", std::to_string(chatd::Message::Type::kMsgAttachment));
-                int count = sqlite3_changes(db);
-
-                // Update DB version number
-                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
-                db.commit();
-
-                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
-                KR_LOG_WARNING("%d messages added to node history", count);
-                ok = true;
+                KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat caches...");
+                api.sdk.invalidateCache();
             }
-            else if (cachedVersionSuffix == "5" && (strcmp(gDbSchemaVersionSuffix, "6") == 0))
+            else
             {
-                // Clients with version 5 need to force a full-reload of SDK's in case there's at least one group chat.
-                // Otherwise the cache schema must be updated to support public chats
-
-                SqliteStmt stmt(db, "select count(*) from chats where peer == -1");
-                stmt.stepMustHaveData("get chats count");
-                if (stmt.intCol(0) > 0)
-                {
-                    KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat caches...");
-                    api.sdk.invalidateCache();
-                }
-                else
-                {
-                    // no chats --> only update cache schema
-                    KR_LOG_WARNING("Updating schema of MEGAchat cache...");
-                    db.query("ALTER TABLE `chats` ADD mode tinyint");
-                    db.query("ALTER TABLE `chats` ADD unified_key blob");
-                    db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
-                    db.commit();
-                    ok = true;
-                    KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
-                }
+                KR_LOG_WARNING("Forcing a reload of MEGAchat cache...");
             }
-            else if (cachedVersionSuffix == "6" && (strcmp(gDbSchemaVersionSuffix, "7") == 0))
+            return false;
+        }
+        case 6:
+        {
+            // clients with version 5 need to force a full-reload of SDK's in case there's at least
+            // one group chat. Otherwise the cache schema is updated to support public chats
+            SqliteStmt stmt(db, "select count(*) from chats where peer == -1");
+            stmt.stepMustHaveData("get chats count");
+            if (stmt.intCol(0) > 0)
             {
-                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
-                db.query("update history set keyid=0 where type=?", chatd::Message::Type::kMsgTruncate);
-                db.commit();
-                ok = true;
-                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
+                KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat caches...");
+                api.sdk.invalidateCache();
+                return false;
             }
+            break;
         }
+        default:
+            break;
     }
 
-    if (!ok)
+    const char* sql = dbMigrationSql(version);
+    if (!sql)
     {
-        db.close();
-        KR_LOG_WARNING("Database schema version is not compatible with app version, will rebuild it");
+        KR_LOG_ERROR("No migration available to update database to version %d", version);
         return false;
     }
 
-    mSid = sid;
+    try
+    {
+        db.simpleQuery(sql);
+        std::string newVersion(gDbSchemaHash);
+        newVersion.append("_").append(std::to_string(version));
+        db.query("update vars set value = ? where name = 'schema_version'", newVersion);
+        db.commit();
+    }
+    catch (std::exception& e)
+    {
+        KR_LOG_ERROR("Error updating database to version %d: %s", version, e.what());
+        return false;
+    }
+
+    KR_LOG_WARNING("Database version has been updated to %d", version);
     return true;
 }
 
@@ -306,9 +299,49 @@ void Client::createDbSchema()
     std::string ver(gDbSchemaHash);
     ver.append("_").append(gDbSchemaVersionSuffix);
     db.query("insert into vars(name, value) values('schema_version', ?)", ver);
+    initSearchIndex();
     db.commit();
 }
 
+void Client::initSearchIndex()
+{
+    mHasSearchIndex = false;
+    if (mSearchIndexTimer)
+    {
+        cancelTimeout(mSearchIndexTimer, appCtx);
+        mSearchIndexTimer = 0;
+    }
+
+    if (ChatdSqliteDb::initSearchIndex(db))
+    {
+        indexHistory();
+    }
+}
+
+void Client::indexHistory()
+{
+    if (ChatdSqliteDb::indexHistory(db, kSearchIndexBatch))
+    {
+        mHasSearchIndex = true;
+        return;
+    }
+
+    auto wptr = weakHandle();
+    mSearchIndexTimer = karere::setTimeout([this, wptr]()
+    {
+        if (wptr.deleted() || !mSearchIndexTimer)
+        {
+            return;
+        }
+
+        mSearchIndexTimer = 0;
+        if (db.isOpen())
+        {
+            indexHistory();
+        }
+    }, kSearchIndexInterval, appCtx);
+}
+
 void Client::heartbeat()
 {
     if (db.isOpen())
@@ -332,6 +365,8 @@ void Client::heartbeat()
 Client::~Client()
 {
     assert(isTerminated());
+    // discard pending decryptions before anything they refer to
+    mDecryptWorkers.reset();
 
 #ifndef KARERE_DISABLE_WEBRTC
    rtc.reset();
@@ -355,6 +390,12 @@ void Client::retryPendingConnections(bool disconnect, bool refreshURL)
 
 promise::Promise<void> Client::notifyUserStatus(bool background)
 {
+    if (background && db.isOpen())
+    {
+        // the app may be suspended or killed while in background
+        db.commitAndSync();
+    }
+
     if (mChatdClient)
     {
         return mChatdClient->notifyUserStatus(background);
@@ -385,8 +426,8 @@ promise::Promise<std::string> Client::decryptChatTitle(uint64_t chatId, const st
         size_t decLen = base64urldecode(encTitle.c_str(), encTitle.size(), buf.buf(), buf.bufSize());
         buf.setDataSize(decLen);
 
-        //Create temporary strongvelope instance to decrypt chat title
-        strongvelope::ProtocolHandler *auxCrypto = newStrongvelope(chatId, true, unifiedKey, false, Id::inval());
+        //Create temporary strongvelope instance to decrypt chat title (it never sends: no unconfirmed keys to load)
+        strongvelope::ProtocolHandler *auxCrypto = newStrongvelope(chatId, true, unifiedKey, false, Id::inval(), false);
 
         auto wptr = getDelTracker();
         promise::Promise<std::string> pms = auxCrypto->decryptChatTitleFromApi(buf);
@@ -621,6 +662,7 @@ Client::InitState Client::initWithAnonymousSession()
     createDb();
     mMyHandle = Id::null(); // anonymous mode should use ownHandle set to all zeros
     mUserAttrCache.reset(new UserAttrCache(*this));
+    mPairwiseKeyCache.reset(new strongvelope::PairwiseKeyCache(*mUserAttrCache, StaticBuffer(mMyPrivCu25519, 32)));
     mChatdClient.reset(new chatd::Client(this));
     mSessionReadyPromise.resolve();
     mInitStats.stageEnd(InitStats::kStatsInit);
@@ -648,6 +690,7 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
     mMyIdentity = initMyIdentity();
 
     mUserAttrCache.reset(new UserAttrCache(*this));
+    mPairwiseKeyCache.reset(new strongvelope::PairwiseKeyCache(*mUserAttrCache, StaticBuffer(mMyPrivCu25519, 32)));
     api.sdk.addGlobalListener(this);
 
     auto wptr = weakHandle();
@@ -743,6 +786,7 @@ void Client::initWithDbSession(const char* sid)
         assert(db);
         assert(!mSid.empty());
         mUserAttrCache.reset(new UserAttrCache(*this));
+        mPairwiseKeyCache.reset(new strongvelope::PairwiseKeyCache(*mUserAttrCache, StaticBuffer(mMyPrivCu25519, 32)));
         api.sdk.addGlobalListener(this);
 
         mMyHandle = getMyHandleFromDb();
@@ -778,6 +822,16 @@ void Client::initWithDbSession(const char* sid)
     return;
 }
 
+void Client::resumeOfflineSession()
+{
+    assert(mInitState == kInitHasOfflineSession);
+    if (mSessionReadyPromise.done())
+        return;
+
+    KR_LOG_WARNING("Resuming the session from the local cache, without fetchnodes");
+    mSessionReadyPromise.resolve();
+}
+
 void Client::setInitState(InitState newState)
 {
     if (newState == mInitState)
@@ -998,6 +1052,9 @@ void Client::wipeDb(const std::string& sid)
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
+    // leftovers of WAL mode, that must not be applied to a new db
+    remove((path+"-wal").c_str());
+    remove((path+"-shm").c_str());
     struct stat info;
     if (stat(path.c_str(), &info) == 0)
         throw std::runtime_error("wipeDb: Could not delete old database file in "+mAppDir);
@@ -1151,6 +1208,27 @@ promise::Promise<void> Client::doConnect(Presence pres, bool isInBackground)
         return ::promise::_Void();
     }
 
+    // derive the pairwise keys with the peers of our chats in one go, rather than
+    // on demand when the first message to each chat needs a new key
+    SetOfIds peers;
+    for (auto& item: *chats)
+    {
+        ChatRoom* room = item.second;
+        if (room->isGroup())
+        {
+            for (auto& member: static_cast<GroupChatRoom*>(room)->peers())
+            {
+                peers.insert(member.first);
+            }
+        }
+        else
+        {
+            peers.insert(static_cast<PeerChatRoom*>(room)->peer());
+        }
+    }
+    size_t derived = mPairwiseKeyCache->warmUp(peers);
+    KR_LOG_DEBUG("Derived %zu pairwise keys for %zu chat peers", derived, peers.size());
+
     mOwnNameAttrHandle = mUserAttrCache->getAttr(mMyHandle, USER_ATTR_FULLNAME, this,
     [](Buffer* buf, void* userp)
     {
@@ -1374,6 +1452,16 @@ void Client::onPresenceChange(Id userid, Presence pres, bool inProgress)
     app.onPresenceChanged(userid, pres, inProgress);
 }
 
+void Client::onPresenceChangeBatch(const presenced::PresenceChanges& changes)
+{
+    if (isTerminated())
+    {
+        return;
+    }
+
+    app.onPresenceChangedBatch(changes);
+}
+
 void Client::onPresenceConfigChanged(const presenced::Config& state, bool pending)
 {
     app.onPresenceConfigChanged(state, pending);
@@ -1450,6 +1538,7 @@ void Client::terminate(bool deleteDb)
         // stop syncing own-name and close user-attributes cache
         mUserAttrCache->removeCb(mOwnNameAttrHandle);
         mUserAttrCache->onLogOut();
+        mPairwiseKeyCache.reset();
         mUserAttrCache.reset();
 
         // stop heartbeats
@@ -1464,6 +1553,12 @@ void Client::terminate(bool deleteDb)
         mPresencedClient.disconnect();
     }
 
+    if (mSearchIndexTimer)
+    {
+        cancelTimeout(mSearchIndexTimer, appCtx);
+        mSearchIndexTimer = 0;
+    }
+
     // close or delete MEGAchat's DB file
     try
     {
@@ -1473,6 +1568,14 @@ void Client::terminate(bool deleteDb)
         }
         else if (db.isOpen())
         {
+            // neither the history received in the middle of a fetch nor the unread counts
+            // are written upon every change, see chatd::Chat::saveUnreadCount()
+            for (auto& item: *chats)
+            {
+                item.second->chat().flushHistory();
+                item.second->chat().saveUnreadCount();
+            }
+
             KR_LOG_INFO("Doing final COMMIT to database");
             db.commit();
             db.close();
@@ -1482,6 +1585,24 @@ void Client::terminate(bool deleteDb)
     {
         KR_LOG_ERROR("Error saving changes to local cache during termination: %s", e.what());
     }
+
+    const strongvelope::ProtocolHandler::KeyStats& keyStats = strongvelope::ProtocolHandler::keyStats();
+    KR_LOG_DEBUG("Send keys used in this session: %zu in memory, %zu loaded from database, %zu not found, %zu evicted",
+                 keyStats.hits, keyStats.dbLoads, keyStats.notFound, keyStats.evictions);
+    strongvelope::ProtocolHandler::resetKeyStats();
+
+    const char* tracePath = getenv("KRCHAT_TRACE");
+    if (tracePath && *tracePath)
+    {
+        if (Trace::writeChromeJson(tracePath))
+        {
+            KR_LOG_WARNING("Timing spans written to %s", tracePath);
+        }
+        else
+        {
+            KR_LOG_ERROR("Can't write the timing spans to %s", tracePath);
+        }
+    }
 }
 
 promise::Promise<void> Client::setPresence(Presence pres)
@@ -1564,7 +1685,7 @@ Client::createGroupChat(std::vector<std::pair<uint64_t, chatd::Priv>> peers, boo
     {
         crypto = std::make_shared<strongvelope::ProtocolHandler>(mMyHandle,
                 StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
-                StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, karere::Id::inval(), publicchat,
+                StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, *mPairwiseKeyCache, mDecryptWorkers.get(), db, karere::Id::inval(), publicchat,
                 unifiedKey, false, Id::inval(), appCtx);
         crypto->setUsers(users.get());  // ownership belongs to this method, it will be released after `crypto`
     }
@@ -1717,20 +1838,33 @@ bool ChatRoom::isChatdChatInitialized()
 }
 
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid, bool isPublic,
-        std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph)
+        std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph,
+        bool hasSendingItems)
 {
     return new strongvelope::ProtocolHandler(mMyHandle,
          StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
-         StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid,
-         isPublic, unifiedKey, isUnifiedKeyEncrypted, ph, appCtx);
+         StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, *mPairwiseKeyCache, mDecryptWorkers.get(), db, chatid,
+         isPublic, unifiedKey, isUnifiedKeyEncrypted, ph, appCtx, hasSendingItems);
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers, bool isPublic,
         std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, const karere::Id ph)
 {
+    // unconfirmed keys are only in the sending queue: don't look for them if the cache has none
+    bool hasSendingItems = true;
+    if (parent.mDbSummaries)
+    {
+        auto it = parent.mDbSummaries->find(mChatid);
+        if (it != parent.mDbSummaries->end())
+        {
+            hasSendingItems = it->second.hasSendingItems;
+        }
+    }
+
     mChat = &parent.mKarereClient.mChatdClient->createChat(
         mChatid, mShardNo, mUrl, this, initialUsers,
-        parent.mKarereClient.newStrongvelope(mChatid, isPublic, unifiedKey, isUnifiedKeyEncrypted, ph), mCreationTs, mIsGroup);
+        parent.mKarereClient.newStrongvelope(mChatid, isPublic, unifiedKey, isUnifiedKeyEncrypted, ph, hasSendingItems),
+        mCreationTs, mIsGroup);
 }
 
 template <class T, typename F>
@@ -1883,7 +2017,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     mMemberNamesResolved = promise::when(promises);
 
     // Save Chatroom into DB
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     bool isPublicChat = aChat.isPublicChat();
     db.query("insert or replace into chats(chatid, shard, peer, peer_priv, "
              "own_priv, ts_created, archived, mode) values(?,?,-1,0,?,?,?,?)",
@@ -1939,17 +2073,16 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
 //Resume from cache
 GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     unsigned char aShard, chatd::Priv aOwnPriv, int64_t ts, bool aIsArchived,
-    const std::string& title, int isTitleEncrypted, bool publicChat, std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted)
+    const std::string& title, int isTitleEncrypted, bool publicChat, std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted,
+    const std::vector<std::pair<karere::Id, chatd::Priv>>& members)
     :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, aIsArchived),
     mRoomGui(nullptr)
 {
     // Initialize list of peers
-    SqliteStmt stmt(parent.mKarereClient.db, "select userid, priv from chat_peers where chatid=?");
-    stmt << mChatid;
     std::vector<promise::Promise<void> > promises;
-    while(stmt.step())
+    for (auto& member: members)
     {
-        promises.push_back(addMember(stmt.uint64Col(0), (chatd::Priv)stmt.intCol(1), false));
+        promises.push_back(addMember(member.first, member.second, false));
     }
     mMemberNamesResolved = promise::when(promises);
 
@@ -1975,7 +2108,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     mUrl = aUrl;
 
     //save to db
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
 
     Buffer unifiedKeyBuf;
     unifiedKeyBuf.write(0, (uint8_t)strongvelope::kDecrypted);  // prefix to indicate it's decrypted
@@ -2309,7 +2442,8 @@ ChatRoomList::ChatRoomList(Client& aClient)
 
 void ChatRoomList::loadFromDb()
 {
-    auto db = mKarereClient.db;
+    KR_TRACE_SPAN("ChatRoomList::loadFromDb");
+    auto& db = mKarereClient.db;
 
     //We need to ensure that the DB does not contain any record related with a preview
     SqliteStmt stmtPreviews(db, "select chatid from chats where mode = '2'");
@@ -2319,6 +2453,25 @@ void ChatRoomList::loadFromDb()
         previewCleanup(chatid);
     }
 
+    // load with a few queries what each room would query by itself
+    std::map<karere::Id, std::vector<std::pair<karere::Id, chatd::Priv>>> members;
+    SqliteStmt stmtMembers(db, sql::kChatPeersAll);
+    while(stmtMembers.step())
+    {
+        members[stmtMembers.uint64Col(0)].emplace_back(stmtMembers.uint64Col(1), (chatd::Priv)stmtMembers.intCol(2));
+    }
+    std::map<karere::Id, ChatdDbSummary> summaries;
+    ChatdSqliteDb::loadSummaries(db, summaries);
+
+    // the summaries are only valid while the rooms are being created: clear them on any exit
+    struct SummariesScope
+    {
+        ChatRoomList& mList;
+        SummariesScope(ChatRoomList& list, std::map<karere::Id, ChatdDbSummary>& summaries)
+            : mList(list) { mList.mDbSummaries = &summaries; }
+        ~SummariesScope() { mList.mDbSummaries = nullptr; }
+    } summariesScope(*this, summaries);
+
     SqliteStmt stmt(db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title, archived, mode, unified_key from chats");
     while(stmt.step())
     {
@@ -2366,7 +2519,7 @@ void ChatRoomList::loadFromDb()
                 auxTitle.assign(posTitle, len);
             }
 
-            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.intCol(7), auxTitle, isTitleEncrypted, stmt.intCol(8), unifiedKey, isUnifiedKeyEncrypted);
+            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.intCol(7), auxTitle, isTitleEncrypted, stmt.intCol(8), unifiedKey, isUnifiedKeyEncrypted, members[chatid]);
         }
         emplace(chatid, room);
     }
@@ -2800,7 +2953,16 @@ promise::Promise<void> GroupChatRoom::autojoinPublicChat(uint64_t ph)
 void ChatRoom::init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
 {
     mChat = &chat;
-    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db);
+    auto db = new ChatdSqliteDb(*mChat, parent.mKarereClient.db);
+    if (parent.mDbSummaries)
+    {
+        auto it = parent.mDbSummaries->find(mChatid);
+        if (it != parent.mDbSummaries->end())
+        {
+            db->setSummary(it->second);
+        }
+    }
+    dbIntf = db;
     if (mAppChatHandler)
     {
         setAppChatHandler(mAppChatHandler);
@@ -3105,7 +3267,7 @@ bool GroupChatRoom::previewMode() const
 
 void ChatRoomList::previewCleanup(Id chatid)
 {
-    auto db = mKarereClient.db;
+    auto& db = mKarereClient.db;
     if (db.isOpen())   // upon karere::Client destruction, DB is already closed
     {
         db.query("delete from chat_peers where chatid = ?", chatid);
@@ -3137,7 +3299,7 @@ bool GroupChatRoom::syncMembers(const mega::MegaTextChat& chat)
         }
     }
 
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     bool peersChanged = false;
     for (auto ourIt = mPeers.begin(); ourIt != mPeers.end();)
     {
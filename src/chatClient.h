@@ -21,9 +21,10 @@
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class PairwiseKeyCache; }
 
 struct sqlite3;
+struct ChatdDbSummary;
 class Buffer;
 
 #define ID_CSTR(id) Id(id).toString().c_str()
@@ -47,6 +48,7 @@ class ContactList;
 
 typedef std::map<Id, chatd::Priv> UserPrivMap;
 class ChatRoomList;
+class WorkerPool;
 
 /** @brief An abstract class representing a chatd chatroom. It has two
  * descendants - \c PeerChatRoom, representing a 1on1 chatroom,
@@ -353,7 +355,8 @@ protected:
 
     GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
                 unsigned char aShard, chatd::Priv aOwnPriv, int64_t ts,
-                bool aIsArchived, const std::string& title, int isTitleEncrypted, bool publicChat, std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted);
+                bool aIsArchived, const std::string& title, int isTitleEncrypted, bool publicChat, std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted,
+                const std::vector<std::pair<karere::Id, chatd::Priv>>& members);
 
     GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
                 unsigned char aShard, chatd::Priv aOwnPriv, int64_t ts,
@@ -437,6 +440,8 @@ class ChatRoomList: public std::map<uint64_t, ChatRoom*> //don't use shared_ptr
 /** @cond PRIVATE */
 public:
     Client& mKarereClient;
+    // summaries of the chats being loaded by loadFromDb(), NULL otherwise
+    std::map<karere::Id, ChatdDbSummary>* mDbSummaries = nullptr;
     void addMissingRoomsFromApi(const mega::MegaTextChatList& rooms, karere::SetOfIds& chatids);
     ChatRoom* addRoom(const mega::MegaTextChat &room);
     void removeRoomPreview(Id chatid);
@@ -829,7 +834,9 @@ public:
 
     enum
     {
-        kHeartbeatTimeout = 10000     /// Timeout for heartbeats (ms)
+        kHeartbeatTimeout = 10000,    /// Timeout for heartbeats (ms)
+        kSearchIndexBatch = 2000,     /// Messages indexed for full-text search at once, see indexHistory()
+        kSearchIndexInterval = 50     /// Pause between batches of messages indexed (ms)
     };
 
     /** @brief Convenience aliases for the \c force flag in \c setPresence() */
@@ -877,12 +884,17 @@ protected:
     uint64_t mMyIdentity = 0; // seed for CLIENTID
     std::unique_ptr<UserAttrCache> mUserAttrCache;
     UserAttrCache::Handle mOwnNameAttrHandle;
+    // keys derived with each peer, shared by all chats. Created and destroyed along with mUserAttrCache
+    std::unique_ptr<strongvelope::PairwiseKeyCache> mPairwiseKeyCache;
+    // verify and decrypt the messages fetched from history
+    std::unique_ptr<WorkerPool> mDecryptWorkers;
 
     std::string mSid;
     std::string mLastScsn;
     InitState mInitState = kInitCreated;
     ConnState mConnState = kDisconnected;
     bool mContactsLoaded = false;
+    bool mHasSearchIndex = false;
 
     // resolved when fetchnodes is completed
     promise::Promise<void> mSessionReadyPromise;
@@ -894,6 +906,8 @@ protected:
     std::string mPresencedUrl;
 
     megaHandle mHeartbeatTimer = 0;
+    // indexes the history already in db for full-text search, see indexHistory()
+    megaHandle mSearchIndexTimer = 0;
     InitStats mInitStats;
 
 public:
@@ -920,10 +934,14 @@ public:
     const std::string& myEmail() const { return mMyEmail; }
     uint64_t myIdentity() const { return mMyIdentity; }
     UserAttrCache& userAttrCache() const { return *mUserAttrCache; }
+    strongvelope::PairwiseKeyCache& pairwiseKeyCache() const { return *mPairwiseKeyCache; }
 
     ConnState connState() const { return mConnState; }
     bool connected() const { return mConnState == kConnected; }
     bool contactsLoaded() const { return mContactsLoaded; }
+    /** @brief Whether the history can be searched with the full-text index (see ChatdSqliteDb::initSearchIndex).
+     * Not until all the history is indexed: meanwhile, searches scan the history */
+    bool hasSearchIndex() const { return mHasSearchIndex; }
 
     presenced::Client& presenced() { return mPresencedClient; }
 
@@ -1000,6 +1018,15 @@ public:
      * offline operation is not possible.
      */
     InitState init(const char* sid);
+
+    /**
+     * @brief Lets the client connect with the session loaded from the cache, without
+     * waiting for the SDK to complete the fetchnodes, which it's not going to do.
+     * It's meant for replaying recorded traffic (see ReplayWebsocketsIO), when the API
+     * requests are served from the recording too (see ReplayApi).
+     * The client must be in \c kInitHasOfflineSession, and stays there.
+     */
+    void resumeOfflineSession();
     InitState initState() const { return mInitState; }
     bool hasInitError() const { return mInitState >= kInitErrFirst; }
     bool isTerminated() const { return mInitState == kInitTerminated; }
@@ -1101,9 +1128,14 @@ protected:
     // db-related methods
     std::string dbPath(const std::string& sid) const;
     bool openDb(const std::string& sid);
+    bool migrateDb(int version);    // upgrades the cache from version-1 to version, false if it must be rebuilt
     void createDb();
     void wipeDb(const std::string& sid);
     void createDbSchema();
+    /** Creates the full-text index of the history, and indexes the history already in db
+     * in batches, between which the app keeps running */
+    void initSearchIndex();
+    void indexHistory();
 
     // initialization of own handle/email/identity/keys/contacts...
     karere::Id getMyHandleFromDb();
@@ -1117,7 +1149,8 @@ protected:
     void loadContactListFromApi(::mega::MegaUserList& contactList);
 
     strongvelope::ProtocolHandler* newStrongvelope(karere::Id chatid, bool isPublic,
-            std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph);
+            std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph,
+            bool hasSendingItems = true);
 
     // connection-related methods
     void connectToChatd(bool isInBackground);
@@ -1146,6 +1179,7 @@ protected:
     // presenced listener interface
     virtual void onConnStateChange(presenced::Client::ConnState state);
     virtual void onPresenceChange(Id userid, Presence pres, bool inProgress = false);
+    virtual void onPresenceChangeBatch(const presenced::PresenceChanges& changes);
     virtual void onPresenceConfigChanged(const presenced::Config& state, bool pending);
     virtual void onPresenceLastGreenUpdated(karere::Id userid);
 
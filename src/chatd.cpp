@@ -1,10 +1,11 @@
 #include "chatd.h"
 #include "chatClient.h"
 #include "chatdICrypto.h"
+#include "dbQueries.h"
 #include "base64url.h"
+#include <base/traceSpans.h>
 #include <algorithm>
 #include <random>
-#include <regex>
 #include <rapidjson/document.h>
 #include <rapidjson/stringbuffer.h>
 
@@ -53,6 +54,7 @@ using ::mega::mega_snprintf;   // enables the calls to snprintf below which are
 #define CALL_LISTENER(methodName,...)                                                           \
     do {                                                                                        \
       try {                                                                                     \
+          KR_TRACE_SPAN("Listener::" #methodName);                                              \
           CHATD_LOG_LISTENER_CALL("Calling Listener::" #methodName "()");                       \
           mListener->methodName(__VA_ARGS__);                                                   \
       } catch(std::exception& e) {                                                              \
@@ -172,7 +174,7 @@ Client::Client(karere::Client *aKarereClient) :
     }
 
     // initialize the most recent message for each user
-    SqliteStmt stmt1(mKarereClient->db, "SELECT DISTINCT userid FROM history");
+    SqliteStmt stmt1(mKarereClient->db, karere::sql::kHistoryUsers);
     while (stmt1.step())
     {
         karere::Id userid = stmt1.uint64Col(0);
@@ -181,7 +183,7 @@ Client::Client(karere::Client *aKarereClient) :
             continue;
         }
 
-        SqliteStmt stmt2(mKarereClient->db, "SELECT MAX(ts) FROM history WHERE userid = ?");
+        SqliteStmt stmt2(mKarereClient->db, karere::sql::kHistoryLastTsOfUser);
         stmt2 << userid.val;
         if (stmt2.step())
         {
@@ -380,6 +382,87 @@ void Client::setLastMsgTs(Id userid, ::mega::m_time_t lastMsgTs)
     mLastMsgTs[userid] = lastMsgTs;
 }
 
+void Client::setHistoryMemoryBudget(size_t bytes)
+{
+    mHistoryMemoryBudget = bytes;
+    enforceHistoryMemoryBudget();
+}
+
+size_t Client::historyMemoryBudget() const
+{
+    return mHistoryMemoryBudget;
+}
+
+size_t Client::historyMemoryUsage() const
+{
+    size_t usage = 0;
+    for (auto& it: mChatForChatId)
+    {
+        usage += it.second->mHistoryBytes;
+    }
+    return usage;
+}
+
+void Client::onHistoryMemoryGrow()
+{
+    if (!mHistoryMemoryBudget || mHistoryBudgetCheckPending)
+    {
+        return;
+    }
+
+    // messages are usually added in batches, and some of them are still being processed
+    // by the caller, so check the budget once the current batch is done
+    mHistoryBudgetCheckPending = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+
+        mHistoryBudgetCheckPending = false;
+        enforceHistoryMemoryBudget();
+    }, mKarereClient->appCtx);
+}
+
+void Client::enforceHistoryMemoryBudget()
+{
+    size_t usage = historyMemoryUsage();
+    if (!mHistoryMemoryBudget || usage <= mHistoryMemoryBudget)
+    {
+        return;
+    }
+
+    // evict some margin below the budget, so it's not exceeded again by every new message
+    size_t target = mHistoryMemoryBudget - mHistoryMemoryBudget / 8;
+    std::vector<Chat*> chats;
+    chats.reserve(mChatForChatId.size());
+    for (auto& it: mChatForChatId)
+    {
+        chats.push_back(it.second.get());
+    }
+    std::sort(chats.begin(), chats.end(), [](const Chat* a, const Chat* b)
+    {
+        return a->mHistoryLastUse < b->mHistoryLastUse;
+    });
+
+    for (Chat* chat: chats)
+    {
+        if (usage <= target)
+        {
+            break;
+        }
+        usage -= chat->mHistoryBytes;
+        chat->mHistoryBytes = chat->historyMemoryUsage();
+        usage += chat->mHistoryBytes;
+        if (usage > target)
+        {
+            usage -= chat->evictOldHistory(usage - target);
+        }
+    }
+
+    CHATD_LOG_DEBUG("History memory usage: %zu bytes (budget: %zu bytes)", usage, mHistoryMemoryBudget);
+}
+
 uint8_t Client::richLinkState() const
 {
     return mRichLinkState;
@@ -708,6 +791,7 @@ void Connection::setState(State state)
         {
             mSendPromise.reject("Failed to send. Socket was closed");
         }
+        mChatsWaitingToSend.clear();    // output queues are flushed again upon rejoin
     }
     else if (mState == kStateConnected)
     {
@@ -1119,6 +1203,13 @@ void Client::heartbeat()
 }
 
 bool Connection::sendBuf(Buffer&& buf)
+{
+    bool rc = sendBuf(static_cast<const StaticBuffer&>(buf));
+    buf.free();
+    return rc;
+}
+
+bool Connection::sendBuf(const StaticBuffer& buf)
 {
     if (!isOnline())
         return false;
@@ -1138,8 +1229,6 @@ bool Connection::sendBuf(Buffer&& buf)
     }
 
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
-    buf.free();
-
     if (!rc)
     {
         mSendPromise.reject("Socket is not ready");
@@ -1148,6 +1237,19 @@ bool Connection::sendBuf(Buffer&& buf)
     return rc;
 }
 
+bool Connection::isSendQueueFull()
+{
+    return wsSendQueueSize() > kSendQueueHighWatermark;
+}
+
+void Connection::waitForSendQueue(Id chatid)
+{
+    if (std::find(mChatsWaitingToSend.begin(), mChatsWaitingToSend.end(), chatid) == mChatsWaitingToSend.end())
+    {
+        mChatsWaitingToSend.push_back(chatid);
+    }
+}
+
 bool Connection::sendCommand(Command&& cmd)
 {
     CHATDS_LOG_DEBUG("send %s", cmd.toString().c_str());
@@ -1168,9 +1270,8 @@ bool Chat::sendCommand(Command&& cmd)
 
 bool Chat::sendCommand(const Command& cmd)
 {
-    Buffer buf(cmd.buf(), cmd.dataSize());
     CHATID_LOG_DEBUG("send %s", cmd.toString().c_str());
-    auto result = mConnection.sendBuf(std::move(buf));
+    auto result = mConnection.sendBuf(static_cast<const StaticBuffer&>(cmd));
     if (!result)
         CHATID_LOG_DEBUG("  Can't send, we are offline");
     return result;
@@ -1496,6 +1597,7 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    mHistoryLastUse = ++mChatdClient.mHistoryUseCounter;
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -1650,6 +1752,34 @@ void Chat::requestNodeHistoryFromServer(Id oldestMsgid, uint32_t count)
     }, mChatdClient.mKarereClient->appCtx);
 }
 
+void Chat::push_forward(Message* msg)
+{
+    mForwardList.emplace_back(msg);
+    mHistoryBytes += msg->memoryUsage();
+    mChatdClient.onHistoryMemoryGrow();
+}
+
+void Chat::push_back(Message* msg)
+{
+    mBackwardList.emplace_back(msg);
+    mHistoryBytes += msg->memoryUsage();
+    mChatdClient.onHistoryMemoryGrow();
+}
+
+size_t Chat::historyMemoryUsage() const
+{
+    size_t usage = 0;
+    for (auto& msg: mBackwardList)
+    {
+        usage += msg->memoryUsage();
+    }
+    for (auto& msg: mForwardList)
+    {
+        usage += msg->memoryUsage();
+    }
+    return usage;
+}
+
 Message *Chat::oldest() const
 {
     if (!mBackwardList.empty())
@@ -1687,6 +1817,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
       mListener(listener), mUsers(initialUsers), mCrypto(crypto),
       mLastMsgTs(chatCreationTs), mIsGroup(isGroup)
 {
+    KR_TRACE_SPAN_ID("Chat::init", chatid.val);
     assert(mChatId);
     assert(mListener);
     assert(mCrypto);
@@ -1719,6 +1850,13 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastSeenIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastReceivedId);
 
+    int unreadCount = mDbInterface->getUnreadCount();
+    if (unreadCount >= 0)
+    {
+        mUnreadCount = unreadCount;
+        mUnreadCountValid = true;
+    }
+
     if ((mHaveAllHistory = mDbInterface->chatVar("have_all_history")))
     {
         CHATID_LOG_DEBUG("All backward history of chat is available locally");
@@ -1741,7 +1879,8 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         CHATID_LOG_DEBUG("Db has local history: %s - %s (middle point: %u)",
             ID_CSTR(info.oldestDbId), ID_CSTR(info.newestDbId), mForwardStart);
         loadAndProcessUnsent();
-        getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
+        // history is loaded into RAM on demand (see loadInitialHistory()), so resuming
+        // chats that are not opened doesn't load nor decrypt any message
     }
 }
 Chat::~Chat()
@@ -1772,6 +1911,14 @@ void Chat::disable(bool state)
     }
 }
 
+void Chat::loadInitialHistory()
+{
+    if (mHasMoreHistoryInDb && mBackwardList.empty())
+    {
+        getHistoryFromDb(initialHistoryFetchCount);
+    }
+}
+
 Idx Chat::getHistoryFromDb(unsigned count)
 {
     assert(mHasMoreHistoryInDb); //we are within the db range
@@ -1821,6 +1968,21 @@ void Connection::wsSendMsgCb(const char *, size_t)
 {
     assert(!mSendPromise.done());
     mSendPromise.resolve();
+
+    // resume the chats waiting for the output to be written, in order. If one of them fills
+    // the queue again, it goes back to the end of the line and the rest keep waiting
+    auto wptr = weakHandle();
+    while (!mChatsWaitingToSend.empty() && !isSendQueueFull())
+    {
+        Id chatid = mChatsWaitingToSend.front();
+        mChatsWaitingToSend.pop_front();
+        if (mChatIds.find(chatid) != mChatIds.end())
+        {
+            mChatdClient.chats(chatid).flushOutputQueue();
+            if (wptr.deleted())
+                return;
+        }
+    }
 }
 
 // inbound command processing
@@ -1839,6 +2001,7 @@ void Connection::execCommand(const StaticBuffer& buf)
       try
       {
         pos++;
+        KR_TRACE_SPAN(Command::opcodeToStr(opcode));
 #ifndef NDEBUG
         size_t base = pos;
 #endif
@@ -2274,6 +2437,9 @@ void Chat::onHistDone()
     mFetchRequest.pop();
     if (fetchType == FetchType::kFetchMessages)
     {
+        // messages received during the fetch are written to db in a single batch
+        CALL_DB(flushHistory);
+
         // We may be fetching from memory and db because of a resetHistFetch()
         // while fetching from server. In that case, we don't notify about
         // fetched messages and onHistDone()
@@ -2286,6 +2452,8 @@ void Chat::onHistDone()
         {
             onJoinComplete();
         }
+
+        saveUnreadCount();
     }
     else if (fetchType == FetchType::kFetchNodeHistory)
     {
@@ -2547,8 +2715,7 @@ uint64_t Chat::generateRefId(const ICrypto* aCrypto)
 
 void Chat::initChat()
 {
-    mBackwardList.clear();
-    mForwardList.clear();
+    clear();
     mIdToIndexMap.clear();
     if (mAttachmentNodes)
     {
@@ -2561,6 +2728,7 @@ void Chat::initChat()
     mLastSeenIdx = CHATD_IDX_INVALID;
     mLastReceivedIdx = CHATD_IDX_INVALID;
     mNextHistFetchIdx = CHATD_IDX_INVALID;
+    invalidateUnreadCount();
     mLastIdReceivedFromServer = 0;
     mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     mLastServerHistFetchCount = 0;
@@ -2570,6 +2738,7 @@ void Chat::initChat()
     mEncryptionHalted = false;
     mDecryptNewHaltedAt = CHATD_IDX_INVALID;
     mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    mDecryptAhead.clear();
     mRefidToIdxMap.clear();
 
     mHasMoreHistoryInDb = false;
@@ -2582,9 +2751,8 @@ void Chat::requestRichLink(Message &message)
     std::string url;
     if (Message::hasUrl(text, url))
     {
-        std::regex expresion("^(http://|https://)(.+)");
         std::string linkRequest = url;
-        if (!regex_match(url, expresion))
+        if (!Message::hasHttpScheme(url))
         {
             linkRequest = std::string("http://") + url;
         }
@@ -3256,6 +3424,7 @@ void Chat::onLastSeen(Id msgid)
             CHATID_LOG_DEBUG("onLastSeen: Setting last seen msgid to %s", ID_CSTR(msgid));
             mLastSeenId = msgid;
             CALL_DB(setLastSeen, msgid);
+            saveUnreadCount();
 
             return;
         }
@@ -3288,6 +3457,11 @@ void Chat::onLastSeen(Id msgid)
         //notify about messages that have become 'seen'
         Idx  notifyOldest = oldLastSeenIdx + 1;
         Idx low = lownum();
+        if (oldLastSeenIdx == CHATD_IDX_INVALID || notifyOldest < low)
+        {
+            // the range of messages that became seen is not fully in RAM
+            invalidateUnreadCount();
+        }
         if (notifyOldest < low) // consider only messages in RAM
         {
             notifyOldest = low;
@@ -3296,6 +3470,10 @@ void Chat::onLastSeen(Id msgid)
         for (Idx i = notifyOldest; i <= mLastSeenIdx; i++)
         {
             auto& msg = at(i);
+            if (msg.isValidUnread(mChatdClient.mMyHandle))
+            {
+                addToUnreadCount(-1);
+            }
             if (msg.userid != mChatdClient.mMyHandle)
             {
                 CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, msg);
@@ -3303,6 +3481,7 @@ void Chat::onLastSeen(Id msgid)
         }
     }
 
+    saveUnreadCount();
     CALL_LISTENER(onUnreadChanged);
 }
 
@@ -3338,10 +3517,15 @@ bool Chat::setMessageSeen(Idx idx)
         if (mLastSeenIdx == CHATD_IDX_INVALID)
         {
             notifyStart = lownum()-1;
+            invalidateUnreadCount();    // messages not loaded in RAM may become seen
         }
         else
         {
             Idx lowest = lownum()-1;
+            if (mLastSeenIdx < lowest)
+            {
+                invalidateUnreadCount();
+            }
             notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
         }
         mLastSeenIdx = idx;
@@ -3351,6 +3535,10 @@ bool Chat::setMessageSeen(Idx idx)
         for (Idx i=notifyStart+1; i<=notifyEnd; i++)
         {
             auto& m = at(i);
+            if (m.isValidUnread(mChatdClient.mMyHandle))
+            {
+                addToUnreadCount(-1);
+            }
             if (m.userid != mChatdClient.mMyHandle)
             {
                 CALL_LISTENER(onMessageStatusChange, i, Message::kSeen, m);
@@ -3358,6 +3546,7 @@ bool Chat::setMessageSeen(Idx idx)
         }
         mLastSeenId = id;
         CALL_DB(setLastSeen, mLastSeenId);
+        saveUnreadCount();
         CALL_LISTENER(onUnreadChanged);
     }, kSeenTimeout, mChatdClient.mKarereClient->appCtx);
 
@@ -3379,24 +3568,25 @@ bool Chat::setMessageSeen(Id msgid)
 
 int Chat::unreadMsgCount() const
 {
-    if (mLastSeenIdx == CHATD_IDX_INVALID)
+    if (!mUnreadCountValid)
     {
-        if (mHaveAllHistory)
-        {
-            return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
-        }
-        else
-        {
-            return -mDbInterface->getUnreadMsgCountAfterIdx(CHATD_IDX_INVALID);
-        }
+        mUnreadCount = countUnreadMessages();
+        mUnreadCountValid = true;
     }
-    else if (mLastSeenIdx < lownum())
+
+    return (mLastSeenIdx == CHATD_IDX_INVALID && !mHaveAllHistory)
+            ? -mUnreadCount : mUnreadCount;
+}
+
+int Chat::countUnreadMessages() const
+{
+    if (mLastSeenIdx == CHATD_IDX_INVALID || mLastSeenIdx < lownum())
     {
         return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
     }
 
     Idx first = mLastSeenIdx+1;
-    unsigned count = 0;
+    int count = 0;
     auto last = highnum();
     for (Idx i=first; i<=last; i++)
     {
@@ -3409,6 +3599,35 @@ int Chat::unreadMsgCount() const
     return count;
 }
 
+void Chat::addToUnreadCount(int delta)
+{
+    if (!mUnreadCountValid)
+        return;
+
+    mUnreadCount += delta;
+    assert(mUnreadCount >= 0);
+}
+
+void Chat::invalidateUnreadCount()
+{
+    mUnreadCountValid = false;
+    CALL_DB(discardUnreadCount);
+}
+
+void Chat::flushHistory()
+{
+    CALL_DB(flushHistory);
+}
+
+void Chat::saveUnreadCount()
+{
+    // while fetching from server, history is written to db in batches: HISTDONE saves the count
+    if (!mUnreadCountValid || isFetchingFromServer())
+        return;
+
+    CALL_DB(setUnreadCount, mUnreadCount, mLastSeenId);
+}
+
 void Chat::flushOutputQueue(bool fromStart)
 {
     if (fromStart)
@@ -3416,6 +3635,13 @@ void Chat::flushOutputQueue(bool fromStart)
 
     while (mNextUnsent != mSending.end())
     {
+        if (mConnection.isSendQueueFull())
+        {
+            // the socket can't keep up, resume when the pending output has been written
+            mConnection.waitForSendQueue(mChatId);
+            return;
+        }
+
         //kickstart encryption
         //return true if we encrypted at least one message
         if (!msgEncryptAndSend(mNextUnsent++))
@@ -3462,7 +3688,8 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
     mServerFetchState = kHistFetchingNewFromServer;
 
     mFetchRequest.push(FetchType::kFetchMessages);
-    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + at(highnum()).id());
+    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId
+                + (empty() ? dbInfo.newestDbId : at(highnum()).id()));
 }
 
 // after a reconnect, we tell the chatd the oldest and newest buffered message
@@ -3476,7 +3703,7 @@ void Chat::handlejoinRangeHist(const ChatDbInfo& dbInfo)
     Command comm (OP_HANDLEJOINRANGEHIST);
     comm.append((const char*) &ph, Id::CHATLINKHANDLE);
     mFetchRequest.push(FetchType::kFetchMessages);
-    sendCommand(comm + dbInfo.oldestDbId + at(highnum()).id());
+    sendCommand(comm + dbInfo.oldestDbId + (empty() ? dbInfo.newestDbId : at(highnum()).id()));
 }
 
 Client::~Client()
@@ -3872,6 +4099,11 @@ void Chat::onMsgUpdated(Message* cipherMsg)
                 msg->type = msg->buf()[1] + Message::Type::kMsgOffset;
         }
 
+        if (msg->type == Message::kMsgTruncate)
+        {
+            loadInitialHistory();   // truncations are handled from the truncated message in RAM
+        }
+
         //update in memory, if loaded
         auto msgit = mIdToIndexMap.find(msg->id());
         Idx idx;
@@ -3910,6 +4142,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             CALL_DB(updateMsgInHistory, msg->id(), *msg);
 
             // update in RAM
+            bool wasUnread = histmsg.isValidUnread(mChatdClient.mMyHandle);
             histmsg.assign(*msg);     // content
             histmsg.updated = msg->updated;
             histmsg.type = msg->type;
@@ -3921,6 +4154,13 @@ void Chat::onMsgUpdated(Message* cipherMsg)
                 histmsg.keyid = msg->keyid;
             }
 
+            bool isUnread = histmsg.isValidUnread(mChatdClient.mMyHandle);
+            if (wasUnread != isUnread && isUnreadIdx(idx))
+            {
+                addToUnreadCount(isUnread ? 1 : -1);
+                saveUnreadCount();  // edits don't change the bounds of history, which invalidate the saved count
+            }
+
             if (idx > mNextHistFetchIdx)
             {
                 // msg.ts is zero - chatd doesn't send the original timestamp
@@ -3974,6 +4214,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             {
                 //update in db
                 CALL_DB(updateMsgInHistory, msg->id(), *msg);
+                invalidateUnreadCount();    // previous state of the message is unknown
             }
 
             if (msg->isDeleted()) // previous type is unknown, so cannot check for attachment type here
@@ -4019,6 +4260,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
     CALL_CRYPTO(resetSendKey);      // discard current key, if any
     CALL_DB(truncateHistory, msg);
+    invalidateUnreadCount();
     if (idx != CHATD_IDX_INVALID)   // message is loaded in RAM
     {
         //GUI must detach and free any resources associated with
@@ -4112,6 +4354,69 @@ void Chat::deleteMessagesBefore(Idx idx)
     {
         mBackwardList.erase(mBackwardList.begin()+mForwardStart-idx, mBackwardList.end());
     }
+    mHistoryBytes = historyMemoryUsage();
+}
+
+size_t Chat::evictOldHistory(size_t bytes)
+{
+    // fetches and halted decryptions refer to messages in RAM by their index
+    if (isFetchingFromServer() || !mDecryptAhead.empty()
+            || mDecryptOldHaltedAt != CHATD_IDX_INVALID || mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+    {
+        return 0;
+    }
+
+    // keep the newest messages, as loaded at startup, and the ones already notified to
+    // the app by getHistory(), which may still refer to them
+    Idx last = highnum() - (Idx)initialHistoryFetchCount;
+    if (mNextHistFetchIdx < last)
+    {
+        last = mNextHistFetchIdx;
+    }
+    if (mLastTextMsg.isValid() && mLastTextMsg.idx() != CHATD_IDX_INVALID && mLastTextMsg.idx() <= last)
+    {
+        last = mLastTextMsg.idx() - 1;
+    }
+
+    size_t freed = 0;
+    Idx end = lownum();
+    for (; end <= last && freed < bytes; end++)
+    {
+        const Message& msg = at(end);
+        if (msg.isPendingToDecrypt() || msg.isEncrypted() == Message::kEncryptedNoType)
+        {
+            break;  // it may still be under decryption, and not saved to db yet
+        }
+        freed += msg.memoryUsage();
+    }
+
+    if (end == lownum())
+    {
+        return 0;
+    }
+
+    CHATID_LOG_DEBUG("Evicting %d messages from RAM (%zu bytes), they remain in db", end - lownum(), freed);
+    removePendingRichLinks(end - 1);
+    for (Idx i = lownum(); i < end; i++)
+    {
+        const Message& msg = at(i);
+        auto it = mIdToIndexMap.find(msg.id());
+        if (it != mIdToIndexMap.end() && it->second == i)
+        {
+            mIdToIndexMap.erase(it);
+        }
+        auto refit = mRefidToIdxMap.find(msg.backRefId);
+        if (refit != mRefidToIdxMap.end() && refit->second == i)
+        {
+            mRefidToIdxMap.erase(refit);
+        }
+    }
+    size_t before = mHistoryBytes;
+    deleteMessagesBefore(end);
+    // messages in RAM are always a suffix of the history in db, and the oldest
+    // one (mOldestKnownMsgId) is not in RAM anymore
+    mHasMoreHistoryInDb = true;
+    return (before > mHistoryBytes) ? before - mHistoryBytes : 0;
 }
 
 Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
@@ -4170,6 +4475,17 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
             CHATID_LOG_WARNING("Ignoring duplicated NEWMSG: msgid %s, idx %d", ID_CSTR(it->first), it->second);
             return it->second;
         }
+        if (isFetchingFromServer() && mHasMoreHistoryInDb && mBackwardList.empty())
+        {
+            // the newest messages in db are not loaded in RAM, check them during JOINRANGEHIST
+            idx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
+            if (idx != CHATD_IDX_INVALID)
+            {
+                CHATID_LOG_WARNING("Ignoring duplicated NEWMSG: msgid %s, idx %d (not loaded from db)", ID_CSTR(msgid), idx);
+                delete message;
+                return idx;
+            }
+        }
 
         push_forward(message);
         idx = highnum();
@@ -4250,6 +4566,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
                 if (message->isEncrypted() != Message::kEncryptedNoType)
                 {
                     CALL_DB(updateMsgInHistory, message->id(), *message);   // update 'data' & 'is_encrypted'
+                    invalidateUnreadCount();
                 }
                 msgIncomingAfterDecrypt(isNew, true, *message, idx);
             })
@@ -4261,48 +4578,64 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         }
         return true;    // decrypt was not done immediately, but none checks the returned value in this codepath
     }
-    else
-    {
-        assert(msg.isPendingToDecrypt()); //no decrypt attempt was made
-    }
 
-    try
+    promise::Promise<Message*> pms;
+    auto ahead = mDecryptAhead.find(idx);
+    if (ahead != mDecryptAhead.end())
     {
-        mCrypto->handleLegacyKeys(msg);
+        // decryption started while halted at a previous message
+        pms = ahead->second;
+        mDecryptAhead.erase(ahead);
     }
-    catch(std::exception& e)
+    else
     {
-        CHATID_LOG_WARNING("handleLegacyKeys threw error: %s\n"
-            "Queued messages for decrypt: %d - %d. Ignoring", e.what(),
-            mDecryptOldHaltedAt, idx);
-        msg.setEncrypted(Message::kEncryptedNoKey);
-        return true;
-    }
+        assert(msg.isPendingToDecrypt()); //no decrypt attempt was made
 
-    if (!msg.isPendingToDecrypt() && msg.isEncrypted() != Message::kEncryptedNoType)
-    {
-        CHATID_LOG_DEBUG("Message already decrypted or undecryptable: %s, bailing out", ID_CSTR(msg.id()));
-        return true;
-    }
+        try
+        {
+            mCrypto->handleLegacyKeys(msg);
+        }
+        catch(std::exception& e)
+        {
+            CHATID_LOG_WARNING("handleLegacyKeys threw error: %s\n"
+                "Queued messages for decrypt: %d - %d. Ignoring", e.what(),
+                mDecryptOldHaltedAt, idx);
+            msg.setEncrypted(Message::kEncryptedNoKey);
+            return true;
+        }
 
-    if (isNew)
-    {
-        if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+        if (!msg.isPendingToDecrypt() && msg.isEncrypted() != Message::kEncryptedNoType)
         {
-            CHATID_LOG_DEBUG("Decryption of new messages is halted, message queued for decryption");
-            return false;
+            CHATID_LOG_DEBUG("Message already decrypted or undecryptable: %s, bailing out", ID_CSTR(msg.id()));
+            return true;
         }
-    }
-    else
-    {
-        if (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
+
+        if ((isNew && mDecryptNewHaltedAt != CHATD_IDX_INVALID)
+            || (!isNew && mDecryptOldHaltedAt != CHATD_IDX_INVALID))
         {
-            CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
+            CHATID_LOG_DEBUG("Decryption of %s messages is halted, message queued for decryption", isNew ? "new" : "old");
+            if (isFetchingFromServer())
+            {
+                CHATD_LOG_CRYPTO_CALL("Calling ICrypto::msgDecryptInBackground() for a queued message");
+                mDecryptAhead[idx] = mCrypto->msgDecryptInBackground(&msg);
+            }
             return false;
         }
+
+        // history is decrypted in the background, so the messages
+        // received meanwhile are decrypted in parallel
+        if (isFetchingFromServer())
+        {
+            CHATD_LOG_CRYPTO_CALL("Calling ICrypto::msgDecryptInBackground()");
+            pms = mCrypto->msgDecryptInBackground(&msg);
+        }
+        else
+        {
+            CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
+            pms = mCrypto->msgDecrypt(&msg);
+        }
     }
-    CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
-    auto pms = mCrypto->msgDecrypt(&msg);
+
     if (pms.succeeded())
     {
         assert(!msg.isEncrypted());
@@ -4460,6 +4793,10 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         {
             mAttachmentNodes->addMessage(msg, isNew, false);
         }
+        if (isUnreadIdx(idx) && msg.isValidUnread(mChatdClient.mMyHandle))
+        {
+            addToUnreadCount(1);
+        }
         CALL_DB(addMsgToHistory, msg, idx);
 
         if (mChatdClient.isMessageReceivedConfirmationActive() && !isGroup() &&
@@ -4862,6 +5199,9 @@ bool Chat::findLastTextMsg()
                 return true;
             }
         }
+    }
+    if (!empty() || mHasMoreHistoryInDb)    // history in db may not be loaded in RAM yet
+    {
         //check in db
         CALL_DB(getLastTextMessage, lownum()-1, mLastTextMsg, mLastMsgTs);
         if (mLastTextMsg.isValid())
@@ -5023,56 +5363,125 @@ const char* Message::statusNames[] =
   "Sending", "SendingManual", "ServerReceived", "ServerRejected", "Delivered", "NotSeen", "Seen"
 };
 
+// Character classes of the URL and email patterns, so they can be matched without std::regex
+static bool isAsciiAlpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool isAsciiAlnum(char c)
+{
+    return isAsciiAlpha(c) || (c >= '0' && c <= '9');
+}
+
+static bool isUrlChar(char c)
+{
+    return isAsciiAlnum(c) || (c && strchr("-._~:/?#@!$&'()*+,;=", c));
+}
+
+// Candidates for URLs are delimited by any character not accepted here
+static bool isUrlTokenChar(char c)
+{
+    return (c >= 33 && c <= 126)
+            && c != '"'
+            && c != '\''
+            && c != '\\'
+            && c != '<'
+            && c != '>'
+            && c != '{'
+            && c != '}'
+            && c != '|';
+}
+
+// [urlChar]+[.][a-zA-Z]{2,5}(:[0-9]{1,5})?[urlChar]* --> since the port and the letters after
+// the first two are also valid urlChars, it's a run of urlChars with a dot (not the first
+// char) followed by at least two letters
+static bool matchesUrlBody(const char *str, size_t len)
+{
+    bool hasDomain = false;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isUrlChar(str[i]))
+        {
+            return false;
+        }
+
+        if (!hasDomain && i > 0 && str[i] == '.' && i + 2 < len
+                && isAsciiAlpha(str[i + 1]) && isAsciiAlpha(str[i + 2]))
+        {
+            hasDomain = true;
+        }
+    }
+    return hasDomain;
+}
+
+static bool matchesUrl(const char *str, size_t len)
+{
+    if (matchesUrlBody(str, len))
+    {
+        return true;
+    }
+
+    // optional prefix "www" or "WWW" followed by any character but a line terminator
+    return len > 4
+            && (!memcmp(str, "www", 3) || !memcmp(str, "WWW", 3))
+            && str[3] != '\n' && str[3] != '\r'
+            && matchesUrlBody(str + 4, len - 4);
+}
+
 bool Message::hasUrl(const string &text, string &url)
 {
-    std::string::size_type position = 0;
     std::string partialString;
+    std::string::size_type position = 0;
     while (position < text.size())
     {
-        char character = text[position];
-        if ((character >= 33 && character <= 126)
-                && character != '"'
-                && character != '\''
-                && character != '\\'
-                && character != '<'
-                && character != '>'
-                && character != '{'
-                && character != '}'
-                && character != '|')
+        // find the next candidate
+        while (position < text.size() && !isUrlTokenChar(text[position]))
         {
-            partialString.push_back(character);
+            position++;
         }
-        else
+
+        std::string::size_type start = position;
+        while (position < text.size() && isUrlTokenChar(text[position]))
         {
-            if (!partialString.empty())
+            position++;
+        }
+
+        if (position > start)
+        {
+            partialString.assign(text, start, position - start);
+            removeUnnecessaryFirstCharacters(partialString);
+            removeUnnecessaryLastCharacters(partialString);
+            if (parseUrl(partialString))
             {
-                removeUnnecessaryFirstCharacters(partialString);
-                removeUnnecessaryLastCharacters(partialString);
-                if (parseUrl(partialString))
-                {
-                    url = partialString;
-                    return true;
-                }
+                url = partialString;
+                return true;
             }
-
-            partialString.clear();
         }
-
-        position ++;
     }
 
-    if (!partialString.empty())
+    return false;
+}
+
+bool Message::hasHttpScheme(const string &url)
+{
+    // ^(http://|https://)(.+) --> the rest can't contain line terminators
+    std::string::size_type schemeLength;
+    if (!url.compare(0, 7, "http://"))
     {
-        removeUnnecessaryFirstCharacters(partialString);
-        removeUnnecessaryLastCharacters(partialString);
-        if (parseUrl(partialString))
-        {
-            url = partialString;
-            return true;
-        }
+        schemeLength = 7;
+    }
+    else if (!url.compare(0, 8, "https://"))
+    {
+        schemeLength = 8;
+    }
+    else
+    {
+        return false;
     }
 
-    return false;
+    return url.size() > schemeLength
+            && url.find_first_of("\r\n", schemeLength) == std::string::npos;
 }
 
 bool Message::parseUrl(const std::string &url)
@@ -5087,32 +5496,25 @@ bool Message::parseUrl(const std::string &url)
         return false;
     }
 
-    std::string urlToParse = url;
-    std::string::size_type position = urlToParse.find("://");
+    std::string::size_type start = 0;
+    std::string::size_type position = url.find("://");
     if (position != std::string::npos)
     {
-        std::regex expresion("^(http://|https://)(.+)");
-        if (regex_match(urlToParse, expresion))
-        {
-            urlToParse = urlToParse.substr(position + 3);
-        }
-        else
+        if (!hasHttpScheme(url))
         {
             return false;
         }
+        start = position + 3;
     }
 
-    if (urlToParse.find("mega.co.nz/#!") != std::string::npos || urlToParse.find("mega.co.nz/#F!") != std::string::npos ||
-            urlToParse.find("mega.nz/#!") != std::string::npos || urlToParse.find("mega.nz/#F!") != std::string::npos ||
-            urlToParse.find("mega.nz/chat/") != std::string::npos)
+    if (url.find("mega.co.nz/#!", start) != std::string::npos || url.find("mega.co.nz/#F!", start) != std::string::npos ||
+            url.find("mega.nz/#!", start) != std::string::npos || url.find("mega.nz/#F!", start) != std::string::npos ||
+            url.find("mega.nz/chat/", start) != std::string::npos)
     {
         return false;
     }
 
-    std::regex regularExpresion("^(WWW.|www.)?[a-z0-9A-Z-._~:/?#@!$&'()*+,;=]+[.][a-zA-Z]{2,5}(:[0-9]{1,5})?([a-z0-9A-Z-._~:/?#@!$&'()*+,;=]*)?$");
-
-
-    return regex_match(urlToParse, regularExpresion);
+    return matchesUrl(url.data() + start, url.size() - start);
 }
 
 Chat::SendingItem::SendingItem(uint8_t aOpcode, Message *aMsg, const SetOfIds &aRcpts, uint64_t aRowid)
@@ -5178,8 +5580,52 @@ void Message::removeUnnecessaryFirstCharacters(string &buf)
 
 bool Message::isValidEmail(const string &buf)
 {
-    std::regex regularExpresion("^[a-z0-9A-Z._%+-]+@[a-z0-9A-Z.-]+[.][a-zA-Z]{2,6}");
-    return regex_match(buf, regularExpresion);
+    // ^[a-z0-9A-Z._%+-]+@[a-z0-9A-Z.-]+[.][a-zA-Z]{2,6}
+    std::string::size_type at = buf.find('@');
+    if (at == std::string::npos || at == 0)
+    {
+        return false;
+    }
+
+    for (std::string::size_type i = 0; i < at; i++)
+    {
+        char c = buf[i];
+        if (!isAsciiAlnum(c) && c != '.' && c != '_' && c != '%' && c != '+' && c != '-')
+        {
+            return false;
+        }
+    }
+
+    // the top-level domain has no dots, so it starts after the last one
+    std::string::size_type lastDot = buf.rfind('.');
+    if (lastDot == std::string::npos || lastDot < at + 2)
+    {
+        return false;
+    }
+
+    for (std::string::size_type i = at + 1; i < lastDot; i++)
+    {
+        char c = buf[i];
+        if (!isAsciiAlnum(c) && c != '.' && c != '-')
+        {
+            return false;
+        }
+    }
+
+    std::string::size_type tldLength = buf.size() - lastDot - 1;
+    if (tldLength < 2 || tldLength > 6)
+    {
+        return false;
+    }
+
+    for (std::string::size_type i = lastDot + 1; i < buf.size(); i++)
+    {
+        if (!isAsciiAlpha(buf[i]))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
 FilteredHistory::FilteredHistory(DbInterface &db, Chat &chat)
@@ -5255,7 +5701,9 @@ void FilteredHistory::truncateHistory(Id id)
         if (it != mIdToMsgMap.end())
         {
             // id is a message in the history, we want to remove from the next message until the oldest
-            for (auto itLoop = ++it->second; itLoop != mBuffer.end(); itLoop++)
+            // (erasing from mIdToMsgMap invalidates 'it', so it's not used after the first erase)
+            auto first = std::next(it->second);
+            for (auto itLoop = first; itLoop != mBuffer.end(); itLoop++)
             {
                 mIdToMsgMap.erase((*itLoop)->id());
 
@@ -5265,7 +5713,7 @@ void FilteredHistory::truncateHistory(Id id)
                     mNextMsgToNotify = mBuffer.end();
                 }
             }
-            mBuffer.erase(it->second, mBuffer.end());
+            mBuffer.erase(first, mBuffer.end());
         }
 
         CALL_DB_FH(truncateNodeHistory, id);
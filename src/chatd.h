@@ -12,6 +12,7 @@
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
 #include <chatdMsg.h>
+#include <idMap.h>
 #include <url.h>
 #include <net/websocketsIO.h>
 #include <userAttrCache.h>
@@ -406,6 +407,11 @@ public:
         kConnectTimeout = 30    // (in seconds) timeout reconnection to succeeed
     };
 
+    enum
+    {
+        kSendQueueHighWatermark = 1024 * 1024   // (in bytes) chats stop flushing their output queue above it
+    };
+
 protected:
     Connection(Client& chatdClient, int shardNo);
 
@@ -458,6 +464,10 @@ protected:
     /** This promise is resolved when output data is written to the sockets */
     promise::Promise<void> mSendPromise;
 
+    /** Chats that stopped flushing their output queue because the socket can't keep up.
+     * They are resumed in order once the pending output has been written */
+    std::deque<karere::Id> mChatsWaitingToSend;
+
     // ---- callbacks called from libwebsocketsIO ----
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
@@ -471,6 +481,9 @@ protected:
     void doConnect();
 // Destroys the buffer content
     bool sendBuf(Buffer&& buf);
+    bool sendBuf(const StaticBuffer& buf);
+    bool isSendQueueFull();
+    void waitForSendQueue(karere::Id chatid);
     bool rejoinExistingChats();
     void resendPending();
     void join(karere::Id chatid);
@@ -650,7 +663,7 @@ protected:
     std::list<std::unique_ptr<Message>> mBuffer;
 
     /** Maps msgid's to their position in the history-buffer */
-    std::map<karere::Id, std::list<std::unique_ptr<Message>>::iterator> mIdToMsgMap;
+    karere::IdMap<std::list<std::unique_ptr<Message>>::iterator> mIdToMsgMap;
 
     /** Index of the newest (most recent) message loaded in RAM */
     Idx mNewestIdx;
@@ -745,7 +758,7 @@ protected:
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::IdMap<Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
@@ -813,6 +826,15 @@ protected:
      * of new messages may work synchronously and not be delayed.
      */
     Idx mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+
+    /** While decryption is halted during a history fetch, the queued messages are not
+     * left waiting: their decryption is started right away (see
+     * \c ICrypto::msgDecryptInBackground), so that the crypto module can process them
+     * in parallel. The promises are kept here by index, and when decryption resumes,
+     * the messages are processed in order as usual, with the result of their promise
+     * instead of a new decryption.
+     */
+    std::map<Idx, promise::Promise<Message*>> mDecryptAhead;
     uint32_t mLastMsgTs;
     bool mIsGroup;
     std::set<karere::Id> mMsgsToUpdateWithRichLink;
@@ -828,17 +850,30 @@ protected:
     bool mDecryptionAttachmentsHalted = false;
     /** True when node-attachments are pending to decrypt and history is truncated --> discard message being decrypted */
     bool mTruncateAttachment = false;
+    /** Number of unread messages (absolute value, see unreadMsgCount() for the sign).
+     * It's maintained incrementally as messages are received, edited and seen, and it's
+     * recalculated from RAM/db only when invalidated (i.e. truncation, history reload).
+     * It's saved to db only at a few points, see saveUnreadCount() */
+    mutable int mUnreadCount = 0;
+    mutable bool mUnreadCountValid = false;
     // ====
-    std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::IdMap<Message*> mPendingEdits;
+    karere::IdMap<Idx, BackRefId> mRefidToIdxMap;
+    /** Approximate RAM held by the history buffer, see \c Message::memoryUsage(). It's updated
+     * when messages are added or removed, but not when they change in place (i.e. decryption
+     * or edits), so it's recalculated with \c historyMemoryUsage() before evicting */
+    size_t mHistoryBytes = 0;
+    /** Last use of the history by the app, to evict from the least recently used chats first */
+    uint64_t mHistoryLastUse = 0;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
+    void push_forward(Message* msg);
+    void push_back(Message* msg);
     void clear()
     {
         mBackwardList.clear();
         mForwardList.clear();
+        mHistoryBytes = 0;
     }
     // msgid can be 0 in case of rejections
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
@@ -959,7 +994,7 @@ public:
       *  This can be used by the app to replace the text of messages who have
       * been edited before they have been sent/confirmed. Normally the app needs
       * to display the edited text in the unsent message.*/
-    const std::map<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
+    const karere::IdMap<Message*>& pendingEdits() const { return mPendingEdits; }
 
     /** @brief Whether the listener will be notified upon receiving
      * old history messages from the server.
@@ -1103,6 +1138,13 @@ public:
      */
     HistSource getHistory(unsigned count);
 
+    /**
+     * @brief Loads into RAM the newest messages of the local history, if they are not
+     * loaded yet. Chats resumed from cache start with no history in RAM, which is loaded
+     * by the first \c getHistory(). Call this method when it's needed before that.
+     */
+    void loadInitialHistory();
+
     HistSource getNodeHistory(uint32_t count);
 
     /**
@@ -1192,6 +1234,16 @@ public:
       */
     int unreadMsgCount() const;
 
+    /** @brief Saves the unread count to db, so it doesn't need to be recalculated upon
+     * the next startup. It's called upon HISTDONE and when the last-seen pointer changes,
+     * and by the app before closing the db. Changes in between are not written, the count
+     * saved together with the bounds of history makes any later message discard it */
+    void saveUnreadCount();
+
+    /** @brief Writes to db the messages received from server that are still pending in a
+     * batch (see DbInterface::flushHistory()). It's called by the app before closing the db */
+    void flushHistory();
+
     /** @brief Returns the text of the most-recent message in the chat that can
      * be displayed as text in the chat list. If it is not found in RAM,
      * the database will be queried. If not found there as well, server is queried,
@@ -1293,6 +1345,10 @@ public:
     /** Returns newest message in  the history buffer*/
     Message* newest() const;
 
+    /** @brief The RAM held by the messages in the history buffer, in bytes. It
+     * doesn't include the node-history, nor the messages in the sending queue */
+    size_t historyMemoryUsage() const;
+
     /** Returns true when fetch in-flight is a NODEHIST */
     bool isFetchingNodeHistory() const;
     void setNodeHistoryHandler(FilteredHistoryHandler *handler);
@@ -1313,8 +1369,13 @@ protected:
     void moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason);
     void handleTruncate(const Message& msg, Idx idx);
     void deleteMessagesBefore(Idx idx);
+    size_t evictOldHistory(size_t bytes);
     void createMsgBackRefs(OutputQueue::iterator msgit);
     void verifyMsgOrder(const Message& msg, Idx idx);
+    int countUnreadMessages() const;
+    bool isUnreadIdx(Idx idx) const { return (mLastSeenIdx == CHATD_IDX_INVALID) || (idx > mLastSeenIdx); }
+    void addToUnreadCount(int delta);
+    void invalidateUnreadCount();
 
     /**
      * @brief Initiates replaying of callbacks about unsent messages and unsent
@@ -1362,11 +1423,18 @@ protected:
     // to track changes in the richPreview's user-attribute
     karere::UserAttrCache::Handle mRichPrevAttrCbHandle;
 
+    // limit of the RAM held by the history buffers, 0 for no limit
+    size_t mHistoryMemoryBudget = 0;
+    bool mHistoryBudgetCheckPending = false;
+    uint64_t mHistoryUseCounter = 0;
+
     uint8_t mKeepaliveType = OP_KEEPALIVE;
     int mKeepaliveCount = 0;                    // number of keepalives to be sent (one per connection)
     bool mKeepaliveFailed = false;              // true means any pending keepalive failed to send
     promise::Promise<void> mKeepalivePromise;   // resolved when all keepalive have been sent (or failed)
     void onKeepaliveSent();
+    void onHistoryMemoryGrow();
+    void enforceHistoryMemoryBudget();
 
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
@@ -1436,6 +1504,20 @@ public:
     mega::m_time_t getLastMsgTs(karere::Id userid) const;
     void setLastMsgTs(karere::Id userid, mega::m_time_t lastMsgTs);
 
+    /** @brief Limits the RAM held by the history buffers of all the chats, in bytes (0 means no limit).
+     *
+     * When exceeded, the oldest messages of the chats least recently used by the app are
+     * evicted from RAM, and loaded again from db if the app fetches them (see \c Chat::getHistory).
+     * The newest \c Chat::initialHistoryFetchCount messages and the ones already
+     * notified to the app are kept, so the actual usage may exceed the budget.
+     */
+    void setHistoryMemoryBudget(size_t bytes);
+    size_t historyMemoryBudget() const;
+
+    /** @brief The RAM held by the history buffers of all the chats, in bytes. It's
+     * approximate, see \c Chat::historyMemoryUsage() for the exact value of a chat */
+    size_t historyMemoryUsage() const;
+
     friend class Connection;
     friend class Chat;
 };
@@ -1488,6 +1570,9 @@ public:
     /// update a message in the history buffer with the specified \c msgid
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
 
+    /// writes to db any message added by \c addMsgToHistory that is still pending (i.e. while fetching from server)
+    virtual void flushHistory() = 0;
+
 
 //  <<<--- Management of the SENDING QUEUE --->>>
 
@@ -1552,6 +1637,14 @@ public:
     virtual Idx getOldestIdx() = 0;
     virtual Idx getIdxOfMsgidFromHistory(karere::Id msgid) = 0;
     virtual Idx getUnreadMsgCountAfterIdx(Idx idx) = 0;
+
+    /// returns the saved unread count, or -1 if it's not available or it was saved for a different
+    /// history range or last-seen pointer than the ones in db, so it's never stale after a restart
+    virtual int getUnreadCount() = 0;
+    /// saves the unread count of the history in db, for the given last-seen pointer
+    virtual void setUnreadCount(int count, karere::Id lastSeenId) = 0;
+    /// discards the saved unread count, when it can't be maintained anymore
+    virtual void discardUnreadCount() = 0;
     virtual void getLastTextMessage(Idx from, chatd::LastTextMsgState& msg, uint32_t& lastTs) = 0;
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated) = 0;
 
@@ -2,23 +2,584 @@
 #define CHATD_DB_H
 
 #include "db.h"
+#include "dbQueries.h"
 #include "chatd.h"
 //extern sqlite3* db;
 
+/** @brief What a chatd::Chat reads from db when it's created. Upon startup, it's loaded
+ * for all the chats at once (see ChatdSqliteDb::loadSummaries()), so resuming from cache
+ * doesn't run several queries per chat */
+struct ChatdDbSummary
+{
+    chatd::ChatDbInfo info;
+    chatd::Idx lastSeenIdx = CHATD_IDX_INVALID;
+    chatd::Idx lastRecvIdx = CHATD_IDX_INVALID;
+    chatd::Idx oldestDbIdx = CHATD_IDX_INVALID;
+    int unreadCount = -1;             // -1 if not saved or saved for a different history
+    std::string unreadCountValue;     // as saved in chat_vars
+    bool hasUnreadCount = false;
+    bool haveAllHistory = false;
+    chatd::Idx nodeHistOldestIdx = 0;     // as returned by getNodeHistoryInfo()
+    chatd::Idx nodeHistNewestIdx = -1;
+    bool hasSendingItems = false;
+    ChatdDbSummary() { memset(&info, 0, sizeof(info)); }
+};
+
 class ChatdSqliteDb: public chatd::DbInterface
 {
 protected:
+    enum
+    {
+        kHistoryBatchRows = 32,     // rows per multi-row insert (11 params per row, below SQLITE_MAX_VARIABLE_NUMBER)
+        kMaxPendingHistory = 256    // max messages held in memory before flushing them to the history table
+    };
+
+    // values of mSummary not read yet
+    enum
+    {
+        kSummaryInfo = 1,
+        kSummaryLastSeenIdx = 2,
+        kSummaryLastRecvIdx = 4,
+        kSummaryUnreadCount = 8,
+        kSummaryHaveAllHistory = 16,
+        kSummaryNodeHistoryInfo = 32,
+        kSummarySendingItems = 64
+    };
+
+    /** A history row waiting to be inserted. It holds its own copy of the message data,
+     * since the message in RAM may be modified or deleted before the batch is flushed */
+    struct PendingHistoryRow
+    {
+        chatd::Idx idx;
+        karere::Id msgid;
+        chatd::KeyId keyid;
+        unsigned char type;
+        karere::Id userid;
+        uint32_t ts;
+        uint16_t updated;
+        Buffer data;
+        bool dataIsNull;
+        chatd::BackRefId backRefId;
+        uint8_t isEncrypted;
+        PendingHistoryRow(const chatd::Message& msg, chatd::Idx aIdx)
+            : idx(aIdx), msgid(msg.id()), keyid(msg.keyid), type(msg.type), userid(msg.userid),
+              ts(msg.ts), updated(msg.updated), data(msg.buf(), msg.dataSize()), dataIsNull(!msg.buf()),
+              backRefId(msg.backRefId), isEncrypted(msg.isEncrypted()) {}
+
+        // deleted messages must be stored as zero-length blobs, not as NULL, as queries rely on length(data)
+        StaticBuffer blob() const
+        {
+            return dataIsNull ? StaticBuffer(nullptr, 0) : StaticBuffer(data.empty() ? "" : data.buf(), data.dataSize());
+        }
+    };
+
     SqliteDb& mDb;
-    chatd::Chat& mChat;
+    chatd::Chat* mChat;     // null for the history of a chat that doesn't exist, see the protected constructor
+    karere::Id mChatId;
     std::string mSendingTblName;
     std::string mHistTblName;
+
+    /** Messages received while a fetch from server is in progress, in order of arrival.
+     * They are written to db in batches, upon HISTDONE or when kMaxPendingHistory is reached.
+     * Any other access to the history table flushes them first, so readers always see
+     * a contiguous history. They are also flushed before the db is closed and when the
+     * chat is deleted. If the app is killed before, they are fetched again from server */
+    std::vector<PendingHistoryRow> mPendingHistory;
+
+    /** Each value is returned only once, by the first read when the chat is created. Any
+     * later read goes to db, since the value may have changed */
+    ChatdDbSummary mSummary;
+    int mSummaryUnread = 0;     // kSummary* flags
+
+    /** The value of 'unread_count' in chat_vars, empty if none. Until it's read at init, assume there's one */
+    std::string mSavedUnreadCount;
+    bool mHasSavedUnreadCount = true;
+
+    /** The unread count is saved together with the history range and the last-seen pointer
+     * it was calculated for, as "count,oldestIdx,newestIdx,lastSeenId". Messages added to
+     * history after saving it change the range, so a count not saved again before the app
+     * is terminated is discarded when it's read, instead of being stale */
+    static std::string unreadCountValue(int count, chatd::Idx oldestIdx, chatd::Idx newestIdx, karere::Id lastSeenId)
+    {
+        return std::to_string(count) + "," + std::to_string(oldestIdx) + ","
+                + std::to_string(newestIdx) + "," + std::to_string(lastSeenId.val);
+    }
+    /** Returns the count in \c value if it matches the given history range and last-seen
+     * pointer, or -1 otherwise (including values saved in a different format) */
+    static int unreadCountFromValue(const std::string& value, chatd::Idx oldestIdx, chatd::Idx newestIdx, karere::Id lastSeenId)
+    {
+        int count = -1;
+        if (sscanf(value.c_str(), "%d,", &count) != 1 || count < 0)
+            return -1;
+        return (value == unreadCountValue(count, oldestIdx, newestIdx, lastSeenId)) ? count : -1;
+    }
+    void getHistoryRange(chatd::Idx& oldest, chatd::Idx& newest)
+    {
+        SqliteStmt stmt(mDb, karere::sql::kHistoryRange);
+        stmt << mChatId;
+        stmt.stepMustHaveData("get history range");
+        bool empty = (sqlite3_column_type(stmt, 0) == SQLITE_NULL);
+        oldest = empty ? CHATD_IDX_INVALID : stmt.intCol(0);
+        newest = empty ? CHATD_IDX_INVALID : stmt.intCol(1);
+    }
+
+    static const std::string& historyInsertSql(int rows)
+    {
+        static const std::string sqlSingle = historyInsertSqlForRows(1);
+        static const std::string sqlBatch = historyInsertSqlForRows(kHistoryBatchRows);
+        assert(rows == 1 || rows == kHistoryBatchRows);
+        return (rows == 1) ? sqlSingle : sqlBatch;
+    }
+    static std::string historyInsertSqlForRows(int rows)
+    {
+        std::string sql = "insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) values";
+        for (int i = 0; i < rows; i++)
+        {
+            sql.append(i ? ",(?,?,?,?,?,?,?,?,?,?,?)" : "(?,?,?,?,?,?,?,?,?,?,?)");
+        }
+        return sql;
+    }
+    void insertPendingRows(size_t first, int rows)
+    {
+        SqliteStmt stmt(mDb, historyInsertSql(rows));
+        for (size_t i = first; i < first + rows; i++)
+        {
+            const PendingHistoryRow& row = mPendingHistory[i];
+            stmt << row.idx << mChatId << row.msgid << row.keyid << row.type << row.userid
+                 << row.ts << row.updated << row.blob() << row.backRefId << row.isEncrypted;
+        }
+        stmt.step();
+    }
+
+    /** Whether the chat is fetching history from server, so the messages added to history
+     * can be batched until HISTDONE */
+    virtual bool isFetchingFromServer() const
+    {
+        return (mChat->serverFetchState() & chatd::kHistSourceServer) == chatd::kHistSourceServer;
+    }
+
+    /** Removes the full-text index of the history and the triggers that keep it up to date.
+     * Without FTS5 the index itself can't be dropped, but it's rebuilt once FTS5 is available
+     * again, since the triggers are missing (see initSearchIndex()) */
+    static void dropSearchIndex(SqliteDb& db)
+    {
+        db.simpleQuery("drop trigger if exists history_fts_insert;"
+                       "drop trigger if exists history_fts_delete;"
+                       "drop trigger if exists history_fts_update;"
+                       "drop view if exists history_text;"
+                       "delete from vars where name = 'history_fts_pending';");
+        try
+        {
+            db.simpleQuery("drop table if exists history_fts");
+        }
+        catch (std::exception& e)
+        {
+            CHATD_LOG_WARNING("Can't drop the full-text index of the history: %s", e.what());
+        }
+    }
+
+    /** For tests of the history table without a chatd::Chat: they must override
+     * isFetchingFromServer(), and can't use the methods that need the own user handle
+     * (the sending queues and the unread count) */
+    ChatdSqliteDb(SqliteDb& db, karere::Id chatid)
+        :mDb(db), mChat(nullptr), mChatId(chatid), mSendingTblName("sending"), mHistTblName("history"){}
+
 public:
     ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
-        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+        :mDb(db), mChat(&chat), mChatId(chat.chatId()), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+
+    /** A chat deleted in the middle of a fetch from server keeps the messages received so far,
+     * unless it has been removed from db already (i.e. a preview). Upon termination, the db is
+     * closed before the chats are deleted, so the client flushes them before (see Chat::flushHistory()) */
+    virtual ~ChatdSqliteDb()
+    {
+        if (mPendingHistory.empty() || !mDb.isOpen())
+            return;
+
+        try
+        {
+            SqliteStmt stmt(mDb, "select count(*) from chats where chatid = ?");
+            stmt << mChatId;
+            stmt.stepMustHaveData("~ChatdSqliteDb");
+            if (stmt.intCol(0))
+            {
+                flushHistory();
+            }
+        }
+        catch (std::exception& e)
+        {
+            CHATD_LOG_ERROR("chatid %s: error writing the pending history to db: %s",
+                mChatId.toString().c_str(), e.what());
+        }
+    }
+
+    /** @brief A message found by searchHistory() */
+    struct SearchResult
+    {
+        karere::Id chatid;
+        chatd::Idx idx;
+        std::unique_ptr<chatd::Message> msg;
+        SearchResult(karere::Id aChatid, chatd::Idx aIdx, chatd::Message* aMsg)
+            : chatid(aChatid), idx(aIdx), msg(aMsg) {}
+    };
+
+    /** @brief Creates the full-text index of the history, if SQLite has FTS5.
+     *
+     * The index doesn't keep a copy of the text: it's an external-content FTS5 table over
+     * the view `history_text` (the decrypted text messages of history), keyed by the rowid of
+     * history, which is stable because the db is never vacuumed.
+     * The index is kept up to date by triggers on the history table, so the messages added,
+     * edited, truncated or cleared (and the history of deleted chats) are indexed in the same
+     * transaction that changes them. Messages still pending in a batch (see flushHistory())
+     * are indexed when written.
+     *
+     * The messages already in db when the index is created are indexed later, a few at a
+     * time, by indexHistory(). Until then, the var `history_fts_pending` is the rowid of the
+     * newest message not indexed yet, and the triggers skip the messages up to it.
+     *
+     * @return Whether the index is available. If not, searchHistory() scans the history.
+     */
+    static bool initSearchIndex(SqliteDb& db)
+    {
+        bool isNew;
+        {
+            // an index with its own copy of the text (from a previous version), or without
+            // triggers (changes to history made without FTS5), is built again
+            SqliteStmt stmt(db, "select count(*) from sqlite_master where (type = 'table' and name = 'history_fts' "
+                                "and sql like '%content%') or (type = 'trigger' and name = 'history_fts_insert')");
+            stmt.stepMustHaveData("initSearchIndex");
+            isNew = (stmt.intCol(0) != 2);
+        }
+
+        try
+        {
+            if (isNew)
+            {
+                dropSearchIndex(db);
+                db.simpleQuery("insert into vars(name, value) select 'history_fts_pending', max(rowid) from history "
+                               "having max(rowid) not null");
+            }
+            // the triggers skip the messages that aren't text, and the ones still pending
+            db.simpleQuery(
+                "create view if not exists history_text as select rowid as id, cast(data as text) as text from history "
+                    "where type = 1 and is_encrypted = 0 and length(data) > 0;"
+                "create virtual table if not exists history_fts using fts5(text, content = 'history_text', content_rowid = 'id');"
+                "create trigger if not exists history_fts_insert after insert on history "
+                    "when new.type = 1 and new.is_encrypted = 0 and length(new.data) > 0 "
+                    "and new.rowid > ifnull((select value from vars where name = 'history_fts_pending'), 0) "
+                    "begin insert into history_fts(rowid, text) values(new.rowid, cast(new.data as text)); end;"
+                "create trigger if not exists history_fts_delete after delete on history "
+                    "when old.type = 1 and old.is_encrypted = 0 and length(old.data) > 0 "
+                    "and old.rowid > ifnull((select value from vars where name = 'history_fts_pending'), 0) "
+                    "begin insert into history_fts(history_fts, rowid, text) values('delete', old.rowid, cast(old.data as text)); end;"
+                "create trigger if not exists history_fts_update after update of type, data, is_encrypted on history "
+                    "when new.rowid > ifnull((select value from vars where name = 'history_fts_pending'), 0) "
+                    "begin insert into history_fts(history_fts, rowid, text) select 'delete', old.rowid, cast(old.data as text) "
+                    "where old.type = 1 and old.is_encrypted = 0 and length(old.data) > 0; "
+                    "insert into history_fts(rowid, text) select new.rowid, cast(new.data as text) "
+                    "where new.type = 1 and new.is_encrypted = 0 and length(new.data) > 0; end;");
+
+            // an index created by a build with FTS5 can't be used without it
+            SqliteStmt stmt(db, "select rowid from history_fts limit 1");
+            stmt.step();
+        }
+        catch (std::exception& e)
+        {
+            CHATD_LOG_WARNING("Full-text search is not available, searching messages will scan the history: %s", e.what());
+            // otherwise, every change to history would fail
+            dropSearchIndex(db);
+            return false;
+        }
+
+        if (isNew)
+        {
+            CHATD_LOG_DEBUG("Full-text index of the history created");
+        }
+        return true;
+    }
+
+    /** @brief Indexes up to \c count of the messages that were in db when the full-text index
+     * was created (see initSearchIndex()), newest first. In the same transaction as the changes
+     * of history, so the index is always consistent with it.
+     *
+     * @return Whether the whole history is indexed
+     */
+    static bool indexHistory(SqliteDb& db, unsigned count)
+    {
+        int64_t pending;
+        {
+            SqliteStmt stmt(db, "select value from vars where name = 'history_fts_pending'");
+            if (!stmt.step())
+            {
+                return true;
+            }
+            pending = stmt.int64Col(0);
+        }
+
+        // rowids, not messages: the ones of deleted messages are skipped
+        int64_t first = (pending > count) ? pending - count : 0;
+        db.query("insert into history_fts(rowid, text) select id, text from history_text where id > ? and id <= ?", first, pending);
+        if (first)
+        {
+            db.query("update vars set value = ? where name = 'history_fts_pending'", first);
+            return false;
+        }
+
+        db.query("delete from vars where name = 'history_fts_pending'");
+        CHATD_LOG_DEBUG("Full-text index of the history completed");
+        return true;
+    }
+
+    /** @brief Searches the text messages of the history of \c chatid (or of all chats, if it's
+     * invalid) that contain all the words of \c query. The last word matches as a prefix too.
+     * Results are sorted by relevance if the full-text index is available (see initSearchIndex()),
+     * or newest first if not.
+     */
+    static void searchHistory(SqliteDb& db, bool hasIndex, karere::Id chatid, const std::string& query,
+                              unsigned limit, unsigned offset, std::vector<SearchResult>& results)
+    {
+        std::vector<std::string> words;
+        size_t pos = 0;
+        while ((pos = query.find_first_not_of(" \t\r\n", pos)) != std::string::npos)
+        {
+            size_t end = query.find_first_of(" \t\r\n", pos);
+            words.push_back(query.substr(pos, end - pos));
+            pos = end;
+        }
+        if (words.empty() || !limit)
+        {
+            return;
+        }
+
+        bool allChats = (chatid == karere::Id::inval());
+        std::string sql = "select h.msgid, h.userid, h.ts, h.type, h.data, h.idx, h.keyid, h.backrefid, "
+                          "h.updated, h.is_encrypted, h.chatid from ";
+        std::vector<std::string> args;
+        if (hasIndex)
+        {
+            // every word as a phrase, so its characters aren't taken as FTS5 syntax
+            std::string match;
+            for (size_t i = 0; i < words.size(); i++)
+            {
+                match.append(i ? " \"" : "\"");
+                for (char c: words[i])
+                {
+                    match.append(c == '"' ? 2 : 1, c);
+                }
+                match.append(i + 1 == words.size() ? "\"*" : "\"");
+            }
+            args.push_back(match);
+            sql.append("history_fts join history h on h.rowid = history_fts.rowid where history_fts match ?");
+        }
+        else
+        {
+            sql.append("history h where h.type = 1 and h.is_encrypted = 0");
+            for (auto& word: words)
+            {
+                std::string pattern = "%";
+                for (char c: word)
+                {
+                    if (c == '%' || c == '_' || c == '\\')
+                        pattern.push_back('\\');
+                    pattern.push_back(c);
+                }
+                pattern.push_back('%');
+                args.push_back(pattern);
+                sql.append(" and cast(h.data as text) like ? escape '\\'");
+            }
+        }
+        if (!allChats)
+        {
+            sql.append(" and h.chatid = ?");
+        }
+        sql.append(hasIndex ? " order by history_fts.rank" : " order by h.ts desc, h.idx desc");
+        sql.append(" limit ? offset ?");
+
+        SqliteStmt stmt(db, sql);
+        for (auto& arg: args)
+        {
+            stmt << arg;
+        }
+        if (!allChats)
+        {
+            stmt << chatid;
+        }
+        stmt << limit << offset;
+        while (stmt.step())
+        {
+            results.emplace_back(stmt.uint64Col(10), stmt.intCol(5), messageFromRow(stmt));
+        }
+    }
+
+    /** @brief Loads the summary of every chat in db, with a few queries for all of them */
+    static void loadSummaries(SqliteDb& db, std::map<karere::Id, ChatdDbSummary>& summaries)
+    {
+        SqliteStmt stmt(db, karere::sql::kSummaryChats);
+        while (stmt.step())
+        {
+            summaries[stmt.uint64Col(0)];
+        }
+
+        // oldest and newest message of each chat
+        SqliteStmt stmtHist(db, karere::sql::kSummaryHistoryEnds);
+        while (stmtHist.step())
+        {
+            auto it = summaries.find(stmtHist.uint64Col(0));
+            if (it == summaries.end())
+                continue;
+
+            chatd::ChatDbInfo& info = it->second.info;
+            chatd::Idx idx = stmtHist.intCol(1);
+            if (idx == stmtHist.intCol(3))
+            {
+                it->second.oldestDbIdx = idx;
+                info.oldestDbId = stmtHist.uint64Col(2);
+            }
+            if (idx == stmtHist.intCol(4))
+            {
+                info.newestDbIdx = idx;
+                info.newestDbId = stmtHist.uint64Col(2);
+            }
+        }
+
+        // as getHistoryInfo(), last-seen and last-received are only known if there's history
+        SqliteStmt stmtSeen(db, karere::sql::kSummaryLastSeenAndRecv);
+        while (stmtSeen.step())
+        {
+            auto it = summaries.find(stmtSeen.uint64Col(0));
+            if (it == summaries.end() || !it->second.info.oldestDbId)
+                continue;
+
+            ChatdDbSummary& summary = it->second;
+            summary.info.lastSeenId = stmtSeen.uint64Col(1);
+            summary.info.lastRecvId = stmtSeen.uint64Col(2);
+            if (sqlite3_column_type(stmtSeen, 3) == SQLITE_NULL)
+                continue;
+
+            karere::Id msgid = stmtSeen.uint64Col(4);
+            if (msgid == summary.info.lastSeenId)
+                summary.lastSeenIdx = stmtSeen.intCol(3);
+            if (msgid == summary.info.lastRecvId)
+                summary.lastRecvIdx = stmtSeen.intCol(3);
+        }
+
+        for (auto& it: summaries)
+        {
+            chatd::ChatDbInfo& info = it.second.info;
+            if (info.oldestDbId && !info.newestDbId)
+            {
+                assert(false);  // if there's an oldest message, there should be always a newest message
+                CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
+                info.oldestDbId = 0;
+            }
+        }
+
+        SqliteStmt stmtUnread(db, karere::sql::kSummaryUnreadCounts);
+        while (stmtUnread.step())
+        {
+            auto it = summaries.find(stmtUnread.uint64Col(0));
+            if (it != summaries.end())
+            {
+                ChatdDbSummary& summary = it->second;
+                chatd::Idx newestIdx = summary.info.oldestDbId ? summary.info.newestDbIdx : CHATD_IDX_INVALID;
+                summary.unreadCountValue = stmtUnread.stringCol(1);
+                summary.unreadCount = unreadCountFromValue(summary.unreadCountValue, summary.oldestDbIdx,
+                        newestIdx, stmtUnread.uint64Col(2));
+                summary.hasUnreadCount = true;
+            }
+        }
+
+        SqliteStmt stmtAllHist(db, karere::sql::kSummaryHaveAllHistory);
+        while (stmtAllHist.step())
+        {
+            auto it = summaries.find(stmtAllHist.uint64Col(0));
+            if (it != summaries.end())
+            {
+                it->second.haveAllHistory = true;
+            }
+        }
+
+        SqliteStmt stmtNodeHist(db, karere::sql::kSummaryNodeHistoryRanges);
+        while (stmtNodeHist.step())
+        {
+            auto it = summaries.find(stmtNodeHist.uint64Col(0));
+            if (it != summaries.end())
+            {
+                it->second.nodeHistOldestIdx = stmtNodeHist.intCol(1);
+                it->second.nodeHistNewestIdx = stmtNodeHist.intCol(2);
+            }
+        }
+
+        // most chats have nothing to send, so they don't need to query their sending queue
+        SqliteStmt stmtSending(db, karere::sql::kSummarySendingChats);
+        while (stmtSending.step())
+        {
+            auto it = summaries.find(stmtSending.uint64Col(0));
+            if (it != summaries.end())
+            {
+                it->second.hasSendingItems = true;
+            }
+        }
+    }
+
+    /** @brief Sets the summary loaded by loadSummaries(). Must be called before the
+     * chat reads anything from db */
+    void setSummary(const ChatdDbSummary& summary)
+    {
+        mSummary = summary;
+        mSummaryUnread = kSummaryInfo | kSummaryLastSeenIdx | kSummaryLastRecvIdx
+                | kSummaryUnreadCount | kSummaryHaveAllHistory
+                | kSummaryNodeHistoryInfo | kSummarySendingItems;
+    }
+    virtual void flushHistory()
+    {
+        if (mPendingHistory.empty())
+            return;
+
+#ifndef NDEBUG
+        checkHistoryContinuity(mPendingHistory.front().idx, mPendingHistory.front().msgid, "history");
+#endif
+        size_t count = mPendingHistory.size();
+        size_t i = 0;
+        try
+        {
+            for (; count - i >= static_cast<size_t>(kHistoryBatchRows); i += kHistoryBatchRows)
+            {
+                insertPendingRows(i, kHistoryBatchRows);
+            }
+        }
+        catch (std::exception& e)
+        {
+            // a failed insert is rolled back as a whole, so retry its rows one by one
+            // in order to store all the valid ones, as the non-batched path does
+            CHATD_LOG_WARNING("chatid %s: flushHistory: batch insert failed, inserting messages one by one: %s",
+                mChatId.toString().c_str(), e.what());
+        }
+        for (; i < count; i++)
+        {
+            try
+            {
+                insertPendingRows(i, 1);
+            }
+            catch (std::exception& e)
+            {
+                CHATD_LOG_ERROR("chatid %s: flushHistory: error adding msgid %s to history: %s",
+                    mChatId.toString().c_str(), mPendingHistory[i].msgid.toString().c_str(), e.what());
+            }
+        }
+        mPendingHistory.clear();
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
-        stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
+        flushHistory();
+        if (mSummaryUnread & kSummaryInfo)
+        {
+            mSummaryUnread &= ~kSummaryInfo;
+            info = mSummary.info;
+            return;
+        }
+        SqliteStmt stmt(mDb, karere::sql::kHistoryRange);
+        stmt.bind(mChatId).step(); //will always return a row, even if table empty
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
         info.newestDbIdx = stmt.intCol(1);
         if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) //no db history
@@ -26,8 +587,8 @@ public:
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
             return;
         }
-        SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2");
-        stmt2 << mChat.chatId() << minIdx;
+        SqliteStmt stmt2(mDb, karere::sql::kHistoryMsgidOfIdx);
+        stmt2 << mChatId << minIdx;
         stmt2.stepMustHaveData();
         info.oldestDbId = stmt2.uint64Col(0);
         stmt2.reset().bind(2, info.newestDbIdx);
@@ -39,8 +600,8 @@ public:
             CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
             info.oldestDbId = 0;
         }
-        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?");
-        stmt3 << mChat.chatId();
+        SqliteStmt stmt3(mDb, karere::sql::kChatLastSeenAndRecv);
+        stmt3 << mChatId;
         stmt3.stepMustHaveData();
         info.lastSeenId = stmt3.uint64Col(0);
         info.lastRecvId = stmt3.uint64Col(1);
@@ -59,12 +620,12 @@ public:
         throw std::runtime_error(msg);
     }
 
-    void addMessage(const chatd::Message& msg, chatd::Idx idx, const std::string& table)
-    {
 #ifndef NDEBUG
+    void checkHistoryContinuity(chatd::Idx idx, karere::Id msgid, const std::string& table)
+    {
         std::string checkQuery = "select min(idx), max(idx), count(*) from " + table + " where chatid = ?";
         SqliteStmt stmt(mDb, checkQuery.c_str());
-        stmt << mChat.chatId();
+        stmt << mChatId;
         stmt.step();
         int low = stmt.intCol(0);
         int high = stmt.intCol(1);
@@ -74,14 +635,21 @@ public:
             CHATD_LOG_ERROR("chatid %s: addMsgToHistory: %s discontinuity detected: "
                 "index of added msg %s is not adjacent to neither end of db history: "
                 "add idx=%d, histlow=%d, histhigh=%d, histcount= %d",
-                table.c_str(), mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
+                table.c_str(), mChatId.toString().c_str(), msgid.toString().c_str(),
                 idx, low, high, count);
             assert(false);
         }
+    }
+#endif
+
+    void addMessage(const chatd::Message& msg, chatd::Idx idx, const std::string& table)
+    {
+#ifndef NDEBUG
+        checkHistoryContinuity(idx, msg.id(), table);
 #endif
         std::string query = "insert into " + table + " (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) " +
                                                      "values(?,?,?,?,?,?,?,?,?,?,?)";
-        mDb.query(query.c_str(), idx, mChat.chatId(), msg.id(), msg.keyid,
+        mDb.query(query.c_str(), idx, mChatId, msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
     }
 
@@ -100,7 +668,7 @@ public:
 
         mDb.query("insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
                          "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
-            (uint64_t)mChat.chatId(), opcode, msg->ts, msg->id(),
+            (uint64_t)mChatId, opcode, msg->ts, msg->id(),
             *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
 
         // assign the given rowid to the SendingItem
@@ -109,8 +677,8 @@ public:
 
     virtual int updateSendingItemsKeyid(chatd::KeyId localkeyid, chatd::KeyId keyid)
     {
-        mDb.query("update sending set keyid = ?, key_cmd = ? where keyid = ? and chatid = ?",
-                  keyid, StaticBuffer(nullptr, 0), localkeyid, mChat.chatId());
+        mDb.query(karere::sql::kSendingUpdateKeyid,
+                  keyid, StaticBuffer(nullptr, 0), localkeyid, mChatId);
 
         return sqlite3_changes(mDb);
     }
@@ -132,7 +700,7 @@ public:
     {
         mDb.query(
             "update sending set opcode=?, msgid=? where chatid=? and opcode=? and msgid=?",
-            chatd::OP_MSGUPD, msgid, mChat.chatId(), chatd::OP_MSGUPDX, msgxid);
+            chatd::OP_MSGUPD, msgid, mChatId, chatd::OP_MSGUPDX, msgxid);
         return sqlite3_changes(mDb);
     }
 
@@ -144,42 +712,58 @@ public:
     virtual int updateSendingItemsContentAndDelta(const chatd::Message& msg)
     {
         mDb.query("update sending set msg = ?, updated = ? where msgid = ? and chatid = ?",
-                  msg, msg.updated, msg.id(), mChat.chatId());
+                  msg, msg.updated, msg.id(), mChatId);
         return sqlite3_changes(mDb);
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
-        addMessage(msg, idx, "history");
+        mPendingHistory.emplace_back(msg, idx);
+
+        // batch only while a fetch from server is in progress, since HISTDONE will flush the batch
+        if (!isFetchingFromServer() || mPendingHistory.size() >= static_cast<size_t>(kMaxPendingHistory))
+        {
+            flushHistory();
+        }
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
+        flushHistory();
         if (msg.type == chatd::Message::kMsgTruncate)
         {
             mDb.query("update history set type = ?, data = ?, ts = ?, userid = ?, keyid = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.ts, msg.userid, msg.keyid, mChat.chatId(), msgid);
+                msg.type, msg, msg.ts, msg.userid, msg.keyid, mChatId, msgid);
         }
         else    // "updated" instead of "ts"
         {
             mDb.query("update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
+                msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChatId, msgid);
         }
         assertAffectedRowCount(1, "updateMsgInHistory");
     }
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
     {
-        SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?");
-        stmt3 << mChat.chatId() << msgid;
+        flushHistory();
+        SqliteStmt stmt3(mDb, karere::sql::kHistoryUpdatedOfMsgid);
+        stmt3 << mChatId << msgid;
         stmt3.stepMustHaveData();
         *updated = stmt3.intCol(0);
     }
 
     virtual void loadSendQueue(chatd::Chat::OutputQueue& queue)
     {
-        SqliteStmt stmt(mDb, "select rowid, opcode, msgid, keyid, msg, type, "
-            "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
-            "from sending where chatid=? order by rowid asc");
-        stmt << mChat.chatId();
+        if (mSummaryUnread & kSummarySendingItems)
+        {
+            mSummaryUnread &= ~kSummarySendingItems;
+            if (!mSummary.hasSendingItems)
+            {
+                queue.clear();
+                return;
+            }
+        }
+
+        SqliteStmt stmt(mDb, karere::sql::kSendingLoad);
+        stmt << mChatId;
 
         // Fill the sending queue with SendingItems from DB
         queue.clear();
@@ -188,7 +772,7 @@ public:
             int rowid = stmt.intCol(0);
             uint8_t opcode = stmt.intCol(1);
             karere::Id msgid = stmt.int64Col(2);
-            karere::Id userid = mChat.client().myHandle();
+            karere::Id userid = mChat->client().myHandle();
             chatd::KeyId keyid = (chatd::KeyId)stmt.intCol(3);
             unsigned char type = (unsigned char)stmt.intCol(5);
             uint32_t ts = stmt.intCol(6);
@@ -221,7 +805,7 @@ public:
             if (stmt.hasBlobCol(11))
             {
                 chatd::KeyId chatdKeyid = (keyid < 0xffff0001) ? keyid : CHATD_KEYID_UNCONFIRMED;
-                chatd::MsgCommand *msgCmd = new chatd::MsgCommand(opcode, mChat.chatId(), userid, msgid, ts, updated, chatdKeyid);
+                chatd::MsgCommand *msgCmd = new chatd::MsgCommand(opcode, mChatId, userid, msgid, ts, updated, chatdKeyid);
                 Buffer buf;
                 stmt.blobCol(11, buf);
                 msgCmd->setMsg(buf.buf(), buf.dataSize());
@@ -235,7 +819,7 @@ public:
                 assert(queue.back().msgCmd);    // a NEWKEY must always indicate there's an encrypted NEWMSG
                 assert(opcode == chatd::OP_NEWMSG || opcode == chatd::OP_NEWNODEMSG);
 
-                chatd::KeyCommand *keyCmd = new chatd::KeyCommand(mChat.chatId(), keyid);
+                chatd::KeyCommand *keyCmd = new chatd::KeyCommand(mChatId, keyid);
                 Buffer buf;
                 stmt.blobCol(12, buf);
                 keyCmd->setKeyBlobs(buf.buf(), buf.dataSize());
@@ -246,65 +830,119 @@ public:
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
+        flushHistory();
         loadMessages(count, idx, messages, "history");
     }
 
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
     {
-        std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
-        SqliteStmt stmt(mDb, query.c_str());
-        stmt << mChat.chatId() << msgid;
+        assert(table == "history" || table == "node_history");
+        SqliteStmt stmt(mDb, (table == "history") ? karere::sql::kHistoryIdxOfMsgid : karere::sql::kNodeHistoryIdxOfMsgid);
+        stmt << mChatId << msgid;
         return (stmt.step()) ? stmt.int64Col(0) : CHATD_IDX_INVALID;
     }
 
     virtual chatd::Idx getIdxOfMsgidFromHistory(karere::Id msgid)
     {
+        flushHistory();
+        if ((mSummaryUnread & kSummaryLastSeenIdx) && msgid == mSummary.info.lastSeenId)
+        {
+            mSummaryUnread &= ~kSummaryLastSeenIdx;
+            return mSummary.lastSeenIdx;
+        }
+        if ((mSummaryUnread & kSummaryLastRecvIdx) && msgid == mSummary.info.lastRecvId)
+        {
+            mSummaryUnread &= ~kSummaryLastRecvIdx;
+            return mSummary.lastRecvIdx;
+        }
         return getIdxOfMsgid(msgid, "history");
     }
     virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
     {
+        flushHistory();
         // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
-        std::string sql = "select count(*) from history where (chatid = ?1)"
-                "and (userid != ?2)"
-                "and not (updated != 0 and length(data) = 0)"
-                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
-                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
-        if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?)";
-
-        SqliteStmt stmt(mDb, sql);
-        stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
-             << chatd::Message::kNotEncrypted               // include decrypted messages
-             << chatd::Message::kEncryptedMalformed         // include encrypted messages due to malformed payload
-             << chatd::Message::kEncryptedSignature         // include encrypted messages due to invalid signature
-             << chatd::Message::kMsgNormal                  // include only known type of messages
-             << chatd::Message::kMsgAttachment
-             << chatd::Message::kMsgContact
-             << chatd::Message::kMsgContainsMeta
-             << chatd::Message::kMsgVoiceClip;
+        // The filter is written with literals to match the partial index `history_unread` (see dbQueries.h)
+        static_assert(chatd::Message::kNotEncrypted == 0 && chatd::Message::kEncryptedMalformed == 4
+                && chatd::Message::kEncryptedSignature == 3, "Update history_unread index");
+        static_assert(chatd::Message::kMsgNormal == 1 && chatd::Message::kMsgAttachment == 101
+                && chatd::Message::kMsgContact == 103 && chatd::Message::kMsgContainsMeta == 104
+                && chatd::Message::kMsgVoiceClip == 105, "Update history_unread index");
+        SqliteStmt stmt(mDb, (idx != CHATD_IDX_INVALID) ? karere::sql::kHistoryUnreadCountAfterIdx : karere::sql::kHistoryUnreadCount);
+        stmt << mChatId << mChat->client().myHandle();
         if (idx != CHATD_IDX_INVALID)
             stmt << idx;
         stmt.stepMustHaveData("get peer msg count");
         return stmt.intCol(0);
     }
+    virtual int getUnreadCount()
+    {
+        if (mSummaryUnread & kSummaryUnreadCount)
+        {
+            mSummaryUnread &= ~kSummaryUnreadCount;
+            mHasSavedUnreadCount = mSummary.hasUnreadCount;
+            mSavedUnreadCount = mSummary.unreadCountValue;
+            return mSummary.unreadCount;
+        }
+
+        flushHistory();
+        SqliteStmt stmt(mDb, karere::sql::kChatUnreadCount);
+        stmt << mChatId;
+        mHasSavedUnreadCount = stmt.step();
+        if (!mHasSavedUnreadCount)
+        {
+            mSavedUnreadCount.clear();
+            return -1;
+        }
+
+        mSavedUnreadCount = stmt.stringCol(0);
+        chatd::Idx oldest, newest;
+        getHistoryRange(oldest, newest);
+        return unreadCountFromValue(mSavedUnreadCount, oldest, newest, stmt.uint64Col(1));
+    }
+    virtual void setUnreadCount(int count, karere::Id lastSeenId)
+    {
+        flushHistory();     // the count includes messages that may be still pending
+        chatd::Idx oldest, newest;
+        getHistoryRange(oldest, newest);
+        std::string value = unreadCountValue(count, oldest, newest, lastSeenId);
+        if (mHasSavedUnreadCount && value == mSavedUnreadCount)
+            return;
+
+        // update in place, since 'insert or replace' deletes the row and inserts it again
+        mDb.query("update chat_vars set value = ? where chatid = ? and name = 'unread_count'", value, mChatId);
+        if (sqlite3_changes(mDb) == 0)
+        {
+            mDb.query("insert into chat_vars(chatid, name, value) values(?, 'unread_count', ?)", mChatId, value);
+        }
+        mSavedUnreadCount = value;
+        mHasSavedUnreadCount = true;
+    }
+    virtual void discardUnreadCount()
+    {
+        if (!mHasSavedUnreadCount)
+            return;
+
+        mDb.query("delete from chat_vars where chatid = ? and name = 'unread_count'", mChatId);
+        mSavedUnreadCount.clear();
+        mHasSavedUnreadCount = false;
+    }
     virtual void saveItemToManualSending(const chatd::Chat::SendingItem& item, int reason)
     {
         auto& msg = *item.msg;
         mDb.query("insert into manual_sending(chatid, rowid, msgid, type, "
             "ts, updated, msg, opcode, reason) values(?,?,?,?,?,?,?,?,?)",
-            mChat.chatId(), item.rowid, item.msg->id(), msg.type, msg.ts,
+            mChatId, item.rowid, item.msg->id(), msg.type, msg.ts,
             msg.updated, msg, item.opcode(), reason);
     }
     virtual void loadManualSendItems(std::vector<chatd::Chat::ManualSendItem>& items)
     {
-        SqliteStmt stmt(mDb, "select rowid, msgid, type, ts, updated, msg, opcode, "
-            "reason from manual_sending where chatid=? order by rowid asc");
-        stmt << mChat.chatId();
+        SqliteStmt stmt(mDb, karere::sql::kManualSendingLoad);
+        stmt << mChatId;
         while(stmt.step())
         {
             Buffer buf;
             stmt.blobCol(5, buf);
-            auto msg = new chatd::Message(stmt.uint64Col(1), mChat.client().myHandle(),
+            auto msg = new chatd::Message(stmt.uint64Col(1), mChat->client().myHandle(),
                 stmt.int64Col(3), stmt.intCol(4), std::move(buf), true,
                 CHATD_KEYID_INVALID, (unsigned char)stmt.intCol(2));
             items.emplace_back(msg, stmt.uint64Col(0), stmt.intCol(6), (chatd::ManualSendReason)stmt.intCol(7));
@@ -319,12 +957,12 @@ public:
     {
         SqliteStmt stmt(mDb, "select msgid, type, ts, updated, msg, opcode, "
             "reason from manual_sending where chatid=? and rowid=?");
-        stmt << mChat.chatId() << rowid;
+        stmt << mChatId << rowid;
         stmt.stepMustHaveData("load manual sending item");
 
         Buffer buf;
         stmt.blobCol(4, buf);
-        auto msg = new chatd::Message(stmt.uint64Col(0), mChat.client().myHandle(),
+        auto msg = new chatd::Message(stmt.uint64Col(0), mChat->client().myHandle(),
                                       stmt.int64Col(2), stmt.intCol(3), std::move(buf), true,
                                       CHATD_KEYID_INVALID, (unsigned char)stmt.intCol(1));
         item.msg = msg;
@@ -334,14 +972,16 @@ public:
     }
     virtual void truncateHistory(const chatd::Message& msg)
     {
+        flushHistory();
+        discardUnreadCount();
         auto idx = getIdxOfMsgidFromHistory(msg.id());
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
-        mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        mDb.query(karere::sql::kHistoryTruncate, mChatId, idx);
 
 #ifndef NDEBUG
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
-        stmt << mChat.chatId() << msg.id();
+        stmt << mChatId << msg.id();
         stmt.step();
         if (stmt.intCol(0) != chatd::Message::kMsgTruncate)
             throw std::runtime_error("DbInterface::truncateHistory: Truncate message type is not 'truncate'");
@@ -349,19 +989,20 @@ public:
     }
     virtual chatd::Idx getOldestIdx()
     {
+        flushHistory();
         SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
-        stmt << mChat.chatId();
+        stmt << mChatId;
         stmt.stepMustHaveData(__FUNCTION__);
         return stmt.uint64Col(0);
     }
     virtual void setLastSeen(karere::Id msgid)
     {
-        mDb.query("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
+        mDb.query("update chats set last_seen=? where chatid=?", msgid, mChatId);
         assertAffectedRowCount(1, "setLastSeen");
     }
     virtual void setLastReceived(karere::Id msgid)
     {
-        mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
+        mDb.query("update chats set last_recv=? where chatid=?", msgid, mChatId);
         assertAffectedRowCount(1);
     }
 
@@ -369,38 +1010,36 @@ public:
     {
         mDb.query(
             "insert or replace into chat_vars(chatid, name, value) "
-            "values(?, 'have_all_history', ?)", mChat.chatId(), haveAllHistory ? 1 : 0);
+            "values(?, 'have_all_history', ?)", mChatId, haveAllHistory ? 1 : 0);
         assertAffectedRowCount(1, "setHaveAllHistory");
     }
     virtual bool haveAllHistory()
     {
         SqliteStmt stmt(mDb,
             "select value from chat_vars where chatid=? and name='have_all_history' and value='1'");
-        stmt << mChat.chatId();
+        stmt << mChatId;
         return stmt.step();
     }
 
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg, uint32_t& lastTs)
     {
-        SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
-            "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
-            "order by idx desc limit 1");
-        stmt << mChat.chatId()
-             << chatd::Message::kMsgTruncate
-             << chatd::Message::kMsgRevokeAttachment
-             << chatd::Message::kMsgInvalid     // exclude (still) encrypted messages (theorically, they should not be stored in DB)
-             << from;
+        flushHistory();
+        // The filter is written with literals to match the partial index `history_last_text` (see dbQueries.h):
+        // include truncates, exclude revokes and (still) encrypted messages (theorically, they should not be stored in DB)
+        static_assert(chatd::Message::kMsgTruncate == 3 && chatd::Message::kMsgRevokeAttachment == 102
+                && chatd::Message::kMsgInvalid == 0, "Update history_last_text index");
+        SqliteStmt stmt(mDb, karere::sql::kHistoryLastText);
+        stmt << mChatId << from;
         if (!stmt.step())
         {
 
-            CHATD_LOG_WARNING("chatid %s: getLastTextMessage cannot find any candidate for last-message", mChat.chatId().toString().c_str());
+            CHATD_LOG_WARNING("chatid %s: getLastTextMessage cannot find any candidate for last-message", mChatId.toString().c_str());
 
             msg.clear();    // any existing last-msg is now obsolete
 
             // reset the last-ts to the chat creation's ts
             SqliteStmt stmt(mDb, "select ts_created from chats where chatid=?");
-            stmt << mChat.chatId();
+            stmt << mChatId;
             stmt.stepMustHaveData();
             lastTs = int(stmt.uint64Col(0));
             return;
@@ -416,16 +1055,20 @@ public:
     {
         mDb.query(
             "insert or replace into chat_vars(chatid, name, value) "
-            "values(?, ?, ?)", mChat.chatId(), name, value ? 1 : 0);
+            "values(?, ?, ?)", mChatId, name, value ? 1 : 0);
         assertAffectedRowCount(1);
     }
 
     //Returns if chat var related to a chat exists
     virtual bool chatVar(const char *name)
     {
-        SqliteStmt stmt(mDb,
-            "select value from chat_vars where chatid=? and name=? and value='1'");
-        stmt << mChat.chatId()
+        if ((mSummaryUnread & kSummaryHaveAllHistory) && !strcmp(name, "have_all_history"))
+        {
+            mSummaryUnread &= ~kSummaryHaveAllHistory;
+            return mSummary.haveAllHistory;
+        }
+        SqliteStmt stmt(mDb, karere::sql::kChatVar);
+        stmt << mChatId
              << name;
         return stmt.step();
     }
@@ -435,14 +1078,16 @@ public:
     {
         SqliteStmt stmt(mDb,
             "delete from chat_vars where chatid = ? and name = ?");
-        stmt << mChat.chatId()
+        stmt << mChatId
              << name;
         return stmt.step();
     }
 
     virtual void clearHistory()
     {
-        mDb.query("delete from history where chatid = ?", mChat.chatId());
+        flushHistory();
+        discardUnreadCount();
+        mDb.query("delete from history where chatid = ?", mChatId);
         setHaveAllHistory(false);
     }
 
@@ -463,25 +1108,33 @@ public:
     virtual void deleteMsgFromNodeHistory(const chatd::Message& msg)
     {
         mDb.query("update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?",
-                  msg, msg.updated, msg.type, mChat.chatId(), msg.id());
+                  msg, msg.updated, msg.type, mChatId, msg.id());
         assertAffectedRowCount(1, "deleteMsgFromNodeHistory");
     }
 
     virtual void truncateNodeHistory(karere::Id id)
     {
         auto idx = getIdxOfMsgid(id, "node_history");
-        mDb.query("delete from node_history where chatid = ? and idx <= ?", mChat.chatId(), idx);
+        mDb.query(karere::sql::kNodeHistoryTruncate, mChatId, idx);
     }
 
     virtual void clearNodeHistory()
     {
-        mDb.query("delete from node_history where chatid = ?", mChat.chatId());
+        mDb.query("delete from node_history where chatid = ?", mChatId);
     }
 
     virtual void getNodeHistoryInfo(chatd::Idx &newest, chatd::Idx &oldest)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from node_history where chatid=?1");
-        stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
+        if (mSummaryUnread & kSummaryNodeHistoryInfo)
+        {
+            mSummaryUnread &= ~kSummaryNodeHistoryInfo;
+            newest = mSummary.nodeHistNewestIdx;
+            oldest = mSummary.nodeHistOldestIdx;
+            return;
+        }
+
+        SqliteStmt stmt(mDb, karere::sql::kNodeHistoryRange);
+        stmt.bind(mChatId).step(); //will always return a row, even if table empty
 
         int count = stmt.intCol(2);
 
@@ -501,38 +1154,43 @@ public:
 
     void loadMessages(int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, const std::string &table)
     {
-        std::string query = "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
-                            " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
-
-        SqliteStmt stmt(mDb, query.c_str());
-        stmt << mChat.chatId() << idx << count;
+        assert(table == "history" || table == "node_history");
+        SqliteStmt stmt(mDb, (table == "history") ? karere::sql::kHistoryLoad : karere::sql::kNodeHistoryLoad);
+        stmt << mChatId << idx << count;
         int i = 0;
         while(stmt.step())
         {
             i++;
-            karere::Id msgid(stmt.uint64Col(0));
-            karere::Id userid(stmt.uint64Col(1));
-            unsigned ts = stmt.uintCol(2);
-            chatd::KeyId keyid = stmt.uintCol(6);
-            Buffer buf;
-            stmt.blobCol(4, buf);
 #ifndef NDEBUG
             auto tableIdx = stmt.intCol(5);
             if(tableIdx != idx - (int)messages.size()) //we go backward in history, hence the -messages.size()
             {
                 CHATD_LOG_ERROR("chatid %s: loadMessages from table %s: History discontinuity detected: "
-                    "expected idx %d, retrieved from db:%d", mChat.chatId().toString().c_str(), table.c_str(),
+                    "expected idx %d, retrieved from db:%d", mChatId.toString().c_str(), table.c_str(),
                     idx - (int)messages.size(), tableIdx);
                 assert(false);
             }
 #endif
-            auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
-                false, keyid, (unsigned char)stmt.intCol(3));
-            msg->backRefId = stmt.uint64Col(7);
-            msg->setEncrypted((uint8_t)stmt.intCol(9));
-            messages.push_back(msg);
+            messages.push_back(messageFromRow(stmt));
         }
     }
+
+    /** @brief Builds a message from a row whose first columns are
+     * msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted */
+    static chatd::Message* messageFromRow(SqliteStmt& stmt)
+    {
+        karere::Id msgid(stmt.uint64Col(0));
+        karere::Id userid(stmt.uint64Col(1));
+        unsigned ts = stmt.uintCol(2);
+        chatd::KeyId keyid = stmt.uintCol(6);
+        Buffer buf;
+        stmt.blobCol(4, buf);
+        auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
+            false, keyid, (unsigned char)stmt.intCol(3));
+        msg->backRefId = stmt.uint64Col(7);
+        msg->setEncrypted((uint8_t)stmt.intCol(9));
+        return msg;
+    }
 };
 
 #endif
@@ -20,6 +20,7 @@ enum
 class Chat;
 class ICrypto
 {
+protected:
     void *appCtx;
     
 public:
@@ -77,6 +78,15 @@ public:
      */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+    /**
+     * @brief Same as \c msgDecrypt, but the signature verification and decryption may
+     * be done in a worker thread, once the keys are available. Used when fetching history,
+     * where the client starts decrypting the queued messages while earlier ones are still
+     * in progress, and handles the results in order.
+     * The message must not be accessed until the returned promise is resolved.
+     */
+    virtual promise::Promise<Message*> msgDecryptInBackground(Message* src) { return msgDecrypt(src); }
+
     /**
      * @brief The chatroom connection (to the chatd server shard) state state has changed.
      */
@@ -684,6 +684,8 @@ public:
                 && type <= Message::kMsgManagementHighest);
     }
     bool isOwnMessage(karere::Id myHandle) const { return (userid == myHandle); }
+    /** @brief Approximate amount of RAM held by the message: the object, its contents and backrefs */
+    size_t memoryUsage() const { return sizeof(Message) + bufSize() + backRefs.capacity() * sizeof(BackRefId); }
     bool isDeleted() const { return (updated && !size()); } // returns false for truncate (update = 0)
     bool isValidLastMessage() const
     {
@@ -736,6 +738,7 @@ public:
 
     static bool hasUrl(const std::string &text, std::string &url);
     static bool parseUrl(const std::string &url);
+    static bool hasHttpScheme(const std::string &url);
     static void removeUnnecessaryLastCharacters(std::string& buf);
     static void removeUnnecessaryFirstCharacters(std::string& buf);
     static bool isValidEmail(const std::string &buf);
@@ -2,6 +2,14 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
 
 struct SqliteString
 {
@@ -16,6 +24,93 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** @brief Background thread that makes durable the transactions committed to a db in WAL mode
+ *
+ * With synchronous=NORMAL, a commit in WAL mode only appends to the WAL file, without waiting
+ * for it to reach the disk. Periodically, this thread runs a checkpoint through its own
+ * connection. The checkpoint syncs the WAL, copies its frames to the db and syncs the db, so all
+ * the transactions committed meanwhile become durable with a single round of fsyncs.
+ * If the app crashes, nothing is lost. If the system crashes, the transactions of the last
+ * interval may be lost, but never part of a transaction, so the db stays consistent.
+ */
+class SqliteWalSyncer
+{
+protected:
+    sqlite3* mDb = nullptr;
+    unsigned mIntervalMs = 1000;
+    bool mStop = false;
+    bool mSyncRequested = false;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::thread mThread;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mStop)
+        {
+            mCv.wait_for(lock, std::chrono::milliseconds(mIntervalMs), [this]()
+            {
+                return mStop || mSyncRequested;
+            });
+            mSyncRequested = false;
+            lock.unlock();
+            // passive: never waits for the connection of the app, which keeps writing meanwhile
+            sqlite3_wal_checkpoint_v2(mDb, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+            lock.lock();
+        }
+    }
+
+public:
+    SqliteWalSyncer() = default;
+    SqliteWalSyncer(const SqliteWalSyncer&) = delete;
+    SqliteWalSyncer& operator=(const SqliteWalSyncer&) = delete;
+    ~SqliteWalSyncer() { stop(); }
+
+    /** @brief Opens its own connection to the db, that must be in WAL mode already, and starts the thread */
+    bool start(const char* fname, unsigned intervalMs)
+    {
+        assert(!mDb);
+        if (sqlite3_open_v2(fname, &mDb, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        sqlite3_exec(mDb, "PRAGMA synchronous=NORMAL", nullptr, nullptr, nullptr);
+        mIntervalMs = intervalMs;
+        mStop = false;
+        mSyncRequested = false;
+        mThread = std::thread(&SqliteWalSyncer::run, this);
+        return true;
+    }
+
+    /** @brief Wakes up the thread to sync now, rather than at the end of the interval */
+    void requestSync()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSyncRequested = true;
+        mCv.notify_one();
+    }
+
+    /** @brief Stops the thread, after a last checkpoint */
+    void stop()
+    {
+        if (!mDb)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+            mCv.notify_one();
+        }
+        mThread.join();
+        sqlite3_close(mDb);
+        mDb = nullptr;
+    }
+
+    bool isRunning() const { return mDb != nullptr; }
+};
+
 class SqliteDb
 {
 protected:
@@ -25,7 +120,70 @@ protected:
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+
+    /** Idle prepared statements, keyed by their SQL text. The most recently used
+     * statement is at the front of the list. A statement is removed from the cache
+     * while it's in use by a SqliteStmt, so the same query can be nested safely */
+    typedef std::list<std::pair<std::string, sqlite3_stmt*>> StmtLru;
+    StmtLru mStmtLru;
+    std::unordered_map<std::string, StmtLru::iterator> mStmtCache;
+    size_t mStmtCacheSize = 64;
+    uint64_t mStmtCacheHits = 0;
+    uint64_t mStmtCacheMisses = 0;
+
+    // set by the app, read when the db is opened
+    std::atomic<bool> mWalMode{false};
+    std::atomic<unsigned> mWalSyncIntervalMs{1000};
+    SqliteWalSyncer mWalSyncer;
+
     inline int step(SqliteStmt& stmt);
+    sqlite3_stmt* acquireStmt(const char* sql)
+    {
+        auto it = mStmtCache.find(sql);
+        if (it != mStmtCache.end())
+        {
+            sqlite3_stmt* stmt = it->second->second;
+            mStmtLru.erase(it->second);
+            mStmtCache.erase(it);
+            mStmtCacheHits++;
+            return stmt;
+        }
+
+        mStmtCacheMisses++;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            sqlite3_finalize(stmt);
+            return nullptr;
+        }
+        return stmt;
+    }
+    void releaseStmt(sqlite3_stmt* stmt)
+    {
+        const char* sql = mDb ? sqlite3_sql(stmt) : nullptr;
+        if (!sql || !mStmtCacheSize || mStmtCache.find(sql) != mStmtCache.end())
+        {
+            // cache disabled, or an idle copy of the same query is already cached
+            sqlite3_finalize(stmt);
+            return;
+        }
+
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        mStmtLru.emplace_front(sql, stmt);
+        mStmtCache.emplace(mStmtLru.front().first, mStmtLru.begin());
+        trimStmtCache(mStmtCacheSize);
+    }
+    void trimStmtCache(size_t maxSize)
+    {
+        while (mStmtLru.size() > maxSize)
+        {
+            auto& oldest = mStmtLru.back();
+            sqlite3_finalize(oldest.second);
+            mStmtCache.erase(oldest.first);
+            mStmtLru.pop_back();
+        }
+    }
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
@@ -41,10 +199,35 @@ protected:
         mLastCommitTs = time(NULL);
         return true;
     }
+    /** Switches the db to WAL mode and starts the syncer. Returns false if the db can't
+     * use WAL (i.e. the VFS doesn't support shared memory) */
+    bool enableWal(const char* fname)
+    {
+        std::string mode;
+        sqlite3_exec(mDb, "PRAGMA journal_mode=WAL", [](void* out, int cols, char** values, char**) -> int
+        {
+            if (cols > 0 && values[0])
+                *static_cast<std::string*>(out) = values[0];
+            return 0;
+        }, &mode, nullptr);
+        if (mode != "wal")
+            return false;
+
+        sqlite3_exec(mDb, "PRAGMA synchronous=NORMAL; PRAGMA mmap_size=67108864", nullptr, nullptr, nullptr);
+        if (mWalSyncer.start(fname, mWalSyncIntervalMs))
+        {
+            // the syncer does the checkpoints, so they never block the commits of this connection
+            sqlite3_exec(mDb, "PRAGMA wal_autocheckpoint=0", nullptr, nullptr, nullptr);
+        }
+        return true;
+    }
 public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
+    // the statement cache can't be shared between copies
+    SqliteDb(const SqliteDb&) = delete;
+    SqliteDb& operator=(const SqliteDb&) = delete;
     bool open(const char* fname, bool commitEach=true)
     {
         assert(!mDb);
@@ -57,6 +240,11 @@ public:
             mDb = nullptr;
             return false;
         }
+        if (!mWalMode || !enableWal(fname))
+        {
+            // the journal mode is persistent, undo a previous WAL mode
+            sqlite3_exec(mDb, "PRAGMA journal_mode=DELETE", nullptr, nullptr, nullptr);
+        }
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
@@ -71,11 +259,24 @@ public:
             return;
         if (!mCommitEach)
             commitTransaction();
+        mWalSyncer.stop();  // after the last commit, so it's synced too
+        trimStmtCache(0);   // sqlite3_close() fails while there are unfinalized statements
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
     }
     bool isOpen() const { return mDb != nullptr; }
+    /** @brief Opens the db in WAL mode from now on, with synchronous=NORMAL and memory-mapped
+     * reads. Commits don't wait for the disk: a background thread syncs them every
+     * \c syncIntervalMs, see SqliteWalSyncer. Takes effect on the next open(), and it
+     * can be called from any thread */
+    void setWalMode(bool enable, unsigned syncIntervalMs = 1000)
+    {
+        mWalMode = enable;
+        mWalSyncIntervalMs = syncIntervalMs;
+    }
+    /** @brief True if the open db is in WAL mode, with its syncer running */
+    bool isWalSyncing() const { return mWalSyncer.isRunning(); }
     void setCommitMode(bool commitEach)
     {
         if (commitEach == mCommitEach)
@@ -92,6 +293,17 @@ public:
         }
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    /** @brief Sets the max number of idle prepared statements kept for reuse. Zero disables the cache */
+    void setStmtCacheSize(size_t size)
+    {
+        mStmtCacheSize = size;
+        trimStmtCache(size);
+    }
+    size_t stmtCacheSize() const { return mStmtCacheSize; }
+    /** @brief Number of statements that were reused from the cache */
+    uint64_t stmtCacheHits() const { return mStmtCacheHits; }
+    /** @brief Number of statements that had to be compiled by sqlite3_prepare_v2() */
+    uint64_t stmtCacheMisses() const { return mStmtCacheMisses; }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
@@ -122,6 +334,16 @@ public:
             beginTransaction();
         }
     }
+    /** @brief Commits the open transaction and, in WAL mode, makes it durable now rather
+     * than at the end of the sync interval. I.e. before the app may be suspended */
+    void commitAndSync()
+    {
+        commit();
+        if (mWalSyncer.isRunning())
+        {
+            mWalSyncer.requestSync();
+        }
+    }
     bool timedCommit()
     {
         if (mCommitEach)
@@ -136,6 +358,10 @@ public:
     }
 };
 
+/** @brief Scoped handle to a prepared statement. The statement is borrowed from
+ * the statement cache of the SqliteDb and, once the handle is destroyed, it's
+ * reset, its bindings are cleared and it's returned to the cache for reuse.
+ */
 class SqliteStmt
 {
 protected:
@@ -168,7 +394,8 @@ protected:
 public:
     SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
     {
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
+        mStmt = db.acquireStmt(sql);
+        if (!mStmt)
         {
             const char* errMsg = sqlite3_errmsg(mDb);
             if (!errMsg)
@@ -183,8 +410,10 @@ public:
     ~SqliteStmt()
     {
         if (mStmt)
-            sqlite3_finalize(mStmt);
+            mDb.releaseStmt(mStmt);
     }
+    SqliteStmt(const SqliteStmt&) = delete;
+    SqliteStmt& operator=(const SqliteStmt&) = delete;
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
     SqliteStmt& bind(int col, int val) { retCheck(sqlite3_bind_int(mStmt, col, val), "bind"); return *this; }
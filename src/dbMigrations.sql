@@ -0,0 +1,47 @@
+-- Incremental upgrades of the MEGAchat cache, compiled into dbMigrationSql() by genDbSchema.cmake.
+-- Each "migration N" section upgrades a cache whose version suffix is N-1 to suffix N, and
+-- the result must be equivalent to what dbSchema.sql creates from scratch. Client::openDb()
+-- applies them in order, so new sections are only ever appended and gDbSchemaVersionSuffix
+-- bumped accordingly. Steps that depend on the cached data (ie. forcing a reload) are
+-- handled in Client::migrateDb().
+
+-- migration 3
+-- call-history msgs were missed, clear history to fetch it again including management msgs
+delete from history;
+update chat_vars set value = 0 where name = 'have_all_history';
+
+-- migration 4
+-- always forces a reload (deleted chats are re-fetched from API)
+
+-- migration 5
+-- move special messages to their new range of types and create node_history
+update history set type = 101 where type = 16;
+update history set type = 102 where type = 17;
+update history set type = 103 where type = 18;
+update history set type = 104 where type = 19;
+CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,
+    userid int64, keyid int not null, type tinyint, updated smallint, ts int,
+    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+insert into node_history select * from history where type = 101;
+
+-- migration 6
+-- support for public chats (forces a reload if there's any group chat)
+ALTER TABLE chats ADD mode tinyint;
+ALTER TABLE chats ADD unified_key blob;
+
+-- migration 7
+-- truncate messages don't have a valid keyid
+update history set keyid = 0 where type = 3;
+
+-- migration 8
+-- indexes for the hot query shapes
+CREATE INDEX sending_chatid ON sending(chatid);
+CREATE INDEX manual_sending_chatid ON manual_sending(chatid);
+CREATE INDEX chat_peers_covering ON chat_peers(chatid, userid, priv);
+CREATE INDEX sendkeys_covering ON sendkeys(chatid, userid, keyid, key);
+CREATE INDEX history_userid_ts ON history(userid, ts);
+CREATE INDEX history_last_text ON history(chatid, idx)
+    WHERE (length(data) > 0 OR type = 3) AND type != 102 AND type != 0;
+CREATE INDEX history_unread ON history(chatid, idx)
+    WHERE NOT (updated != 0 AND length(data) = 0) AND is_encrypted IN (0, 4, 3)
+    AND type IN (1, 101, 103, 104, 105);
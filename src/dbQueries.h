@@ -0,0 +1,139 @@
+#ifndef DB_QUERIES_H
+#define DB_QUERIES_H
+
+/** @brief The hot queries of the local cache: the ones run for every chat, message or key.
+ *
+ * They are shared by the code that runs them and by the check of their query plans in the
+ * unit tests (see TEST_DbQueryPlans), so a change to any of them, or to the schema, that
+ * makes SQLite scan a whole table is caught there. A query that isn't in one of the lists
+ * at the end isn't checked.
+ */
+namespace karere
+{
+namespace sql
+{
+// history of a chat (see ChatdSqliteDb)
+constexpr const char* kHistoryRange =
+    "select min(idx), max(idx) from history where chatid = ?1";
+constexpr const char* kHistoryMsgidOfIdx =
+    "select msgid from history where chatid = ?1 and idx = ?2";
+constexpr const char* kHistoryIdxOfMsgid =
+    "select idx from history where chatid = ? and msgid = ?";
+constexpr const char* kHistoryUpdatedOfMsgid =
+    "select updated from history where chatid = ? and msgid = ?";
+constexpr const char* kHistoryLoad =
+    "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from history "
+    "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
+constexpr const char* kHistoryTruncate =
+    "delete from history where chatid = ? and idx < ?";
+
+// The filters of the unread count and of the last text message are written with literals,
+// to match the partial indexes `history_unread` and `history_last_text` (see dbSchema.sql),
+// which SQLite can't use for bound parameters
+constexpr const char* kHistoryUnreadCount =
+    "select count(*) from history where chatid = ?1 "
+    "and userid != ?2 "     // skip own messages
+    "and NOT (updated != 0 AND length(data) = 0) "
+    "and is_encrypted IN (0, 4, 3) "    // decrypted, malformed payload or invalid signature
+    "and type IN (1, 101, 103, 104, 105)"; // include only known type of messages
+constexpr const char* kHistoryUnreadCountAfterIdx =
+    "select count(*) from history where chatid = ?1 "
+    "and userid != ?2 "
+    "and NOT (updated != 0 AND length(data) = 0) "
+    "and is_encrypted IN (0, 4, 3) "
+    "and type IN (1, 101, 103, 104, 105) and (idx > ?3)";
+constexpr const char* kHistoryLastText =
+    "select type, idx, data, msgid, userid, ts from history where chatid = ?1 and "
+    "(length(data) > 0 OR type = 3) AND type != 102 AND type != 0 and (idx <= ?2) "
+    "order by idx desc limit 1";
+
+constexpr const char* kNodeHistoryRange =
+    "select min(idx), max(idx), count(*) from node_history where chatid = ?1";
+constexpr const char* kNodeHistoryIdxOfMsgid =
+    "select idx from node_history where chatid = ? and msgid = ?";
+constexpr const char* kNodeHistoryLoad =
+    "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from node_history "
+    "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
+constexpr const char* kNodeHistoryTruncate =
+    "delete from node_history where chatid = ? and idx <= ?";
+
+constexpr const char* kChatLastSeenAndRecv =
+    "select last_seen, last_recv from chats where chatid = ?";
+constexpr const char* kChatVar =
+    "select value from chat_vars where chatid = ? and name = ? and value = '1'";
+constexpr const char* kChatUnreadCount =
+    "select v.value, c.last_seen from chat_vars v join chats c on c.chatid = v.chatid "
+    "where v.chatid = ? and v.name = 'unread_count'";
+
+constexpr const char* kSendingLoad =
+    "select rowid, opcode, msgid, keyid, msg, type, ts, updated, backrefid, backrefs, recipients, "
+    "msg_cmd, key_cmd from sending where chatid = ? order by rowid asc";
+constexpr const char* kSendingUpdateKeyid =
+    "update sending set keyid = ?, key_cmd = ? where keyid = ? and chatid = ?";
+constexpr const char* kManualSendingLoad =
+    "select rowid, msgid, type, ts, updated, msg, opcode, reason from manual_sending "
+    "where chatid = ? order by rowid asc";
+
+// keys of a chat (see strongvelope::ProtocolHandler)
+constexpr const char* kSendKeyLoad =
+    "select key from sendkeys where chatid = ? and userid = ? and keyid = ?";
+constexpr const char* kSendingUnconfirmedKeys =
+    "select recipients, key_cmd, keyid from sending "
+    "where chatid = ? and key_cmd not null order by rowid asc";
+
+// user attributes (see UserAttrCache)
+constexpr const char* kUserAttrLoad =
+    "select data from userattrs where userid = ? and type = ?";
+
+// last message of each user (see chatd::Client)
+constexpr const char* kHistoryUsers =
+    "select distinct userid from history";
+constexpr const char* kHistoryLastTsOfUser =
+    "select max(ts) from history where userid = ?";
+
+// Startup: what each chat would query by itself, loaded for all of them at once
+// (see ChatRoomList::loadFromDb() and ChatdSqliteDb::loadSummaries())
+constexpr const char* kChatPeersAll =
+    "select chatid, userid, priv from chat_peers";
+constexpr const char* kSummaryChats =
+    "select chatid from chats";
+constexpr const char* kSummaryHistoryEnds =
+    "select h.chatid, h.idx, h.msgid, b.lo, b.hi from history h join "
+    "(select chatid, min(idx) as lo, max(idx) as hi from history group by chatid) b "
+    "on h.chatid = b.chatid and (h.idx = b.lo or h.idx = b.hi)";
+constexpr const char* kSummaryLastSeenAndRecv =
+    "select c.chatid, c.last_seen, c.last_recv, h.idx, h.msgid from chats c "
+    "left join history h on h.chatid = c.chatid and h.msgid in (c.last_seen, c.last_recv)";
+constexpr const char* kSummaryUnreadCounts =
+    "select v.chatid, v.value, c.last_seen from chat_vars v "
+    "join chats c on c.chatid = v.chatid where v.name = 'unread_count'";
+constexpr const char* kSummaryHaveAllHistory =
+    "select chatid from chat_vars where name = 'have_all_history' and value = '1'";
+constexpr const char* kSummaryNodeHistoryRanges =
+    "select chatid, min(idx), max(idx) from node_history group by chatid";
+constexpr const char* kSummarySendingChats =
+    "select distinct chatid from sending";
+
+/** Queries run for a single chat, message or key: none of them may scan a whole table */
+constexpr const char* kPointQueries[] =
+{
+    kHistoryRange, kHistoryMsgidOfIdx, kHistoryIdxOfMsgid, kHistoryUpdatedOfMsgid, kHistoryLoad,
+    kHistoryTruncate, kHistoryUnreadCount, kHistoryUnreadCountAfterIdx, kHistoryLastText,
+    kNodeHistoryRange, kNodeHistoryIdxOfMsgid, kNodeHistoryLoad, kNodeHistoryTruncate,
+    kChatLastSeenAndRecv, kChatVar, kChatUnreadCount,
+    kSendingLoad, kSendingUpdateKeyid, kManualSendingLoad,
+    kSendKeyLoad, kSendingUnconfirmedKeys, kUserAttrLoad,
+    kHistoryUsers, kHistoryLastTsOfUser
+};
+
+/** Queries run once for all the chats: they may scan one table, but must look up any
+ * other one through an index, instead of scanning it for every row */
+constexpr const char* kBulkQueries[] =
+{
+    kChatPeersAll, kSummaryChats, kSummaryHistoryEnds, kSummaryLastSeenAndRecv,
+    kSummaryUnreadCounts, kSummaryHaveAllHistory, kSummaryNodeHistoryRanges, kSummarySendingChats
+};
+}
+}
+
+#endif // DB_QUERIES_H
@@ -39,3 +39,19 @@ CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 n
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
     is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
 
+CREATE INDEX sending_chatid ON sending(chatid);
+
+CREATE INDEX manual_sending_chatid ON manual_sending(chatid);
+
+CREATE INDEX chat_peers_covering ON chat_peers(chatid, userid, priv);
+
+CREATE INDEX sendkeys_covering ON sendkeys(chatid, userid, keyid, key);
+
+CREATE INDEX history_userid_ts ON history(userid, ts);
+
+CREATE INDEX history_last_text ON history(chatid, idx)
+    WHERE (length(data) > 0 OR type = 3) AND type != 102 AND type != 0;
+
+CREATE INDEX history_unread ON history(chatid, idx)
+    WHERE NOT (updated != 0 AND length(data) = 0) AND is_encrypted IN (0, 4, 3)
+    AND type IN (1, 101, 103, 104, 105);
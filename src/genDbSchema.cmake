@@ -6,12 +6,29 @@ string(REGEX REPLACE "([^\r\n]*)[\r\n]+" "\"\\1\"\n" dbschema "${dbschema_raw}")
 string(REGEX REPLACE "[ \t\r\n]" "" dbschema_for_hash "${dbschema_raw}")
 string(SHA1 schema_hash "${dbschema_for_hash}")
 
+# Every "-- migration N" section of dbMigrations.sql becomes a case of dbMigrationSql().
+# List operations are avoided on purpose, since the SQL contains semicolons.
+file(READ "${CMAKE_CURRENT_LIST_DIR}/dbMigrations.sql" migrations_raw)
+string(REGEX REPLACE "--[ \t]*migration[ \t]+([0-9]+)[^\r\n]*" "@MIGRATION_\\1@" migrations "${migrations_raw}")
+string(REGEX REPLACE "--[^\r\n]*" "" migrations "${migrations}")
+string(REGEX REPLACE "[ \t]+([\r\n])" "\\1" migrations "${migrations}")
+string(STRIP "${migrations}" migrations)
+string(REGEX REPLACE "([^\r\n]+)[\r\n]*" "\"\\1 \"\n" migrations "${migrations}")
+string(REGEX REPLACE "\"@MIGRATION_([0-9]+)@ \"" ";\ncase \\1: return \"\"" migrations "${migrations}")
+
 FILE(WRITE ${CMAKE_CURRENT_BINARY_DIR}/karereDbSchema.cpp
- "//This file is autogenerated from src/dbSchema.sql\n\n"
+ "//This file is autogenerated from src/dbSchema.sql and src/dbMigrations.sql\n\n"
  "namespace karere\n"
  "{\n"
  "const char* gDbSchema =\n${dbschema};\n"
- "const char* gDbSchemaHash = \"${schema_hash}\";\n"
+ "const char* gDbSchemaHash = \"${schema_hash}\";\n\n"
+ "const char* dbMigrationSql(int version)\n"
+ "{\n"
+ "switch (version)\n"
+ "{\n"
+ "${migrations};\n"
+ "}\n"
+ "return nullptr;\n"
+ "}\n"
  "}\n"
  )
-
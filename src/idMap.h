@@ -0,0 +1,253 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include <vector>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include "karereId.h"
+
+namespace karere
+{
+/** @brief Hash map for 64-bit ids (message ids, user handles, backrefids...)
+ *
+ * It uses open addressing with linear probing on a single array, so a lookup usually
+ * touches one cache line and entries cost no allocation of their own. Ids are already
+ * random, but some of them are small counters, so they are spread with a multiplicative
+ * (Fibonacci) hash. Erasing shifts back the following entries instead of leaving
+ * tombstones, so lookups never degrade after many erasures.
+ *
+ * It supports the subset of the std::map interface used by the per-chat maps of chatd.
+ * Iteration order is unspecified. Inserting a new key or erasing any key invalidates
+ * iterators and references to entries, while emplace() and operator[] with a key that is
+ * already in the map don't.
+ */
+template <class V, class K = karere::Id>
+class IdMap
+{
+public:
+    // first and second as in std::pair, but with no padding between the value and the flag
+    struct Slot
+    {
+        K first;
+        V second;
+        bool used = false;
+    };
+    typedef Slot value_type;
+
+protected:
+    enum { kMinCapacity = 16 };
+
+    std::vector<Slot> mSlots;   // empty until the first insertion, otherwise a power of two
+    size_t mSize = 0;
+    unsigned mShift = 64;       // 64 - log2(capacity)
+
+    size_t home(const K& key) const
+    {
+        return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> mShift);
+    }
+    size_t mask() const { return mSlots.size() - 1; }
+
+    // returns the slot of the key, or the free slot where it should be inserted
+    size_t probe(const K& key) const
+    {
+        size_t i = home(key);
+        while (mSlots[i].used && !(mSlots[i].first == key))
+        {
+            i = (i + 1) & mask();
+        }
+        return i;
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<Slot> old;
+        old.swap(mSlots);
+        mSlots.resize(capacity);
+        mShift = 64;
+        for (size_t c = capacity; c > 1; c >>= 1)
+        {
+            mShift--;
+        }
+        for (Slot& slot: old)
+        {
+            if (slot.used)
+            {
+                Slot& dest = mSlots[probe(slot.first)];
+                dest = std::move(slot);
+            }
+        }
+    }
+
+    // keeps the load factor at most 3/4. Returns whether the slots were reallocated
+    bool reserveOneMore()
+    {
+        if (mSlots.empty())
+        {
+            rehash(kMinCapacity);
+        }
+        else if ((mSize + 1) * 4 > mSlots.size() * 3)
+        {
+            rehash(mSlots.size() * 2);
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    // returns the slot of the key, taking a free one if it's not in the map. It only grows
+    // the map for a new key, so the lookup of an existing one keeps iterators valid
+    size_t findOrInsert(const K& key, bool& inserted)
+    {
+        size_t i = 0;
+        if (!mSlots.empty())
+        {
+            i = probe(key);
+            if (mSlots[i].used)
+            {
+                inserted = false;
+                return i;
+            }
+        }
+        if (reserveOneMore())
+        {
+            i = probe(key);
+        }
+        mSlots[i].first = key;
+        mSlots[i].used = true;
+        mSize++;
+        inserted = true;
+        return i;
+    }
+
+    void eraseSlot(size_t i)
+    {
+        // shift back the entries of the cluster that would no longer be reachable
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask(); mSlots[j].used; j = (j + 1) & mask())
+        {
+            size_t h = home(mSlots[j].first);
+            // move it if its home is not in the cyclic range (hole, j]
+            if (((j - h) & mask()) >= ((j - hole) & mask()))
+            {
+                mSlots[hole] = std::move(mSlots[j]);
+                hole = j;
+            }
+        }
+        mSlots[hole] = Slot();
+        mSize--;
+    }
+
+public:
+    template <class P, class T>
+    class Iterator
+    {
+    protected:
+        P mPos;
+        P mEnd;
+        void skipFree()
+        {
+            while (mPos != mEnd && !mPos->used)
+            {
+                mPos++;
+            }
+        }
+        friend class IdMap;
+    public:
+        Iterator(P pos, P end): mPos(pos), mEnd(end) { skipFree(); }
+        T& operator*() const { return *mPos; }
+        T* operator->() const { return mPos; }
+        Iterator& operator++() { mPos++; skipFree(); return *this; }
+        bool operator==(const Iterator& other) const { return mPos == other.mPos; }
+        bool operator!=(const Iterator& other) const { return mPos != other.mPos; }
+    };
+    typedef Iterator<Slot*, value_type> iterator;
+    typedef Iterator<const Slot*, const value_type> const_iterator;
+
+    iterator begin() { return iterator(mSlots.data(), mSlots.data() + mSlots.size()); }
+    iterator end() { return iterator(mSlots.data() + mSlots.size(), mSlots.data() + mSlots.size()); }
+    const_iterator begin() const { return const_iterator(mSlots.data(), mSlots.data() + mSlots.size()); }
+    const_iterator end() const { return const_iterator(mSlots.data() + mSlots.size(), mSlots.data() + mSlots.size()); }
+
+    size_t size() const { return mSize; }
+    bool empty() const { return !mSize; }
+
+    iterator find(const K& key)
+    {
+        if (!mSize)
+        {
+            return end();
+        }
+        size_t i = probe(key);
+        return mSlots[i].used ? iterator(mSlots.data() + i, mSlots.data() + mSlots.size()) : end();
+    }
+
+    const_iterator find(const K& key) const
+    {
+        if (!mSize)
+        {
+            return end();
+        }
+        size_t i = probe(key);
+        return mSlots[i].used ? const_iterator(mSlots.data() + i, mSlots.data() + mSlots.size()) : end();
+    }
+
+    size_t count(const K& key) const { return find(key) != end(); }
+
+    std::pair<iterator, bool> emplace(const K& key, const V& value)
+    {
+        bool inserted;
+        size_t i = findOrInsert(key, inserted);
+        if (inserted)
+        {
+            mSlots[i].second = value;
+        }
+        return std::make_pair(iterator(mSlots.data() + i, mSlots.data() + mSlots.size()), inserted);
+    }
+
+    V& operator[](const K& key)
+    {
+        bool inserted;
+        Slot& slot = mSlots[findOrInsert(key, inserted)];
+        if (inserted)
+        {
+            slot.second = V();
+        }
+        return slot.second;
+    }
+
+    size_t erase(const K& key)
+    {
+        if (!mSize)
+        {
+            return 0;
+        }
+        size_t i = probe(key);
+        if (!mSlots[i].used)
+        {
+            return 0;
+        }
+        eraseSlot(i);
+        return 1;
+    }
+
+    void erase(iterator it)
+    {
+        eraseSlot(it.mPos - mSlots.data());
+    }
+
+    // also frees the memory, as std::map does
+    void clear()
+    {
+        std::vector<Slot>().swap(mSlots);
+        mSize = 0;
+        mShift = 64;
+    }
+
+    /** @brief Bytes allocated by the map */
+    size_t memoryUsage() const { return mSlots.capacity() * sizeof(Slot); }
+};
+}
+#endif // IDMAP_H
@@ -14,13 +14,16 @@ namespace rtcModule {void globalCleanup(); }
 
 namespace karere
 {
-const char* gDbSchemaVersionSuffix = "7";
+const char* gDbSchemaVersionSuffix = "8";
 /*
     2 --> +3: invalidate cached chats to reload history (so call-history msgs are fetched)
     3 --> +4: invalidate both caches, SDK + MEGAchat, if there's at least one chat (so deleted chats are re-fetched from API)
     4 --> +5: modify attachment, revoke, contact and containsMeta and create a new table node_history
     5 --> +6: invalidate both caches, SDK + MEGAchat, (so deleted chats are re-fetched from API) if there's at least one chat,
               otherwise modify cache structure to support public chats
+    6 --> +7: set keyid=0 for truncate messages
+    7 --> +8: add covering and partial indexes for the hot queries
+    Since +8, upgrades are applied step by step from dbMigrations.sql (see Client::migrateDb())
 */
 
 bool gCatchException = true;
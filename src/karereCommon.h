@@ -161,6 +161,10 @@ enum: uint8_t
 extern const char* gDbSchema;
 extern const char* gDbSchemaHash;
 
+// SQL that upgrades a cache with version suffix \c version-1 to \c version, generated
+// from dbMigrations.sql. Returns NULL if there's no migration for that version.
+const char* dbMigrationSql(int version);
+
 // If the schema hasn't changed but its usage by the karere lib has,
 // the lib can force a new version via this suffix
 // Defined in karereCommon.cpp
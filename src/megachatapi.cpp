@@ -272,6 +272,11 @@ void MegaChatApi::setLogToConsole(bool enable)
     MegaChatApiImpl::setLogToConsole(enable);
 }
 
+void MegaChatApi::setLogAsync(bool enable)
+{
+    MegaChatApiImpl::setLogAsync(enable);
+}
+
 int MegaChatApi::init(const char *sid)
 {
     return pImpl->init(sid);
@@ -642,6 +647,26 @@ bool MegaChatApi::isFullHistoryLoaded(MegaChatHandle chatid)
     return pImpl->isFullHistoryLoaded(chatid);
 }
 
+void MegaChatApi::setHistoryMemoryBudget(size_t bytes)
+{
+    pImpl->setHistoryMemoryBudget(bytes);
+}
+
+void MegaChatApi::setDatabaseWalMode(bool enable)
+{
+    pImpl->setDatabaseWalMode(enable);
+}
+
+size_t MegaChatApi::getHistoryMemoryUsage(MegaChatHandle chatid)
+{
+    return pImpl->getHistoryMemoryUsage(chatid);
+}
+
+MegaChatMessageList *MegaChatApi::searchMessages(MegaChatHandle chatid, const char *query, int limit, int offset)
+{
+    return pImpl->searchMessages(chatid, query, limit, offset);
+}
+
 MegaChatMessage *MegaChatApi::getMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
     return pImpl->getMessage(chatid, msgid);
@@ -934,6 +959,16 @@ void MegaChatApi::removeChatRemoteVideoListener(MegaChatHandle chatid, MegaChatH
     pImpl->removeChatVideoListener(chatid, peerid, clientid, listener);
 }
 
+void MegaChatApi::setVideoFrameFormat(int format)
+{
+    pImpl->setVideoFrameFormat(format);
+}
+
+int MegaChatApi::getVideoFrameFormat()
+{
+    return pImpl->getVideoFrameFormat();
+}
+
 #endif
 
 void MegaChatApi::setCatchException(bool enable)
@@ -1344,6 +1379,13 @@ void MegaChatVideoListener::onChatVideoData(MegaChatApi * /*api*/, MegaChatHandl
 
 }
 
+void MegaChatVideoListener::onChatVideoDataI420(MegaChatApi * /*api*/, MegaChatHandle /*chatid*/, int /*width*/, int /*height*/,
+                                                const char * /*dataY*/, int /*strideY*/, const char * /*dataU*/, int /*strideU*/,
+                                                const char * /*dataV*/, int /*strideV*/)
+{
+
+}
+
 
 void MegaChatCallListener::onChatCallUpdate(MegaChatApi * /*api*/, MegaChatCall * /*call*/)
 {
@@ -1365,6 +1407,14 @@ void MegaChatListener::onChatOnlineStatusUpdate(MegaChatApi* /*api*/, MegaChatHa
 
 }
 
+void MegaChatListener::onChatOnlineStatusBatch(MegaChatApi *api, MegaChatOnlineStatusList *list)
+{
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        onChatOnlineStatusUpdate(api, list->getUserHandle(i), list->getStatus(i), false);
+    }
+}
+
 void MegaChatListener::onChatPresenceConfigUpdate(MegaChatApi * /*api*/, MegaChatPresenceConfig * /*config*/)
 {
 
@@ -1726,6 +1776,46 @@ unsigned int MegaChatListItemList::size() const
     return 0;
 }
 
+MegaChatMessageList *MegaChatMessageList::copy() const
+{
+    return NULL;
+}
+
+const MegaChatMessage *MegaChatMessageList::get(unsigned int /*i*/) const
+{
+    return NULL;
+}
+
+MegaChatHandle MegaChatMessageList::getChatId(unsigned int /*i*/) const
+{
+    return MEGACHAT_INVALID_HANDLE;
+}
+
+unsigned int MegaChatMessageList::size() const
+{
+    return 0;
+}
+
+MegaChatOnlineStatusList *MegaChatOnlineStatusList::copy() const
+{
+    return NULL;
+}
+
+MegaChatHandle MegaChatOnlineStatusList::getUserHandle(unsigned int /*i*/) const
+{
+    return MEGACHAT_INVALID_HANDLE;
+}
+
+int MegaChatOnlineStatusList::getStatus(unsigned int /*i*/) const
+{
+    return MegaChatApi::STATUS_INVALID;
+}
+
+unsigned int MegaChatOnlineStatusList::size() const
+{
+    return 0;
+}
+
 MegaChatPresenceConfig *MegaChatPresenceConfig::copy() const
 {
     return NULL;
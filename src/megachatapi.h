@@ -57,6 +57,8 @@ class MegaChatVideoListener;
 class MegaChatListener;
 class MegaChatNotificationListener;
 class MegaChatListItem;
+class MegaChatMessageList;
+class MegaChatOnlineStatusList;
 class MegaChatNodeHistoryListener;
 
 /**
@@ -624,6 +626,33 @@ public:
      *  The MegaChatVideoListener retains the ownership of the buffer.
      */
     virtual void onChatVideoData(MegaChatApi *api, MegaChatHandle chatid, int width, int height, char *buffer, size_t size);
+
+    /**
+     * @brief This function is called when a new image from a local or remote device is available,
+     * if the video frame format is MegaChatApi::VIDEO_FORMAT_I420
+     *
+     * The image is passed as the three planes of the decoded frame, without any conversion nor copy.
+     * The U and V planes have half the width and height of the image (rounded up). A row of a plane
+     * may be followed by padding, so rows must be located by their stride.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param chatid MegaChatHandle that provides the video
+     * @param width Size in pixels
+     * @param height Size in pixels
+     * @param dataY Y plane
+     * @param strideY Bytes between the start of two rows of the Y plane
+     * @param dataU U plane
+     * @param strideU Bytes between the start of two rows of the U plane
+     * @param dataV V plane
+     * @param strideV Bytes between the start of two rows of the V plane
+     *
+     * The planes are only valid during this callback, so they must be copied to be used later.
+     *
+     * @see MegaChatApi::setVideoFrameFormat
+     */
+    virtual void onChatVideoDataI420(MegaChatApi *api, MegaChatHandle chatid, int width, int height,
+                                     const char *dataY, int strideY, const char *dataU, int strideU,
+                                     const char *dataV, int strideV);
 };
 
 /**
@@ -814,6 +843,91 @@ public:
 
 };
 
+/**
+ * @brief List of MegaChatMessage objects found by MegaChatApi::searchMessages
+ *
+ * A MegaChatMessageList has the ownership of the MegaChatMessage objects that it contains, so they will be
+ * only valid until the MegaChatMessageList is deleted. If you want to retain a MegaChatMessage returned by
+ * a MegaChatMessageList, use MegaChatMessage::copy.
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatMessageList
+{
+public:
+    virtual ~MegaChatMessageList() {}
+
+    virtual MegaChatMessageList *copy() const;
+
+    /**
+     * @brief Returns the MegaChatMessage at the position i in the MegaChatMessageList
+     *
+     * The MegaChatMessageList retains the ownership of the returned MegaChatMessage. It will be only valid until
+     * the MegaChatMessageList is deleted.
+     *
+     * If the index is >= the size of the list, this function returns NULL.
+     *
+     * @param i Position of the MegaChatMessage that we want to get for the list
+     * @return MegaChatMessage at the position i in the list
+     */
+    virtual const MegaChatMessage *get(unsigned int i) const;
+
+    /**
+     * @brief Returns the handle of the chatroom of the MegaChatMessage at the position i
+     *
+     * If the index is >= the size of the list, this function returns MEGACHAT_INVALID_HANDLE.
+     *
+     * @param i Position of the MegaChatMessage in the list
+     * @return MegaChatHandle of the chatroom that contains the message
+     */
+    virtual MegaChatHandle getChatId(unsigned int i) const;
+
+    /**
+     * @brief Returns the number of MegaChatMessages in the list
+     * @return Number of MegaChatMessage in the list
+     */
+    virtual unsigned int size() const;
+};
+
+/**
+ * @brief List of users and their online status, as notified by MegaChatListener::onChatOnlineStatusBatch
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatOnlineStatusList
+{
+public:
+    virtual ~MegaChatOnlineStatusList() {}
+
+    virtual MegaChatOnlineStatusList *copy() const;
+
+    /**
+     * @brief Returns the handle of the user at the position i in the list
+     *
+     * If the index is >= the size of the list, this function returns MEGACHAT_INVALID_HANDLE.
+     *
+     * @param i Position of the user in the list
+     * @return MegaChatHandle of the user at the position i in the list
+     */
+    virtual MegaChatHandle getUserHandle(unsigned int i) const;
+
+    /**
+     * @brief Returns the online status of the user at the position i in the list
+     *
+     * If the index is >= the size of the list, this function returns MegaChatApi::STATUS_INVALID.
+     *
+     * @param i Position of the user in the list
+     * @return Online status of the user at the position i in the list
+     */
+    virtual int getStatus(unsigned int i) const;
+
+    /**
+     * @brief Returns the number of users in the list
+     * @return Number of users in the list
+     */
+    virtual unsigned int size() const;
+};
+
 /**
  * @brief This class store rich preview data
  *
@@ -2094,6 +2208,12 @@ public:
         CHAT_CONNECTION_ONLINE      = 3     /// Connection with chatd is ready and logged in
     };
 
+    enum
+    {
+        VIDEO_FORMAT_ARGB   = 0,    /// Frames are delivered by MegaChatVideoListener::onChatVideoData
+        VIDEO_FORMAT_I420   = 1     /// Frames are delivered by MegaChatVideoListener::onChatVideoDataI420
+    };
+
 
     // chat will reuse an existent megaApi instance (ie. the one for cloud storage)
     /**
@@ -2161,6 +2281,22 @@ public:
      */
     static void setLogToConsole(bool enable);
 
+    /**
+     * @brief Enable the asynchronous logging
+     *
+     * When enabled, the threads that log a message only format it and queue it, and
+     * a background thread outputs it to the console, the log file and the MegaChatLogger.
+     * Then, MegaChatLogger::log is called from that thread. If too many messages are
+     * queued, some info and debug messages may be dropped, and a warning reports how many.
+     *
+     * Disabling it outputs any queued message before returning.
+     *
+     * By default, logging is synchronous.
+     *
+     * @param enable True to enable it, false to disable.
+     */
+    static void setLogAsync(bool enable);
+
     /**
      * @brief Initializes karere
      *
@@ -3570,6 +3706,71 @@ public:
      */
     bool isFullHistoryLoaded(MegaChatHandle chatid);
 
+    /**
+     * @brief Limits the RAM used to keep the loaded history of all the chatrooms
+     *
+     * When the limit is exceeded, the oldest messages of the chatrooms least recently used
+     * are released from RAM. They remain in the local cache, and they are loaded again
+     * when required by MegaChatApi::loadMessages. Messages already loaded by the app are
+     * never released, nor the newest messages of each chatroom, so the limit may be exceeded.
+     *
+     * By default, there's no limit. The value is kept across sessions of this MegaChatApi.
+     *
+     * @param bytes Maximum RAM to be used, in bytes. Zero means no limit.
+     */
+    void setHistoryMemoryBudget(size_t bytes);
+
+    /**
+     * @brief Enables or disables the write-ahead log mode of the local cache
+     *
+     * In this mode, writes to the local cache don't wait for them to reach the disk, which
+     * saves most of the disk syncs done while receiving messages. A background thread makes
+     * them durable every second. If the app crashes, nothing is lost. If the device powers off,
+     * the changes of the last second may be lost, but the local cache remains consistent.
+     *
+     * It takes effect the next time the local cache is opened, so it should be called before
+     * MegaChatApi::init. By default, it's disabled.
+     *
+     * @param enable True to enable the write-ahead log mode, false to disable it
+     */
+    void setDatabaseWalMode(bool enable);
+
+    /**
+     * @brief Returns the RAM used to keep the loaded history of a chatroom
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @return The RAM used, in bytes, or zero if the chatroom is not found
+     */
+    size_t getHistoryMemoryUsage(MegaChatHandle chatid);
+
+    /**
+     * @brief Searches the text of the messages in the local cache
+     *
+     * Only the history in the local cache is searched, so messages not loaded yet from server
+     * (see MegaChatApi::loadMessages) are not found. Only normal messages are searched: the
+     * management messages, attachments, contacts, etc. and the messages that could not be
+     * decrypted are not.
+     *
+     * The query is split in words, and the messages found contain all of them. The last word
+     * matches also any word that starts with it, so results can be updated as the user types.
+     * Results are sorted by relevance. If the local cache can't be indexed (the SQLite
+     * library lacks FTS5), or while a cache created by a previous version is being indexed
+     * (shortly after its first use), words match any part of the text and results are sorted
+     * newest first.
+     *
+     * Use MegaChatMessageList::getChatId to know the chatroom of each message.
+     *
+     * You take the ownership of the returned value.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE
+     * to search in all chatrooms
+     * @param query Words to search
+     * @param limit Maximum number of messages to return
+     * @param offset Number of results to skip, to retrieve the next pages of results
+     * @return List of messages found, or NULL if there's no local cache
+     */
+    MegaChatMessageList *searchMessages(MegaChatHandle chatid, const char *query, int limit, int offset = 0);
+
     /**
      * @brief Returns the MegaChatMessage specified from the chat room.
      *
@@ -4626,6 +4827,32 @@ public:
      * @param listener Object that is unregistered
      */
     void removeChatRemoteVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
+
+    /**
+     * @brief Set the format of the video frames delivered to the MegaChatVideoListener
+     *
+     * By default, frames are converted to ARGB and delivered by MegaChatVideoListener::onChatVideoData.
+     * With MegaChatApi::VIDEO_FORMAT_I420, frames are delivered in the format they are decoded, by
+     * MegaChatVideoListener::onChatVideoDataI420, which avoids the conversion and the copy of every frame.
+     * This is recommended for apps that render the video with the GPU or convert it anyway.
+     *
+     * It applies to the local and the remote video of all the calls, from the next frame.
+     *
+     * Valid values are:
+     * - MegaChatApi::VIDEO_FORMAT_ARGB = 0
+     * - MegaChatApi::VIDEO_FORMAT_I420 = 1
+     *
+     * @param format Format of the video frames
+     */
+    void setVideoFrameFormat(int format);
+
+    /**
+     * @brief Get the format of the video frames delivered to the MegaChatVideoListener
+     *
+     * @return Format of the video frames
+     * @see MegaChatApi::setVideoFrameFormat
+     */
+    int getVideoFrameFormat();
 #endif
 
     static void setCatchException(bool enable);
@@ -5315,6 +5542,25 @@ public:
      */
     virtual void onChatOnlineStatusUpdate(MegaChatApi* api, MegaChatHandle userhandle, int status, bool inProgress);
 
+    /**
+     * @brief This function is called when the online status of several users has changed
+     *
+     * The changes of the online status of other users that are received at the same time (i.e.
+     * the status of every contact after reconnecting to the server) are notified together, with
+     * a single call to this function. A user is included only once, with the latest status.
+     *
+     * The default implementation calls MegaChatListener::onChatOnlineStatusUpdate for each user,
+     * with \c inProgress as false. Apps that override this function receive only the batch.
+     *
+     * The SDK retains the ownership of the MegaChatOnlineStatusList in the second parameter.
+     * The MegaChatOnlineStatusList object will be valid until this function returns. If you
+     * want to save the MegaChatOnlineStatusList, use MegaChatOnlineStatusList::copy
+     *
+     * @param api MegaChatApi connected to the account
+     * @param list Users whose online status has changed, and their new status
+     */
+    virtual void onChatOnlineStatusBatch(MegaChatApi* api, MegaChatOnlineStatusList *list);
+
     /**
      * @brief This function is called when the presence configuration has changed
      *
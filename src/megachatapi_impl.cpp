@@ -40,6 +40,7 @@
 #include <base/logger.h>
 #include <IGui.h>
 #include <chatClient.h>
+#include <chatdDb.h>
 #include <mega/base64.h>
 
 #ifndef _WIN32
@@ -102,7 +103,16 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
     this->mClient = NULL;
     this->terminating = false;
     this->waiter = new MegaChatWaiter();
-    this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, megaApi, this);
+    const char *replayDir = WsRecording::replayDir();
+    if (replayDir)
+    {
+        // replay recorded chatd/presenced traffic instead of connecting (see WsRecording)
+        this->websocketsIO = new ReplayWebsocketsIO(&sdkMutex, megaApi, this, replayDir, getenv("KRCHAT_WS_REPLAY_REALTIME") != NULL);
+    }
+    else
+    {
+        this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, megaApi, this);
+    }
     this->reqtag = 0;
 
     //Start blocking thread
@@ -709,6 +719,7 @@ void MegaChatApiImpl::sendPendingRequests()
             handle messageid = request->getUserHandle();
             if (messageid == MEGACHAT_INVALID_HANDLE)   // clear the full history, from current message
             {
+                chatroom->chat().loadInitialHistory();
                 if (chatroom->chat().empty())
                 {
                     MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_OK);
@@ -1324,7 +1335,11 @@ void MegaChatApiImpl::sendPendingRequests()
                         MegaHandleList *msgids = MegaHandleList::createInstance();
 
                         MegaChatHandle chatid = it->first;
-                        const Chat &chat = it->second->chat();
+                        Chat &chat = it->second->chat();
+                        if (chat.unreadMsgCount() != 0)
+                        {
+                            chat.loadInitialHistory();  // not loaded if the chat was not opened yet
+                        }
                         Idx lastSeenIdx = chat.lastSeenIdx();
 
                         // first msg to consider: last-seen if loaded in memory. Otherwise, the oldest loaded msg
@@ -1723,13 +1738,41 @@ void MegaChatApiImpl::sendPendingRequests()
 
 void MegaChatApiImpl::sendPendingEvents()
 {
-    void *msg;
-    while ((msg = eventQueue.pop()))
+    // events posted while processing a batch are taken by the next iteration
+    megaMessage *msg;
+    while ((msg = eventQueue.popAll()))
     {
-        megaProcessMessage(msg);
+        do
+        {
+            megaMessage *next = msg->next;  // the message is deleted when processed
+            megaProcessMessage(msg);
+            msg = next;
+        } while (msg);
     }
+
+#ifdef KARERE_QUEUE_STATS
+    logQueueStats();
+#endif
 }
 
+#ifdef KARERE_QUEUE_STATS
+void MegaChatApiImpl::logQueueStats()
+{
+    static const std::chrono::seconds kQueueStatsInterval(60);
+    auto now = std::chrono::steady_clock::now();
+    if (now - mLastQueueStatsTs < kQueueStatsInterval)
+    {
+        return;
+    }
+    mLastQueueStatsTs = now;
+
+    API_LOG_INFO("Event queue %s", eventQueue.stats().toString().c_str());
+    API_LOG_INFO("Request queue %s", requestQueue.stats().toString().c_str());
+    eventQueue.stats().reset();
+    requestQueue.stats().reset();
+}
+#endif
+
 void MegaChatApiImpl::setLogLevel(int logLevel)
 {
     if (!loggerHandler)
@@ -1755,6 +1798,11 @@ void MegaChatApiImpl::setLogToConsole(bool enable)
     }
 }
 
+void MegaChatApiImpl::setLogAsync(bool enable)
+{
+    gLogger.setAsync(enable);
+}
+
 void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
 {
     if (!megaLogger)   // removing logger
@@ -1801,6 +1849,11 @@ int MegaChatApiImpl::init(const char *sid)
         // there's been an error during initialization
         localLogout();
     }
+    else if (state == karere::Client::kInitHasOfflineSession && WsRecording::replayDir())
+    {
+        // the SDK isn't logged in to replay a recording: the cache is all the session there is
+        mClient->resumeOfflineSession();
+    }
 
     sdkMutex.unlock();
     return MegaChatApiImpl::convertInitState(state);
@@ -1826,6 +1879,15 @@ void MegaChatApiImpl::createKarereClient()
         uint8_t caps = karere::kClientIsMobile | karere::kClientSupportLastGreen;
 #endif
         mClient = new karere::Client(*megaApi, websocketsIO, *this, megaApi->getBasePath(), caps, this);
+        mClient->db.setWalMode(mDbWalMode);
+        if (WsRecording::replayDir())
+        {
+            ReplayApi::replay(mClient->api, WsRecording::replayDir());
+        }
+        else
+        {
+            ReplayApi::record(mClient->api);
+        }
         terminating = false;
     }
 }
@@ -2232,6 +2294,23 @@ void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle
     }
 }
 
+void MegaChatApiImpl::fireOnChatVideoDataI420(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height,
+                                              const char *dataY, int strideY, const char *dataU, int strideU, const char *dataV, int strideV)
+{
+    std::map<MegaChatHandle, MegaChatPeerVideoListener_map>::iterator it = videoListeners.find(chatid);
+    if (it != videoListeners.end())
+    {
+        MegaChatPeerVideoListener_map::iterator peerVideoIterator = it->second.find(EndpointId(peerid, clientid));
+        if (peerVideoIterator != it->second.end())
+        {
+            for (MegaChatVideoListener *listener: peerVideoIterator->second)
+            {
+                listener->onChatVideoDataI420(chatApi, chatid, width, height, dataY, strideY, dataU, strideU, dataV, strideV);
+            }
+        }
+    }
+}
+
 #endif  // webrtc
 
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
@@ -2260,6 +2339,16 @@ void MegaChatApiImpl::fireOnChatOnlineStatusUpdate(MegaChatHandle userhandle, in
     }
 }
 
+void MegaChatApiImpl::fireOnChatOnlineStatusBatch(MegaChatOnlineStatusList *list)
+{
+    for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
+    {
+        (*it)->onChatOnlineStatusBatch(chatApi, list);
+    }
+
+    delete list;
+}
+
 void MegaChatApiImpl::fireOnChatPresenceConfigUpdate(MegaChatPresenceConfig *config)
 {
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
@@ -3165,6 +3254,86 @@ bool MegaChatApiImpl::isFullHistoryLoaded(MegaChatHandle chatid)
     return ret;
 }
 
+void MegaChatApiImpl::setHistoryMemoryBudget(size_t bytes)
+{
+    sdkMutex.lock();
+
+    mHistoryMemoryBudget = bytes;
+    if (mClient && mClient->mChatdClient)
+    {
+        mClient->mChatdClient->setHistoryMemoryBudget(bytes);
+    }
+
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setDatabaseWalMode(bool enable)
+{
+    sdkMutex.lock();
+
+    mDbWalMode = enable;
+    if (mClient)
+    {
+        mClient->db.setWalMode(enable);
+    }
+
+    sdkMutex.unlock();
+}
+
+size_t MegaChatApiImpl::getHistoryMemoryUsage(MegaChatHandle chatid)
+{
+    size_t ret = 0;
+    sdkMutex.lock();
+
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom)
+    {
+        ret = chatroom->chat().historyMemoryUsage();
+    }
+
+    sdkMutex.unlock();
+    return ret;
+}
+
+MegaChatMessageList *MegaChatApiImpl::searchMessages(MegaChatHandle chatid, const char *query, int limit, int offset)
+{
+    if (!query || limit <= 0 || offset < 0)
+    {
+        return NULL;
+    }
+
+    MegaChatMessageListPrivate *list = NULL;
+    sdkMutex.lock();
+
+    if (mClient && mClient->db.isOpen())
+    {
+        std::vector<ChatdSqliteDb::SearchResult> results;
+        try
+        {
+            ChatdSqliteDb::searchHistory(mClient->db, mClient->hasSearchIndex(), chatid, query, limit, offset, results);
+        }
+        catch (std::exception& e)
+        {
+            API_LOG_ERROR("Failed to search messages: %s", e.what());
+        }
+
+        list = new MegaChatMessageListPrivate();
+        for (auto& result: results)
+        {
+            chatd::Message::Status status = chatd::Message::kServerReceived;
+            ChatRoom *chatroom = findChatRoom(result.chatid);
+            if (chatroom)
+            {
+                status = chatroom->chat().getMsgStatus(*result.msg, result.idx);
+            }
+            list->addMessage(result.chatid, new MegaChatMessagePrivate(*result.msg, status, result.idx));
+        }
+    }
+
+    sdkMutex.unlock();
+    return list;
+}
+
 MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
     MegaChatMessagePrivate *megaMsg = NULL;
@@ -4116,6 +4285,21 @@ void MegaChatApiImpl::removeChatVideoListener(MegaChatHandle chatid, MegaChatHan
     videoMutex.unlock();
 }
 
+void MegaChatApiImpl::setVideoFrameFormat(int format)
+{
+    if (format != MegaChatApi::VIDEO_FORMAT_ARGB && format != MegaChatApi::VIDEO_FORMAT_I420)
+    {
+        API_LOG_ERROR("setVideoFrameFormat: invalid format %d", format);
+        return;
+    }
+    mVideoFrameFormat = format;
+}
+
+int MegaChatApiImpl::getVideoFrameFormat()
+{
+    return mVideoFrameFormat;
+}
+
 #endif  // webrtc
 
 void MegaChatApiImpl::removeChatListener(MegaChatListener *listener)
@@ -4294,6 +4478,13 @@ void MegaChatApiImpl::onInitStateChange(int newState)
 
     int state = MegaChatApiImpl::convertInitState(newState);
 
+    // the chatd client is created again for every session
+    if ((state == MegaChatApi::INIT_OFFLINE_SESSION || state == MegaChatApi::INIT_ONLINE_SESSION)
+            && mClient && mClient->mChatdClient)
+    {
+        mClient->mChatdClient->setHistoryMemoryBudget(mHistoryMemoryBudget);
+    }
+
     // only notify meaningful state to the app
     if (state == MegaChatApi::INIT_ERROR ||
             state == MegaChatApi::INIT_WAITING_NEW_SESSION ||
@@ -4435,6 +4626,12 @@ void MegaChatApiImpl::onPresenceChanged(Id userid, Presence pres, bool inProgres
     fireOnChatOnlineStatusUpdate(userid.val, pres.status(), inProgress);
 }
 
+void MegaChatApiImpl::onPresenceChangedBatch(const presenced::PresenceChanges& changes)
+{
+    API_LOG_INFO("Presence of %zu users has been changed", changes.size());
+    fireOnChatOnlineStatusBatch(new MegaChatOnlineStatusListPrivate(changes));
+}
+
 void MegaChatApiImpl::onPresenceConfigChanged(const presenced::Config &state, bool pending)
 {
     MegaChatPresenceConfigPrivate *config = new MegaChatPresenceConfigPrivate(state, pending);
@@ -4446,108 +4643,73 @@ void MegaChatApiImpl::onPresenceLastGreenUpdated(Id userid, uint16_t lastGreen)
     fireOnChatPresenceLastGreenUpdated(userid, lastGreen);
 }
 
-ChatRequestQueue::ChatRequestQueue()
-{
-    mutex.init(false);
-}
-
 void ChatRequestQueue::push(MegaChatRequestPrivate *request)
 {
-    mutex.lock();
-    requests.push_back(request);
-    mutex.unlock();
-}
-
-void ChatRequestQueue::push_front(MegaChatRequestPrivate *request)
-{
-    mutex.lock();
-    requests.push_front(request);
-    mutex.unlock();
+#ifdef KARERE_QUEUE_STATS
+    if (requests.push(request))
+    {
+        mStats.onFirstPush();
+    }
+#else
+    requests.push(request);
+#endif
 }
 
 MegaChatRequestPrivate *ChatRequestQueue::pop()
 {
-    mutex.lock();
-    if(requests.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    MegaChatRequestPrivate *request = requests.front();
-    requests.pop_front();
-    mutex.unlock();
+#ifdef KARERE_QUEUE_STATS
+    size_t count;
+    MegaChatRequestPrivate *request = requests.pop(&count);
+    mStats.onBatch(count);
     return request;
+#else
+    return requests.pop();
+#endif
 }
 
 void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
 {
-    mutex.lock();
-
-    deque<MegaChatRequestPrivate *>::iterator it = requests.begin();
-    while(it != requests.end())
+    requests.forEach([listener](MegaChatRequestPrivate *request)
     {
-        MegaChatRequestPrivate *request = (*it);
-        if(request->getListener()==listener)
+        if (request->getListener() == listener)
+        {
             request->setListener(NULL);
-        it++;
-    }
-
-    mutex.unlock();
-}
-
-EventQueue::EventQueue()
-{
-    mutex.init(false);
-}
-
-void EventQueue::push(void *transfer)
-{
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
+        }
+    });
 }
 
-void EventQueue::push_front(void *event)
+void EventQueue::push(void *event)
 {
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
+#ifdef KARERE_QUEUE_STATS
+    if (events.push(static_cast<megaMessage*>(event)))
+    {
+        mStats.onFirstPush();
+    }
+#else
+    events.push(static_cast<megaMessage*>(event));
+#endif
 }
 
-void* EventQueue::pop()
+megaMessage *EventQueue::popAll()
 {
-    mutex.lock();
-    if(events.empty())
-    {
-        mutex.unlock();
-        return NULL;
-    }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
-    return event;
+#ifdef KARERE_QUEUE_STATS
+    size_t count;
+    megaMessage *batch = events.popAll(&count);
+    mStats.onBatch(count);
+    return batch;
+#else
+    return events.popAll();
+#endif
 }
 
 bool EventQueue::isEmpty()
 {
-    bool ret;
-
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
-
-    return ret;
+    return events.empty();
 }
 
 size_t EventQueue::size()
 {
-    size_t ret;
-
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
-
-    return ret;
+    return events.size();
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -5551,6 +5713,16 @@ void MegaChatCallPrivate::setCaller(Id caller)
     this->callerId = caller;
 }
 
+MegaChatVideoFrame::MegaChatVideoFrame(int width, int height)
+    : buffer(new ::mega::byte[width * height * 4]), width(width), height(height)
+{
+}
+
+MegaChatVideoFrame::~MegaChatVideoFrame()
+{
+    delete [] buffer;
+}
+
 MegaChatVideoReceiver::MegaChatVideoReceiver(MegaChatApiImpl *chatApi, rtcModule::ICall *call, MegaChatHandle peerid, uint32_t clientid)
 {
     this->chatApi = chatApi;
@@ -5561,14 +5733,36 @@ MegaChatVideoReceiver::MegaChatVideoReceiver(MegaChatApiImpl *chatApi, rtcModule
 
 MegaChatVideoReceiver::~MegaChatVideoReceiver()
 {
+    for (MegaChatVideoFrame *frame: mFramePool)
+    {
+        delete frame;
+    }
 }
 
 void* MegaChatVideoReceiver::getImageBuffer(unsigned short width, unsigned short height, void*& userData)
 {
-    MegaChatVideoFrame *frame = new MegaChatVideoFrame;
-    frame->width = width;
-    frame->height = height;
-    frame->buffer = new ::mega::byte[width * height * 4];  // in format ARGB: 4 bytes per pixel
+    MegaChatVideoFrame *frame = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mFramePoolMutex);
+        while (!mFramePool.empty())
+        {
+            frame = mFramePool.back();
+            mFramePool.pop_back();
+            if (frame->width == width && frame->height == height)
+            {
+                break;
+            }
+
+            // the resolution has changed, so the remaining ones are of no use either
+            delete frame;
+            frame = NULL;
+        }
+    }
+
+    if (!frame)
+    {
+        frame = new MegaChatVideoFrame(width, height);
+    }
     userData = frame;
     return frame->buffer;
 }
@@ -5579,8 +5773,33 @@ void MegaChatVideoReceiver::frameComplete(void *userData)
     MegaChatVideoFrame *frame = (MegaChatVideoFrame *)userData;
     chatApi->fireOnChatVideoData(chatid, peerid, clientid, frame->width, frame->height, (char *)frame->buffer);
     chatApi->videoMutex.unlock();
-    delete [] frame->buffer;
-    delete frame;
+
+    std::lock_guard<std::mutex> lock(mFramePoolMutex);
+    if (mFramePool.size() < kMaxPooledFrames)
+    {
+        mFramePool.push_back(frame);
+    }
+    else
+    {
+        delete frame;
+    }
+}
+
+bool MegaChatVideoReceiver::wantsI420()
+{
+    return chatApi->getVideoFrameFormat() == MegaChatApi::VIDEO_FORMAT_I420;
+}
+
+void MegaChatVideoReceiver::frameI420(unsigned short width, unsigned short height,
+                                      const unsigned char *dataY, int strideY,
+                                      const unsigned char *dataU, int strideU,
+                                      const unsigned char *dataV, int strideV)
+{
+    chatApi->videoMutex.lock();
+    chatApi->fireOnChatVideoDataI420(chatid, peerid, clientid, width, height,
+                                     (const char *)dataY, strideY, (const char *)dataU, strideU,
+                                     (const char *)dataV, strideV);
+    chatApi->videoMutex.unlock();
 }
 
 void MegaChatVideoReceiver::onVideoAttach()
@@ -8094,6 +8313,120 @@ void MegaChatListItemListPrivate::addChatListItem(MegaChatListItem *item)
     list.push_back(item);
 }
 
+MegaChatMessageListPrivate::MegaChatMessageListPrivate()
+{
+}
+
+MegaChatMessageListPrivate::~MegaChatMessageListPrivate()
+{
+    for (unsigned int i = 0; i < list.size(); i++)
+    {
+        delete list[i];
+        list[i] = NULL;
+    }
+
+    list.clear();
+}
+
+MegaChatMessageListPrivate::MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list)
+{
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        this->list.push_back(list->get(i)->copy());
+        this->chatids.push_back(list->getChatId(i));
+    }
+}
+
+MegaChatMessageListPrivate *MegaChatMessageListPrivate::copy() const
+{
+    return new MegaChatMessageListPrivate(this);
+}
+
+const MegaChatMessage *MegaChatMessageListPrivate::get(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return NULL;
+    }
+    else
+    {
+        return list.at(i);
+    }
+}
+
+MegaChatHandle MegaChatMessageListPrivate::getChatId(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return MEGACHAT_INVALID_HANDLE;
+    }
+    else
+    {
+        return chatids.at(i);
+    }
+}
+
+unsigned int MegaChatMessageListPrivate::size() const
+{
+    return list.size();
+}
+
+void MegaChatMessageListPrivate::addMessage(MegaChatHandle chatid, MegaChatMessage *msg)
+{
+    list.push_back(msg);
+    chatids.push_back(chatid);
+}
+
+MegaChatOnlineStatusListPrivate::MegaChatOnlineStatusListPrivate(const presenced::PresenceChanges& changes)
+{
+    userhandles.reserve(changes.size());
+    statuses.reserve(changes.size());
+    for (auto& change: changes)
+    {
+        userhandles.push_back(change.first.val);
+        statuses.push_back(change.second.status());
+    }
+}
+
+MegaChatOnlineStatusListPrivate::MegaChatOnlineStatusListPrivate(const MegaChatOnlineStatusListPrivate *list)
+    : userhandles(list->userhandles), statuses(list->statuses)
+{
+}
+
+MegaChatOnlineStatusListPrivate *MegaChatOnlineStatusListPrivate::copy() const
+{
+    return new MegaChatOnlineStatusListPrivate(this);
+}
+
+MegaChatHandle MegaChatOnlineStatusListPrivate::getUserHandle(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return MEGACHAT_INVALID_HANDLE;
+    }
+    else
+    {
+        return userhandles.at(i);
+    }
+}
+
+int MegaChatOnlineStatusListPrivate::getStatus(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return MegaChatApi::STATUS_INVALID;
+    }
+    else
+    {
+        return statuses.at(i);
+    }
+}
+
+unsigned int MegaChatOnlineStatusListPrivate::size() const
+{
+    return userhandles.size();
+}
+
 MegaChatPresenceConfigPrivate::MegaChatPresenceConfigPrivate(const MegaChatPresenceConfigPrivate &config)
 {
     this->status = config.getOnlineStatus();
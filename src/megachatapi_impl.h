@@ -42,9 +42,13 @@
 #include <sdkApi.h>
 #include <karereCommon.h>
 #include <logger.h>
+#include <mpscQueue.h>
 #include <rapidjson/document.h>
 #include <stdint.h>
+#include <atomic>
+#include <mutex>
 #include "net/libwebsocketsIO.h"
+#include "net/wsReplay.h"
 #include "waiter/libuvWaiter.h"
 
 typedef LibwebsocketsIO MegaWebsocketsIO;
@@ -120,6 +124,10 @@ protected:
     mega::MegaHandleList *mMegaHandleList;
     std::map<MegaChatHandle, mega::MegaHandleList*> mMegaHandleListMap;
     int mParamType;
+
+    // link of the ChatRequestQueue, which belongs to the queue while the request is pending
+    MegaChatRequestPrivate *queueNext = NULL;
+    friend class ChatRequestQueue;
 };
 
 class MegaChatPresenceConfigPrivate : public MegaChatPresenceConfig
@@ -276,7 +284,10 @@ protected:
 class MegaChatVideoFrame
 {
 public:
-    unsigned char *buffer;
+    MegaChatVideoFrame(int width, int height);
+    ~MegaChatVideoFrame();
+
+    unsigned char *buffer;  // in format ARGB: 4 bytes per pixel
     int width;
     int height;
 };
@@ -294,6 +305,11 @@ public:
     // rtcModule::IVideoRenderer implementation
     virtual void* getImageBuffer(unsigned short width, unsigned short height, void*& userData);
     virtual void frameComplete(void* userData);
+    virtual bool wantsI420();
+    virtual void frameI420(unsigned short width, unsigned short height,
+                           const unsigned char* dataY, int strideY,
+                           const unsigned char* dataU, int strideU,
+                           const unsigned char* dataV, int strideV);
     virtual void onVideoAttach();
     virtual void onVideoDetach();
     virtual void clearViewport();
@@ -305,6 +321,11 @@ protected:
     MegaChatHandle chatid;
     MegaChatHandle peerid;
     uint32_t clientid;
+
+    // frames already delivered, kept to reuse their buffers. All of them have the latest resolution
+    enum { kMaxPooledFrames = 3 };
+    std::vector<MegaChatVideoFrame *> mFramePool;
+    std::mutex mFramePoolMutex;
 };
 
 #endif
@@ -680,6 +701,42 @@ private:
     std::vector<MegaChatListItem*> list;
 };
 
+class MegaChatMessageListPrivate :  public MegaChatMessageList
+{
+public:
+    MegaChatMessageListPrivate();
+    virtual ~MegaChatMessageListPrivate();
+    virtual MegaChatMessageListPrivate *copy() const;
+
+    virtual const MegaChatMessage *get(unsigned int i) const;
+    virtual MegaChatHandle getChatId(unsigned int i) const;
+    virtual unsigned int size() const;
+
+    void addMessage(MegaChatHandle chatid, MegaChatMessage *msg);
+
+private:
+    MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list);
+    std::vector<MegaChatMessage*> list;
+    std::vector<MegaChatHandle> chatids;
+};
+
+class MegaChatOnlineStatusListPrivate :  public MegaChatOnlineStatusList
+{
+public:
+    MegaChatOnlineStatusListPrivate(const presenced::PresenceChanges& changes);
+    virtual ~MegaChatOnlineStatusListPrivate() {}
+    virtual MegaChatOnlineStatusListPrivate *copy() const;
+
+    virtual MegaChatHandle getUserHandle(unsigned int i) const;
+    virtual int getStatus(unsigned int i) const;
+    virtual unsigned int size() const;
+
+private:
+    MegaChatOnlineStatusListPrivate(const MegaChatOnlineStatusListPrivate *list);
+    std::vector<MegaChatHandle> userhandles;
+    std::vector<int> statuses;
+};
+
 class MegaChatRoomPrivate : public MegaChatRoom
 {
 public:
@@ -852,35 +909,44 @@ private:
     const MegaChatContainsMeta *mContainsMeta = NULL;
 };
 
-//Thread safe request queue
+//Thread safe request queue: any thread can push requests, but only the thread
+//holding the sdkMutex of the MegaChatApiImpl can pop them or remove listeners
 class ChatRequestQueue
 {
     protected:
-        std::deque<MegaChatRequestPrivate *> requests;
-        mega::MegaMutex mutex;
+        karere::MpscQueue<MegaChatRequestPrivate, &MegaChatRequestPrivate::queueNext> requests;
+#ifdef KARERE_QUEUE_STATS
+        karere::QueueStats mStats;
+#endif
 
     public:
-        ChatRequestQueue();
         void push(MegaChatRequestPrivate *request);
-        void push_front(MegaChatRequestPrivate *request);
         MegaChatRequestPrivate * pop();
         void removeListener(MegaChatRequestListener *listener);
+#ifdef KARERE_QUEUE_STATS
+        karere::QueueStats& stats() { return mStats; }
+#endif
 };
 
-//Thread safe transfer queue
+//Thread safe event queue of marshalled calls (megaMessage), with the same
+//threading rules as ChatRequestQueue
 class EventQueue
 {
 protected:
-    std::deque<void *> events;
-    mega::MegaMutex mutex;
+    karere::MpscQueue<megaMessage, &megaMessage::next> events;
+#ifdef KARERE_QUEUE_STATS
+    karere::QueueStats mStats;
+#endif
 
 public:
-    EventQueue();
     void push(void* event);
-    void push_front(void *event);
-    void* pop();
+    // returns all the queued events linked through megaMessage::next, oldest first
+    megaMessage* popAll();
     bool isEmpty();
     size_t size();
+#ifdef KARERE_QUEUE_STATS
+    karere::QueueStats& stats() { return mStats; }
+#endif
 };
 
 class MegaChatApiImpl :
@@ -926,9 +992,16 @@ private:
     int reqtag;
     std::map<int, MegaChatRequestPrivate *> requestMap;
 
+    // RAM limit for the history of all the chats, applied to the chatd client of each session
+    size_t mHistoryMemoryBudget = 0;
+
+    // WAL mode of the local cache, applied to the db of each client
+    bool mDbWalMode = false;
+
 #ifndef KARERE_DISABLE_WEBRTC
     std::set<MegaChatCallListener *> callListeners;
     std::map<MegaChatHandle, MegaChatPeerVideoListener_map> videoListeners;
+    std::atomic<int> mVideoFrameFormat { MegaChatApi::VIDEO_FORMAT_ARGB };  // read by the video threads
 
     mega::MegaStringList *getChatInDevices(const std::vector<std::string> &devicesVector);
     void cleanCallHandlerMap();
@@ -943,11 +1016,17 @@ public:
 
     void sendPendingRequests();
     void sendPendingEvents();
+#ifdef KARERE_QUEUE_STATS
+    // periodically logs (and resets) the histograms of the event and request queues
+    void logQueueStats();
+    std::chrono::steady_clock::time_point mLastQueueStatsTs;
+#endif
 
     static void setLogLevel(int logLevel);
     static void setLoggerClass(MegaChatLogger *megaLogger);
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
+    static void setLogAsync(bool enable);
 
     int init(const char *sid);
     int initAnonymous();
@@ -992,6 +1071,8 @@ public:
     void removeChatCallListener(MegaChatCallListener *listener);
     void addChatVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
     void removeChatVideoListener(MegaChatHandle chatid, MegaChatHandle peerid, MegaChatHandle clientid, MegaChatVideoListener *listener);
+    void setVideoFrameFormat(int format);
+    int getVideoFrameFormat();
 #endif
 
     // MegaChatRequestListener callbacks
@@ -1006,12 +1087,15 @@ public:
 
     // MegaChatVideoListener callbacks
     void fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height, char*buffer);
+    void fireOnChatVideoDataI420(MegaChatHandle chatid, MegaChatHandle peerid, uint32_t clientid, int width, int height,
+                                 const char *dataY, int strideY, const char *dataU, int strideU, const char *dataV, int strideV);
 #endif
 
     // MegaChatListener callbacks (specific ones)
     void fireOnChatListItemUpdate(MegaChatListItem *item);
     void fireOnChatInitStateUpdate(int newState);
     void fireOnChatOnlineStatusUpdate(MegaChatHandle userhandle, int status, bool inProgress);
+    void fireOnChatOnlineStatusBatch(MegaChatOnlineStatusList *list);
     void fireOnChatPresenceConfigUpdate(MegaChatPresenceConfig *config);
     void fireOnChatPresenceLastGreenUpdated(MegaChatHandle userhandle, int lastGreen);
     void fireOnChatConnectionStateUpdate(MegaChatHandle chatid, int newState);
@@ -1097,6 +1181,10 @@ public:
 
     int loadMessages(MegaChatHandle chatid, int count);
     bool isFullHistoryLoaded(MegaChatHandle chatid);
+    void setHistoryMemoryBudget(size_t bytes);
+    void setDatabaseWalMode(bool enable);
+    size_t getHistoryMemoryUsage(MegaChatHandle chatid);
+    MegaChatMessageList *searchMessages(MegaChatHandle chatid, const char *query, int limit, int offset);
     MegaChatMessage *getMessage(MegaChatHandle chatid, MegaChatHandle msgid);
     MegaChatMessage *getMessageFromNodeHistory(MegaChatHandle chatid, MegaChatHandle msgid);
     MegaChatMessage *getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid);
@@ -1159,6 +1247,7 @@ public:
     virtual IApp::IChatHandler *createChatHandler(karere::ChatRoom &chat);
     virtual IApp::IChatListHandler *chatListHandler();
     virtual void onPresenceChanged(karere::Id userid, karere::Presence pres, bool inProgress);
+    virtual void onPresenceChangedBatch(const presenced::PresenceChanges& changes);
     virtual void onPresenceConfigChanged(const presenced::Config& state, bool pending);
     virtual void onPresenceLastGreenUpdated(karere::Id userid, uint16_t lastGreen);
 #ifndef KARERE_DISABLE_WEBRTC
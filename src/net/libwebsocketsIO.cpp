@@ -107,7 +107,7 @@ bool LibwebsocketsIO::wsResolveDNS(const char *hostname, std::function<void (int
 
 WebsocketsClientImpl *LibwebsocketsIO::wsConnect(const char *ip, const char *host, int port, const char *path, bool ssl, WebsocketsClient *client)
 {
-    LibwebsocketsClient *libwebsocketsClient = new LibwebsocketsClient(mutex, client);
+    LibwebsocketsClient *libwebsocketsClient = new LibwebsocketsClient(mutex, client, mRecvBufferPool);
     
     std::string cip = ip;
     if (cip[0] == '[')
@@ -138,7 +138,8 @@ WebsocketsClientImpl *LibwebsocketsIO::wsConnect(const char *ip, const char *hos
     return libwebsocketsClient;
 }
 
-LibwebsocketsClient::LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client) : WebsocketsClientImpl(mutex, client)
+LibwebsocketsClient::LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client, RecvBufferPool& recvPool)
+    : WebsocketsClientImpl(mutex, client), reassembler(recvPool)
 {
     wsi = NULL;
 }
@@ -148,35 +149,6 @@ LibwebsocketsClient::~LibwebsocketsClient()
     wsDisconnect(true);
 }
 
-void LibwebsocketsClient::appendMessageFragment(char *data, size_t len, size_t remaining)
-{
-    if (!recbuffer.size() && remaining)
-    {
-        recbuffer.reserve(len + remaining);
-    }
-    recbuffer.append(data, len);
-}
-
-bool LibwebsocketsClient::hasFragments()
-{
-    return recbuffer.size();
-}
-
-const char *LibwebsocketsClient::getMessage()
-{
-    return recbuffer.data();
-}
-
-size_t LibwebsocketsClient::getMessageLength()
-{
-    return recbuffer.size();
-}
-
-void LibwebsocketsClient::resetMessage()
-{
-    recbuffer.clear();
-}
-
 bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
 {
     assert(wsi);
@@ -188,12 +160,9 @@ bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
         return false;
     }
     
-    if (!sendbuffer.size())
-    {
-        sendbuffer.reserve(LWS_PRE + len);
-        sendbuffer.resize(LWS_PRE);
-    }
-    sendbuffer.append(msg, len);
+    Buffer& frame = frameForMessage(len);
+    frame.append(msg, len);
+    sendQueueBytes += len;
 
     if (lws_callback_on_writable(wsi) <= 0)
     {
@@ -211,6 +180,9 @@ void LibwebsocketsClient::wsDisconnect(bool immediate)
         return;
     }
 
+    // neither kind of disconnection writes the pending output
+    resetOutputQueue();
+
     if (immediate)
     {
         struct lws *dwsi = wsi;
@@ -249,19 +221,65 @@ bool LibwebsocketsClient::wsIsConnected()
     return wsi != NULL;
 }
 
-const char *LibwebsocketsClient::getOutputBuffer()
+Buffer& LibwebsocketsClient::frameForMessage(size_t len)
+{
+    // coalesce with the last pending frame, unless it would exceed the maximum frame size
+    if (!sendQueue.empty() && sendQueue.back().dataSize() - LWS_PRE + len <= kMaxFrameSize)
+    {
+        Buffer& frame = sendQueue.back();
+        size_t required = frame.dataSize() + len;
+        if (required > frame.bufSize())
+        {
+            // grow geometrically, so many small commands don't reallocate the frame every time
+            size_t target = std::max(required, std::min(frame.bufSize() * 2, (size_t)(LWS_PRE + kMaxFrameSize)));
+            frame.reserve(target - frame.dataSize());
+        }
+        return frame;
+    }
+
+    // reuse the last written frame, unless it has grown beyond the usual frame size
+    if (spareFrame && spareFrame->bufSize() <= LWS_PRE + kMaxFrameSize)
+    {
+        sendQueue.emplace_back(std::move(*spareFrame));
+        spareFrame.reset();
+        Buffer& frame = sendQueue.back();
+        frame.setDataSize(LWS_PRE);
+        if (frame.bufSize() < LWS_PRE + len)
+        {
+            frame.reserve(len);
+        }
+        return frame;
+    }
+
+    sendQueue.emplace_back(LWS_PRE + std::max(len, (size_t)kMinFrameSize), LWS_PRE);
+    return sendQueue.back();
+}
+
+Buffer *LibwebsocketsClient::getOutputFrame()
+{
+    return sendQueue.empty() ? NULL : &sendQueue.front();
+}
+
+bool LibwebsocketsClient::outputFrameSent()
 {
-    return sendbuffer.size() ? sendbuffer.data() + LWS_PRE : NULL;
+    assert(!sendQueue.empty());
+    Buffer& frame = sendQueue.front();
+    sendQueueBytes -= frame.dataSize() - LWS_PRE;
+
+    spareFrame.reset(new Buffer(std::move(frame)));    // keep it for the next frame
+    sendQueue.pop_front();
+    return sendQueue.empty();
 }
 
-size_t LibwebsocketsClient::getOutputBufferLength()
+size_t LibwebsocketsClient::wsSendQueueSize()
 {
-    return sendbuffer.size() ? sendbuffer.size() - LWS_PRE : 0;
+    return sendQueueBytes;
 }
 
-void LibwebsocketsClient::resetOutputBuffer()
+void LibwebsocketsClient::resetOutputQueue()
 {
-    sendbuffer.clear();
+    sendQueue.clear();
+    sendQueueBytes = 0;
 }
 
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined (LIBRESSL_VERSION_NUMBER) || defined (OPENSSL_IS_BORINGSSL)
@@ -388,6 +406,7 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 client->wsi = NULL;
                 lws_set_wsi_user(dwsi, NULL);
             }
+            client->resetOutputQueue();
             client->wsCloseCb(reason, 0, "closed", 7);
             break;
         }
@@ -400,25 +419,8 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
-            const size_t remaining = lws_remaining_packet_payload(wsi);
-            if (!remaining && lws_is_final_fragment(wsi))
-            {
-                if (client->hasFragments())
-                {
-                    WEBSOCKETS_LOG_DEBUG("Fragmented data completed");
-                    client->appendMessageFragment((char *)data, len, 0);
-                    data = (void *)client->getMessage();
-                    len = client->getMessageLength();
-                }
-                
-                client->wsHandleMsgCb((char *)data, len);
-                client->resetMessage();
-            }
-            else
-            {
-                WEBSOCKETS_LOG_DEBUG("Managing fragmented data");
-                client->appendMessageFragment((char *)data, len, remaining);
-            }
+            client->wsHandleFragmentCb(client->reassembler, (char *)data, len,
+                                       lws_remaining_packet_payload(wsi), lws_is_final_fragment(wsi));
             break;
         }
         case LWS_CALLBACK_CLIENT_WRITEABLE:
@@ -436,13 +438,22 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
-            data = (void *)client->getOutputBuffer();
-            len = client->getOutputBufferLength();
-            if (len && data)
+            Buffer *frame = client->getOutputFrame();
+            if (frame)
             {
+                data = frame->buf() + LWS_PRE;
+                len = frame->dataSize() - LWS_PRE;
                 lws_write(wsi, (unsigned char *)data, len, LWS_WRITE_BINARY);
-                client->wsSendMsgCb((const char *)data, len);
-                client->resetOutputBuffer();
+                if (client->outputFrameSent())
+                {
+                    // notify only when all pending output has been written
+                    // (data is still valid, the frame is kept as spare)
+                    client->wsSendMsgCb((const char *)data, len);
+                }
+                else
+                {
+                    lws_callback_on_writable(wsi);
+                }
             }
             break;
         }
@@ -5,6 +5,7 @@
 #include <openssl/ssl.h>
 #include <iostream>
 #include <functional>
+#include <deque>
 
 #include "net/websocketsIO.h"
 
@@ -30,25 +31,33 @@ protected:
 class LibwebsocketsClient : public WebsocketsClientImpl
 {
 public:
-    LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client);
+    LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client, RecvBufferPool& recvPool);
     virtual ~LibwebsocketsClient();
     
 protected:
-    std::string recbuffer;
-    std::string sendbuffer;
-
-    void appendMessageFragment(char *data, size_t len, size_t remaining);
-    bool hasFragments();
-    const char *getMessage();
-    size_t getMessageLength();
-    void resetMessage();
-    const char *getOutputBuffer();
-    size_t getOutputBufferLength();
-    void resetOutputBuffer();
+    enum
+    {
+        kMaxFrameSize = 64 * 1024,  // outgoing commands are coalesced into frames up to this size
+        kMinFrameSize = 1024        // initial allocation for a new outgoing frame
+    };
+
+    FrameReassembler reassembler;
+
+    // Outgoing frames, each one with LWS_PRE bytes of headroom for libwebsockets. A single
+    // frame is written per writable callback, so other traffic is not stalled by big sends
+    std::deque<Buffer> sendQueue;
+    size_t sendQueueBytes = 0;          // payload bytes in sendQueue
+    std::unique_ptr<Buffer> spareFrame; // last written frame, reused by the next one
+
+    Buffer& frameForMessage(size_t len);
+    Buffer *getOutputFrame();
+    bool outputFrameSent();     // returns true if there are no more frames to send
+    void resetOutputQueue();
     
     virtual bool wsSendMessage(char *msg, size_t len);
     virtual void wsDisconnect(bool immediate);
     virtual bool wsIsConnected();
+    virtual size_t wsSendQueueSize();
     
 public:
     struct lws *wsi;
@@ -1,4 +1,5 @@
 #include "net/websocketsIO.h"
+#include "net/wsReplay.h"
 
 WebsocketsIO::WebsocketsIO(::mega::Mutex *mutex, ::mega::MegaApi *megaApi, void *ctx)
     : mApi(*megaApi, ctx, false)
@@ -12,16 +13,113 @@ WebsocketsIO::~WebsocketsIO()
     
 }
 
+RecvBufferPool::RecvBufferPool()
+    : mState(std::make_shared<State>())
+{
+}
+
+RecvBufferPool::~RecvBufferPool()
+{
+    std::lock_guard<std::mutex> lock(mState->mutex);
+    for (Buffer *buf: mState->buffers)
+    {
+        delete buf;
+    }
+    mState->buffers.clear();
+}
+
+RecvBufferPool::Handle RecvBufferPool::get(size_t size)
+{
+    Buffer *buf = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mState->mutex);
+        auto& buffers = mState->buffers;
+        if (!buffers.empty())
+        {
+            // prefer a buffer that doesn't need to grow
+            auto it = buffers.begin();
+            for (; it != buffers.end(); it++)
+            {
+                if ((*it)->bufSize() >= size)
+                    break;
+            }
+            if (it == buffers.end())
+                it = buffers.begin();
+
+            buf = *it;
+            buffers.erase(it);
+        }
+    }
+
+    if (buf)
+    {
+        buf->reserve(size);
+    }
+    else
+    {
+        buf = new Buffer(size);
+    }
+
+    std::weak_ptr<State> state = mState;
+    return Handle(buf, [state](Buffer *buf) { release(state, buf); });
+}
+
+void RecvBufferPool::release(const std::weak_ptr<State>& state, Buffer *buf)
+{
+    auto pool = state.lock();
+    if (pool && buf->bufSize() <= kMaxBufferSize)
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (pool->buffers.size() < kMaxBuffers)
+        {
+            buf->clear();
+            pool->buffers.push_back(buf);
+            return;
+        }
+    }
+    delete buf;
+}
+
+bool FrameReassembler::add(char *&data, size_t &len, size_t remaining, bool isFinal, RecvBufferPool::Handle &frame)
+{
+    if (remaining || !isFinal)
+    {
+        WEBSOCKETS_LOG_DEBUG("Managing fragmented data");
+        if (!mBuffer)
+        {
+            mBuffer = mPool.get(len + remaining);
+        }
+        else if (remaining)
+        {
+            mBuffer->reserve(len + remaining);   // on top of the data already in it
+        }
+        mBuffer->append(data, len);
+        return false;
+    }
+
+    if (hasFragments())
+    {
+        WEBSOCKETS_LOG_DEBUG("Fragmented data completed");
+        mBuffer->append(data, len);
+        frame = std::move(mBuffer);
+        data = frame->buf();
+        len = frame->dataSize();
+    }
+    mBuffer.reset();
+    return true;
+}
+
 WebsocketsClientImpl::WebsocketsClientImpl(::mega::Mutex *mutex, WebsocketsClient *client)
 {
     this->mutex = mutex;
     this->client = client;
     this->disconnecting = false;
+    this->recorder = NULL;
 }
 
 WebsocketsClientImpl::~WebsocketsClientImpl()
 {
-
+    delete recorder;
 }
 
 class ScopedLock
@@ -63,6 +161,10 @@ void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preas
     else
     {
         WEBSOCKETS_LOG_DEBUG("Connection closed by server");
+        if (recorder)
+        {
+            recorder->write(WsRecording::kClosed, preason, reason_len);
+        }
     }
 
     client->wsCloseCbPrivate(errcode, errtype, preason, reason_len);
@@ -72,9 +174,23 @@ void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
 {
     ScopedLock lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Received %d bytes", len);
+    if (recorder)
+    {
+        recorder->write(WsRecording::kReceived, data, len);
+    }
     client->wsHandleMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsHandleFragmentCb(FrameReassembler &reassembler, char *data, size_t len,
+                                              size_t remaining, bool isFinal)
+{
+    RecvBufferPool::Handle frame;   // keeps the reassembled frame alive while it's handled
+    if (reassembler.add(data, len, remaining, isFinal, frame))
+    {
+        wsHandleMsgCb(data, len);
+    }
+}
+
 void WebsocketsClientImpl::wsSendMsgCb(const char *data, size_t len)
 {
     ScopedLock lock(this->mutex);
@@ -122,8 +238,10 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
     if (!ctx)
     {
         WEBSOCKETS_LOG_WARNING("Immediate error in wsConnect");
+        return false;
     }
-    return ctx != NULL;
+    ctx->recorder = WsRecorder::create(host);
+    return true;
 }
 
 bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
@@ -144,6 +262,10 @@ bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
     
     
     WEBSOCKETS_LOG_DEBUG("Sending %d bytes", len);
+    if (ctx->recorder)
+    {
+        ctx->recorder->write(WsRecording::kSent, msg, len);
+    }
     bool result = ctx->wsSendMessage(msg, len);
     if (!result)
     {
@@ -191,6 +313,22 @@ bool WebsocketsClient::wsIsConnected()
     return ctx->wsIsConnected();
 }
 
+size_t WebsocketsClient::wsSendQueueSize()
+{
+    if (!ctx)
+    {
+        return 0;
+    }
+
+#if defined(_WIN32) && defined(_MSC_VER)
+    assert(thread_id == std::this_thread::get_id());
+#else
+    assert(thread_id == pthread_self());
+#endif
+
+    return ctx->wsSendQueueSize();
+}
+
 void WebsocketsClient::wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len)
 {
     if (!ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
@@ -3,11 +3,14 @@
 
 #include <iostream>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <mega/waiter.h>
 #include <mega/thread.h>
 #include "base/logger.h"
 #include "sdkApi.h"
+#include "buffer.h"
 
 #define WEBSOCKETS_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
 #define WEBSOCKETS_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
@@ -16,6 +19,7 @@
 
 class WebsocketsClient;
 class WebsocketsClientImpl;
+class WsRecorder;
 
 class DNScache
 {
@@ -43,6 +47,53 @@ private:
     std::map<std::string, DNSrecord> mRecords;
 };
 
+// Pool of the buffers used to reassemble fragmented frames (ie. big batches of history).
+// Without it, every fragmented frame allocates a new block and reallocates it as fragments
+// arrive. Buffers are handed out reference-counted and go back to the pool when released,
+// even if the pool itself has been destroyed in the meantime.
+class RecvBufferPool
+{
+public:
+    typedef std::shared_ptr<Buffer> Handle;
+    enum
+    {
+        kMaxBuffers = 4,                // max number of idle buffers kept
+        kMaxBufferSize = 1024 * 1024    // bigger buffers are freed instead of kept
+    };
+
+    RecvBufferPool();
+    ~RecvBufferPool();
+    // returns an empty buffer with room for, at least, \c size bytes
+    Handle get(size_t size);
+
+protected:
+    struct State
+    {
+        std::mutex mutex;
+        std::vector<Buffer*> buffers;
+    };
+    std::shared_ptr<State> mState;
+    static void release(const std::weak_ptr<State>& state, Buffer *buf);
+};
+
+// Reassembles the fragments of the received frames, in buffers of a RecvBufferPool
+class FrameReassembler
+{
+public:
+    FrameReassembler(RecvBufferPool& pool) : mPool(pool) {}
+    // Adds a fragment, as delivered by the websockets library, with the size of the rest of the
+    // frame if it's known. Returns true if the frame is complete: then \c data and \c len point to
+    // the whole frame, which is kept alive by \c frame if it has been reassembled. Frames that
+    // come in a single fragment are returned as they are, without copying them.
+    bool add(char *&data, size_t &len, size_t remaining, bool isFinal, RecvBufferPool::Handle &frame);
+    bool hasFragments() const { return mBuffer && mBuffer->dataSize(); }
+    void reset() { mBuffer.reset(); }   // back to the pool
+
+protected:
+    RecvBufferPool& mPool;
+    RecvBufferPool::Handle mBuffer;     // only while a fragmented frame is being received
+};
+
 // Generic websockets network layer
 class WebsocketsIO : public ::mega::EventTrigger
 {
@@ -51,6 +102,7 @@ public:
     virtual ~WebsocketsIO();
 
     DNScache mDnsCache;
+    RecvBufferPool mRecvBufferPool;
     
 protected:
     ::mega::Mutex *mutex;
@@ -89,6 +141,7 @@ public:
     bool wsSendMessage(char *msg, size_t len);  // returns true on success, false if error
     void wsDisconnect(bool immediate);
     bool wsIsConnected();
+    size_t wsSendQueueSize();   // bytes queued but not written to the socket yet
     void wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len);
 
     virtual void wsConnectCb() = 0;
@@ -104,18 +157,23 @@ protected:
     WebsocketsClient *client;
     ::mega::Mutex *mutex;
     bool disconnecting;
+    WsRecorder *recorder;   // not NULL if the traffic is being recorded, see WsRecording
     
 public:
     WebsocketsClientImpl(::mega::Mutex *mutex, WebsocketsClient *client);
     virtual ~WebsocketsClientImpl();
+    friend WebsocketsClient;
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
+    // passes the frame to wsHandleMsgCb() once \c reassembler has all its fragments
+    void wsHandleFragmentCb(FrameReassembler& reassembler, char *data, size_t len, size_t remaining, bool isFinal);
     void wsSendMsgCb(const char *data, size_t len);
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
     virtual bool wsIsConnected() = 0;
+    virtual size_t wsSendQueueSize() = 0;
 };
 
 #endif /* websocketsIO_h */
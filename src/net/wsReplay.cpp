@@ -0,0 +1,587 @@
+#include "net/wsReplay.h"
+#include "base/timers.hpp"
+
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+const char WsRecording::kSignature[] = "KRWSREC1";
+
+const char *WsRecording::recordDir()
+{
+    const char *dir = getenv("KRCHAT_WS_RECORD");
+    return (dir && *dir) ? dir : NULL;
+}
+
+const char *WsRecording::replayDir()
+{
+    const char *dir = getenv("KRCHAT_WS_REPLAY");
+    return (dir && *dir) ? dir : NULL;
+}
+
+string WsRecording::fileName(const string &dir, const string &host, unsigned index)
+{
+    return dir + "/" + host + "." + to_string(index) + ".wsrec";
+}
+
+bool WsRecording::load(const string &fileName, vector<Entry> &entries)
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+
+    char signature[sizeof(kSignature) - 1];
+    bool valid = fread(signature, 1, sizeof(signature), file) == sizeof(signature)
+            && memcmp(signature, kSignature, sizeof(signature)) == 0;
+    while (valid)
+    {
+        Entry entry;
+        uint32_t len;
+        if (fread(&entry.type, 1, 1, file) != 1
+                || fread(&entry.timeUs, sizeof(entry.timeUs), 1, file) != 1
+                || fread(&len, sizeof(len), 1, file) != 1)
+        {
+            break;
+        }
+        entry.data.resize(len);
+        if (len && fread(&entry.data[0], 1, len, file) != len)
+        {
+            break;
+        }
+        entries.push_back(std::move(entry));
+    }
+
+    fclose(file);
+    if (!valid)
+    {
+        WEBSOCKETS_LOG_ERROR("%s is not a websocket recording", fileName.c_str());
+    }
+    return valid;
+}
+
+WsRecorder *WsRecorder::create(const char *host)
+{
+    const char *dir = WsRecording::recordDir();
+    if (!dir)
+    {
+        return NULL;
+    }
+
+    static std::mutex mutex;
+    static map<string, unsigned> connectionCount;
+    unsigned index;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        index = connectionCount[host]++;
+    }
+
+    string fileName = WsRecording::fileName(dir, host, index);
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (!file)
+    {
+        WEBSOCKETS_LOG_ERROR("Can't create the websocket recording %s", fileName.c_str());
+        return NULL;
+    }
+    fwrite(WsRecording::kSignature, 1, sizeof(WsRecording::kSignature) - 1, file);
+    WEBSOCKETS_LOG_INFO("Recording the traffic of %s in %s", host, fileName.c_str());
+    return new WsRecorder(file);
+}
+
+WsRecorder::WsRecorder(FILE *file)
+    : mFile(file), mStart(std::chrono::steady_clock::now())
+{
+}
+
+WsRecorder::~WsRecorder()
+{
+    fclose(mFile);
+}
+
+void WsRecorder::write(char type, const char *data, size_t len)
+{
+    uint64_t timeUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - mStart).count();
+    uint32_t len32 = (uint32_t)len;
+    fwrite(&type, 1, 1, mFile);
+    fwrite(&timeUs, sizeof(timeUs), 1, mFile);
+    fwrite(&len32, sizeof(len32), 1, mFile);
+    if (len)
+    {
+        fwrite(data, 1, len, mFile);
+    }
+    if (type == WsRecording::kClosed || type == WsRecording::kApiResult)
+    {
+        fflush(mFile);
+    }
+}
+
+ReplayWebsocketsIO::ReplayWebsocketsIO(::mega::Mutex *mutex, ::mega::MegaApi *megaApi, void *ctx,
+                                       const string &dir, bool realtime)
+    : WebsocketsIO(mutex, megaApi, ctx), mDir(dir), mRealtime(realtime)
+{
+    WEBSOCKETS_LOG_WARNING("Replaying the websocket recordings of %s instead of connecting to the servers", dir.c_str());
+}
+
+ReplayWebsocketsIO::~ReplayWebsocketsIO()
+{
+}
+
+void ReplayWebsocketsIO::addevents(::mega::Waiter*, int)
+{
+}
+
+bool ReplayWebsocketsIO::wsResolveDNS(const char *hostname, std::function<void (int, vector<string>&, vector<string>&)> f)
+{
+    WEBSOCKETS_LOG_DEBUG("Resolving %s to the replay stand-in", hostname);
+    karere::marshallCall([f]()
+    {
+        vector<string> ipsv4(1, "127.0.0.1");
+        vector<string> ipsv6;
+        f(0, ipsv4, ipsv6);
+    }, appCtx);
+    return 0;
+}
+
+WebsocketsClientImpl *ReplayWebsocketsIO::wsConnect(const char */*ip*/, const char *host, int /*port*/,
+                                                    const char */*path*/, bool /*ssl*/, WebsocketsClient *client)
+{
+    unsigned &count = mConnectionCount[host];
+    vector<WsRecording::Entry> entries;
+    for (unsigned index = count + 1; index-- > 0; )
+    {
+        string fileName = WsRecording::fileName(mDir, host, index);
+        if (WsRecording::load(fileName, entries))
+        {
+            WEBSOCKETS_LOG_INFO("Replaying %s (%zu frames)", fileName.c_str(), entries.size());
+            count++;
+            return new ReplayWebsocketsClient(mutex, client, appCtx, std::move(entries), mRealtime);
+        }
+    }
+
+    WEBSOCKETS_LOG_ERROR("No websocket recording for %s in %s", host, mDir.c_str());
+    return NULL;
+}
+
+ReplayWebsocketsClient::ReplayWebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client, void *ctx,
+                                               vector<WsRecording::Entry> &&entries, bool realtime)
+    : WebsocketsClientImpl(mutex, client), appCtx(ctx), mEntries(std::move(entries)), mRealtime(realtime),
+      mStart(std::chrono::steady_clock::now()), mAlive(std::make_shared<bool>(true))
+{
+    post([this]()
+    {
+        mConnected = true;
+        mStart = std::chrono::steady_clock::now();
+        std::weak_ptr<bool> alive = mAlive;
+        wsConnectCb();
+        if (alive.lock())   // the client may have disconnected already
+        {
+            replay();
+        }
+    });
+}
+
+ReplayWebsocketsClient::~ReplayWebsocketsClient()
+{
+}
+
+void ReplayWebsocketsClient::post(std::function<void()> &&func, unsigned delayMs)
+{
+    std::weak_ptr<bool> alive = mAlive;
+    auto call = [alive, func]()
+    {
+        if (alive.lock())
+        {
+            func();
+        }
+    };
+
+    if (delayMs)
+    {
+        karere::setTimeout(std::move(call), delayMs, appCtx);
+    }
+    else
+    {
+        karere::marshallCall(std::move(call), appCtx);
+    }
+}
+
+void ReplayWebsocketsClient::replay()
+{
+    while (mConnected && !mTimerPending && mNext < mEntries.size())
+    {
+        const WsRecording::Entry &entry = mEntries[mNext];
+        if (entry.type == WsRecording::kSent)
+        {
+            if (mSentReplayed == mSentCount)
+            {
+                return; // the client hasn't sent it yet
+            }
+            mSentReplayed++;
+            mNext++;
+            continue;
+        }
+
+        if (mRealtime)
+        {
+            uint64_t elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - mStart).count();
+            if (entry.timeUs > elapsedUs + 1000)
+            {
+                mTimerPending = true;
+                post([this]()
+                {
+                    mTimerPending = false;
+                    replay();
+                }, (unsigned)((entry.timeUs - elapsedUs) / 1000));
+                return;
+            }
+        }
+
+        size_t index = mNext++;
+        if (entry.type == WsRecording::kClosed)
+        {
+            // after the frames already posted, as the server did
+            mNext = mEntries.size();
+            post([this]()
+            {
+                mConnected = false;
+                wsCloseCb(0, 0, "closed", 7);  // it deletes this object
+            });
+            return;
+        }
+
+        post([this, index]()
+        {
+            if (mConnected)
+            {
+                std::string &data = mEntries[index].data;
+                wsHandleMsgCb(data.empty() ? NULL : &data[0], data.size());
+            }
+        });
+    }
+}
+
+bool ReplayWebsocketsClient::wsSendMessage(char */*msg*/, size_t /*len*/)
+{
+    if (!mConnected)
+    {
+        WEBSOCKETS_LOG_ERROR("Trying to send a message without a valid socket (replay)");
+        return false;
+    }
+
+    mSentCount++;
+    if (!mSendCbPending)
+    {
+        // as the real socket, notify once all the pending output has been written
+        mSendCbPending = true;
+        post([this]()
+        {
+            mSendCbPending = false;
+            wsSendMsgCb("", 0);
+        });
+    }
+    replay();
+    return true;
+}
+
+void ReplayWebsocketsClient::wsDisconnect(bool immediate)
+{
+    bool wasConnected = mConnected;
+    mConnected = false;
+    if (!immediate && wasConnected)
+    {
+        disconnecting = true;
+        post([this]()
+        {
+            wsCloseCb(0, 0, "closed", 7);  // it deletes this object
+        });
+    }
+}
+
+bool ReplayWebsocketsClient::wsIsConnected()
+{
+    return mConnected;
+}
+
+size_t ReplayWebsocketsClient::wsSendQueueSize()
+{
+    return 0;
+}
+
+
+namespace
+{
+// Result of an API request, as recorded by ReplayApi
+class ReplayRequest : public ::mega::MegaRequest
+{
+public:
+    enum { kText, kLink, kEmail, kPassword, kFile, kNumStrings };
+
+    int type = 0;
+    ::mega::MegaHandle nodeHandle = ::mega::INVALID_HANDLE;
+    int paramType = 0;
+    string strings[kNumStrings];
+    bool hasString[kNumStrings] = {};
+    std::shared_ptr<::mega::MegaStringMap> stringMap;
+
+    virtual ::mega::MegaRequest *copy() { return new ReplayRequest(*this); }
+    virtual int getType() const { return type; }
+    virtual ::mega::MegaHandle getNodeHandle() const { return nodeHandle; }
+    virtual int getParamType() const { return paramType; }
+    virtual const char *getText() const { return getString(kText); }
+    virtual const char *getLink() const { return getString(kLink); }
+    virtual const char *getEmail() const { return getString(kEmail); }
+    virtual const char *getPassword() const { return getString(kPassword); }
+    virtual const char *getFile() const { return getString(kFile); }
+    virtual ::mega::MegaStringMap *getMegaStringMap() const { return stringMap.get(); }
+
+protected:
+    const char *getString(int index) const { return hasString[index] ? strings[index].c_str() : NULL; }
+};
+
+// NULL strings are saved with length UINT32_MAX
+void putString(string &out, const char *str)
+{
+    uint32_t len = str ? (uint32_t)strlen(str) : UINT32_MAX;
+    out.append((const char*)&len, sizeof(len));
+    if (str)
+    {
+        out.append(str, len);
+    }
+}
+
+template <typename T>
+void putValue(string &out, T value)
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+template <typename T>
+bool getValue(const string &in, size_t &pos, T &value)
+{
+    if (in.size() - pos < sizeof(value))
+    {
+        return false;
+    }
+    memcpy(&value, in.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+bool getString(const string &in, size_t &pos, string &str, bool &isNull)
+{
+    uint32_t len;
+    if (!getValue(in, pos, len))
+    {
+        return false;
+    }
+    isNull = (len == UINT32_MAX);
+    if (isNull)
+    {
+        str.clear();
+        return true;
+    }
+    if (in.size() - pos < len)
+    {
+        return false;
+    }
+    str.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+string serializeResult(const string &key, const ::mega::MegaRequest &req)
+{
+    string data;
+    putString(data, key.c_str());
+    putValue<int32_t>(data, req.getType());
+    putValue<uint64_t>(data, req.getNodeHandle());
+    putValue<int32_t>(data, req.getParamType());
+    putString(data, req.getText());
+    putString(data, req.getLink());
+    putString(data, req.getEmail());
+    putString(data, req.getPassword());
+    putString(data, req.getFile());
+
+    const ::mega::MegaStringMap *map = req.getMegaStringMap();
+    std::unique_ptr<::mega::MegaStringList> keys(map ? map->getKeys() : NULL);
+    putValue<uint32_t>(data, keys ? (uint32_t)keys->size() : UINT32_MAX);
+    for (int i = 0; keys && i < keys->size(); i++)
+    {
+        putString(data, keys->get(i));
+        putString(data, map->get(keys->get(i)));
+    }
+    return data;
+}
+
+bool unserializeResult(const string &data, string &key, ReplayRequest &req)
+{
+    size_t pos = 0;
+    bool isNull;
+    int32_t type, paramType;
+    uint64_t nodeHandle;
+    uint32_t mapSize;
+    if (!getString(data, pos, key, isNull)
+            || !getValue(data, pos, type)
+            || !getValue(data, pos, nodeHandle)
+            || !getValue(data, pos, paramType))
+    {
+        return false;
+    }
+    req.type = type;
+    req.nodeHandle = nodeHandle;
+    req.paramType = paramType;
+    for (int i = 0; i < ReplayRequest::kNumStrings; i++)
+    {
+        if (!getString(data, pos, req.strings[i], isNull))
+        {
+            return false;
+        }
+        req.hasString[i] = !isNull;
+    }
+
+    if (!getValue(data, pos, mapSize))
+    {
+        return false;
+    }
+    if (mapSize != UINT32_MAX)
+    {
+        req.stringMap.reset(::mega::MegaStringMap::createInstance());
+        for (uint32_t i = 0; i < mapSize; i++)
+        {
+            string mapKey, value;
+            if (!getString(data, pos, mapKey, isNull) || !getString(data, pos, value, isNull))
+            {
+                return false;
+            }
+            req.stringMap->set(mapKey.c_str(), value.c_str());
+        }
+    }
+    return true;
+}
+}
+
+string ReplayApi::requestKey(int type, ::mega::MegaHandle handle, int paramType, const char *email)
+{
+    switch (type)
+    {
+        case ::mega::MegaRequest::TYPE_CHAT_URL:
+        case ::mega::MegaRequest::TYPE_GET_USER_EMAIL:
+            return to_string(type) + ":" + to_string(handle);
+
+        case ::mega::MegaRequest::TYPE_GET_ATTR_USER:
+            return to_string(type) + ":" + (email ? email : "") + ":" + to_string(paramType);
+
+        case ::mega::MegaRequest::TYPE_GET_USER_DATA:
+            return to_string(type) + ":" + (email ? email : "");
+
+        case ::mega::MegaRequest::TYPE_CHAT_PRESENCE_URL:
+            return to_string(type);
+
+        default:
+            return string();
+    }
+}
+
+void ReplayApi::record(MyMegaApi &api)
+{
+    std::shared_ptr<WsRecorder> recorder(WsRecorder::create("api"));
+    if (!recorder)
+    {
+        return;
+    }
+
+    api.resultHook = [recorder](const ::mega::MegaRequest &req)
+    {
+        string key = requestKey(req.getType(), req.getNodeHandle(), req.getParamType(), req.getEmail());
+        if (!key.empty())
+        {
+            string data = serializeResult(key, req);
+            recorder->write(WsRecording::kApiResult, data.data(), data.size());
+        }
+    };
+}
+
+void ReplayApi::replay(MyMegaApi &api, const string &dir)
+{
+    typedef map<string, std::shared_ptr<ReplayRequest>> Results;
+    auto results = std::make_shared<Results>();
+
+    vector<WsRecording::Entry> entries;
+    for (unsigned index = 0; ; index++)
+    {
+        if (!WsRecording::load(WsRecording::fileName(dir, "api", index), entries))
+        {
+            break;
+        }
+    }
+    for (const WsRecording::Entry &entry: entries)
+    {
+        if (entry.type != WsRecording::kApiResult)
+        {
+            continue;
+        }
+        string key;
+        auto req = std::make_shared<ReplayRequest>();
+        if (!unserializeResult(entry.data, key, *req))
+        {
+            WEBSOCKETS_LOG_ERROR("Corrupt API result in the recordings of %s", dir.c_str());
+            break;
+        }
+        (*results)[key] = req;  // the newest result wins
+    }
+    WEBSOCKETS_LOG_INFO("Replaying %zu API results from %s", results->size(), dir.c_str());
+
+    auto find = [results](int type, ::mega::MegaHandle handle, int paramType, const char *email) -> ::mega::MegaRequest*
+    {
+        string key = requestKey(type, handle, paramType, email);
+        auto it = results->find(key);
+        if (it == results->end())
+        {
+            WEBSOCKETS_LOG_WARNING("No recorded result for the API request %s", key.c_str());
+            return NULL;
+        }
+        return it->second->copy();
+    };
+
+    typedef ::mega::MegaApi Api;
+    typedef ::mega::MegaRequest Req;
+    typedef ::mega::MegaRequestListener Listener;
+    api.setStub<void(Api::*)(::mega::MegaHandle, Listener*)>(&Api::getUrlChat,
+        [find](::mega::MegaHandle chatid, Listener*)
+        {
+            return find(Req::TYPE_CHAT_URL, chatid, 0, NULL);
+        });
+    api.setStub<void(Api::*)(Listener*)>(&Api::getChatPresenceURL,
+        [find](Listener*)
+        {
+            return find(Req::TYPE_CHAT_PRESENCE_URL, ::mega::INVALID_HANDLE, 0, NULL);
+        });
+    api.setStub<void(Api::*)(const char*, int, const char*, Listener*)>(&Api::getChatUserAttribute,
+        [find](const char *user, int attrType, const char */*ph*/, Listener*)
+        {
+            return find(Req::TYPE_GET_ATTR_USER, ::mega::INVALID_HANDLE, attrType, user);
+        });
+    api.setStub<void(Api::*)(::mega::MegaHandle, Listener*)>(&Api::getUserEmail,
+        [find](::mega::MegaHandle user, Listener*)
+        {
+            return find(Req::TYPE_GET_USER_EMAIL, user, 0, NULL);
+        });
+    api.setStub<void(Api::*)(const char*, Listener*)>(&Api::getUserData,
+        [find](const char *user, Listener*)
+        {
+            return find(Req::TYPE_GET_USER_DATA, ::mega::INVALID_HANDLE, 0, user);
+        });
+    // the events of a replayed session aren't reported
+    api.setStub<void(Api::*)(int, const char*, Listener*)>(&Api::sendEvent,
+        [](int, const char*, Listener*) -> Req*
+        {
+            auto req = new ReplayRequest;
+            req->type = Req::TYPE_SEND_EVENT;
+            return req;
+        });
+}
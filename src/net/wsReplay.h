@@ -0,0 +1,152 @@
+#ifndef wsReplay_h
+#define wsReplay_h
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "net/websocketsIO.h"
+
+// Traffic of a websocket connection, recorded to be replayed later by ReplayWebsocketsIO.
+// Recording is enabled by setting the KRCHAT_WS_RECORD environment variable to an existing
+// directory. Each connection is saved to <dir>/<host>.<n>.wsrec, where n counts the
+// connections to that host since the app started.
+//
+// File format: the signature "KRWSREC1", followed by the entries. Each entry is its type
+// (1 byte), its time since the connection was requested (uint64_t, microseconds), the
+// length of its data (uint32_t) and the data. Integers are in host byte order.
+//
+// The results of the API requests needed to replay offline are recorded too, see ReplayApi.
+class WsRecording
+{
+public:
+    enum: char
+    {
+        kSent = 'S',        // frame sent by the client
+        kReceived = 'R',    // frame received from the server
+        kClosed = 'X',      // connection closed by the server
+        kApiResult = 'A'    // result of an API request, see ReplayApi
+    };
+
+    struct Entry
+    {
+        char type;
+        uint64_t timeUs;
+        std::string data;
+    };
+
+    static const char kSignature[];
+
+    // returns NULL if recording is disabled
+    static const char *recordDir();
+    // returns NULL unless the recordings are being replayed (KRCHAT_WS_REPLAY)
+    static const char *replayDir();
+    static std::string fileName(const std::string &dir, const std::string &host, unsigned index);
+    // returns false if the file can't be read or it's not a recording. A truncated last
+    // entry (i.e. the app was killed while recording) is ignored
+    static bool load(const std::string &fileName, std::vector<Entry> &entries);
+};
+
+// Writes the traffic of one connection to its file, see WsRecording
+class WsRecorder
+{
+public:
+    // returns NULL if recording is disabled or the file can't be created
+    static WsRecorder *create(const char *host);
+    ~WsRecorder();
+    void write(char type, const char *data, size_t len);
+
+protected:
+    FILE *mFile;
+    std::chrono::steady_clock::time_point mStart;
+    WsRecorder(FILE *file);
+};
+
+// Stand-in for the chatd and presenced servers, that replays the traffic recorded with
+// KRCHAT_WS_RECORD, without any network access. MegaChatApiImpl uses it instead of the
+// real network layer when KRCHAT_WS_REPLAY is set to the directory of the recordings.
+//
+// A connection to a host replays the next recording of that host, or the last one when
+// all of them have been used, so reconnections keep working. The frames received from the
+// server are delivered in order, but each one only after the client has sent as many frames
+// as it had sent before that one was recorded, so responses don't overtake their requests.
+// Frames are delivered as fast as possible, or with their recorded timing if \c realtime.
+// If the server closed the connection in the recording, it's closed by the replay too.
+// Otherwise, it's left idle at the end.
+// The replay is most faithful when the app starts from a copy of the cache taken before
+// recording, since the commands sent by the client depend on the cached history.
+class ReplayWebsocketsIO : public WebsocketsIO
+{
+public:
+    ReplayWebsocketsIO(::mega::Mutex *mutex, ::mega::MegaApi *megaApi, void *ctx,
+                       const std::string &dir, bool realtime);
+    virtual ~ReplayWebsocketsIO();
+
+    virtual void addevents(::mega::Waiter*, int);
+
+protected:
+    std::string mDir;
+    bool mRealtime;
+    std::map<std::string, unsigned> mConnectionCount;   // connections made to each host
+
+    virtual bool wsResolveDNS(const char *hostname, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> f);
+    virtual WebsocketsClientImpl *wsConnect(const char *ip, const char *host,
+                                           int port, const char *path, bool ssl,
+                                           WebsocketsClient *client);
+};
+
+class ReplayWebsocketsClient : public WebsocketsClientImpl
+{
+public:
+    ReplayWebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client, void *ctx,
+                           std::vector<WsRecording::Entry> &&entries, bool realtime);
+    virtual ~ReplayWebsocketsClient();
+
+protected:
+    void *appCtx;
+    std::vector<WsRecording::Entry> mEntries;
+    bool mRealtime;
+    size_t mNext = 0;           // next entry to replay
+    size_t mSentCount = 0;      // frames sent by the client
+    size_t mSentReplayed = 0;   // recorded sent frames already matched with mSentCount
+    bool mConnected = false;
+    bool mSendCbPending = false;
+    bool mTimerPending = false;
+    std::chrono::steady_clock::time_point mStart;
+
+    // marshalled calls and timers check it, since the client may be deleted before they run
+    std::shared_ptr<bool> mAlive;
+
+    // delivers the entries that are due, and schedules itself for the next one if realtime
+    void replay();
+    void post(std::function<void()> &&func, unsigned delayMs = 0);
+
+    virtual bool wsSendMessage(char *msg, size_t len);
+    virtual void wsDisconnect(bool immediate);
+    virtual bool wsIsConnected();
+    virtual size_t wsSendQueueSize();
+};
+
+// Results of the API requests that a session needs to run without the API servers: the
+// chatd and presenced URLs, and the user attributes, emails and public keys fetched by
+// UserAttrCache. They are recorded along with the websocket traffic, to <dir>/api.<n>.wsrec.
+// At replay, MyMegaApi takes them from the recording instead of sending the requests, so
+// the keys of the peers are the recorded ones. Requests not recorded fail with API_ENOENT.
+class ReplayApi
+{
+public:
+    // records the results of the requests made through \c api, if recording is enabled
+    static void record(MyMegaApi &api);
+    // stubs the requests of \c api with the results recorded in \c dir
+    static void replay(MyMegaApi &api, const std::string &dir);
+
+    // identifies a request by its type and the arguments its result depends on. It's
+    // empty for the requests that aren't recorded
+    static std::string requestKey(int type, ::mega::MegaHandle handle, int paramType, const char *email);
+};
+
+#endif /* wsReplay_h */
@@ -188,25 +188,25 @@ bool Client::requestLastGreen(Id userid)
         return false;
     }
 
-    // Reset user last green or insert an entry in the map if not exists
-    mPeersLastGreen[userid.val] = 0;
+    // Reset user last green or insert an entry in the table if not exists
+    mPeers[userid.val].lastGreen = 0;
 
     return sendCommand(Command(OP_LASTGREEN) + userid);
 }
 
 time_t Client::getLastGreen(Id userid)
 {
-    std::map<uint64_t, time_t>::iterator it = mPeersLastGreen.find(userid.val);
-    if (it != mPeersLastGreen.end())
+    auto it = mPeers.find(userid.val);
+    if (it != mPeers.end())
     {
-        return it->second;
+        return it->second.lastGreen;
     }
     return 0;
 }
 
 bool Client::updateLastGreen(Id userid, time_t lastGreen)
 {
-    time_t &auxLastGreen = mPeersLastGreen[userid.val];
+    time_t &auxLastGreen = mPeers[userid.val].lastGreen;
     if (lastGreen >= auxLastGreen)
     {
         auxLastGreen = lastGreen;
@@ -449,8 +449,8 @@ bool Client::sendKeepalive(time_t now)
 
 bool Client::isExContact(uint64_t userid)
 {
-    auto it = mContacts.find(userid);
-    if (it == mContacts.end() || (it != mContacts.end() && it->second != ::mega::MegaUser::VISIBILITY_HIDDEN))
+    auto it = mPeers.find(userid);
+    if (it == mPeers.end() || it->second.visibility != ::mega::MegaUser::VISIBILITY_HIDDEN)
     {
         return false;
     }
@@ -458,6 +458,14 @@ bool Client::isExContact(uint64_t userid)
     return true;
 }
 
+void Client::clearContacts()
+{
+    for (auto& peer: mPeers)
+    {
+        peer.second.visibility = ::mega::MegaUser::VISIBILITY_UNKNOWN;
+    }
+}
+
 void Client::onChatsUpdate(::mega::MegaApi *api, ::mega::MegaTextChatList *roomsUpdated)
 {
     const char *buf = api->getSequenceNumber();
@@ -587,21 +595,21 @@ void Client::onUsersUpdate(::mega::MegaApi *api, ::mega::MegaUserList *usersUpda
                 continue;
             }
 
-            auto it = mContacts.find(userid);
-            if (it == mContacts.end())  // new contact
+            int &visibility = mPeers[userid].visibility;
+            if (visibility == ::mega::MegaUser::VISIBILITY_UNKNOWN)  // new contact
             {
                 assert(newVisibility == ::mega::MegaUser::VISIBILITY_VISIBLE);
-                mContacts[userid] = newVisibility;
+                visibility = newVisibility;
                 addPeer(userid);
             }
             else    // existing (ex)contact
             {
-                int oldVisibility = it->second;
-                it->second = newVisibility;
+                int oldVisibility = visibility;
+                visibility = newVisibility;
 
                 if (newVisibility == ::mega::MegaUser::VISIBILITY_INACTIVE) // user cancelled the account
                 {
-                    mContacts.erase(it);
+                    visibility = ::mega::MegaUser::VISIBILITY_UNKNOWN;
                     removePeer(userid, true);
                 }
                 else if (oldVisibility == ::mega::MegaUser::VISIBILITY_VISIBLE && newVisibility == ::mega::MegaUser::VISIBILITY_HIDDEN)
@@ -641,8 +649,8 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
 
         // reset current status (for the full reload once logged in already)
         mLastScsn = karere::Id::inval();
+        // (contacts are reset by the marshalled call, the peer table is not thread-safe)
         mCurrentPeers.clear();
-        mContacts.clear();
         mChatMembers.clear();
 
         auto wptr = weakHandle();
@@ -655,12 +663,11 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
 
             assert(!mLastScsn.isValid());
             assert(mCurrentPeers.empty());
-            assert(mContacts.empty());
             assert(mChatMembers.empty());
 
             mLastScsn = scsn;
             mCurrentPeers.clear();
-            mContacts.clear();
+            clearContacts();
             mChatMembers.clear();
 
             // initialize the list of contacts
@@ -670,7 +677,7 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
                 uint64_t userid = user->getHandle();
                 int visibility = user->getVisibility();
 
-                mContacts[userid] = visibility; // add ex-contacts to identify them
+                mPeers[userid].visibility = visibility; // add ex-contacts to identify them
                 if (visibility == ::mega::MegaUser::VISIBILITY_VISIBLE)
                 {
                     mCurrentPeers.insert(userid);
@@ -1074,6 +1081,8 @@ bool Client::sendPrefs()
 
 void Client::configChanged()
 {
+    // our own presence may be in the batch too, keep the order of the notifications
+    flushPresenceChanges();
     CALL_LISTENER(onPresenceConfigChanged, mConfig, mPrefsAckWait);
     CALL_LISTENER(onPresenceChange, mKarereClient->myHandle(), mConfig.mPresence, mPrefsAckWait);
 }
@@ -1214,7 +1223,7 @@ void Client::handleMessage(const StaticBuffer& buf)
 
                 // convert the received minutes into a UNIX timestamp
                 time_t lastGreenTs = time(NULL) - (lastGreen * 60);
-                mPeersLastGreen[userid] = lastGreenTs;
+                mPeers[userid].lastGreen = lastGreenTs;
 
                 CALL_LISTENER(onPresenceLastGreenUpdated, userid);
                 break;
@@ -1378,8 +1387,12 @@ void Client::removePeer(karere::Id peer, bool force)
 
     mCurrentPeers.erase(it);
 
-    // Remove peer from mPeersLastGreen map if exists
-    mPeersLastGreen.erase(peer.val);
+    // Forget its last green, if known
+    auto peerIt = mPeers.find(peer.val);
+    if (peerIt != mPeers.end())
+    {
+        peerIt->second.lastGreen = 0;
+    }
 
 
     size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t);
@@ -1394,17 +1407,57 @@ void Client::removePeer(karere::Id peer, bool force)
 
 void Client::updatePeerPresence(karere::Id peer, karere::Presence pres)
 {
-    mPeersPresence[peer] = pres;
-    CALL_LISTENER(onPresenceChange, peer, pres);
+    PeerInfo& info = mPeers[peer.val];
+    info.presence = pres;
+    if (info.presenceChanged)
+    {
+        return; // already in the batch, it will be notified with its latest presence
+    }
+    info.presenceChanged = true;
+    mChangedPresences.push_back(peer.val);
+    if (mChangedPresences.size() > 1)
+    {
+        return; // the flush is already scheduled
+    }
+
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+        {
+            return;
+        }
+        flushPresenceChanges();
+    }, mKarereClient->appCtx);
+}
+
+void Client::flushPresenceChanges()
+{
+    if (mChangedPresences.empty())
+    {
+        return;
+    }
+
+    PresenceChanges changes;
+    changes.reserve(mChangedPresences.size());
+    for (uint64_t userid: mChangedPresences)
+    {
+        PeerInfo& info = mPeers[userid];
+        info.presenceChanged = false;
+        changes.emplace_back(userid, info.presence);
+    }
+    mChangedPresences.clear();
+    PRESENCED_LOG_DEBUG("Notifying the presence of %zu peers", changes.size());
+    CALL_LISTENER(onPresenceChangeBatch, changes);
 }
 
 karere::Presence Client::peerPresence(karere::Id peer) const
 {
-    auto it = mPeersPresence.find(peer);
-    if (it == mPeersPresence.end())
+    auto it = mPeers.find(peer.val);
+    if (it == mPeers.end())
     {
         return karere::Presence::kInvalid;
     }
-    return it->second;
+    return it->second.presence;
 }
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <buffer.h>
 #include <base/promise.h>
 #include <base/timers.hpp>
@@ -321,6 +323,9 @@ struct IdRefMap: public std::map<karere::Id, int>
 
 class Listener;
 
+/** Presence changes of several users, in the order they were received */
+typedef std::vector<std::pair<karere::Id, karere::Presence>> PresenceChanges;
+
 class Client: public karere::DeleteTrackable, public WebsocketsClient,
         public ::mega::MegaGlobalListener
 {
@@ -397,20 +402,31 @@ protected:
      * (currently, it includes contacts and any user in our groupchats, except ex-contacts) */
     IdRefMap mCurrentPeers;
 
-    /** Map of userids (key) and presence (value) of any user wich we're allowed to receive it's presence */
-    std::map<uint64_t, karere::Presence> mPeersPresence;
+    /** What we know about a user. Each field has a default that means "unknown" */
+    struct PeerInfo
+    {
+        /** Presence, if we're allowed to receive it */
+        karere::Presence presence;
+
+        /** Last green, if it's a contact or any user in our groupchats, except ex-contacts */
+        time_t lastGreen = 0;
+
+        /** Visibility, if it's a contact or an ex-contact (updated only from API) */
+        int visibility = ::mega::MegaUser::VISIBILITY_UNKNOWN;
+
+        /** True if the presence has changed and it's in mChangedPresences */
+        bool presenceChanged = false;
+    };
+
+    /** Table of users (key) we know anything about (value) */
+    std::unordered_map<uint64_t, PeerInfo> mPeers;
 
-    /** Map of userids (key) and last green (value) of any contact or any user in our groupchats, except ex-contacts */
-    std::map<uint64_t, time_t> mPeersLastGreen;
+    /** Users whose presence has changed since the last onPresenceChangeBatch() */
+    std::vector<uint64_t> mChangedPresences;
 
     /** Map of chatids (key) and the list of peers (value) in every chat (updated only from API) */
     std::map<uint64_t, karere::SetOfIds> mChatMembers;
 
-    /** Map of userid of contacts (key) and their visibility (value) (updated only from API)
-     * @note: ex-contacts are included.
-     */
-    std::map<uint64_t, int> mContacts;
-
     /** Sequence-number for the list of peers and contacts above (initialized upon completion of catch-up phase) */
     karere::Id mLastScsn = karere::Id::inval();
 
@@ -443,6 +459,10 @@ protected:
     void removePeer(karere::Id peer, bool force=false);
     void pushPeers();
     bool isExContact(uint64_t userid);
+    void clearContacts();
+
+    /** Notifies the presence changes received so far, in one batch */
+    void flushPresenceChanges();
 
     // mega::MegaGlobalListener interface, called by worker thread
     virtual void onChatsUpdate(::mega::MegaApi*, ::mega::MegaTextChatList* rooms);
@@ -483,6 +503,8 @@ public:
     void signalActivity();
 
     // peers management
+    /** @brief Updates the presence of a peer. Changes are notified to the listener in a
+     * batch, once the current event loop iteration is done */
     void updatePeerPresence(karere::Id peer, karere::Presence pres);
     karere::Presence peerPresence(karere::Id peer) const;
 
@@ -497,6 +519,15 @@ class Listener
 public:
     virtual void onConnStateChange(Client::ConnState state) = 0;
     virtual void onPresenceChange(karere::Id userid, karere::Presence pres, bool inProgress = false) = 0;
+    /** @brief Called with the presence changes of peers received during the last event
+     * loop iteration. A peer appears once, with its latest presence */
+    virtual void onPresenceChangeBatch(const PresenceChanges& changes)
+    {
+        for (auto& change: changes)
+        {
+            onPresenceChange(change.first, change.second);
+        }
+    }
     virtual void onPresenceConfigChanged(const Config& Config, bool pending) = 0;
     virtual void onPresenceLastGreenUpdated(karere::Id userid) = 0;
     virtual void onDestroy(){}
@@ -13,6 +13,9 @@ namespace rtcModule
  * its internal image buffer. In that case the application needs to also associate a pointer
  * to that bitmap object (rather than to the raw memory) so that it can use and free
  * the high-level bitmap object properly.
+ * Alternatively, a renderer can take the frames in I420 format, as they are decoded, by
+ * returning true from \c wantsI420(). Then \c frameI420() is called instead, and the
+ * frame is neither converted nor copied.
  */
 class IVideoRenderer
 {
@@ -37,6 +40,23 @@ public:
      */
     virtual void frameComplete(void* userData) = 0;
 
+    /**
+     * @brief wantsI420 Called _by a worker thread_ for each frame, to choose between
+     * \c frameI420() and the \c getImageBuffer() / \c frameComplete() pair
+     */
+    virtual bool wantsI420() { return false; }
+
+    /**
+     * @brief frameI420 Called _by a worker thread_ with a frame in I420 format, if
+     * \c wantsI420() returned true. The U and V planes have half the width and height
+     * of the frame, rounded up. The planes are valid only during this call.
+     * @param stride* The distance in bytes between the start of two rows of the plane
+     */
+    virtual void frameI420(unsigned short /*width*/, unsigned short /*height*/,
+                           const unsigned char* /*dataY*/, int /*strideY*/,
+                           const unsigned char* /*dataU*/, int /*strideU*/,
+                           const unsigned char* /*dataV*/, int /*strideV*/) {}
+
     /**
      * @brief onVideoAttach Called when a video stream is attached to the player component
      * Frames can be expected after that point
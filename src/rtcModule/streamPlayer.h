@@ -166,6 +166,14 @@ public:
             }
             unsigned short width = (unsigned short)buffer->width();
             unsigned short height = (unsigned short)buffer->height();
+            if (mRenderer->wantsI420())
+            {
+                mRenderer->frameI420(width, height,
+                                     buffer->DataY(), buffer->StrideY(),
+                                     buffer->DataU(), buffer->StrideU(),
+                                     buffer->DataV(), buffer->StrideV());
+                return;
+            }
             void* frameBuf = mRenderer->getImageBuffer(width, height, userData);
             if (!frameBuf) //image is frozen or app is minimized/covered
                 return;
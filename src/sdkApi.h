@@ -11,6 +11,9 @@
 #include "base/trackDelete.h"
 #include <logger.h>
 #include <string.h>
+#include <functional>
+#include <map>
+#include <memory>
 #include "karereCommon.h" //for KR_LOG_DEBUG
 
 typedef std::shared_ptr<::mega::MegaRequest> ReqResult;
@@ -36,13 +39,18 @@ public:
 
 };
 
+// Called with the result of every successful request made through MyMegaApi::call()
+typedef std::function<void(const ::mega::MegaRequest&)> ApiResultHook;
+
 class MyListener: public ::mega::MegaRequestListener
 {
     void *appCtx;
     karere::DeleteTrackable::Handle wptr;
+    ApiResultHook mResultHook;
     
 public:
-    MyListener(void *ctx, karere::DeleteTrackable::Handle wptr) : appCtx(ctx), wptr(wptr) { }
+    MyListener(void *ctx, karere::DeleteTrackable::Handle wptr, const ApiResultHook& hook = nullptr)
+        : appCtx(ctx), wptr(wptr), mResultHook(hook) { }
     ApiPromise mPromise;
     virtual void onRequestFinish(::mega::MegaApi* /*api*/, ::mega::MegaRequest *request, ::mega::MegaError* e)
     {
@@ -68,6 +76,10 @@ public:
             }
             else
             {
+                if (mResultHook)
+                {
+                    mResultHook(*req);
+                }
                 mPromise.resolve(req);
             }
             delete this;
@@ -139,6 +151,16 @@ class MyMegaLogger: public ::mega::MegaLogger
     }
 };
 
+// Replacement of a MegaApi request, to run without the API servers (see ReplayApi).
+// It's called with the arguments of the request (the listener being NULL) and returns
+// its result, or NULL to fail the request with API_ENOENT
+template <typename MSig> struct MegaApiStub;
+template <typename... Params>
+struct MegaApiStub<void(::mega::MegaApi::*)(Params...)>
+{
+    typedef std::function<::mega::MegaRequest*(Params...)> Func;
+};
+
 class MyMegaApi: public karere::DeleteTrackable
 {
 public:
@@ -146,6 +168,7 @@ public:
     std::unique_ptr<MyMegaLogger> mLogger;
     void *appCtx;
     bool logging;
+    ApiResultHook resultHook;
     
     MyMegaApi(::mega::MegaApi& aSdk, void *ctx, bool addlogger = true)
     :sdk(aSdk), mLogger(new MyMegaLogger), appCtx(ctx), logging(addlogger)
@@ -158,17 +181,35 @@ public:
     template <typename... Args, typename MSig=void(::mega::MegaApi::*)(Args..., ::mega::MegaRequestListener*)>
     ApiPromise call(MSig method, Args... args)
     {
-        auto listener = new MyListener(appCtx, getDelTracker());
+        auto stub = findStub(method);
+        if (stub)
+        {
+            return callStub<ReqResult>(ReqResult((*stub)(args..., nullptr)));
+        }
+        auto listener = new MyListener(appCtx, getDelTracker(), resultHook);
         (sdk.*method)(args..., listener);
         return listener->mPromise;
     }
     template <typename... Args, typename MSig=void(::mega::MegaApi::*)(Args..., ::mega::MegaRequestListener*)>
     promise::Promise<void> callIgnoreResult(MSig method, Args... args)
     {
+        auto stub = findStub(method);
+        if (stub)
+        {
+            return callStub<void>(ReqResult((*stub)(args..., nullptr)));
+        }
         auto listener = new MyListenerNoResult(appCtx, getDelTracker());
         (sdk.*method)(args..., listener);
         return listener->mPromise;
     }
+    // Requests made with \c method won't reach the SDK, \c func provides their results.
+    // Overloaded methods need the signature as template argument, i.e.
+    // setStub<void(MegaApi::*)(const char*, MegaRequestListener*)>(&MegaApi::getUserData, func)
+    template <typename MSig>
+    void setStub(MSig method, typename MegaApiStub<MSig>::Func func)
+    {
+        mStubs[stubKey(method)] = std::make_shared<typename MegaApiStub<MSig>::Func>(func);
+    }
 
     ~MyMegaApi()
     {
@@ -179,6 +220,53 @@ public:
         mLogger.reset();
         KR_LOG_DEBUG("Deleted SDK logger");
     }
+
+protected:
+    std::map<std::string, std::shared_ptr<void>> mStubs;   // by the bytes of the method pointer
+
+    template <typename MSig>
+    static std::string stubKey(MSig method)
+    {
+        return std::string(reinterpret_cast<const char*>(&method), sizeof(method));
+    }
+    template <typename MSig>
+    typename MegaApiStub<MSig>::Func* findStub(MSig method)
+    {
+        if (mStubs.empty())
+            return nullptr;
+        auto it = mStubs.find(stubKey(method));
+        return (it != mStubs.end())
+            ? static_cast<typename MegaApiStub<MSig>::Func*>(it->second.get())
+            : nullptr;
+    }
+    // resolves as the SDK would, asynchronously
+    template <typename T>
+    promise::Promise<T> callStub(ReqResult req)
+    {
+        promise::Promise<T> pms;
+        auto wptr = getDelTracker();
+        karere::marshallCall([wptr, pms, req]() mutable
+        {
+            if (wptr.deleted())
+                return;
+
+            if (!req)
+            {
+                int errCode = ::mega::MegaError::API_ENOENT;
+                std::string errmsg = "Mega API error ";
+                errmsg.append(std::to_string(errCode)).append(" (")
+                      .append(::mega::MegaError::getErrorString(errCode))+=')';
+                pms.reject(errmsg, errCode, ERRTYPE_MEGASDK);
+            }
+            else
+            {
+                resolveStub(pms, req);
+            }
+        }, appCtx);
+        return pms;
+    }
+    static void resolveStub(ApiPromise& pms, const ReqResult& req) { pms.resolve(req); }
+    static void resolveStub(promise::Promise<void>& pms, const ReqResult&) { pms.resolve(); }
 };
 
 #endif // SDKAPI_H
@@ -90,43 +90,26 @@ static inline void aesCBCDecrypt(const StaticBuffer& cipherText,
 
 //CTR mode is used for message content
 
-//can't use binary buffers here, libsodium doesn't support them for CTR mode
-static inline std::string aesCTREncrypt(const std::string& text,
-                        const StaticBuffer& derivedkey, const StaticBuffer& iv)
-{
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
-    std::string cipher;
-    encryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(text, true,
-        new CryptoPP::StreamTransformationFilter(encryptor,
-            new CryptoPP::StringSink(cipher)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return cipher;
-}
-
-static inline std::string aesCTRDecrypt(const std::string& ciphertext,
-                            const StaticBuffer& derivedkey, const StaticBuffer& iv)
+/** AES-128-CTR over the consecutive parts of a message, written straight to their
+ * destination buffers. CTR needs no padding, and encryption and decryption are the
+ * same operation. The output of each call may be the same buffer as its input.
+ */
+class AesCTRStream
 {
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption decryptor;
-    std::string text;
-    assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
-    decryptor.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher. CTR does not.
-    CryptoPP::StringSource s(ciphertext, true,
-        new CryptoPP::StreamTransformationFilter(decryptor,
-            new CryptoPP::StringSink(text)
-        ) // StreamTransformationFilter
-    ); // StringSource
-    return text;
-}
+protected:
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption mCipher;
+public:
+    AesCTRStream(const StaticBuffer& derivedkey, const StaticBuffer& iv)
+    {
+        assert(iv.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        assert(derivedkey.dataSize() == CryptoPP::AES::BLOCKSIZE);
+        mCipher.SetKeyWithIV(derivedkey.ubuf(), derivedkey.dataSize(), iv.ubuf());
+    }
+    void process(const void* input, size_t len, void* output)
+    {
+        if (len)
+            mCipher.ProcessData(static_cast<byte*>(output), static_cast<const byte*>(input), len);
+    }
+};
 
 }
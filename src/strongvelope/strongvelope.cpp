@@ -30,11 +30,14 @@
 #include <mega.h>
 #include <megaapi.h>
 #include <db.h>
+#include <dbQueries.h>
 #ifndef _MSC_VER
 #include <codecvt>   // deprecated
 #endif
 #include <locale>
 #include <karereCommon.h>
+#include <base/workerPool.h>
+#include <base/traceSpans.h>
 
 namespace strongvelope
 {
@@ -74,33 +77,34 @@ uint32_t getKeyIdLength(uint32_t protocolVersion)
     return (protocolVersion == 1) ? 8 : 4;
 }
 
-EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
-: key(aKey), backRefId(msg.backRefId)
+EncryptedMessage::EncryptedMessage(const Message& aMsg, const StaticBuffer& aKey)
+: msg(aMsg), key(aKey), backRefId(aMsg.backRefId), derivedNonce(32) //deriveNonceSecret uses dataSize() to confirm there is buffer space
 {
     assert(!key.empty());
     randombytes_buf(nonce.buf(), nonce.bufSize());
-    Key<32> derivedNonce(32); //deriveNonceSecret uses dataSize() to confirm there is buffer space
     deriveNonceSecret(nonce, derivedNonce);
     derivedNonce.setDataSize(SVCRYPTO_NONCE_SIZE+4); //truncate to nonce size+32bit counter
 
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0; //zero the 32-bit counter
     assert(derivedNonce.dataSize() == AES::BLOCKSIZE);
+}
 
-    size_t brsize = msg.backRefs.size()*8;
-    size_t binsize = 10+brsize;
-    Buffer buf(binsize+msg.dataSize());
-    buf.append<uint64_t>(msg.backRefId)
-       .append<uint16_t>(brsize);
+void EncryptedMessage::addPayloadRecord(TlvWriter& tlv) const
+{
+    // plaintext: <backRefId><backrefs size><backrefs><text>, encrypted part by part
+    uint16_t brsize = msg.backRefs.size()*8;
+    char header[10];
+    memcpy(header, &backRefId, 8);
+    memcpy(header+8, &brsize, 2);
+
+    char* dest = tlv.addRecordPtr(TLV_TYPE_PAYLOAD, sizeof(header)+brsize+msg.dataSize());
+    AesCTRStream aes(key, derivedNonce);
+    aes.process(header, sizeof(header), dest);
     if (brsize)
     {
-        buf.append((const char*)(&msg.backRefs[0]), brsize);
+        aes.process(&msg.backRefs[0], brsize, dest+sizeof(header));
     }
-    if (!msg.empty())
-    {
-        buf.append(msg);
-    }
-    ciphertext = aesCTREncrypt(std::string(buf.buf(), buf.dataSize()),
-        key, derivedNonce);
+    aes.process(msg.buf(), msg.dataSize(), dest+sizeof(header)+brsize);
 }
 
 /**
@@ -118,6 +122,13 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;   // for the log below
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
+    decryptPayload(key, outMsg, outMsg.backRefId, outMsg.backRefs);
+    outMsg.setEncrypted(Message::kNotEncrypted);
+}
+
+void ParsedMessage::decryptPayload(const StaticBuffer& key, Buffer& text, BackRefId& backRefId,
+                                   std::vector<BackRefId>& backRefs) const
+{
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
     deriveNonceSecret(nonce, derivedNonce);
@@ -125,10 +136,45 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
-    outMsg.setEncrypted(Message::kNotEncrypted);
+    AesCTRStream aes(key, derivedNonce);
+
+    if (protocolVersion < 3)
+    {
+        Buffer cleartext(payload.dataSize(), payload.dataSize());
+        aes.process(payload.buf(), payload.dataSize(), cleartext.buf());
+        parsePayloadWithUtfBackrefs(cleartext, text, backRefId);
+        return;
+    }
+
+    // plaintext: <backRefId><backrefs size><backrefs><text>, decrypted part by part
+    if (payload.dataSize() < 10)
+        throw std::runtime_error("parsePayload: payload is less than backrefs minimum size");
+
+    char header[10];
+    aes.process(payload.buf(), sizeof(header), header);
+    backRefId = Buffer::alignSafeRead<uint64_t>(header);
+    uint16_t refsSize = Buffer::alignSafeRead<uint16_t>(header+8);
+    size_t binsize = sizeof(header)+refsSize;
+    if (payload.dataSize() < binsize)
+        throw std::runtime_error("parsePayload: Payload size "+std::to_string(payload.dataSize())+" is less than size of backrefs "+std::to_string(binsize));
+
+    assert(backRefs.empty());
+    if (refsSize)
+    {
+        backRefs.resize((refsSize+sizeof(BackRefId)-1)/sizeof(BackRefId), 0);
+        aes.process(payload.buf()+sizeof(header), refsSize, &backRefs[0]);
+    }
+
+    size_t textSize = payload.dataSize()-binsize;
+    if (text.bufSize() < textSize)
+    {
+        text.free(); // don't copy the current content to the new block
+    }
+    text.clear();
+    if (textSize)
+    {
+        aes.process(payload.buf()+binsize, textSize, text.writePtr(0, textSize));
+    }
 }
 
 /**
@@ -168,6 +214,10 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
     assert(signature.dataSize() == crypto_sign_BYTES);
 // To save space, myPrivEd25519 holds only the 32-bit seed of the priv key,
 // without the pubkey part, so we add it here
+    if (myPubEd25519.empty())   // derived when first needed, most chats never send
+    {
+        getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
+    }
     Buffer key(myPrivEd25519.dataSize()+myPubEd25519.dataSize());
     key.append(myPrivEd25519).append(myPubEd25519);
 
@@ -236,17 +286,18 @@ void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const st
     memcpy(output.buf(), step2.buf(), AES::BLOCKSIZE);
 }
 
-ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+ParsedMessage::ParsedMessage(const Message& src, ProtocolHandler& protoHandler)
+: mRaw(src.buf(), src.dataSize()), mProtoHandler(protoHandler)
 {
-    if(binaryMessage.empty())
+    if(src.empty())
     {
         throw std::runtime_error("parsedMessage::parse: Empty binary message");
     }
+    const StaticBuffer& binaryMessage = mRaw;
     protocolVersion = binaryMessage.read<uint8_t>(0);
     if (protocolVersion > SVCRYPTO_PROTOCOL_VERSION)
         throw std::runtime_error("Message protocol version "+std::to_string(protocolVersion)+" is newer than the latest supported by this client. Message dump: "+binaryMessage.toString());
-    sender = binaryMessage.userid;
+    sender = src.userid;
 
     size_t offset;
     bool isLegacy = (protocolVersion < 2);
@@ -278,9 +329,9 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
         {
             case TLV_TYPE_SIGNATURE:
             {
-                signature.assign(record.buf(), record.dataLen);
+                signature = StaticBuffer(record.buf(), record.dataLen);
                 auto nextOffset = record.dataOffset+record.dataLen;
-                signedContent.assign(binaryMessage.buf()+nextOffset, binaryMessage.dataSize()-nextOffset);
+                signedContent = StaticBuffer(binaryMessage.buf()+nextOffset, binaryMessage.dataSize()-nextOffset);
                 break;
             }
             case TLV_TYPE_NONCE:
@@ -351,7 +402,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             }
             case TLV_TYPE_KEYBLOB:
             {
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = StaticBuffer(record.buf(), record.dataLen);
                 break;
             }
             //legacy key stuff
@@ -373,7 +424,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             case TLV_TYPE_KEYS:
             {
 //KEYS, not KEY, because these can be pairs of current+previous key, concatenated and encrypted together
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = StaticBuffer(record.buf(), record.dataLen);
                 break;
             }
             case TLV_TYPE_KEY_IDS:
@@ -408,7 +459,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
 //                if (type != SVCRYPTO_MSGTYPE_KEYED && type != SVCRYPTO_MSGTYPE_FOLLOWUP)
 //                    throw std::runtime_error("Payload record found in a non-regular message");
-                payload.assign(binaryMessage.buf()+record.dataOffset, record.dataLen);
+                payload = StaticBuffer(binaryMessage.buf()+record.dataOffset, record.dataLen);
                 break;
             }
             case TLV_TYPE_OPENMODE:
@@ -417,7 +468,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
                 break;
             }
             default:
-                throw std::runtime_error("Unknown TLV record type "+std::to_string(record.type)+" in message "+binaryMessage.id().toString());
+                throw std::runtime_error("Unknown TLV record type "+std::to_string(record.type)+" in message "+src.id().toString());
         }
     }
     if (!recordNames.empty())
@@ -425,11 +476,11 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
         recordNames.resize(recordNames.size()-2);
         Id chatid = protoHandler.chatid;
         STRONGVELOPE_LOG_DEBUG("msg %s: read %s",
-            binaryMessage.id().toString().c_str(), recordNames.c_str());
+            src.id().toString().c_str(), recordNames.c_str());
     }
 }
 
-void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Message &msg)
+void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Buffer &text, BackRefId &backRefId) const
 {
     Id chatid = mProtoHandler.chatid;
     if (data.empty())
@@ -461,7 +512,7 @@ void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Messag
 //                  printf("char > 255: 0x%x, at offset %zu\n", u16[i], i);
         *(data8.buf()+i) = u16[i] & 0xff;
     }
-    msg.backRefId = data8.read<uint64_t>(0);
+    backRefId = data8.read<uint64_t>(0);
     uint16_t refsSize = data8.read<uint16_t>(8);
 
     //convert back to utf8 the binary part, only to determine its utf8 len
@@ -474,43 +525,10 @@ void ParsedMessage::parsePayloadWithUtfBackrefs(const StaticBuffer &data, Messag
 #endif
 
     if (data.dataSize() > binlen8)
-        msg.assign(data.buf()+binlen8, data.dataSize()-binlen8);
-    else
-    {
-        msg.clear();
-    }
-}
-
-void ParsedMessage::parsePayload(const StaticBuffer &data, Message &msg)
-{
-    if (this->protocolVersion < 3)
-    {
-        parsePayloadWithUtfBackrefs(data, msg);
-        return;
-    }
-
-    if(data.dataSize() < 10)
-        throw std::runtime_error("parsePayload: payload is less than backrefs minimum size");
-
-    msg.backRefId = data.read<uint64_t>(0);
-    uint16_t refsSize = data.read<uint16_t>(8);
-    assert(msg.backRefs.empty());
-    msg.backRefs.reserve(refsSize/8);
-    size_t binsize = 10+refsSize;
-    if (data.dataSize() < binsize)
-        throw std::runtime_error("parsePayload: Payload size "+std::to_string(data.dataSize())+" is less than size of backrefs "+std::to_string(binsize)+"\nMessage:"+data.toString());
-    char* end = data.buf() + binsize;
-    for (char* prefid = data.buf() + 10; prefid < end; prefid += sizeof(uint64_t))
-    {
-        msg.backRefs.push_back(Buffer::alignSafeRead<uint64_t>(prefid));
-    }
-    if (data.dataSize() > binsize)
-    {
-        msg.assign(data.buf()+binsize, data.dataSize()-binsize);
-    }
+        text.assign(data.buf()+binlen8, data.dataSize()-binlen8);
     else
     {
-        msg.clear();
+        text.clear();
     }
 }
 
@@ -541,15 +559,16 @@ void ProtocolHandler::setPublicHandle(const uint64_t ph)
 ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519, const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,karere::UserAttrCache& userAttrCache,
-    SqliteDb &db, Id aChatId, bool isPublic, std::shared_ptr<std::string> unifiedKey,
-    int isUnifiedKeyEncrypted, karere::Id ph, void *ctx)
+    PairwiseKeyCache& pairwiseKeys, karere::WorkerPool* decryptWorkers, SqliteDb &db, Id aChatId, bool isPublic, std::shared_ptr<std::string> unifiedKey,
+    int isUnifiedKeyEncrypted, karere::Id ph, void *ctx, bool hasSendingItems)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
-  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa), mUserAttrCache(userAttrCache),
-  mDb(db), chatid(aChatId), mPh(ph)
+  myPrivEd25519(privEd25519), myPubEd25519((size_t)0), myPrivRsaKey(privRsa), mUserAttrCache(userAttrCache),
+  mPairwiseKeys(pairwiseKeys), mDb(db), mDecryptWorkers(decryptWorkers), chatid(aChatId), mPh(ph)
 {
-    getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
-    loadUnconfirmedKeysFromDb();
+    if (hasSendingItems)
+    {
+        loadUnconfirmedKeysFromDb();
+    }
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
     {
@@ -629,32 +648,60 @@ unsigned int ProtocolHandler::getCacheVersion() const
     return mCacheVersion;
 }
 
-void ProtocolHandler::loadKeysFromDb()
+ProtocolHandler::KeyStats ProtocolHandler::sKeyStats;
+
+std::shared_ptr<SendKey> ProtocolHandler::loadKeyFromDb(UserKeyId ukid)
+{
+    KR_TRACE_SPAN("keys.loadFromDb");
+    SqliteStmt stmt(mDb, karere::sql::kSendKeyLoad);
+    stmt << chatid << ukid.user << ukid.keyid;
+    if (!stmt.step())
+    {
+        return nullptr;
+    }
+    auto key = std::make_shared<SendKey>();
+    stmt.blobCol(0, *key);
+    sKeyStats.dbLoads++;
+    STRONGVELOPE_LOG_DEBUG("Loaded key %" PRIu64 " of user %s from database", ukid.keyid, ukid.user.toString().c_str());
+    return key;
+}
+
+void ProtocolHandler::touchKey(UserKeyId ukid, KeyEntry& entry)
 {
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
-    while(stmt.step())
+    assert(entry.key);
+    if (entry.inLru)
     {
-        auto key = std::make_shared<SendKey>();
-        stmt.blobCol(2, *key);
-        Id userid(stmt.uint64Col(0));
-        uint64_t keyid = stmt.uint64Col(1);
+        mKeyLru.splice(mKeyLru.begin(), mKeyLru, entry.lruPos);
+    }
+    else
+    {
+        entry.lruPos = mKeyLru.insert(mKeyLru.begin(), ukid);
+        entry.inLru = true;
+    }
+}
 
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(userid, keyid),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+void ProtocolHandler::trimKeys()
+{
+    auto it = mKeyLru.end();
+    while (mKeyLru.size() > kMaxResidentKeys && it != mKeyLru.begin())
+    {
+        --it;
+        auto kit = mKeys.find(*it);
+        assert(kit != mKeys.end());
+        if (kit->second.pms)
+        {
+            continue;   // someone is being notified of this key right now
+        }
+        it = mKeyLru.erase(it);
+        mKeys.erase(kit);
+        sKeyStats.evictions++;
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
 }
 
 void ProtocolHandler::loadUnconfirmedKeysFromDb()
 {
-    SqliteStmt stmt(mDb, "select recipients, key_cmd, keyid from sending "
-                    "where chatid=? and key_cmd not null order by rowid asc");
+    KR_TRACE_SPAN("keys.loadUnconfirmedFromDb");
+    SqliteStmt stmt(mDb, karere::sql::kSendingUnconfirmedKeys);
     stmt << chatid;
     while(stmt.step())
     {
@@ -728,12 +775,11 @@ void ProtocolHandler::msgEncryptWithKey(const Message& src, MsgCommand& dest,
 {
     // create 'nonce' and encrypt plaintext --> `ciphertext`
     EncryptedMessage encryptedMessage(src, key);
-    assert(!encryptedMessage.ciphertext.empty());
 
     // prepare TLV for content: <nonce><ciphertext>
-    TlvWriter tlv(encryptedMessage.ciphertext.size()+128); //only signed content goes here
+    TlvWriter tlv(src.dataSize()+src.backRefs.size()*8+128); //only signed content goes here
     tlv.addRecord(TLV_TYPE_NONCE, encryptedMessage.nonce);
-    tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(encryptedMessage.ciphertext, false));
+    encryptedMessage.addPayloadRecord(tlv);
 
     // prepare TLV for signature: <signature>
     Signature signature;
@@ -754,35 +800,147 @@ void ProtocolHandler::msgEncryptWithKey(const Message& src, MsgCommand& dest,
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padString)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
+    return mPairwiseKeys.getKey(userid, padString);
+}
+
+struct PairwiseKeyCache::PeerEntry
+{
+    karere::Id peer;
+    EcKey pubKey;   // the public key the cached keys were derived from
+    std::map<std::string, std::shared_ptr<SendKey>> keys; // by padding string
+    karere::UserAttrCache::Handle pubKeyCbHandle;
+    PeerEntry(karere::Id aPeer, const StaticBuffer& aPubKey)
+    : peer(aPeer), pubKey(aPubKey){}
+    void setPubKey(const StaticBuffer* newPubKey)
+    {
+        if (newPubKey && newPubKey->dataSize() == pubKey.dataSize()
+            && memcmp(newPubKey->buf(), pubKey.buf(), pubKey.dataSize()) == 0)
+        {
+            return;
+        }
+        KARERE_LOG_DEBUG(krLogChannel_strongvelope, "Cu25519 public key of user %s changed, dropping %zu cached pairwise keys",
+            peer.toString().c_str(), keys.size());
+        keys.clear();
+        if (newPubKey && newPubKey->dataSize() == EcKey::bufSize())
+        {
+            pubKey.assign(newPubKey->buf(), newPubKey->dataSize());
+        }
+        else
+        {
+            // no usable key, getKey() will fetch it again
+            pubKey.setDataSize(0);
+        }
+    }
+};
+
+PairwiseKeyCache::PairwiseKeyCache(karere::UserAttrCache& userAttrCache, const StaticBuffer& myPrivCu25519)
+: mUserAttrCache(userAttrCache), mMyPrivCu25519(myPrivCu25519)
+{}
+
+PairwiseKeyCache::~PairwiseKeyCache()
+{
+    for (auto& peer: mPeers)
     {
-        return it->second;
+        mUserAttrCache.removeCb(peer.second->pubKeyCbHandle);
+    }
+}
+
+promise::Promise<std::shared_ptr<SendKey>>
+PairwiseKeyCache::getKey(karere::Id peer, const std::string& padString)
+{
+    auto it = mPeers.find(peer);
+    if (it != mPeers.end())
+    {
+        auto& keys = it->second->keys;
+        auto keyIt = keys.find(padString);
+        if (keyIt != keys.end())
+        {
+            return keyIt->second;
+        }
     }
     auto wptr = weakHandle();
-    return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
-    .then([wptr, this, userid, padString](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
+    return mUserAttrCache.getAttr(peer, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
+    .then([wptr, this, peer, padString](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
     {
         wptr.throwIfDeleted();
+        if (pubKey->empty())
+            return ::promise::Error("Empty Cu25519 chat key for user "+peer.toString());
+        if (pubKey->dataSize() != EcKey::bufSize())
+            return ::promise::Error("Invalid Cu25519 chat key for user "+peer.toString());
         // We may have had 2 almost parallel requests, and the second may
         // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
-
-        if (pubKey->empty())
-            return ::promise::Error("Empty Cu25519 chat key for user "+userid.toString());
-        Key<crypto_scalarmult_BYTES> sharedSecret;
-        sharedSecret.setDataSize(crypto_scalarmult_BYTES);
-        auto ignore = crypto_scalarmult(sharedSecret.ubuf(), myPrivCu25519.ubuf(), pubKey->ubuf());
-        (void)ignore;
-        auto result = std::make_shared<SendKey>();
-        deriveSharedKey(sharedSecret, *result, padString);
-        mSymmKeyCache.emplace(userid, result);
-        return result;
+        return deriveKey(peerEntry(peer, *pubKey), padString);
     });
 }
 
+PairwiseKeyCache::PeerEntry&
+PairwiseKeyCache::peerEntry(karere::Id peer, const StaticBuffer& pubKey)
+{
+    auto it = mPeers.find(peer);
+    if (it != mPeers.end())
+    {
+        // the entry follows the public key, so it only differs if a request
+        // was resolved in the middle of an update
+        it->second->setPubKey(&pubKey);
+        return *it->second;
+    }
+    auto& entry = mPeers[peer];
+    entry.reset(new PeerEntry(peer, pubKey));
+    // follow changes of the public key (the callback is also called now, with the current key)
+    entry->pubKeyCbHandle = mUserAttrCache.getAttr(peer,
+        ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, entry.get(), &onPubKeyChange);
+    return *entry;
+}
+
+std::shared_ptr<SendKey>
+PairwiseKeyCache::deriveKey(PeerEntry& entry, const std::string& padString)
+{
+    auto it = entry.keys.find(padString);
+    if (it != entry.keys.end())
+    {
+        return it->second;
+    }
+    Key<crypto_scalarmult_BYTES> sharedSecret;
+    sharedSecret.setDataSize(crypto_scalarmult_BYTES);
+    auto ignore = crypto_scalarmult(sharedSecret.ubuf(), mMyPrivCu25519.ubuf(), entry.pubKey.ubuf());
+    (void)ignore;
+    auto result = std::make_shared<SendKey>();
+    deriveSharedKey(sharedSecret, *result, padString);
+    entry.keys.emplace(padString, result);
+    return result;
+}
+
+void PairwiseKeyCache::onPubKeyChange(Buffer* pubKey, void* userp)
+{
+    static_cast<PeerEntry*>(userp)->setPubKey(pubKey);
+}
+
+size_t PairwiseKeyCache::warmUp(const karere::SetOfIds& peers, const std::string& padString)
+{
+    size_t count = 0;
+    for (auto peer: peers)
+    {
+        auto it = mUserAttrCache.findCached(karere::UserAttrPair(peer, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY));
+        if (it == mUserAttrCache.end())
+        {
+            continue;
+        }
+        auto& item = *it->second;
+        if (item.pending != karere::kCacheFetchNotPending || !item.data
+            || item.data->dataSize() != EcKey::bufSize())
+        {
+            continue;
+        }
+        PeerEntry& entry = peerEntry(peer, *item.data);
+        if (!entry.keys.count(padString))
+        {
+            deriveKey(entry, padString);
+            count++;
+        }
+    }
+    return count;
+}
+
 promise::Promise<std::string>
 ProtocolHandler::encryptUnifiedKeyToUser(karere::Id user)
 {
@@ -1154,6 +1312,17 @@ void ProtocolHandler::fetchUserKeys(karere::Id userid)
 //is decrypted.
 Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
 {
+    return decryptMessage(message, false);
+}
+
+Promise<Message*> ProtocolHandler::msgDecryptInBackground(Message* message)
+{
+    return decryptMessage(message, mDecryptWorkers != nullptr);
+}
+
+Promise<Message*> ProtocolHandler::decryptMessage(Message* message, bool inBackground)
+{
+    KR_TRACE_SPAN("msgDecrypt");
     unsigned int cacheVersion = mCacheVersion;
     try
     {
@@ -1227,7 +1396,7 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
         // Verify signature and decrypt
         auto wptr = weakHandle();
         return promise::when(symPms, edPms)
-        .then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid, cacheVersion]() ->promise::Promise<Message*>
+        .then([this, wptr, message, parsedMsg, ctx, isLegacy, keyid, cacheVersion, inBackground]() ->promise::Promise<Message*>
         {
             if (wptr.deleted())
             {
@@ -1239,6 +1408,11 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
                 return ::promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
             }
 
+            if (inBackground)
+            {
+                return verifyAndDecryptInBackground(message, parsedMsg, ctx->sendKey, ctx->edKey, isLegacy);
+            }
+
             if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
             {
                 return ::promise::Error("Signature invalid for message "+
@@ -1263,6 +1437,116 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+struct ProtocolHandler::DecryptJob
+{
+    // read by the worker
+    std::shared_ptr<ParsedMessage> parsedMsg;
+    std::shared_ptr<SendKey> sendKey;
+    EcKey edKey;
+    // written by the worker. The decrypted content is moved to the message afterwards
+    bool signatureOk = false;
+    Buffer text;
+    BackRefId backRefId = 0;
+    std::vector<BackRefId> backRefs;
+    std::string error;
+    // only used by the GUI thread. The worker hands its reference to the job over to the
+    // GUI thread, so the job (and the ParsedMessage, the tracker and the promise, which are
+    // not thread-safe) is always released there
+    ProtocolHandler* handler;
+    karere::DeleteTrackable::Handle handlerTracker;
+    Message* message;
+    bool isLegacy;
+    unsigned int cacheVersion;
+    Promise<Message*> pms;
+
+    DecryptJob(ProtocolHandler& aHandler, Message* aMessage, bool aIsLegacy)
+    : handler(&aHandler), handlerTracker(aHandler.getDelTracker()), message(aMessage),
+      isLegacy(aIsLegacy), cacheVersion(aHandler.mCacheVersion)
+    {}
+};
+
+Promise<Message*> ProtocolHandler::verifyAndDecryptInBackground(Message* message,
+    const std::shared_ptr<ParsedMessage>& parsedMsg, const std::shared_ptr<SendKey>& sendKey,
+    const EcKey& edKey, bool isLegacy)
+{
+    auto job = std::make_shared<DecryptJob>(*this, message, isLegacy);
+    job->parsedMsg = parsedMsg;
+    job->sendKey = sendKey;
+    job->edKey.assign(edKey.buf(), edKey.dataSize());
+    Promise<Message*> result = job->pms;
+
+    void* ctx = appCtx;
+    mDecryptWorkers->post([job, ctx]() mutable
+    {
+        KR_TRACE_SPAN("msgDecrypt.worker");
+        job->signatureOk = job->parsedMsg->verifySignature(job->edKey, *job->sendKey);
+        if (job->signatureOk && !job->parsedMsg->payload.empty())
+        {
+            try
+            {
+                job->parsedMsg->decryptPayload(*job->sendKey, job->text, job->backRefId, job->backRefs);
+            }
+            catch (std::exception& e)
+            {
+                job->error = e.what();
+            }
+        }
+        // moved, not copied: if the worker kept a reference, it could be the last one
+        karere::marshallCall(std::bind(&ProtocolHandler::onDecryptedInBackground, std::move(job)), ctx);
+    });
+    return result;
+}
+
+// Same checks and results as the last step of decryptMessage(), but with
+// the signature verification and the decryption already done
+void ProtocolHandler::onDecryptedInBackground(std::shared_ptr<DecryptJob>& jobRef)
+{
+    // released here, in the GUI thread, whatever the result
+    std::shared_ptr<DecryptJob> owner(std::move(jobRef));
+    DecryptJob& job = *owner;
+    Promise<Message*>& pms = job.pms;
+    if (job.handlerTracker.deleted())
+    {
+        pms.reject(::promise::Error("msgDecrypt: strongvelop deleted, ignore message", EINVAL, SVCRYPTO_EEXPIRED));
+        return;
+    }
+    if (job.cacheVersion != job.handler->mCacheVersion)
+    {
+        pms.reject(::promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG));
+        return;
+    }
+    Message* message = job.message;
+    if (!job.signatureOk)
+    {
+        pms.reject(::promise::Error("Signature invalid for message "+
+                                     message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE));
+        return;
+    }
+
+    if (job.parsedMsg->payload.empty())
+    {
+        message->clear();
+    }
+    else
+    {
+        if (!job.error.empty())
+        {
+            pms.reject(::promise::Error(job.error, ::promise::kErrException));
+            return;
+        }
+        message->swap(job.text);
+        message->backRefId = job.backRefId;
+        assert(message->backRefs.empty());
+        message->backRefs.swap(job.backRefs);
+        message->setEncrypted(Message::kNotEncrypted);
+    }
+    if (job.isLegacy)
+    {
+        message->setEncrypted(Message::kNotEncrypted);
+    }
+    pms.resolve(message);
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
@@ -1354,8 +1638,14 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.keyid, ukid.user.toString().c_str());
 
     auto& entry = mKeys[ukid];
+    if (!entry.key)
+    {
+        // it may be known already, but not loaded
+        entry.key = loadKeyFromDb(ukid);
+    }
     if (entry.key)  // if KeyEntry already had a decrypted key assigned to it...
     {
+        touchKey(ukid, entry);
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
             throw std::runtime_error("addDecryptedKey: Key with id "+std::to_string(ukid.keyid)+" from user '"+ukid.user.toString()+"' already known but different");
 
@@ -1364,6 +1654,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     else    // new key was confirmed or received key wast not decrypted yet...
     {
         entry.key = key;
+        touchKey(ukid, entry);
         try
         {
             mDb.query("insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
@@ -1382,6 +1673,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
         entry.pms->resolve(entry.key);
         entry.pms.reset();
     }
+    trimKeys();
 }
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
@@ -1389,6 +1681,17 @@ ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
     auto kit = mKeys.find(ukid);
     if (kit == mKeys.end())
     {
+        auto key = loadKeyFromDb(ukid);
+        if (key)
+        {
+            auto& entry = mKeys[ukid];
+            entry.key = key;
+            touchKey(ukid, entry);
+            trimKeys();
+            return key;
+        }
+
+        sKeyStats.notFound++;
         if (legacy)
         {
             auto& key = mKeys[ukid];
@@ -1405,6 +1708,8 @@ ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
     auto& entry = kit->second;
     if (entry.key)  // key is available
     {
+        sKeyStats.hits++;
+        touchKey(ukid, entry);
         return entry.key;
     }
     else if (entry.pms) // key is being decrypted
@@ -1589,7 +1894,7 @@ ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser, b
             tlv.addRecord(TLV_TYPE_INVITOR, mOwnHandle.val);
             tlv.addRecord(TLV_TYPE_NONCE, enc.nonce);
             tlv.addRecord(TLV_TYPE_KEYBLOB, StaticBuffer(keyCmd.buf()+17, keyCmd.dataSize()-17));
-            tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(enc.ciphertext, false));
+            enc.addPayloadRecord(tlv);
             if (!createNewKey)
             {
                 tlv.addRecord(TLV_TYPE_OPENMODE, true);
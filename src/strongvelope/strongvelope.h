@@ -8,7 +8,9 @@
 #ifndef STRONGVELOPE_H_
 #define STRONGVELOPE_H_
 #include <vector>
+#include <list>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <assert.h>
 #include <iostream>
@@ -44,6 +46,7 @@
 namespace karere
 {
     class UserAttrCache;
+    class WorkerPool;
 }
 class SqliteDb;
 
@@ -164,16 +167,23 @@ typedef Key<16> UnifiedKey;
 typedef Key<64> Signature;
 
 class ProtocolHandler;
-/** Class to parse an encrypted message and store its attributes and content */
+class TlvWriter;
+/** Class to parse an encrypted message and store its attributes and content.
+ * The variable-size fields are views into a single copy of the encrypted message,
+ * owned by this object, since the source message may be deleted or overwritten with
+ * the decrypted content while this object is still in use */
 struct ParsedMessage: public karere::DeleteTrackable
 {
+protected:
+    Buffer mRaw;
+public:
     ProtocolHandler& mProtoHandler;
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
-    Buffer signature;
+    StaticBuffer payload{nullptr, 0};
+    StaticBuffer signedContent{nullptr, 0};
+    StaticBuffer signature{nullptr, 0};
     unsigned char type;
 
     /** True when the message is posted in open mode. It allows to decrypt the `ct` of management
@@ -183,16 +193,21 @@ struct ParsedMessage: public karere::DeleteTrackable
     //legacy key stuff
     uint64_t keyId;
     uint64_t prevKeyId;
-    Buffer encryptedKey; //may contain also the prev key, concatenated
+    StaticBuffer encryptedKey{nullptr, 0}; //may contain also the prev key, concatenated
 
     std::unique_ptr<chatd::Message::ManagementInfo> managementInfo;
     std::unique_ptr<chatd::Message::CallEndedInfo> callEndedInfo;
 
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
+    ParsedMessage(const ParsedMessage&) = delete;
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
-    void parsePayload(const StaticBuffer& data, chatd::Message& msg);
-    void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
+    void parsePayloadWithUtfBackrefs(const StaticBuffer& data, Buffer& text, chatd::BackRefId& backRefId) const;
     void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    /** Decrypts the payload straight into its destination: the text of the message and its
+     * backrefs. Only reads the parsed data, so it can be called from any thread, as long as
+     * the outputs are not shared */
+    void decryptPayload(const StaticBuffer& key, Buffer& text, chatd::BackRefId& backRefId,
+                        std::vector<chatd::BackRefId>& backRefs) const;
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg, bool msgCanBeDeleted);
 };
 
@@ -229,15 +244,18 @@ enum
     kUndecryptable = 2
 };
 
-/** @brief Encrypts and holds an encrypted message and its attributes - key and
- *  nonce */
+/** @brief Encrypts a message and holds its attributes - key and nonce. The ciphertext
+ * is written straight into the TLV container of the message by addPayloadRecord() */
 struct EncryptedMessage
 {
-    std::string ciphertext; //crypto++ does not support binary buffers in AES CTR mode, which is used for encrypting messages
+    const chatd::Message& msg;
     SendKey key;
     chatd::BackRefId backRefId;
     Key<SVCRYPTO_NONCE_SIZE> nonce;
-    EncryptedMessage(const chatd::Message& msg, const StaticBuffer& aKey);
+    Key<32> derivedNonce;
+    EncryptedMessage(const chatd::Message& aMsg, const StaticBuffer& aKey);
+    /** Encrypts the message into a new TLV_TYPE_PAYLOAD record of \c tlv */
+    void addPayloadRecord(TlvWriter& tlv) const;
 };
 
 /**
@@ -256,12 +274,69 @@ struct UserKeyId
         else
             return keyid < other.keyid;
     }
+    bool operator==(UserKeyId other) const
+    {
+        return user == other.user && keyid == other.keyid;
+    }
+    // user handles are random, but keyids are counters
+    struct Hash
+    {
+        size_t operator()(UserKeyId ukid) const
+        {
+            return (size_t)(ukid.user.val ^ (ukid.keyid * 0x9E3779B97F4A7C15ull));
+        }
+    };
 };
 
-class TlvWriter;
 extern const std::string SVCRYPTO_PAIRWISE_KEY;
 void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
 
+/**
+ * @brief Cache of the symmetric keys derived with each peer (pubCu255 * privCu255),
+ * shared by all the chats of the client.
+ *
+ * Pairwise keys don't depend on the chat, so once the key of a member is derived,
+ * encrypting a new key to that member in any chat only costs an AES operation. Keys
+ * are cached per peer and padding string (chat and RTC keys use different paddings).
+ * For every peer with cached keys, the cache follows the peer's Cu25519 public key
+ * in the UserAttrCache, and drops the keys as soon as the public key changes.
+ *
+ * It must be destroyed before the UserAttrCache.
+ */
+class PairwiseKeyCache: public karere::DeleteTrackable
+{
+protected:
+    struct PeerEntry;
+    karere::UserAttrCache& mUserAttrCache;
+    // owned by the client, which may load it after creating the cache
+    StaticBuffer mMyPrivCu25519;
+    std::map<karere::Id, std::unique_ptr<PeerEntry>> mPeers;
+    PeerEntry& peerEntry(karere::Id peer, const StaticBuffer& pubKey);
+    std::shared_ptr<SendKey> deriveKey(PeerEntry& entry, const std::string& padString);
+    static void onPubKeyChange(Buffer* pubKey, void* userp);
+
+public:
+    PairwiseKeyCache(karere::UserAttrCache& userAttrCache, const StaticBuffer& myPrivCu25519);
+    ~PairwiseKeyCache();
+
+    /**
+     * @brief Returns the key derived with \c peer, fetching its public key if needed.
+     * The promise is already resolved when the key is cached, or when the public key
+     * of the peer is in the UserAttrCache.
+     */
+    promise::Promise<std::shared_ptr<SendKey>>
+    getKey(karere::Id peer, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
+
+    /**
+     * @brief Derives in advance the keys of the given peers, so the first key
+     * rotation after login doesn't have to. Only peers whose public key is already
+     * in the UserAttrCache (in memory or in its db) are considered, nothing is fetched
+     * from the API.
+     * @return The number of keys derived
+     */
+    size_t warmUp(const karere::SetOfIds& peers, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
+};
+
 /**
  * @brief The ProtocolHandler class implements ICrypto.
  * @see chatd::ICrypto for more details.
@@ -281,19 +356,28 @@ protected:
     {
         std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
+        std::list<UserKeyId>::iterator lruPos;  // valid if inLru
+        bool inLru = false;
         KeyEntry(){}
         KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
 
+    /** Max number of decrypted keys kept in memory per chat. The rest are loaded
+     * from the db when needed */
+    enum { kMaxResidentKeys = 64 };
+
     // own keys
     karere::Id mOwnHandle;
     EcKey myPrivCu25519;
     EcKey myPrivEd25519;
-    EcKey myPubEd25519;
+    EcKey myPubEd25519;     // derived from myPrivEd25519 when first signing
     RsaKey myPrivRsaKey;
 
     karere::UserAttrCache& mUserAttrCache;
+    PairwiseKeyCache& mPairwiseKeys;
     SqliteDb& mDb;
+    // verifies and decrypts history messages, if not NULL
+    karere::WorkerPool* mDecryptWorkers;
 
     // current key, keyid and userlist
     std::shared_ptr<SendKey> mCurrentKey;
@@ -320,10 +404,11 @@ protected:
     bool mForceRsa = false; // for testing of legacy-mode
 
     // received and confirmed keys (doesn't include unconfirmed keys)
-    std::map<UserKeyId, KeyEntry> mKeys;
-
-    // cache of symmetric keys (pubCu255 * privCu255)
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    // node-based, since entries are referenced while resolving their promises.
+    // Only the keys used recently are kept, the db has all of them
+    std::unordered_map<UserKeyId, KeyEntry, UserKeyId::Hash> mKeys;
+    // decrypted keys in mKeys, most recently used first
+    std::list<UserKeyId> mKeyLru;
 
     // current list of participants (mapped to the `chatd::Client::mUsers`)
     karere::SetOfIds* mParticipants = nullptr;
@@ -334,6 +419,15 @@ protected:
     promise::Promise<std::shared_ptr<UnifiedKey>> mUnifiedKeyDecrypted;
 
 public:
+    /** @brief Counters of the send keys used in this session, by all chats */
+    struct KeyStats
+    {
+        size_t hits = 0;        // found in memory
+        size_t dbLoads = 0;     // not in memory, loaded from the db
+        size_t notFound = 0;    // neither in memory nor in the db
+        size_t evictions = 0;   // removed from memory to keep kMaxResidentKeys
+    };
+
     karere::Id chatid;
     karere::Id mPh = karere::Id::inval();     // it's only valid during preview mode (required to fetch user-attributes)
     karere::Id ownHandle() const { return mOwnHandle; }
@@ -342,16 +436,25 @@ public:
     ProtocolHandler(karere::Id ownHandle, const StaticBuffer& privCu25519,
         const StaticBuffer& privEd25519,
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
-        SqliteDb& db, karere::Id aChatId, bool isPublic, std::shared_ptr<std::string> unifiedKey,
-        int isUnifiedKeyEncrypted, karere::Id ph, void *ctx);
+        PairwiseKeyCache& pairwiseKeys, karere::WorkerPool* decryptWorkers, SqliteDb& db, karere::Id aChatId, bool isPublic, std::shared_ptr<std::string> unifiedKey,
+        int isUnifiedKeyEncrypted, karere::Id ph, void *ctx, bool hasSendingItems = true);
 
     promise::Promise<std::shared_ptr<SendKey>> //must be public to access from ParsedMessage
         decryptKey(std::shared_ptr<Buffer>& key, karere::Id sender, karere::Id receiver);
 
     unsigned int getCacheVersion() const;
+    static const KeyStats& keyStats() { return sKeyStats; }
+    static void resetKeyStats() { sKeyStats = KeyStats(); }
 
 protected:
-    void loadKeysFromDb();
+    static KeyStats sKeyStats;
+
+    /** @brief Returns the key from the db, or NULL if it's not there */
+    std::shared_ptr<SendKey> loadKeyFromDb(UserKeyId ukid);
+    /** @brief Marks a decrypted key as the most recently used one */
+    void touchKey(UserKeyId ukid, KeyEntry& entry);
+    /** @brief Removes the least recently used keys beyond kMaxResidentKeys */
+    void trimKeys();
 
     /**
      * @brief Load unconfirmed keys stored in cache
@@ -389,6 +492,8 @@ protected:
      *
      * Note: The Curve25519 key cache must already contain the public key of
      *       the recipient.
+     *
+     * The key is taken from the client-wide PairwiseKeyCache.
      */
     promise::Promise<std::shared_ptr<SendKey>>
     computeSymmetricKey(karere::Id userid, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
@@ -409,6 +514,16 @@ protected:
     chatd::Message* legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
         chatd::Message* msg, const SendKey& key);
 
+    promise::Promise<chatd::Message*> decryptMessage(chatd::Message* message, bool inBackground);
+
+    /** Verifies and decrypts a message in \c mDecryptWorkers, and parses the
+     * decrypted payload in the GUI thread */
+    struct DecryptJob;
+    promise::Promise<chatd::Message*> verifyAndDecryptInBackground(chatd::Message* message,
+        const std::shared_ptr<ParsedMessage>& parsedMsg, const std::shared_ptr<SendKey>& sendKey,
+        const EcKey& edKey, bool isLegacy);
+    static void onDecryptedInBackground(std::shared_ptr<DecryptJob>& job);
+
     void fetchUserKeys(karere::Id userid);
 
 // legacy RSA encryption methods
@@ -429,6 +544,7 @@ public:
     promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
     msgEncrypt(chatd::Message *message, const karere::SetOfIds &recipients, chatd::MsgCommand* msgCmd);
     virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message);
+    virtual promise::Promise<chatd::Message*> msgDecryptInBackground(chatd::Message* message);
     virtual void onKeyReceived(chatd::KeyId keyid, karere::Id sender,
         karere::Id receiver, const char* data, uint16_t dataLen);
     virtual void onKeyConfirmed(chatd::KeyId localkeyid, chatd::KeyId keyid);
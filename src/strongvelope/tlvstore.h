@@ -97,10 +97,21 @@ public:
  */
 
 void addRecord(uint8_t type, const StaticBuffer& value)
+{
+    char* data = addRecordPtr(type, value.dataSize());
+    if (value.dataSize())
+        memcpy(data, value.buf(), value.dataSize());
+}
+
+/**
+ * Adds a record of \c len bytes, and returns the address where its value must be
+ * written, so it can be generated in place. It's only valid until the next change.
+ */
+char* addRecordPtr(uint8_t type, size_t len)
 {
     assert(!mEnded);
     append(type);
-    if (value.dataSize() >= 0xffff)
+    if (len >= 0xffff)
     {
         append<uint16_t>(0xffff);
 #ifdef NODEBUG
@@ -109,9 +120,9 @@ void addRecord(uint8_t type, const StaticBuffer& value)
     }
     else
     {
-        append<uint16_t>(htons(value.dataSize()));
+        append<uint16_t>(htons(len));
     }
-    append(value);
+    return appendPtr(len);
 }
 
 template <typename T, typename=typename std::enable_if<std::is_pod<T>::value>::type>
@@ -2,6 +2,7 @@
 #include "userAttrCache.h"
 #include "chatClient.h"
 #include "db.h"
+#include "dbQueries.h"
 #ifndef _MSC_VER
 #include <codecvt> // deprecated
 #endif
@@ -211,19 +212,115 @@ void UserAttrCache::dbWriteNull(UserAttrPair key)
 
 UserAttrCache::UserAttrCache(Client& aClient): mClient(aClient)
 {
-    //load all attributes from db
-    SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs");
-    while(stmt.step())
+    // attributes are loaded from db on demand, see dbLoad()
+    mClient.api.sdk.addGlobalListener(this);
+}
+
+UserAttrCache::iterator UserAttrCache::dbLoad(UserAttrPair key)
+{
+    if (key.mPh.isValid() || (key.attrType & USER_ATTR_FLAG_COMPOSITE))
     {
-        std::unique_ptr<Buffer> data(new Buffer((size_t)sqlite3_column_bytes(stmt, 2)));
-        stmt.blobCol(2, *data);
-        UserAttrPair key(stmt.uint64Col(0), stmt.intCol(1));
-        emplace(std::make_pair(key, std::make_shared<UserAttrCacheItem>(
-                *this, data.release(), kCacheFetchNotPending)));
-//        UACACHE_LOG_DEBUG("loaded attr %s", key.toString().c_str());
+        return end();   // not persisted
     }
-    UACACHE_LOG_DEBUG("loaded %zu entries from db", size());
-    mClient.api.sdk.addGlobalListener(this);
+
+    SqliteStmt stmt(mClient.db, karere::sql::kUserAttrLoad);
+    stmt << key.user.val << key.attrType;
+    if (!stmt.step())
+    {
+        return end();
+    }
+    std::unique_ptr<Buffer> data(new Buffer((size_t)sqlite3_column_bytes(stmt, 0)));
+    stmt.blobCol(0, *data);
+    auto it = emplace(key, std::make_shared<UserAttrCacheItem>(
+            *this, data.release(), kCacheFetchNotPending)).first;
+    UACACHE_LOG_DEBUG("loaded attr %s from db", key.toString().c_str());
+    lruTouch(key, *it->second);
+    return it;
+}
+
+UserAttrCache::iterator UserAttrCache::findCached(UserAttrPair key)
+{
+    auto it = find(key);
+    return (it != end()) ? it : dbLoad(key);
+}
+
+bool UserAttrCache::isLargeAttr(uint8_t type)
+{
+    return type == ::mega::MegaApi::USER_ATTR_AVATAR
+        || type == ::mega::MegaApi::USER_ATTR_AUTHRING
+        || type == ::mega::MegaApi::USER_ATTR_KEYRING
+        || type == USER_ATTR_RSA_PUBKEY;
+}
+
+void UserAttrCache::lruTouch(UserAttrPair key, UserAttrCacheItem& item)
+{
+    if (!isLargeAttr(key.attrType))
+    {
+        return;
+    }
+    if (!item.inLru)
+    {
+        // the item may have been dropped from the cache while it was being fetched
+        auto it = find(key);
+        if (it == end() || it->second.get() != &item)
+        {
+            return;
+        }
+        mLru.push_front(key);
+        item.lruIt = mLru.begin();
+        item.inLru = true;
+    }
+    else if (item.lruIt != mLru.begin())
+    {
+        mLru.splice(mLru.begin(), mLru, item.lruIt);
+    }
+
+    mLruBytes -= item.lruBytes;
+    item.lruBytes = item.data ? item.data->dataSize() : 0;
+    mLruBytes += item.lruBytes;
+    lruTrim();
+}
+
+void UserAttrCache::lruTrim()
+{
+    if (mLru.empty())
+    {
+        return;
+    }
+    // the most recently used one is kept, since it's the one being accessed
+    auto lruIt = mLru.end();
+    while (mLruBytes > mLargeAttrBudget && --lruIt != mLru.begin())
+    {
+        auto it = find(*lruIt);
+        assert(it != end());
+        auto& item = *it->second;
+        if (!item.cbs.empty() || item.pending != kCacheFetchNotPending)
+        {
+            continue;   // in use
+        }
+        UACACHE_LOG_DEBUG("Attr %s dropped from memory", lruIt->toString().c_str());
+        ++lruIt;    // the erased node is unlinked, continue from the next one
+        eraseItem(it);
+    }
+}
+
+void UserAttrCache::eraseItem(iterator it)
+{
+    auto& item = *it->second;
+    if (item.inLru)
+    {
+        mLru.erase(item.lruIt);
+        mLruBytes -= item.lruBytes;
+        item.inLru = false;
+        item.lruBytes = 0;
+    }
+    erase(it);
+}
+
+void UserAttrCache::setLargeAttrBudget(size_t bytes)
+{
+    mLargeAttrBudget = bytes;
+    lruTrim();
 }
 
 const char* attrName(uint8_t type)
@@ -260,9 +357,13 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
         int type = desc.type;
         UserAttrPair key(userid, type);
         auto it = find(key);
-        if (it == end()) //we don't have such attribute
+        if (it == end()) //we don't have such attribute in memory
         {
-            UACACHE_LOG_DEBUG("Attr %s change received for unknown user, ignoring", attrName(type));
+            if ((type & USER_ATTR_FLAG_COMPOSITE) == 0)
+            {
+                dbInvalidateItem(key); //it may be in the db, not loaded yet
+            }
+            UACACHE_LOG_DEBUG("Attr %s change received for unused attribute, ignoring", attrName(type));
             continue;
         }
         auto& item = it->second;
@@ -272,7 +373,7 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
         }
         if (item->cbs.empty()) //we aren't using that item atm
         { //delete it from memory as well, forcing it to be freshly fetched if it's requested
-            erase(key);
+            eraseItem(it);
             UACACHE_LOG_DEBUG("Attr %s change received, attr is unused -> deleted from cache",
                 key.toString().c_str());
             continue;
@@ -321,12 +422,14 @@ void UserAttrCacheItem::resolve(UserAttrPair key)
     UACACHE_LOG_DEBUG("Attr %s fetched, writing to db and doing callbacks...", key.toString().c_str());
     parent.dbWrite(key, *data);
     notify();
+    parent.lruTouch(key, *this);
 }
 void UserAttrCacheItem::resolveNoDb(UserAttrPair key)
 {
     pending = kCacheFetchNotPending;
     UACACHE_LOG_DEBUG("Attr %s fetched but not writing to db, doing callbacks...", key.toString().c_str());
     notify();
+    parent.lruTouch(key, *this);
 }
 void UserAttrCacheItem::error(UserAttrPair key, int errCode)
 {
@@ -342,6 +445,7 @@ void UserAttrCacheItem::error(UserAttrPair key, int errCode)
         UACACHE_LOG_DEBUG("Attr %s fetch error %d, not touching db and doing callbacks...", key.toString().c_str(), errCode);
     }
     notify();
+    parent.lruTouch(key, *this);
 }
 
 void UserAttrCacheItem::errorNoDb(int /*errCode*/)
@@ -370,12 +474,15 @@ UserAttrCache::Handle UserAttrCache::getAttr(uint64_t userHandle, unsigned type,
             void* userp, UserAttrReqCbFunc cb, bool oneShot, uint64_t ph)
 {
     UserAttrPair key(userHandle, type, ph);
-    auto it = find(key);
+    auto it = findCached(key);
     if (it != end())
     {
+        lruTouch(key, *it->second);
         if (cb)
         {
-            auto& item = *it->second;
+            // keep the item alive during the callback, even if it's dropped from the cache
+            auto itemPtr = it->second;
+            auto& item = *itemPtr;
             // Maybe not optimal to store each cb pointer, as these pointers would be mostly only a few, with different userp-s
             if (item.pending != kCacheFetchNewPending)
             {
@@ -111,6 +111,9 @@ struct UserAttrCacheItem
     std::unique_ptr<Buffer> data;
     std::list<UserAttrReqCb> cbs;
     unsigned char pending;
+    bool inLru = false;
+    size_t lruBytes = 0; // size accounted in UserAttrCache::mLruBytes
+    std::list<UserAttrPair>::iterator lruIt;
     UserAttrCacheItem(UserAttrCache& aParent ,Buffer* buf, unsigned char aPending)
         : parent(aParent), data(buf), pending(aPending){}
     UserAttrReqCb::WeakRefHandle addCb(UserAttrReqCbFunc cb, void* userp, bool oneShot=false);
@@ -122,6 +125,12 @@ struct UserAttrCacheItem
 };
 /** @brief
  * User attribute cache, prividing notifications when an attribute is changed
+ *
+ * Attributes are loaded from the db on demand, the first time each one is requested.
+ * Large attributes (see \c isLargeAttr()) are kept in an LRU, and the least recently
+ * used ones are dropped from memory when their total size exceeds the budget set with
+ * \c setLargeAttrBudget(). Attributes that have callbacks registered or a fetch in
+ * progress are never dropped.
  */
 class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCacheItem>>,
                      public ::mega::MegaGlobalListener, public karere::DeleteTrackable
@@ -129,6 +138,15 @@ class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCache
 protected:
     Client& mClient;
     bool mIsLoggedIn = false;
+    std::list<UserAttrPair> mLru; // large attributes in memory, most recently used first
+    size_t mLruBytes = 0;
+    size_t mLargeAttrBudget = 256 * 1024;
+    static bool isLargeAttr(uint8_t type);
+    /** @brief Loads the attribute from the db into memory. Returns \c end() if it's not there */
+    iterator dbLoad(UserAttrPair key);
+    void lruTouch(UserAttrPair key, UserAttrCacheItem& item);
+    void lruTrim();
+    void eraseItem(iterator it);
     void dbWrite(UserAttrPair key, const Buffer& data);
     void dbWriteNull(UserAttrPair key);
     void dbInvalidateItem(UserAttrPair item);
@@ -185,6 +203,13 @@ public:
      * request is currently registered (expired one-shot for example).
      */
     bool removeCb(Handle handle);
+    /** @brief Returns the attribute if it's in memory or in the db, without fetching it
+     * from the server, or \c end() otherwise */
+    iterator findCached(UserAttrPair key);
+    /** @brief Sets the maximum size, in bytes, of the large attributes that are kept in
+     * memory while unused */
+    void setLargeAttrBudget(size_t bytes);
+    size_t largeAttrBudget() const { return mLargeAttrBudget; }
 };
 
 }
@@ -0,0 +1,228 @@
+/**
+ * @file tests/replay_bench/replay_bench.cpp
+ * @brief Benchmark of a session replayed from recorded traffic
+ *
+ * (c) 2016 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+// It runs offline and needs no testing accounts: it replays a session recorded with
+// KRCHAT_WS_RECORD (see WsRecording). The directory of the recording must contain a copy
+// of the cache of the session taken before recording, i.e. karere-<...>.db, and the
+// recording of the API results (api.0.wsrec), so the keys of the peers are available.
+//
+// - Resume the session from the copy of the cache, with tracing enabled, while the
+// recorded chatd and presenced traffic is replayed
+// - Print the rate of messages from Connection::execCommand to the chat listeners
+// - Force a reconnection, and print the time until logged in to all chats again
+
+#include "../../src/megachatapi.h"
+#include <megaapi.h>
+#include <traceSpans.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace megachat;
+using namespace mega;
+
+static const std::string APPLICATION_KEY = "MBoVFSyZ";
+static const std::string USER_AGENT_DESCRIPTION = "MEGAChatReplayBench";
+static const std::string LOCAL_PATH = "./tmp-replay"; // no ending slash
+static const unsigned maxTimeout = 120;    // seconds
+static const unsigned pollingT = 500000;   // microseconds
+
+class ReplayBenchListener : public MegaChatListener
+{
+public:
+    std::atomic<bool> loggedInAllChats;
+
+    ReplayBenchListener() : loggedInAllChats(false) {}
+    virtual void onChatConnectionStateUpdate(MegaChatApi* /*api*/, MegaChatHandle chatid, int newState)
+    {
+        if (chatid == MEGACHAT_INVALID_HANDLE && newState == MegaChatApi::CHAT_CONNECTION_ONLINE)
+        {
+            loggedInAllChats = true;
+        }
+    }
+};
+
+struct Span
+{
+    std::string name;
+    uint64_t startUs;
+    uint64_t endUs;
+};
+
+// parses the output of karere::Trace::toChromeJson()
+static std::vector<Span> parseSpans(const std::string& json)
+{
+    static const std::string kName = "{\"name\":\"";
+    std::vector<Span> spans;
+    for (size_t pos = json.find(kName); pos != std::string::npos; pos = json.find(kName, pos + 1))
+    {
+        size_t nameStart = pos + kName.size();
+        size_t nameEnd = json.find('"', nameStart);
+        size_t ts = json.find("\"ts\":", nameStart);
+        size_t dur = json.find("\"dur\":", nameStart);
+        if (nameEnd == std::string::npos || ts == std::string::npos || dur == std::string::npos)
+        {
+            break;
+        }
+        Span span;
+        span.name = json.substr(nameStart, nameEnd - nameStart);
+        span.startUs = strtoull(json.c_str() + ts + 5, NULL, 10);
+        span.endUs = span.startUs + strtoull(json.c_str() + dur + 6, NULL, 10);
+        spans.push_back(span);
+    }
+    return spans;
+}
+
+static bool waitFor(const std::atomic<bool>& flag, unsigned timeout)
+{
+    timeout *= 1000000; // convert to micro-seconds
+    for (unsigned tWaited = 0; !flag; tWaited += pollingT)
+    {
+        if (tWaited >= timeout)
+        {
+            return false;
+        }
+        usleep(pollingT);
+    }
+    return true;
+}
+
+static bool copyFile(const std::string& from, const std::string& to)
+{
+    std::ifstream src(from, std::ios::binary);
+    std::ofstream dst(to, std::ios::binary | std::ios::trunc);
+    if (!src || !dst)
+    {
+        return false;
+    }
+    dst << src.rdbuf();
+    return bool(dst);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 || strlen(argv[2]) <= 44)
+    {
+        std::cout << "Usage: " << argv[0] << " <recording dir> <session id>" << std::endl;
+        return 1;
+    }
+    std::string dir = argv[1];
+    const char *sid = argv[2];
+
+    // the replay must not modify the copy of the cache of the recording
+    std::string dbName = std::string("/karere-") + (sid + 44) + ".db";
+    struct stat st = {0};
+    if (stat(LOCAL_PATH.c_str(), &st) == -1)
+    {
+        mkdir(LOCAL_PATH.c_str(), 0700);
+    }
+    if (!copyFile(dir + dbName, LOCAL_PATH + dbName))
+    {
+        std::cout << "Can't copy the cache of the session from " << dir + dbName << std::endl;
+        return 1;
+    }
+
+    // MegaChatApi replays the recordings instead of connecting, and the SDK isn't logged in
+    setenv("KRCHAT_WS_REPLAY", dir.c_str(), 1);
+    MegaChatApi::setLogToConsole(false);
+
+    MegaApi *megaApi = new MegaApi(APPLICATION_KEY.c_str(), LOCAL_PATH.c_str(), USER_AGENT_DESCRIPTION.c_str());
+    MegaChatApi *megaChatApi = new MegaChatApi(megaApi);
+    ReplayBenchListener listener;
+    megaChatApi->addChatListener(&listener);
+
+    int result = 1;
+    bool wasTracing = karere::Trace::enabled();
+    karere::Trace::setEnabled(true);
+    uint64_t loginStartUs = karere::Trace::now();
+    if (megaChatApi->init(sid) != MegaChatApi::INIT_OFFLINE_SESSION)
+    {
+        std::cout << "Can't resume the session from " << LOCAL_PATH + dbName << std::endl;
+    }
+    else
+    {
+        megaChatApi->connect();
+        if (!waitFor(listener.loggedInAllChats, maxTimeout))
+        {
+            std::cout << "Expired timeout for login to all chats" << std::endl;
+        }
+        else
+        {
+            size_t msgCount = 0;
+            uint64_t firstUs = UINT64_MAX;
+            uint64_t lastUs = 0;
+            for (const Span& span: parseSpans(karere::Trace::toChromeJson()))
+            {
+                if (span.startUs < loginStartUs)
+                {
+                    continue;
+                }
+                if (span.name == "OLDMSG" || span.name == "NEWMSG")
+                {
+                    firstUs = std::min(firstUs, span.startUs);
+                }
+                else if (span.name == "Listener::onRecvHistoryMessage" || span.name == "Listener::onRecvNewMessage")
+                {
+                    msgCount++;
+                    lastUs = std::max(lastUs, span.endUs);
+                }
+            }
+            double msgTime = (lastUs > firstUs) ? (lastUs - firstUs) / 1e6 : 0;
+            std::cout << msgCount << " messages from chatd to the listeners in " << msgTime * 1000
+                      << " ms: " << (msgTime > 0 ? msgCount / msgTime : 0) << " msg/s" << std::endl;
+
+            listener.loggedInAllChats = false;
+            auto start = std::chrono::steady_clock::now();
+            megaChatApi->retryPendingConnections(true);
+            if (!waitFor(listener.loggedInAllChats, maxTimeout))
+            {
+                std::cout << "Expired timeout for login to all chats after reconnecting" << std::endl;
+            }
+            else
+            {
+                double reconnectTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Reconnection until logged in to all chats: " << reconnectTime * 1000 << " ms" << std::endl;
+                result = msgCount ? 0 : 1;
+                if (!msgCount)
+                {
+                    std::cout << "No message was received from the replayed traffic" << std::endl;
+                }
+            }
+        }
+    }
+    karere::Trace::setEnabled(wasTracing);
+
+    megaChatApi->removeChatListener(&listener);
+    delete megaChatApi;
+    delete megaApi;
+    return result;
+}
@@ -4,6 +4,9 @@
 #include "../../src/megachatapi.h"
 #include "../../src/karereCommon.h" // for logging with karere facility
 
+#include <chrono>
+#include <set>
+
 #include <signal.h>
 #include <stdio.h>
 #include <time.h>
@@ -46,6 +49,9 @@ int main(int argc, char **argv)
     EXECUTE_TEST(t.TEST_ChangeMyOwnName(0), "TEST Change my name");
     EXECUTE_TEST(t.TEST_RichLinkUserAttribute(0), "TEST Rich link user attributes");
     EXECUTE_TEST(t.TEST_SendRichLink(0, 1), "TEST Send Rich link");
+    EXECUTE_TEST(t.TEST_HistoryMemoryBudget(0), "TEST History memory budget");
+    EXECUTE_TEST(t.TEST_SearchMessages(0, 1), "TEST Search messages");
+    EXECUTE_TEST(t.TEST_OnlineStatusBatch(0, 1), "TEST Online status batch");
 
 #ifndef KARERE_DISABLE_WEBRTC
     EXECUTE_TEST(t.TEST_Calls(0, 1), "TEST Signalling calls");
@@ -342,6 +348,10 @@ void MegaChatApiTest::SetUp()
 
         mNotTransferRunning[i] = true;
         mPresenceConfigUpdated[i] = false;
+        mPeerStatusUser[i] = MEGACHAT_INVALID_HANDLE;
+        mPeerStatusUpdated[i] = false;
+        mPeerStatus[i] = MegaChatApi::STATUS_INVALID;
+        mDuplicateInStatusBatch[i] = false;
 
         mRichLinkFlag[i] = false;
         mCountRichLink[i] = 0;
@@ -3207,6 +3217,237 @@ void MegaChatApiTest::TEST_SendRichLink(unsigned int a1, unsigned int a2)
     secondarySession = NULL;
 }
 
+/**
+ * @brief TEST_HistoryMemoryBudget
+ *
+ * This test does the following:
+ *
+ * - Load the whole history of a chatroom
+ * - Reopen the chatroom and set a tiny memory budget, so the history not loaded
+ * by the app yet is released from RAM
+ * + Check the RAM used by the history of the chatroom decreases
+ * - Load the whole history again, while the budget is still exceeded
+ * + Check the same messages are loaded (from cache)
+ */
+void MegaChatApiTest::TEST_HistoryMemoryBudget(unsigned int accountIndex)
+{
+    char *session = login(accountIndex);
+
+    MegaChatRoomList *chats = megaChatApi[accountIndex]->getChatRooms();
+    MegaChatHandle chatid = MEGACHAT_INVALID_HANDLE;
+    for (unsigned i = 0; i < chats->size(); i++)
+    {
+        if (!chats->get(i)->isPublic() && chats->get(i)->isActive())
+        {
+            chatid = chats->get(i)->getChatId();
+            break;
+        }
+    }
+    delete chats;
+    chats = NULL;
+    if (chatid == MEGACHAT_INVALID_HANDLE)
+    {
+        postLog("No chatroom available, skipping the history memory budget test");
+        delete [] session;
+        return;
+    }
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[accountIndex]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(accountIndex+1));
+    int msgCount = loadHistory(accountIndex, chatid, chatroomListener);
+    megaChatApi[accountIndex]->closeChatRoom(chatid, chatroomListener);
+    size_t fullUsage = megaChatApi[accountIndex]->getHistoryMemoryUsage(chatid);
+    ASSERT_CHAT_TEST(!msgCount || fullUsage, "No RAM reported for " + std::to_string(msgCount) + " loaded messages");
+
+    // reopening resets the history notified to the app, so all of it but the newest messages can be released
+    ASSERT_CHAT_TEST(megaChatApi[accountIndex]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(accountIndex+1));
+    megaChatApi[accountIndex]->setHistoryMemoryBudget(1);
+    size_t budgetUsage = megaChatApi[accountIndex]->getHistoryMemoryUsage(chatid);
+    postLog("History RAM: " + std::to_string(fullUsage) + " bytes for " + std::to_string(msgCount)
+            + " messages, " + std::to_string(budgetUsage) + " bytes with the budget");
+    ASSERT_CHAT_TEST(budgetUsage <= fullUsage, "The RAM used by the history increased with the budget");
+    if (msgCount > 64)  // more than the newest messages kept in RAM (including the management ones)
+    {
+        ASSERT_CHAT_TEST(budgetUsage < fullUsage, "No history was released from RAM");
+    }
+
+    int reloadCount = loadHistory(accountIndex, chatid, chatroomListener);
+    ASSERT_CHAT_TEST(reloadCount == msgCount, "Wrong number of messages loaded after releasing them from RAM: "
+                     + std::to_string(reloadCount) + " (expected: " + std::to_string(msgCount) + ")");
+
+    megaChatApi[accountIndex]->setHistoryMemoryBudget(0);
+    megaChatApi[accountIndex]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete [] session;
+    session = NULL;
+}
+
+/**
+ * @brief TEST_SearchMessages
+ *
+ * Requirements:
+ * - Both accounts should be conctacts
+ * - The 1on1 chatroom between them should exist
+ * (if not accomplished, the test automatically solves the above)
+ *
+ * This test does the following:
+ *
+ * - Send a message with a unique word
+ * + Search the word, and the start of it, in the chatroom and in all chatrooms
+ * - Edit the message with another unique word
+ * + Search both words, only the new one is found
+ *
+ */
+void MegaChatApiTest::TEST_SearchMessages(unsigned int a1, unsigned int a2)
+{
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || user->getVisibility() != MegaUser::VISIBILITY_VISIBLE)
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+
+    auto found = [this](unsigned int accountIndex, MegaChatHandle chatid, const std::string &query, MegaChatHandle msgid)
+    {
+        MegaChatMessageList *results = megaChatApi[accountIndex]->searchMessages(chatid, query.c_str(), 100);
+        bool ret = false;
+        for (unsigned int i = 0; results && i < results->size(); i++)
+        {
+            if (results->get(i)->getMsgId() == msgid)
+            {
+                ret = (chatid == MEGACHAT_INVALID_HANDLE || results->getChatId(i) == chatid);
+                break;
+            }
+        }
+        delete results;
+        return ret;
+    };
+
+    std::string word = "srch" + std::to_string(time(NULL));
+    std::string messageToSend = "Testing message to search: " + word + " - sent by " + mAccounts[a1].getEmail();
+    MegaChatMessage *msgSent = sendTextMessageOrUpdate(a1, a2, chatid, messageToSend, chatroomListener);
+    MegaChatHandle msgid = msgSent->getMsgId();
+    delete msgSent; msgSent = NULL;
+
+    for (unsigned int accountIndex: {a1, a2})
+    {
+        std::string account = " (account " + std::to_string(accountIndex+1) + ")";
+        ASSERT_CHAT_TEST(found(accountIndex, chatid, word, msgid), "Message not found in its chatroom" + account);
+        ASSERT_CHAT_TEST(found(accountIndex, MEGACHAT_INVALID_HANDLE, word, msgid), "Message not found in all chatrooms" + account);
+        ASSERT_CHAT_TEST(found(accountIndex, chatid, "search " + word.substr(0, word.size() - 3), msgid), "Message not found by prefix" + account);
+        ASSERT_CHAT_TEST(!found(accountIndex, chatid, word + " nonexistentword", msgid), "Message found with a word it doesn't contain" + account);
+    }
+
+    std::string newWord = "edit" + std::to_string(time(NULL));
+    std::string messageToUpdate = "Edited testing message to search: " + newWord;
+    MegaChatMessage *msgUpdated = sendTextMessageOrUpdate(a1, a2, chatid, messageToUpdate, chatroomListener, msgid);
+    delete msgUpdated; msgUpdated = NULL;
+
+    for (unsigned int accountIndex: {a1, a2})
+    {
+        std::string account = " (account " + std::to_string(accountIndex+1) + ")";
+        ASSERT_CHAT_TEST(found(accountIndex, chatid, newWord, msgid), "Edited message not found" + account);
+        ASSERT_CHAT_TEST(!found(accountIndex, chatid, word, msgid), "Edited message found by its previous content" + account);
+    }
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
+
+/**
+ * @brief TEST_OnlineStatusBatch
+ *
+ * Requirements:
+ * - Both accounts should be conctacts
+ * (if not accomplished, the test automatically solves the above)
+ *
+ * This test does the following:
+ *
+ * - Track the status of the secondary account in the batches received by the primary account
+ * - Set status busy in the secondary account
+ * + Check the primary account receives it in a batch, and getUserOnlineStatus agrees
+ * - Set status online in the secondary account
+ * + Check the primary account receives it in a batch
+ * + Check no batch included the same user twice
+ *
+ */
+void MegaChatApiTest::TEST_OnlineStatusBatch(unsigned int a1, unsigned int a2)
+{
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || user->getVisibility() != MegaUser::VISIBILITY_VISIBLE)
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle uh = megaChatApi[a2]->getMyUserHandle();
+    mPeerStatusUser[a1] = uh;
+    mDuplicateInStatusBatch[a1] = false;
+
+    auto waitForPeerStatus = [this, a1](int status)
+    {
+        bool *flag = &mPeerStatusUpdated[a1];
+        for (;;)
+        {
+            *flag = false;
+            if (mPeerStatus[a1] == status)
+            {
+                return true;
+            }
+            if (!waitForResponse(flag))
+            {
+                return mPeerStatus[a1] == status;
+            }
+        }
+    };
+
+    for (int status: {MegaChatApi::STATUS_BUSY, MegaChatApi::STATUS_ONLINE})
+    {
+        bool *flag = &requestFlagsChat[a2][MegaChatRequest::TYPE_SET_ONLINE_STATUS]; *flag = false;
+        megaChatApi[a2]->setOnlineStatus(status);
+        ASSERT_CHAT_TEST(waitForResponse(flag), "Failed to set online status after " + std::to_string(maxTimeout) + " seconds");
+        ASSERT_CHAT_TEST(!lastErrorChat[a2], "Failed to set online status. Error: " + lastErrorMsgChat[a2] + " (" + std::to_string(lastErrorChat[a2]) + ")");
+
+        ASSERT_CHAT_TEST(waitForPeerStatus(status), "Online status of the peer not received in a batch. Expected: "
+                         + std::string(MegaChatRoom::statusToString(status)) + " Received: " + std::string(MegaChatRoom::statusToString(mPeerStatus[a1])));
+        int onlineStatus = megaChatApi[a1]->getUserOnlineStatus(uh);
+        ASSERT_CHAT_TEST(onlineStatus == status, "Online status of the peer differs from the batch. Received: " + std::string(MegaChatRoom::statusToString(onlineStatus)));
+    }
+
+    ASSERT_CHAT_TEST(!mDuplicateInStatusBatch[a1], "A batch of online status included the same user more than once");
+    mPeerStatusUser[a1] = MEGACHAT_INVALID_HANDLE;
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
+
 int MegaChatApiTest::loadHistory(unsigned int accountIndex, MegaChatHandle chatid, TestChatRoomListener *chatroomListener)
 {
     // first of all, ensure the chatd connection is ready
@@ -4038,6 +4279,28 @@ void MegaChatApiTest::onChatOnlineStatusUpdate(MegaChatApi* api, MegaChatHandle
     }
 }
 
+void MegaChatApiTest::onChatOnlineStatusBatch(MegaChatApi* api, MegaChatOnlineStatusList *list)
+{
+    unsigned int apiIndex = getMegaChatApiIndex(api);
+    std::set<MegaChatHandle> users;
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        MegaChatHandle userhandle = list->getUserHandle(i);
+        if (!users.insert(userhandle).second)
+        {
+            mDuplicateInStatusBatch[apiIndex] = true;
+        }
+        if (userhandle == mPeerStatusUser[apiIndex])
+        {
+            mPeerStatus[apiIndex] = list->getStatus(i);
+            mPeerStatusUpdated[apiIndex] = true;
+        }
+    }
+
+    // keep receiving the status of each user too
+    MegaChatListener::onChatOnlineStatusBatch(api, list);
+}
+
 void MegaChatApiTest::onChatPresenceConfigUpdate(MegaChatApi *api, MegaChatPresenceConfig */*config*/)
 {
     unsigned int apiIndex = getMegaChatApiIndex(api);
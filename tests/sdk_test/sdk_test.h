@@ -204,6 +204,9 @@ public:
 
     void TEST_RichLinkUserAttribute(unsigned int a1);
     void TEST_SendRichLink(unsigned int a1, unsigned int a2);
+    void TEST_HistoryMemoryBudget(unsigned int accountIndex);
+    void TEST_SearchMessages(unsigned int a1, unsigned int a2);
+    void TEST_OnlineStatusBatch(unsigned int a1, unsigned int a2);
 
     unsigned mOKTests;
     unsigned mFailedTests;
@@ -293,6 +296,10 @@ private:
     bool mPresenceConfigUpdated[NUM_ACCOUNTS];
     bool mOnlineStatusUpdated[NUM_ACCOUNTS];
     int mOnlineStatus[NUM_ACCOUNTS];
+    megachat::MegaChatHandle mPeerStatusUser[NUM_ACCOUNTS];   // peer whose status is tracked from the batches
+    bool mPeerStatusUpdated[NUM_ACCOUNTS];
+    int mPeerStatus[NUM_ACCOUNTS];
+    bool mDuplicateInStatusBatch[NUM_ACCOUNTS];
 
     ::mega::MegaContactRequest* mContactRequest[NUM_ACCOUNTS];
     bool mContactRequestUpdated[NUM_ACCOUNTS];
@@ -345,6 +352,7 @@ public:
     virtual void onChatInitStateUpdate(megachat::MegaChatApi *api, int newState);
     virtual void onChatListItemUpdate(megachat::MegaChatApi* api, megachat::MegaChatListItem *item);
     virtual void onChatOnlineStatusUpdate(megachat::MegaChatApi* api, megachat::MegaChatHandle userhandle, int status, bool inProgress);
+    virtual void onChatOnlineStatusBatch(megachat::MegaChatApi* api, megachat::MegaChatOnlineStatusList *list);
     virtual void onChatPresenceConfigUpdate(megachat::MegaChatApi* api, megachat::MegaChatPresenceConfig *config);
     virtual void onChatConnectionStateUpdate(megachat::MegaChatApi* api, megachat::MegaChatHandle chatid, int state);
 
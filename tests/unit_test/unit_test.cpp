@@ -0,0 +1,1842 @@
+#include "unit_test.h"
+
+#include "../../src/megachatapi.h"
+#include "../../src/karereCommon.h" // for logging with karere facility
+#include <gcmpp.h>
+#include <idMap.h>
+#include <buffer.h>
+#include <db.h>
+#include <dbQueries.h>
+#include <chatClient.h>
+#include <chatdDb.h>
+#include <userAttrCache.h>
+#include <strongvelope/strongvelope.h>
+#include <cservices.h>
+#include <workerPool.h>
+#include <traceSpans.h>
+#include <net/websocketsIO.h>
+#include <sodium.h>
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace megachat;
+
+const std::string MegaChatUnitTest::LOCAL_PATH = "./tmp"; // no ending slash
+
+int main(int argc, char **argv)
+{
+    MegaChatUnitTest t;
+    t.init();
+
+    EXECUTE_TEST(t.TEST_DbQueryPlans(), "TEST Query plans of the cache");
+    EXECUTE_TEST(t.TEST_UrlDetection(), "TEST Url detection");
+    EXECUTE_TEST(t.TEST_MarshallCallThroughput(), "TEST Marshall call throughput");
+    EXECUTE_TEST(t.TEST_IdMapVsStdMap(), "TEST IdMap vs std::map");
+    EXECUTE_TEST(t.TEST_IdMapEraseHeldIterator(), "TEST IdMap erase with a held iterator");
+    EXECUTE_TEST(t.TEST_IdMapLookupHeldIterator(), "TEST IdMap lookup with a held iterator");
+    EXECUTE_TEST(t.TEST_ParallelSignatureVerification(), "TEST Parallel signature verification");
+    EXECUTE_TEST(t.TEST_TraceSpans(), "TEST Trace spans");
+    EXECUTE_TEST(t.TEST_AsyncLogger(), "TEST Asynchronous logger");
+    EXECUTE_TEST(t.TEST_DatabaseWalMode(), "TEST Database WAL mode");
+    EXECUTE_TEST(t.TEST_HistoryInsertBatching(), "TEST Batched history inserts");
+    EXECUTE_TEST(t.TEST_UserAttrCache(), "TEST User attributes cache");
+    EXECUTE_TEST(t.TEST_FrameReassembly(), "TEST Reassembly of fragmented frames");
+    EXECUTE_TEST(t.TEST_SendKeyCache(), "TEST Cache of send keys");
+    EXECUTE_TEST(t.TEST_SearchIndex(), "TEST Full-text index of the history");
+    EXECUTE_TEST(t.TEST_DecryptionOrder(), "TEST Order of the messages decrypted in the background");
+
+    t.terminate();
+
+    return t.mFailedTests;
+}
+
+ChatTestException::ChatTestException(const std::string &file, int line, const std::string &msg)
+    : mFile(file)
+    , mLine(line)
+    , mMsg(msg)
+{
+    mExceptionText = mFile + ":" + std::to_string(mLine) + ": Failure";
+}
+
+const char *ChatTestException::what() const throw()
+{
+    return mExceptionText.c_str();
+}
+
+const char *ChatTestException::msg() const throw()
+{
+    return !mMsg.empty() ? mMsg.c_str() : NULL;
+}
+
+MegaChatUnitTest::MegaChatUnitTest()
+    : mOKTests(0)
+    , mFailedTests(0)
+{
+}
+
+void MegaChatUnitTest::init()
+{
+    std::cout << "[========] Global test environment initialization" << std::endl;
+
+    mOKTests = mFailedTests = 0;
+
+    MegaChatApi::setLogToConsole(false);
+    MegaChatApi::setCatchException(false);
+    if (sodium_init() == -1)
+    {
+        std::cout << "TEST - Can't initialize libsodium" << std::endl;
+        exit(-1);
+    }
+
+    // there's no MegaChatApi to forward the marshalled calls to the app: they are
+    // executed by the posting thread
+    megaPostMessageToGui = [](void *msg, void * /*appCtx*/)
+    {
+        megaProcessMessage(msg);
+    };
+
+    struct stat st = {0};
+    if (stat(LOCAL_PATH.c_str(), &st) == -1)
+    {
+        mkdir(LOCAL_PATH.c_str(), 0700);
+    }
+}
+
+void MegaChatUnitTest::terminate()
+{
+    std::cout << "[==========] Global test environment termination" << std::endl;
+
+    std::cout << "[ PASSED ] " << mOKTests << " test/s." << std::endl;
+    if (mFailedTests)
+    {
+        std::cout << "[ FAILED ] " << mFailedTests << " test/s, see above." << std::endl;
+    }
+}
+
+void MegaChatUnitTest::postLog(const std::string &msg)
+{
+    std::cout << "           " << msg << std::endl;
+}
+
+/**
+ * @brief TEST_DbQueryPlans
+ *
+ * This test does the following:
+ *
+ * - Create an in-memory database from the current schema
+ * - Get the query plan of the hot queries of the cache (see dbQueries.h)
+ * + Check that none of the queries for a single chat, message or key falls back to a full table scan
+ * + Check that the queries for all the chats scan a single table at most
+ */
+void MegaChatUnitTest::TEST_DbQueryPlans()
+{
+    sqlite3 *db = NULL;
+    ASSERT_CHAT_TEST(sqlite3_open(":memory:", &db) == SQLITE_OK, "Can't open in-memory database");
+    char *err = NULL;
+    int ret = sqlite3_exec(db, karere::gDbSchema, NULL, NULL, &err);
+    std::string errMsg = err ? err : "";
+    sqlite3_free(err);
+    if (ret != SQLITE_OK)
+    {
+        sqlite3_close(db);
+    }
+    ASSERT_CHAT_TEST(ret == SQLITE_OK, "Can't create database schema: " + errMsg);
+
+    // returns the full table scans in the plan of the query, or -1 if it can't be prepared
+    auto fullScans = [db](const char *query, std::string &detail) -> int
+    {
+        sqlite3_stmt *stmt = NULL;
+        std::string sql = std::string("EXPLAIN QUERY PLAN ") + query;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+        {
+            detail = sqlite3_errmsg(db);
+            return -1;
+        }
+
+        int count = 0;
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            // a full table scan is reported as "SCAN <table>" ("SCAN TABLE <table>" in old versions),
+            // while scans of an index mention it: "SCAN <table> USING [COVERING] INDEX <index>".
+            // A min()/max() over a table without a suitable index is reported as "SEARCH <table>"
+            std::string step = (const char *)sqlite3_column_text(stmt, 3);
+            bool isScan = (step.compare(0, 5, "SCAN ") == 0 && step.find(" INDEX ") == std::string::npos)
+                    || (step.compare(0, 7, "SEARCH ") == 0 && step.find(" USING ") == std::string::npos);
+            if (isScan)
+            {
+                detail.append(count++ ? ", " : "").append(step);
+            }
+        }
+        sqlite3_finalize(stmt);
+        return count;
+    };
+
+    std::string failed;
+    for (const char *query : karere::sql::kPointQueries)
+    {
+        std::string detail;
+        if (fullScans(query, detail) != 0)
+        {
+            failed.append("\n").append(query).append(": ").append(detail);
+        }
+    }
+    for (const char *query : karere::sql::kBulkQueries)
+    {
+        std::string detail;
+        int count = fullScans(query, detail);
+        if (count < 0 || count > 1)
+        {
+            failed.append("\n").append(query).append(": ").append(detail);
+        }
+    }
+    sqlite3_close(db);
+
+    ASSERT_CHAT_TEST(failed.empty(), "Queries with a full table scan:" + failed);
+}
+
+/**
+ * @brief TEST_UrlDetection
+ *
+ * This test does the following:
+ *
+ * - Check the URL detection against a corpus of messages with known results
+ * - Measure the throughput of the detection for a long message without URLs
+ */
+void MegaChatUnitTest::TEST_UrlDetection()
+{
+    static const struct
+    {
+        const char *text;
+        bool hasUrl;
+    } corpus[] = {
+        { "Hello world", false },
+        { "see www.example.com please", true },
+        { "WWW.EXAMPLE.COM", true },
+        { "wwwxexample.com", true },
+        { "www.a", false },
+        { "https://mega.io", true },
+        { "http://foo.bar/baz?x=1", true },
+        { "ftp://example.com/file", false },
+        { "http://", false },
+        { "https://mega.nz/#!abc!def", false },
+        { "mega.nz/#F!abc", false },
+        { "https://mega.co.nz/#!abc", false },
+        { "write to bob@example.com", false },
+        { "(example.org)", true },
+        { "\"quoted.link\"", true },
+        { "example.com.", true },
+        { "x.y.zz", true },
+        { "example.c", false },
+        { "...com", false },
+        { "a.b1", false },
+        { "192.168.1.1", false },
+        { "localhost:8080/path", false },
+        { "mail@host.co mega.nz/chat/xyz", false }
+    };
+
+    std::string failed;
+    for (const auto &entry : corpus)
+    {
+        if (MegaChatApi::hasUrl(entry.text) != entry.hasUrl)
+        {
+            failed.append("\n").append(entry.text);
+        }
+    }
+    ASSERT_CHAT_TEST(failed.empty(), "Wrong URL detection for:" + failed);
+
+    std::string text;
+    while (text.size() < 1024 * 1024)
+    {
+        text.append("Hello there, the document is attached. Ping me at bob@example.com later; ");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool found = MegaChatApi::hasUrl(text.c_str());
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(!found, "Unexpected URL detected in a message without URLs");
+    postLog("URL detection throughput: " + std::to_string(elapsed > 0 ? text.size() / elapsed / (1024 * 1024) : 0) + " MB/s");
+}
+
+/**
+ * @brief TEST_MarshallCallThroughput
+ *
+ * This test does the following:
+ *
+ * - Post 10M closures with marshallCall() and check that all of them are executed
+ * - Add, look up and remove 1M handles of the handle store, and check that stale handles are rejected
+ * - Log the time per operation
+ *
+ * Closures are posted without context, so they are executed by the posting thread and
+ * the test measures the allocation, dispatch and release of the messages
+ */
+void MegaChatUnitTest::TEST_MarshallCallThroughput()
+{
+    static const unsigned kClosures = 10000000;
+    static const unsigned kHandles = 1000000;
+
+    unsigned executed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kClosures; i++)
+    {
+        karere::marshallCall([&executed, i]()
+        {
+            executed += (i & 1) + 1;
+        }, NULL);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(executed == kClosures / 2 * 3, "Not all the marshalled closures were executed");
+    postLog("marshallCall: " + std::to_string(elapsed * 1e9 / kClosures) + " ns per closure");
+
+    std::string errors;
+    megaHandle prev = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kHandles; i++)
+    {
+        megaHandle handle = services_hstore_add_handle(MEGA_HTYPE_TIMER, &executed);
+        if (!handle || services_hstore_get_handle(MEGA_HTYPE_TIMER, handle) != &executed
+                || services_hstore_get_handle(MEGA_HTYPE_DNSREQ, handle)
+                || (prev && services_hstore_get_handle(MEGA_HTYPE_TIMER, prev)))
+        {
+            errors = "Wrong handle lookup at iteration " + std::to_string(i);
+            break;
+        }
+        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
+        prev = handle;
+    }
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(errors.empty(), errors);
+    postLog("Handle store: " + std::to_string(elapsed * 1e9 / kHandles) + " ns per add/get/remove");
+}
+
+/**
+ * @brief TEST_IdMapVsStdMap
+ *
+ * This test does the following:
+ *
+ * - Fill a karere::IdMap and a std::map with 100k random msgids, like the
+ * msgid-to-index map of a chat with 100k messages loaded in RAM
+ * - Look up all of them plus the same amount of unknown msgids in both, and check the results match
+ * - Erase half of the msgids from both and check the results match again
+ * - Log the memory used and the average time per lookup of each map
+ *
+ * The memory of std::map is estimated as one node per entry: the entry, the color and
+ * three pointers, and 16 bytes of allocator overhead
+ */
+void MegaChatUnitTest::TEST_IdMapVsStdMap()
+{
+    static const unsigned kMessages = 100000;
+
+    std::mt19937_64 rng(kMessages);
+    std::vector<karere::Id> ids(kMessages);
+    std::vector<karere::Id> lookups;
+    for (unsigned i = 0; i < kMessages; i++)
+    {
+        ids[i] = rng();
+        lookups.push_back(ids[i]);
+        lookups.push_back(rng());
+    }
+    std::shuffle(lookups.begin(), lookups.end(), rng);
+
+    karere::IdMap<int32_t> idMap;
+    std::map<karere::Id, int32_t> stdMap;
+    for (unsigned i = 0; i < kMessages; i++)
+    {
+        idMap[ids[i]] = i;
+        stdMap[ids[i]] = i;
+    }
+
+    uint64_t idMapSum = 0;
+    uint64_t stdMapSum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (karere::Id id: lookups)
+    {
+        auto it = idMap.find(id);
+        idMapSum += (it == idMap.end()) ? 1 : it->second + 2;
+    }
+    double idMapTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (karere::Id id: lookups)
+    {
+        auto it = stdMap.find(id);
+        stdMapSum += (it == stdMap.end()) ? 1 : it->second + 2;
+    }
+    double stdMapTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(idMapSum == stdMapSum && idMap.size() == stdMap.size(), "IdMap lookups don't match std::map ones");
+
+    size_t idMapMemory = idMap.memoryUsage();
+    size_t stdMapMemory = stdMap.size() * (sizeof(std::map<karere::Id, int32_t>::value_type) + 32 + 16);
+
+    for (unsigned i = 0; i < kMessages; i += 2)
+    {
+        ASSERT_CHAT_TEST(idMap.erase(ids[i]) == stdMap.erase(ids[i]), "IdMap erase doesn't match std::map one");
+    }
+    for (unsigned i = 0; i < kMessages; i++)
+    {
+        auto it = idMap.find(ids[i]);
+        auto stdIt = stdMap.find(ids[i]);
+        ASSERT_CHAT_TEST((it == idMap.end()) == (stdIt == stdMap.end())
+                         && (it == idMap.end() || it->second == stdIt->second), "IdMap lookup after erase doesn't match std::map one");
+    }
+
+    postLog("IdMap: " + std::to_string(idMapMemory / 1024) + " KB, "
+            + std::to_string(idMapTime * 1e9 / lookups.size()) + " ns per lookup");
+    postLog("std::map: ~" + std::to_string(stdMapMemory / 1024) + " KB, "
+            + std::to_string(stdMapTime * 1e9 / lookups.size()) + " ns per lookup");
+}
+
+/**
+ * @brief TEST_IdMapEraseHeldIterator
+ *
+ * This test does the following:
+ *
+ * - Fill a list of messages, newest first, and a karere::IdMap from msgid to list position,
+ * like FilteredHistory does. Maps are small and at their maximum load, so clusters are long
+ * - Truncate the list after each message, from the oldest to the newest, erasing the truncated
+ * msgids from the map while an iterator to the kept message is held, as
+ * FilteredHistory::truncateHistory() does
+ * - Check that the entries left in the map are exactly the messages left in the list, and
+ * that each one still points to its message
+ * - Check that, in some of the truncations, the held iterator ended up at another entry
+ *
+ * Erasing shifts back the entries of a cluster, so the position of the first truncated
+ * message must be copied before erasing
+ */
+void MegaChatUnitTest::TEST_IdMapEraseHeldIterator()
+{
+    static const unsigned kRounds = 1000;
+    static const unsigned kMessages = 12;   // 3/4 of the minimum capacity
+
+    std::mt19937_64 rng(kRounds);
+    unsigned moved = 0;
+    unsigned truncations = 0;
+    for (unsigned round = 0; round < kRounds; round++)
+    {
+        std::list<karere::Id> messages;
+        karere::IdMap<std::list<karere::Id>::iterator> idToMsg;
+        for (unsigned i = 0; i < kMessages; i++)
+        {
+            messages.push_front(rng());
+            idToMsg[messages.front()] = messages.begin();
+        }
+
+        for (int keep = kMessages - 2; keep >= 0; keep--)
+        {
+            karere::Id id = *std::next(messages.begin(), keep);
+            auto it = idToMsg.find(id);
+            ASSERT_CHAT_TEST(it != idToMsg.end() && *it->second == id, "Message not found before truncating");
+            const void *slot = &*it;
+            auto first = std::next(it->second);
+            for (auto itLoop = first; itLoop != messages.end(); itLoop++)
+            {
+                ASSERT_CHAT_TEST(idToMsg.erase(*itLoop) == 1, "Truncated message not found in the map");
+            }
+            messages.erase(first, messages.end());
+            truncations++;
+            if (&*idToMsg.find(id) != slot)
+            {
+                moved++;    // 'it' would have been pointing to another entry
+            }
+
+            ASSERT_CHAT_TEST(idToMsg.size() == messages.size(), "Wrong size after truncating at " + std::to_string(keep));
+            for (auto msgIt = messages.begin(); msgIt != messages.end(); msgIt++)
+            {
+                auto found = idToMsg.find(*msgIt);
+                ASSERT_CHAT_TEST(found != idToMsg.end() && found->second == msgIt, "Wrong entry after truncating at " + std::to_string(keep));
+            }
+        }
+    }
+
+    ASSERT_CHAT_TEST(moved, "No truncation moved the held entry, the test doesn't cover the erasure with a held iterator");
+    postLog("The held iterator pointed to another entry after " + std::to_string(moved) + " of "
+            + std::to_string(truncations) + " truncations");
+}
+
+/**
+ * @brief TEST_IdMapLookupHeldIterator
+ *
+ * This test does the following:
+ *
+ * - Fill a karere::IdMap up to its maximum load, and hold an iterator to each entry
+ * - Look up every key with emplace() and operator[], as done to get or create an entry
+ * + Check no entry was moved, and no value was overwritten
+ * - Insert a new key
+ * + Check the map grew, and every entry is still found with its value
+ */
+void MegaChatUnitTest::TEST_IdMapLookupHeldIterator()
+{
+    static const unsigned kEntries = 12;    // 3/4 of the minimum capacity
+
+    std::mt19937_64 rng(kEntries);
+    karere::IdMap<uint64_t> map;
+    std::vector<karere::Id> ids;
+    for (unsigned i = 0; i < kEntries; i++)
+    {
+        ids.push_back(rng());
+        map[ids.back()] = i;
+    }
+    std::vector<const void*> slots;
+    for (karere::Id id: ids)
+    {
+        slots.push_back(&*map.find(id));
+    }
+    size_t usage = map.memoryUsage();
+
+    for (unsigned i = 0; i < kEntries; i++)
+    {
+        auto result = map.emplace(ids[i], kEntries + i);
+        ASSERT_CHAT_TEST(!result.second && result.first->second == i, "emplace() of an existing key changed its value");
+        ASSERT_CHAT_TEST(map[ids[i]] == i, "operator[] of an existing key changed its value");
+    }
+    ASSERT_CHAT_TEST(map.size() == kEntries && map.memoryUsage() == usage, "The lookup of existing keys grew the map");
+    for (unsigned i = 0; i < kEntries; i++)
+    {
+        ASSERT_CHAT_TEST(&*map.find(ids[i]) == slots[i], "The lookup of existing keys moved entry " + std::to_string(i));
+    }
+
+    karere::Id newId = rng();
+    map[newId] = kEntries;
+    ASSERT_CHAT_TEST(map.size() == kEntries + 1 && map.memoryUsage() > usage, "The map didn't grow for a new key");
+    for (unsigned i = 0; i < kEntries; i++)
+    {
+        auto it = map.find(ids[i]);
+        ASSERT_CHAT_TEST(it != map.end() && it->second == i, "Entry lost after growing the map");
+    }
+    ASSERT_CHAT_TEST(map.find(newId) != map.end(), "New entry not found after growing the map");
+}
+
+/**
+ * @brief TEST_ParallelSignatureVerification
+ *
+ * This test does the following:
+ *
+ * - Sign 10k messages of 1KB with Ed25519, like a history fetch of 10k messages,
+ * and corrupt one signature out of 100
+ * - Verify all the signatures in this thread, and then in a karere::WorkerPool with
+ * 1, 2, 4... threads, up to the number of hardware threads
+ * - Check that every run finds the same valid signatures, and log the speedup of each run
+ */
+void MegaChatUnitTest::TEST_ParallelSignatureVerification()
+{
+    static const unsigned kMessages = 10000;
+    static const unsigned kMessageSize = 1024;
+
+    unsigned char pubKey[crypto_sign_PUBLICKEYBYTES];
+    unsigned char privKey[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair(pubKey, privKey);
+    std::vector<std::string> messages(kMessages);
+    std::vector<std::array<unsigned char, crypto_sign_BYTES>> signatures(kMessages);
+    for (unsigned i = 0; i < kMessages; i++)
+    {
+        messages[i].assign(kMessageSize, 'a' + i % 26);
+        messages[i].append(std::to_string(i));
+        crypto_sign_detached(signatures[i].data(), NULL, (const unsigned char*)messages[i].data(),
+                             messages[i].size(), privKey);
+        if (i % 100 == 99)
+        {
+            signatures[i][0] ^= 1;
+        }
+    }
+    unsigned expectedValid = kMessages - kMessages / 100;
+    auto verify = [&](unsigned i)
+    {
+        return crypto_sign_verify_detached(signatures[i].data(), (const unsigned char*)messages[i].data(),
+                                           messages[i].size(), pubKey) == 0;
+    };
+
+    unsigned valid = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kMessages; i++)
+    {
+        valid += verify(i);
+    }
+    double serialTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(valid == expectedValid, "Wrong number of valid signatures: " + std::to_string(valid));
+    postLog("Serial: " + std::to_string(serialTime * 1000) + " ms");
+
+    for (size_t threads = 1; threads <= karere::WorkerPool::defaultThreadCount(); threads *= 2)
+    {
+        std::atomic<unsigned> validCount(0);
+        std::atomic<unsigned> doneCount(0);
+        std::mutex mutex;
+        std::condition_variable allDone;
+        start = std::chrono::steady_clock::now();
+        {
+            karere::WorkerPool pool(threads);
+            for (unsigned i = 0; i < kMessages; i++)
+            {
+                pool.post([&, i]()
+                {
+                    if (verify(i))
+                    {
+                        validCount++;
+                    }
+                    if (++doneCount == kMessages)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        allDone.notify_one();
+                    }
+                });
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            allDone.wait(lock, [&doneCount]() { return doneCount == kMessages; });
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        ASSERT_CHAT_TEST(validCount == expectedValid, "Wrong number of valid signatures with "
+                         + std::to_string(threads) + " threads: " + std::to_string(validCount));
+        postLog(std::to_string(threads) + " threads: " + std::to_string(elapsed * 1000) + " ms, speedup "
+                + std::to_string(elapsed > 0 ? serialTime / elapsed : 0));
+    }
+}
+
+/**
+ * @brief TEST_TraceSpans
+ *
+ * This test does the following:
+ *
+ * - Record spans with tracing disabled, and check that they are not exported
+ * - Enable tracing and record spans from several threads, while another thread exports them
+ * - Check that the exported JSON contains every span, with its id, and log the cost of a span
+ * - Write the spans to a file, as karere::Client does on termination with KRCHAT_TRACE
+ * + Check the file has the exported JSON
+ */
+void MegaChatUnitTest::TEST_TraceSpans()
+{
+    static const unsigned kThreads = 4;
+    static const unsigned kSpansPerThread = 1000;
+
+    auto countOf = [](const std::string& str, const std::string& what)
+    {
+        size_t count = 0;
+        for (size_t pos = str.find(what); pos != std::string::npos; pos = str.find(what, pos + what.size()))
+        {
+            count++;
+        }
+        return count;
+    };
+
+    bool wasEnabled = karere::Trace::enabled();
+    karere::Trace::setEnabled(false);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < kSpansPerThread; i++)
+    {
+        KR_TRACE_SPAN("test.disabled");
+    }
+    double disabledTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ASSERT_CHAT_TEST(countOf(karere::Trace::toChromeJson(), "\"test.disabled\"") == 0,
+                     "Spans recorded while tracing was disabled");
+
+    karere::Trace::setEnabled(true);
+    size_t droppedBefore = karere::Trace::droppedCount();
+    std::atomic<bool> done(false);
+    std::thread exporter([&done]()
+    {
+        while (!done)
+        {
+            karere::Trace::toChromeJson();
+        }
+    });
+    start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < kThreads; t++)
+    {
+        threads.emplace_back([]()
+        {
+            for (unsigned i = 0; i < kSpansPerThread; i++)
+            {
+                KR_TRACE_SPAN_ID("test.span", 0xabc);
+            }
+        });
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    double enabledTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    done = true;
+    exporter.join();
+    karere::Trace::setEnabled(wasEnabled);
+
+    std::string json = karere::Trace::toChromeJson();
+    size_t recorded = countOf(json, "\"test.span\"") + karere::Trace::droppedCount() - droppedBefore;
+    ASSERT_CHAT_TEST(json.compare(0, 16, "{\"traceEvents\":[") == 0, "Unexpected trace format: " + json.substr(0, 100));
+    ASSERT_CHAT_TEST(recorded == kThreads * kSpansPerThread, "Wrong number of recorded spans: " + std::to_string(recorded));
+    ASSERT_CHAT_TEST(countOf(json, "\"id\":\"0000000000000abc\"") >= countOf(json, "\"test.span\""), "Span ids were not exported");
+
+    std::string path = LOCAL_PATH + "/trace.json";
+    ASSERT_CHAT_TEST(karere::Trace::writeChromeJson(path.c_str()), "Can't write the spans to " + path);
+    std::ifstream file(path, std::ios::binary);
+    std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    remove(path.c_str());
+    ASSERT_CHAT_TEST(written == json, "The file doesn't have the exported spans");
+
+    postLog("Disabled span: " + std::to_string(disabledTime * 1e9 / kSpansPerThread) + " ns, enabled span: "
+            + std::to_string(enabledTime * 1e9 / (kThreads * kSpansPerThread)) + " ns (with " + std::to_string(kThreads) + " threads)");
+}
+
+/**
+ * @brief TEST_AsyncLogger
+ *
+ * This test does the following:
+ *
+ * - Register a user logger and enable asynchronous logging, with a queue smaller than the messages logged
+ * - Log messages from several threads, flush, and check that every message was output once,
+ * in order within each thread, and from the writer thread
+ * - Disable asynchronous logging and check that messages are output from the calling thread again
+ */
+void MegaChatUnitTest::TEST_AsyncLogger()
+{
+    static const unsigned kThreads = 4;
+    static const unsigned kMsgsPerThread = 2000;
+
+    struct TestLogger: public karere::Logger::ILoggerBackend
+    {
+        std::mutex mutex;
+        std::vector<int> lastMsg;
+        size_t count = 0;
+        bool outOfOrder = false;
+        std::set<std::thread::id> outputThreads;
+        TestLogger(): lastMsg(kThreads, -1) {}
+        virtual void log(krLogLevel /*level*/, const char* msg, size_t /*len*/, unsigned /*flags*/)
+        {
+            const char* marker = strstr(msg, "asyncTest ");
+            unsigned thread, i;
+            if (!marker || sscanf(marker, "asyncTest %u %u", &thread, &i) != 2 || thread >= kThreads)
+            {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            outOfOrder |= ((int)i <= lastMsg[thread]);
+            lastMsg[thread] = i;
+            count++;
+            outputThreads.insert(std::this_thread::get_id());
+        }
+    };
+
+    TestLogger* logger = new TestLogger;
+    karere::gLogger.addUserLogger("TEST_AsyncLogger", logger);
+    bool wasAsync = karere::gLogger.isAsync();
+    karere::gLogger.setAsync(true, 256, karere::Logger::kOverflowBlock);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    std::set<std::thread::id> producerThreads;
+    for (unsigned t = 0; t < kThreads; t++)
+    {
+        threads.emplace_back([t]()
+        {
+            for (unsigned i = 0; i < kMsgsPerThread; i++)
+            {
+                karere::gLogger.log("test", krLogLevelInfo, krLogNoConsole | krLogNoFile, "asyncTest %u %u\n", t, i);
+            }
+        });
+        producerThreads.insert(threads.back().get_id());
+    }
+    for (auto& thread: threads)
+    {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    karere::gLogger.flush();
+
+    {
+        std::lock_guard<std::mutex> lock(logger->mutex);
+        ASSERT_CHAT_TEST(logger->count == kThreads * kMsgsPerThread, "Wrong number of messages output: " + std::to_string(logger->count));
+        ASSERT_CHAT_TEST(!logger->outOfOrder, "Messages of a thread were output out of order");
+        ASSERT_CHAT_TEST(logger->outputThreads.size() == 1
+                         && !producerThreads.count(*logger->outputThreads.begin()), "Messages were not output by the writer thread");
+        logger->outputThreads.clear();
+    }
+
+    karere::gLogger.setAsync(false);
+    karere::gLogger.log("test", krLogLevelInfo, krLogNoConsole | krLogNoFile, "asyncTest 0 %u\n", kMsgsPerThread);
+    karere::gLogger.removeUserLogger("TEST_AsyncLogger");
+    ASSERT_CHAT_TEST(logger->outputThreads.size() == 1 && *logger->outputThreads.begin() == std::this_thread::get_id(),
+                     "Messages were not output synchronously after disabling asynchronous logging");
+    delete logger;
+    karere::gLogger.setAsync(wasAsync);
+
+    postLog("Async logging: " + std::to_string(elapsed * 1e9 / (kThreads * kMsgsPerThread)) + " ns per message (with "
+            + std::to_string(kThreads) + " threads)");
+}
+
+/**
+ * @brief TEST_DatabaseWalMode
+ *
+ * This test does the following:
+ *
+ * - Open a database in WAL mode, with committing after each statement
+ * - Insert rows, and check that they are read back by the same connection
+ * - Check that another connection sees them, and that the syncer checkpoints them into the
+ * db file
+ * - Log the time per insert in WAL mode and in the default mode
+ * - Reopen the database in WAL mode with a long sync interval and one open transaction,
+ * as the app does, insert more rows and call commitAndSync(), as done in background
+ * + Check that the syncer checkpoints them without waiting for the interval
+ * - Reopen the database with WAL mode disabled, and check that the rows are there
+ * and the WAL file is removed
+ */
+void MegaChatUnitTest::TEST_DatabaseWalMode()
+{
+    static const unsigned kRows = 200;
+    static const unsigned kSyncIntervalMs = 100;
+    static const unsigned kLongSyncIntervalMs = 60000;
+
+    std::string path = LOCAL_PATH + "/walmode.db";
+    auto removeDb = [&path]()
+    {
+        remove(path.c_str());
+        remove((path + "-wal").c_str());
+        remove((path + "-shm").c_str());
+    };
+    auto insertRows = [](SqliteDb& db, unsigned firstId) -> double
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = firstId; i < firstId + kRows; i++)
+        {
+            db.query("insert into walmode(id, data) values(?, ?)", i, std::string(100, 'a'));
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // default mode, as reference
+    removeDb();
+    double defaultTime;
+    {
+        SqliteDb db;
+        ASSERT_CHAT_TEST(db.open(path.c_str(), true), "Can't open database at " + path);
+        db.simpleQuery("create table walmode(id int primary key, data text)");
+        defaultTime = insertRows(db, 0);
+        db.close();
+    }
+
+    removeDb();
+    SqliteDb db;
+    db.setWalMode(true, kSyncIntervalMs);
+    ASSERT_CHAT_TEST(db.open(path.c_str(), true), "Can't open database at " + path);
+    ASSERT_CHAT_TEST(db.isWalSyncing(), "Database not in WAL mode");
+    db.simpleQuery("create table walmode(id int primary key, data text)");
+    double walTime = insertRows(db, 0);
+    {
+        SqliteStmt stmt(db, "select count(*) from walmode");
+        stmt.stepMustHaveData("count rows");
+        ASSERT_CHAT_TEST(stmt.intCol(0) == (int)kRows, "Wrong number of rows read by the writer: " + std::to_string(stmt.intCol(0)));
+    }
+
+    sqlite3 *reader = NULL;
+    ASSERT_CHAT_TEST(sqlite3_open_v2(path.c_str(), &reader, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK, "Can't open a second connection");
+    int count = -1;
+    auto countRows = [](void *out, int, char **values, char **) -> int
+    {
+        *static_cast<int *>(out) = atoi(values[0]);
+        return 0;
+    };
+    sqlite3_exec(reader, "select count(*) from walmode", countRows, &count, NULL);
+    sqlite3_close(reader);
+    ASSERT_CHAT_TEST(count == (int)kRows, "Wrong number of rows read by another connection: " + std::to_string(count));
+
+    // waits for the syncer to checkpoint the rows, checking a copy of the db file without its WAL
+    auto waitCheckpoint = [&path, &countRows](int rows) -> int
+    {
+        std::string copy = path + ".copy";
+        int count = -1;
+        for (int i = 0; i < 20 && count != rows; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(kSyncIntervalMs));
+            {
+                std::ifstream src(path, std::ios::binary);
+                std::ofstream dst(copy, std::ios::binary | std::ios::trunc);
+                dst << src.rdbuf();
+            }
+            sqlite3 *conn = NULL;
+            if (sqlite3_open(copy.c_str(), &conn) == SQLITE_OK)
+            {
+                sqlite3_exec(conn, "select count(*) from walmode", countRows, &count, NULL);
+            }
+            sqlite3_close(conn);
+            remove(copy.c_str());
+            remove((copy + "-wal").c_str());
+            remove((copy + "-shm").c_str());
+        }
+        return count;
+    };
+    count = waitCheckpoint(kRows);
+    ASSERT_CHAT_TEST(count == (int)kRows, "The WAL was not checkpointed: " + std::to_string(count) + " rows in the db file");
+    db.close();
+
+    postLog("Database insert: " + std::to_string(walTime * 1e6 / kRows) + " us per row in WAL mode, "
+            + std::to_string(defaultTime * 1e6 / kRows) + " us in default mode");
+
+    // synced on demand, long before the interval expires
+    db.setWalMode(true, kLongSyncIntervalMs);
+    ASSERT_CHAT_TEST(db.open(path.c_str(), false), "Can't reopen database at " + path);
+    ASSERT_CHAT_TEST(db.isWalSyncing(), "Database not in WAL mode after reopening");
+    insertRows(db, kRows);
+    db.commitAndSync();
+    count = waitCheckpoint(kRows * 2);
+    ASSERT_CHAT_TEST(count == (int)kRows * 2, "The WAL was not checkpointed after commitAndSync(): "
+                     + std::to_string(count) + " rows in the db file");
+    db.close();
+
+    db.setWalMode(false);
+    ASSERT_CHAT_TEST(db.open(path.c_str(), true), "Can't reopen database at " + path);
+    ASSERT_CHAT_TEST(!db.isWalSyncing(), "Database still in WAL mode");
+    {
+        SqliteStmt stmt(db, "select count(*) from walmode");
+        stmt.stepMustHaveData("count rows");
+        ASSERT_CHAT_TEST(stmt.intCol(0) == (int)kRows * 2, "Wrong number of rows after reopening: " + std::to_string(stmt.intCol(0)));
+    }
+    db.close();
+    struct stat info;
+    bool walExists = (stat((path + "-wal").c_str(), &info) == 0);
+    removeDb();
+    ASSERT_CHAT_TEST(!walExists, "WAL file not removed after disabling WAL mode");
+}
+
+// the history in db of a chat that doesn't exist, which is fetching history from server while \c fetching is set
+class UnitTestHistoryDb : public ChatdSqliteDb
+{
+public:
+    bool fetching = false;
+    UnitTestHistoryDb(SqliteDb &db, karere::Id chatid) : ChatdSqliteDb(db, chatid) {}
+    virtual bool isFetchingFromServer() const { return fetching; }
+    using ChatdSqliteDb::kMaxPendingHistory;
+};
+
+/**
+ * @brief TEST_HistoryInsertBatching
+ *
+ * This test does the following:
+ *
+ * - Create a database from the current schema, as the app does (one open transaction)
+ * - Add 300 messages to the history of a chat while it's fetching history from server
+ * + Check no message is written until ChatdSqliteDb::kMaxPendingHistory are pending
+ * + Check that reading the history writes the pending messages first, and returns all of them in order
+ * - Add a history of 50k messages (5k in debug builds) while not fetching from server, so each one
+ * is written when added
+ * - Add the same history to an empty database while fetching from server, so they are written in batches
+ * + Check both databases have the same history
+ * - Log the time per message of both
+ */
+void MegaChatUnitTest::TEST_HistoryInsertBatching()
+{
+#ifdef NDEBUG
+    static const int kMessages = 50000;
+#else
+    // debug builds check the continuity of the history in db upon every write, with a query
+    // as slow as the whole history
+    static const int kMessages = 5000;
+#endif
+    static const int kFewMessages = 300;
+    static const karere::Id kChatid(0x1234567890abcdefULL);
+
+    std::vector<std::unique_ptr<chatd::Message>> history;
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < kMessages; i++)
+    {
+        // as received by OLDMSG, from the newest to the oldest (idx = -i)
+        std::string data(20 + rng() % 200, 'a' + i % 26);
+        karere::Id msgid(rng());
+        karere::Id userid(0x1000 + rng() % 10);
+        chatd::Message *msg = new chatd::Message(msgid, userid, 1500000000 - i, 0, data.data(), data.size(),
+                                                 false, 0xfffffffe - (i / 100), chatd::Message::kMsgNormal);
+        msg->backRefId = rng();
+        history.emplace_back(msg);
+    }
+
+    std::string path = LOCAL_PATH + "/histinsert.db";
+    auto createDb = [this, &path](SqliteDb &db)
+    {
+        remove(path.c_str());
+        ASSERT_CHAT_TEST(db.open(path.c_str(), false), "Can't open database at " + path);
+        db.simpleQuery(karere::gDbSchema);
+    };
+    auto rowCount = [](SqliteDb &db) -> int
+    {
+        SqliteStmt stmt(db, "select count(*) from history");
+        stmt.stepMustHaveData("history count");
+        return stmt.intCol(0);
+    };
+    auto checksum = [](SqliteDb &db) -> std::string
+    {
+        SqliteStmt stmt(db, "select count(*), sum(idx), sum(msgid % 1000003), sum(length(data)), "
+                            "sum(keyid), sum(userid % 1000003), sum(ts), sum(backrefid % 1000003) from history");
+        stmt.stepMustHaveData("history checksum");
+        std::string result;
+        for (int i = 0; i < 8; i++)
+        {
+            result.append(std::to_string(stmt.int64Col(i))).append(" ");
+        }
+        return result;
+    };
+
+    // pending messages, while fetching from server
+    {
+        SqliteDb db;
+        createDb(db);
+        UnitTestHistoryDb historyDb(db, kChatid);
+        historyDb.fetching = true;
+        int i = 0;
+        for (; i < UnitTestHistoryDb::kMaxPendingHistory - 1; i++)
+        {
+            historyDb.addMsgToHistory(*history[i], -i);
+        }
+        ASSERT_CHAT_TEST(rowCount(db) == 0, "Messages written before a batch is full: " + std::to_string(rowCount(db)));
+        historyDb.addMsgToHistory(*history[i], -i);
+        i++;
+        ASSERT_CHAT_TEST(rowCount(db) == UnitTestHistoryDb::kMaxPendingHistory,
+                         "Full batch not written: " + std::to_string(rowCount(db)) + " messages in db");
+        for (; i < kFewMessages; i++)
+        {
+            historyDb.addMsgToHistory(*history[i], -i);
+        }
+
+        std::vector<chatd::Message *> loaded;
+        historyDb.fetchDbHistory(0, kFewMessages + 1, loaded);
+        bool inOrder = (loaded.size() == static_cast<size_t>(kFewMessages));
+        for (size_t j = 0; inOrder && j < loaded.size(); j++)
+        {
+            inOrder = (loaded[j]->id() == history[j]->id() && loaded[j]->dataSize() == history[j]->dataSize()
+                       && !memcmp(loaded[j]->buf(), history[j]->buf(), loaded[j]->dataSize()));
+        }
+        for (chatd::Message *msg : loaded)
+        {
+            delete msg;
+        }
+        ASSERT_CHAT_TEST(inOrder, "Wrong history read while messages are pending: "
+                         + std::to_string(loaded.size()) + " of " + std::to_string(kFewMessages) + " messages");
+        ASSERT_CHAT_TEST(rowCount(db) == kFewMessages, "Pending messages not written before reading the history");
+        db.close();
+    }
+
+    // adds the whole history to a new database and returns the time it took
+    auto addHistory = [&](bool fetching, std::string &sum) -> double
+    {
+        SqliteDb db;
+        createDb(db);
+        double time;
+        {
+            UnitTestHistoryDb historyDb(db, kChatid);
+            historyDb.fetching = fetching;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < kMessages; i++)
+            {
+                historyDb.addMsgToHistory(*history[i], -i);
+            }
+            historyDb.flushHistory();   // as upon HISTDONE
+            db.commit();
+            time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        sum = checksum(db);
+        db.close();
+        return time;
+    };
+
+    std::string singleChecksum;
+    std::string batchChecksum;
+    double singleTime = addHistory(false, singleChecksum);
+    double batchTime = addHistory(true, batchChecksum);
+    remove(path.c_str());
+
+    ASSERT_CHAT_TEST(singleChecksum == batchChecksum, "Different history after batched inserts: "
+                     + batchChecksum + "vs " + singleChecksum);
+    ASSERT_CHAT_TEST(singleChecksum.compare(0, std::to_string(kMessages).size() + 1, std::to_string(kMessages) + " ") == 0,
+                     "Wrong number of messages in history: " + singleChecksum);
+
+    postLog("History of " + std::to_string(kMessages) + " messages: " + std::to_string(singleTime * 1e6 / kMessages)
+            + " us per message one by one, " + std::to_string(batchTime * 1e6 / kMessages) + " us batched ("
+            + std::to_string(batchTime > 0 ? singleTime / batchTime : 0) + "x)");
+}
+
+// the app and the network layer of a karere::Client that is never initialized nor connected
+class UnitTestApp : public karere::IApp
+{
+public:
+    virtual IChatListHandler* chatListHandler() { return NULL; }
+    virtual void onPresenceConfigChanged(const presenced::Config& /*config*/, bool /*pending*/) {}
+    virtual void onPresenceLastGreenUpdated(karere::Id /*userid*/, uint16_t /*lastGreen*/) {}
+#ifndef KARERE_DISABLE_WEBRTC
+    virtual rtcModule::ICallHandler* onIncomingCall(rtcModule::ICall& /*call*/, karere::AvFlags /*av*/) { return NULL; }
+    virtual rtcModule::ICallHandler* onGroupCallActive(karere::Id /*chatid*/, karere::Id /*callid*/, uint32_t /*duration*/) { return NULL; }
+#endif
+};
+
+class UnitTestWebsocketsIO : public WebsocketsIO
+{
+public:
+    UnitTestWebsocketsIO(::mega::Mutex *mutex, ::mega::MegaApi *megaApi) : WebsocketsIO(mutex, megaApi, NULL) {}
+
+protected:
+    virtual bool wsResolveDNS(const char * /*hostname*/, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> /*f*/)
+    {
+        return false;
+    }
+    virtual WebsocketsClientImpl *wsConnect(const char * /*ip*/, const char * /*host*/, int /*port*/, const char * /*path*/,
+                                            bool /*ssl*/, WebsocketsClient * /*client*/)
+    {
+        return NULL;
+    }
+};
+
+// exposes the notifications of changes of attributes, which come from the SDK
+class UnitTestUserAttrCache : public karere::UserAttrCache
+{
+public:
+    UnitTestUserAttrCache(karere::Client& client) : karere::UserAttrCache(client) {}
+    using karere::UserAttrCache::onUserAttrChange;
+};
+
+/**
+ * @brief TEST_UserAttrCache
+ *
+ * This test does the following:
+ *
+ * - Create a karere client that is not logged in, so no attribute is fetched from the
+ * server, and a cache of user attributes with some attributes in its db only
+ * - Request an attribute that is only in the db
+ * + Check it's loaded and the callback is called before getAttr() returns
+ * - Request an attribute that isn't in the db
+ * + Check the callback is not called, since it's being fetched
+ * - Request more avatars than fit in the budget of large attributes: one with a
+ * callback, one with a pending fetch and idle ones
+ * + Check only the idle ones are dropped from memory, and they're loaded from the db again
+ * - Notify the change of an attribute that is in the db but not in memory
+ * + Check its row is deleted from the db
+ */
+void MegaChatUnitTest::TEST_UserAttrCache()
+{
+    static const size_t kAvatarSize = 100 * 1024;
+    static const uint64_t kUsers[] = { 0x1001, 0x1002, 0x1003, 0x1004, 0x1005 };
+
+    std::string path = LOCAL_PATH + "/userattrs.db";
+    remove(path.c_str());
+    ::mega::Mutex mutex(true);
+    ::mega::MegaApi *megaApi = new ::mega::MegaApi("MBoVFSyZ", LOCAL_PATH.c_str(), "MEGAChatUnitTest");
+    UnitTestWebsocketsIO *websocketsIO = new UnitTestWebsocketsIO(&mutex, megaApi);
+    UnitTestApp app;
+    karere::Client *client = new karere::Client(*megaApi, websocketsIO, app, LOCAL_PATH, 0);
+    ASSERT_CHAT_TEST(client->db.open(path.c_str(), false), "Can't open database at " + path);
+    client->db.simpleQuery(karere::gDbSchema);
+
+    std::string avatar(kAvatarSize, 'a');
+    for (uint64_t user: kUsers)
+    {
+        client->db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                         user, ::mega::MegaApi::USER_ATTR_AVATAR, StaticBuffer(avatar.data(), avatar.size()));
+    }
+    std::string firstname = "Alice";
+    std::string lastname = "Smith";
+    client->db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                     kUsers[0], ::mega::MegaApi::USER_ATTR_FIRSTNAME, StaticBuffer(firstname.data(), firstname.size()));
+    client->db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                     kUsers[4], ::mega::MegaApi::USER_ATTR_LASTNAME, StaticBuffer(lastname.data(), lastname.size()));
+
+    struct Result
+    {
+        int calls = 0;
+        std::string data;
+    };
+    auto cb = [](Buffer *buf, void *userp)
+    {
+        Result *result = static_cast<Result *>(userp);
+        result->calls++;
+        result->data = buf ? std::string(buf->buf(), buf->dataSize()) : "";
+    };
+    auto isLoaded = [](UnitTestUserAttrCache& cache, uint64_t user)
+    {
+        return cache.find(karere::UserAttrPair(user, ::mega::MegaApi::USER_ATTR_AVATAR)) != cache.end();
+    };
+    auto rowCount = [client](uint64_t user, int type) -> int
+    {
+        SqliteStmt stmt(client->db, "select count(*) from userattrs where userid=? and type=?");
+        stmt << user << type;
+        stmt.stepMustHaveData("count of user attributes");
+        return stmt.intCol(0);
+    };
+
+    {
+        UnitTestUserAttrCache cache(*client);
+
+        // in the db: loaded on demand and delivered synchronously
+        Result name;
+        cache.getAttr(kUsers[0], ::mega::MegaApi::USER_ATTR_FIRSTNAME, &name, cb, true);
+        ASSERT_CHAT_TEST(name.calls == 1, "The attribute in the db wasn't delivered synchronously");
+        ASSERT_CHAT_TEST(name.data == firstname, "Wrong attribute loaded from the db: " + name.data);
+
+        // not in the db: fetched from the server (never, since it's not logged in)
+        Result email;
+        cache.getAttr(kUsers[0], karere::USER_ATTR_EMAIL, &email, cb, true);
+        ASSERT_CHAT_TEST(email.calls == 0, "Callback called for an attribute that isn't in the db");
+
+        // one avatar with a callback, and one with a fetch in progress
+        Result withCb;
+        karere::UserAttrCache::Handle handle = cache.getAttr(kUsers[0], ::mega::MegaApi::USER_ATTR_AVATAR, &withCb, cb);
+        ASSERT_CHAT_TEST(withCb.calls == 1 && withCb.data == avatar, "The avatar in the db wasn't delivered synchronously");
+        Result pending;
+        karere::UserAttrCache::Handle pendingHandle = cache.getAttr(kUsers[1], ::mega::MegaApi::USER_ATTR_AVATAR, &pending, cb);
+        cache.onUserAttrChange(kUsers[1], ::mega::MegaUser::CHANGE_TYPE_AVATAR);  // re-fetched while it has callbacks
+        cache.removeCb(pendingHandle);
+
+        // idle ones, which exceed the budget
+        Result idle;
+        cache.getAttr(kUsers[2], ::mega::MegaApi::USER_ATTR_AVATAR, &idle, cb, true);
+        cache.getAttr(kUsers[3], ::mega::MegaApi::USER_ATTR_AVATAR, &idle, cb, true);
+        ASSERT_CHAT_TEST(idle.calls == 2, "The avatars in the db weren't delivered synchronously");
+        ASSERT_CHAT_TEST(isLoaded(cache, kUsers[0]), "Avatar with a callback dropped from memory");
+        ASSERT_CHAT_TEST(isLoaded(cache, kUsers[1]), "Avatar being fetched dropped from memory");
+        ASSERT_CHAT_TEST(!isLoaded(cache, kUsers[2]), "Idle avatar kept in memory beyond the budget");
+        ASSERT_CHAT_TEST(isLoaded(cache, kUsers[3]), "Most recently used avatar dropped from memory");
+
+        // nothing fits, but the most recently used one
+        cache.setLargeAttrBudget(0);
+        cache.getAttr(kUsers[2], ::mega::MegaApi::USER_ATTR_AVATAR, &idle, cb, true);
+        ASSERT_CHAT_TEST(idle.calls == 3 && idle.data == avatar, "Dropped avatar not loaded from the db again");
+        ASSERT_CHAT_TEST(isLoaded(cache, kUsers[0]) && isLoaded(cache, kUsers[1]), "Avatar in use dropped from memory");
+        ASSERT_CHAT_TEST(isLoaded(cache, kUsers[2]) && !isLoaded(cache, kUsers[3]), "Idle avatar kept in memory beyond the budget");
+        cache.removeCb(handle);
+        cache.setLargeAttrBudget(0);
+        ASSERT_CHAT_TEST(!isLoaded(cache, kUsers[0]), "Avatar without callbacks kept in memory beyond the budget");
+        ASSERT_CHAT_TEST(isLoaded(cache, kUsers[1]), "Avatar being fetched dropped from memory");
+
+        // changed while not loaded: the db is not up to date anymore
+        ASSERT_CHAT_TEST(rowCount(kUsers[4], ::mega::MegaApi::USER_ATTR_LASTNAME) == 1, "Attribute not in the db");
+        cache.onUserAttrChange(kUsers[4], ::mega::MegaUser::CHANGE_TYPE_LASTNAME);
+        ASSERT_CHAT_TEST(rowCount(kUsers[4], ::mega::MegaApi::USER_ATTR_LASTNAME) == 0, "Changed attribute not deleted from the db");
+        ASSERT_CHAT_TEST(cache.find(karere::UserAttrPair(kUsers[4], ::mega::MegaApi::USER_ATTR_LASTNAME)) == cache.end(),
+                         "Changed attribute loaded into memory");
+        ASSERT_CHAT_TEST(rowCount(kUsers[4], ::mega::MegaApi::USER_ATTR_AVATAR) == 1, "Unchanged attribute deleted from the db");
+    }
+
+    client->terminate();
+    delete client;
+    delete websocketsIO;
+    delete megaApi;
+    remove(path.c_str());
+}
+
+// the end of the network layer: chatd::Connection executes the commands of the frames from here
+class UnitTestFrameHandler : public WebsocketsClient
+{
+public:
+    std::function<void(const char *, size_t)> onFrame;
+    virtual void wsConnectCb() {}
+    virtual void wsCloseCb(int /*errcode*/, int /*errtype*/, const char * /*preason*/, size_t /*reason_len*/) {}
+    virtual void wsHandleMsgCb(char *data, size_t len) { onFrame(data, len); }
+    virtual void wsSendMsgCb(const char * /*data*/, size_t /*len*/) {}
+};
+
+// a connection that only receives
+class UnitTestWebsocketsClientImpl : public WebsocketsClientImpl
+{
+public:
+    UnitTestWebsocketsClientImpl(::mega::Mutex *mutex, WebsocketsClient *client) : WebsocketsClientImpl(mutex, client) {}
+    virtual bool wsSendMessage(char * /*msg*/, size_t /*len*/) { return false; }
+    virtual void wsDisconnect(bool /*immediate*/) {}
+    virtual bool wsIsConnected() { return true; }
+    virtual size_t wsSendQueueSize() { return 0; }
+};
+
+/**
+ * @brief TEST_FrameReassembly
+ *
+ * This test does the following:
+ *
+ * - Split big frames (i.e. batches of history) into fragments, as libwebsockets delivers them
+ * - Pass them to WebsocketsClientImpl::wsHandleFragmentCb(), as LibwebsocketsClient does, which reassembles
+ * them in buffers of a RecvBufferPool and passes each frame to the WebsocketsClient (where chatd executes it)
+ * - Do the same, reassembling them as it was done before, in a std::string that lives as long as the connection
+ * + Check both deliver the same frames
+ * + Check frames received in a single fragment are delivered without copying them
+ * - Log the throughput of both
+ */
+void MegaChatUnitTest::TEST_FrameReassembly()
+{
+    static const unsigned kFrames = 200;
+    static const unsigned kFramesPerConnection = 20;
+    static const size_t kFragmentSize = 4096;   // the rx buffer of libwebsockets
+    static const unsigned kRounds = 5;
+
+    std::mt19937 rng(42);
+    std::vector<std::string> frames(kFrames);
+    size_t totalSize = 0;
+    for (std::string& frame: frames)
+    {
+        frame.resize(16 * 1024 + rng() % (768 * 1024));
+        for (size_t i = 0; i < frame.size(); i++)
+        {
+            frame[i] = (char)(i * 31 + frame.size());
+        }
+        totalSize += frame.size();
+    }
+
+    // what the handler of the frame reads from it
+    auto checksum = [](const char *data, size_t len) -> uint64_t
+    {
+        uint64_t sum = len;
+        for (size_t i = 0; i < len; i += 64)
+        {
+            sum += (unsigned char)data[i];
+        }
+        return sum;
+    };
+
+    // calls feed(data, len, remaining) for each fragment, and done() after the last one of each frame
+    auto fragmentFrames = [&frames](unsigned frameOffset, const std::function<void(char*, size_t, size_t)>& feed,
+            const std::function<void()>& done)
+    {
+        for (unsigned i = 0; i < kFramesPerConnection; i++)
+        {
+            std::string& frame = frames[(frameOffset + i) % frames.size()];
+            for (size_t pos = 0; pos < frame.size(); pos += kFragmentSize)
+            {
+                size_t len = std::min(kFragmentSize, frame.size() - pos);
+                feed(&frame[pos], len, frame.size() - pos - len);
+            }
+            done();
+        }
+    };
+
+    ::mega::Mutex mutex(true);
+    UnitTestFrameHandler handler;
+    UnitTestWebsocketsClientImpl impl(&mutex, &handler);
+
+    // frames in a single fragment
+    {
+        RecvBufferPool pool;
+        FrameReassembler reassembler(pool);
+        char frame[] = "single fragment";
+        const char *delivered = NULL;
+        handler.onFrame = [&delivered](const char *data, size_t /*len*/) { delivered = data; };
+        impl.wsHandleFragmentCb(reassembler, frame, sizeof(frame), 0, true);
+        ASSERT_CHAT_TEST(delivered == frame, "Frame in a single fragment copied before delivering it");
+    }
+
+    uint64_t received = 0;
+    handler.onFrame = [&received, &checksum](const char *data, size_t len)
+    {
+        received += checksum(data, len);
+    };
+
+    // pooled buffers, as LibwebsocketsClient
+    uint64_t poolSum = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        RecvBufferPool pool;
+        for (unsigned round = 0; round < kRounds; round++)
+        {
+            for (unsigned conn = 0; conn < kFrames; conn += kFramesPerConnection)
+            {
+                FrameReassembler reassembler(pool);
+                fragmentFrames(conn, [&impl, &reassembler](char *data, size_t len, size_t remaining)
+                {
+                    impl.wsHandleFragmentCb(reassembler, data, len, remaining, remaining == 0);
+                },
+                []() {});
+            }
+        }
+        poolSum = received;
+    }
+    double poolTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // std::string per connection, as before the pool
+    received = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned round = 0; round < kRounds; round++)
+    {
+        for (unsigned conn = 0; conn < kFrames; conn += kFramesPerConnection)
+        {
+            std::string recbuffer;
+            fragmentFrames(conn, [&recbuffer](char *data, size_t len, size_t remaining)
+            {
+                if (!recbuffer.size() && remaining)
+                {
+                    recbuffer.reserve(len + remaining);
+                }
+                recbuffer.append(data, len);
+            },
+            [&recbuffer, &impl]()
+            {
+                impl.wsHandleMsgCb(&recbuffer[0], recbuffer.size());
+                recbuffer.clear();
+            });
+        }
+    }
+    uint64_t stringSum = received;
+    double stringTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t expectedSum = 0;
+    for (const std::string& frame: frames)
+    {
+        expectedSum += checksum(frame.data(), frame.size());
+    }
+    expectedSum *= kRounds;
+    ASSERT_CHAT_TEST(poolSum == expectedSum, "Wrong frames reassembled in pooled buffers");
+    ASSERT_CHAT_TEST(stringSum == expectedSum, "Wrong frames reassembled in std::string");
+
+    double totalMB = (double)totalSize * kRounds / (1024 * 1024);
+    postLog("Reassembly of " + std::to_string(kFrames * kRounds) + " fragmented frames (" + std::to_string((int)totalMB) + " MB) "
+            + "up to the handler of the commands: " + std::to_string(poolTime > 0 ? totalMB / poolTime : 0)
+            + " MB/s with RecvBufferPool, " + std::to_string(stringTime > 0 ? totalMB / stringTime : 0) + " MB/s with std::string");
+}
+
+// exposes the cache of received keys of a chat
+class UnitTestProtocolHandler : public strongvelope::ProtocolHandler
+{
+public:
+    UnitTestProtocolHandler(karere::UserAttrCache& userAttrCache, strongvelope::PairwiseKeyCache& pairwiseKeys,
+                            const StaticBuffer& privKey, SqliteDb& db, karere::Id chatid)
+        : strongvelope::ProtocolHandler(karere::Id(0x2001), privKey, privKey, StaticBuffer(nullptr, 0), userAttrCache,
+                                        pairwiseKeys, nullptr, db, chatid, false, nullptr, 0, karere::Id::inval(), nullptr)
+    {}
+    using strongvelope::ProtocolHandler::kMaxResidentKeys;
+    using strongvelope::ProtocolHandler::getKey;
+    bool isLoaded(strongvelope::UserKeyId ukid) const { return mKeys.find(ukid) != mKeys.end(); }
+    size_t loadedKeys() const { return mKeys.size(); }
+};
+
+/**
+ * @brief TEST_SendKeyCache
+ *
+ * This test does the following:
+ *
+ * - Create the keys handler of a chat, with more keys in its db than fit in memory
+ * - Request all the keys
+ * + Check each one is loaded from the db, and the least recently used ones are evicted
+ * so no more than kMaxResidentKeys are kept in memory
+ * - Request a key in memory, and one that was evicted
+ * + Check the first one is found in memory and the second one is loaded from the db again
+ * - Request a key that isn't in the db
+ * + Check it fails, and it's counted as not found
+ */
+void MegaChatUnitTest::TEST_SendKeyCache()
+{
+    static const uint64_t kChatid = 0x3001;
+    static const uint64_t kSender = 0x1001;
+    static const size_t kKeys = 100;
+
+    std::string path = LOCAL_PATH + "/sendkeys.db";
+    remove(path.c_str());
+    ::mega::Mutex mutex(true);
+    ::mega::MegaApi *megaApi = new ::mega::MegaApi("MBoVFSyZ", LOCAL_PATH.c_str(), "MEGAChatUnitTest");
+    UnitTestWebsocketsIO *websocketsIO = new UnitTestWebsocketsIO(&mutex, megaApi);
+    UnitTestApp app;
+    karere::Client *client = new karere::Client(*megaApi, websocketsIO, app, LOCAL_PATH, 0);
+    ASSERT_CHAT_TEST(client->db.open(path.c_str(), false), "Can't open database at " + path);
+    client->db.simpleQuery(karere::gDbSchema);
+
+    auto keyData = [](uint64_t keyid)
+    {
+        return std::string(strongvelope::SVCRYPTO_KEY_SIZE, (char)('a' + keyid % 26));
+    };
+    for (uint64_t keyid = 0; keyid < kKeys; keyid++)
+    {
+        std::string key = keyData(keyid);
+        client->db.query("insert into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
+                         kChatid, kSender, keyid, StaticBuffer(key.data(), key.size()), 0);
+    }
+
+    {
+        char privKey[32];
+        randombytes_buf(privKey, sizeof(privKey));
+        karere::UserAttrCache userAttrCache(*client);
+        strongvelope::PairwiseKeyCache pairwiseKeys(userAttrCache, StaticBuffer(privKey, sizeof(privKey)));
+        UnitTestProtocolHandler handler(userAttrCache, pairwiseKeys, StaticBuffer(privKey, sizeof(privKey)),
+                                        client->db, karere::Id(kChatid));
+        ASSERT_CHAT_TEST(kKeys > UnitTestProtocolHandler::kMaxResidentKeys, "Not enough keys to evict any of them");
+
+        strongvelope::ProtocolHandler::resetKeyStats();
+        const strongvelope::ProtocolHandler::KeyStats& stats = strongvelope::ProtocolHandler::keyStats();
+        auto getKey = [&handler, &keyData](uint64_t keyid) -> bool
+        {
+            auto pms = handler.getKey(strongvelope::UserKeyId(karere::Id(kSender), keyid));
+            return pms.succeeded() && pms.value() && std::string(pms.value()->buf(), pms.value()->dataSize()) == keyData(keyid);
+        };
+
+        // on demand, keeping only the most recently used ones
+        for (uint64_t keyid = 0; keyid < kKeys; keyid++)
+        {
+            ASSERT_CHAT_TEST(getKey(keyid), "Key " + std::to_string(keyid) + " not loaded from the db");
+            ASSERT_CHAT_TEST(handler.loadedKeys() <= UnitTestProtocolHandler::kMaxResidentKeys,
+                             "More than kMaxResidentKeys keys in memory: " + std::to_string(handler.loadedKeys()));
+        }
+        size_t evicted = kKeys - UnitTestProtocolHandler::kMaxResidentKeys;
+        ASSERT_CHAT_TEST(stats.dbLoads == kKeys && stats.hits == 0, "Keys not loaded from the db once each");
+        ASSERT_CHAT_TEST(stats.evictions == evicted, "Wrong number of evicted keys: " + std::to_string(stats.evictions));
+        for (uint64_t keyid = 0; keyid < kKeys; keyid++)
+        {
+            bool loaded = handler.isLoaded(strongvelope::UserKeyId(karere::Id(kSender), keyid));
+            ASSERT_CHAT_TEST(loaded == (keyid >= evicted), "Key " + std::to_string(keyid) + (loaded ? " kept in memory" : " evicted")
+                             + " out of LRU order");
+        }
+
+        // in memory: found there, and becomes the most recently used one
+        ASSERT_CHAT_TEST(getKey(evicted), "Key in memory not found");
+        ASSERT_CHAT_TEST(stats.hits == 1 && stats.dbLoads == kKeys, "Key in memory loaded from the db");
+
+        // evicted: loaded again, evicting the least recently used one, but not the one just used
+        ASSERT_CHAT_TEST(getKey(0), "Evicted key not loaded from the db again");
+        ASSERT_CHAT_TEST(stats.dbLoads == kKeys + 1 && stats.evictions == evicted + 1, "Evicted key not loaded from the db again");
+        ASSERT_CHAT_TEST(handler.isLoaded(strongvelope::UserKeyId(karere::Id(kSender), evicted)), "Recently used key evicted");
+        ASSERT_CHAT_TEST(!handler.isLoaded(strongvelope::UserKeyId(karere::Id(kSender), evicted + 1)), "Least recently used key kept in memory");
+
+        // unknown
+        ASSERT_CHAT_TEST(!getKey(kKeys), "Unknown key found");
+        ASSERT_CHAT_TEST(stats.notFound == 1, "Unknown key not counted as not found");
+        strongvelope::ProtocolHandler::resetKeyStats();
+        ASSERT_CHAT_TEST(stats.hits == 0 && stats.dbLoads == 0 && stats.notFound == 0 && stats.evictions == 0, "Key stats not reset");
+    }
+
+    client->terminate();
+    delete client;
+    delete websocketsIO;
+    delete megaApi;
+    remove(path.c_str());
+}
+
+/**
+ * @brief TEST_SearchIndex
+ *
+ * This test does the following:
+ *
+ * - Create a database with a history of 200k text messages (20k in debug builds) and some
+ * others, as a cache from a version without the full-text index
+ * - Create the full-text index
+ * + Check no message is indexed yet
+ * - Index the history in batches, while adding, editing and deleting messages, both indexed
+ * and still pending
+ * + Check the index is consistent with the history, and finds the same messages as a scan
+ * - Log the time to create the index, the time of the longest batch and of indexing the whole
+ * history at once, and the time of a search with the index and scanning the history
+ */
+void MegaChatUnitTest::TEST_SearchIndex()
+{
+#ifdef NDEBUG
+    static const int kMessages = 200000;
+#else
+    static const int kMessages = 20000;
+#endif
+    static const unsigned kBatch = 2000;
+    static const int kWords = 500;
+    static const int kChats = 10;
+
+    std::string path = LOCAL_PATH + "/searchindex.db";
+    remove(path.c_str());
+    SqliteDb db;
+    ASSERT_CHAT_TEST(db.open(path.c_str(), false), "Can't open database at " + path);
+    db.simpleQuery(karere::gDbSchema);
+
+    // distinct words, none of them part of another one, so a scan finds the same as the index
+    auto word = [](int i)
+    {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "kw%04d", i);
+        return std::string(buf);
+    };
+    std::mt19937_64 rng(42);
+    int64_t msgid = 0;
+    auto addMessage = [&db, &rng, &msgid](const std::string& text, unsigned char type, uint8_t isEncrypted)
+    {
+        msgid++;
+        db.query("insert into history(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+                 "values(?,?,?,?,?,?,?,?,?,?,?)", (int)(msgid / kChats), msgid % kChats, msgid, 0, type,
+                 (int64_t)(0x1000 + rng() % 10), (int)(1500000000 + msgid), 0, StaticBuffer(text.data(), text.size()),
+                 0, isEncrypted);
+    };
+    auto randomText = [&rng, &word]()
+    {
+        std::string text;
+        for (int i = 0; i < 8; i++)
+        {
+            text.append(i ? " " : "").append(word(rng() % kWords));
+        }
+        return text;
+    };
+    for (int i = 0; i < kMessages; i++)
+    {
+        // one in 16 isn't a decrypted text message, so it isn't indexed
+        int kind = rng() % 16;
+        addMessage(randomText(), (kind == 0) ? chatd::Message::kMsgAttachment : chatd::Message::kMsgNormal, (kind == 1) ? 1 : 0);
+    }
+    db.commit();
+
+    auto start = std::chrono::steady_clock::now();
+    bool hasIndex = ChatdSqliteDb::initSearchIndex(db);
+    double initTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!hasIndex)
+    {
+        postLog("SQLite has no FTS5, the history can't be indexed");
+        return;
+    }
+
+    auto intValue = [&db](const char* sql) -> int
+    {
+        SqliteStmt stmt(db, sql);
+        stmt.stepMustHaveData("intValue");
+        return stmt.intCol(0);
+    };
+    ASSERT_CHAT_TEST(intValue("select value from vars where name = 'history_fts_pending'") == kMessages,
+                     "History indexed when the index was created");
+    int64_t lastPending = msgid;
+    double maxBatchTime = 0;
+    double indexTime = 0;
+    int batches = 0;
+    bool done = false;
+    while (!done)
+    {
+        start = std::chrono::steady_clock::now();
+        done = ChatdSqliteDb::indexHistory(db, kBatch);
+        double batchTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        maxBatchTime = std::max(maxBatchTime, batchTime);
+        indexTime += batchTime;
+        batches++;
+
+        // meanwhile, the app changes both the indexed history and the pending one
+        int pending = done ? 0 : intValue("select value from vars where name = 'history_fts_pending'");
+        ASSERT_CHAT_TEST(done || pending < lastPending, "History not indexed newest first");
+        lastPending = pending;
+        addMessage(randomText() + " kwnew", chatd::Message::kMsgNormal, 0);
+        db.query("update history set data = cast(data || ' kwedit' as blob), updated = 1 where rowid in (?, ?)",
+                 (int64_t)(rng() % msgid + 1), (int64_t)(rng() % msgid + 1));
+        db.query("delete from history where rowid in (?, ?)", (int64_t)(rng() % msgid + 1), (int64_t)(rng() % msgid + 1));
+    }
+    ASSERT_CHAT_TEST(batches == (kMessages + kBatch - 1) / kBatch, "Wrong number of batches: " + std::to_string(batches));
+    try
+    {
+        // with rank = 1, the index is checked against the history too
+        db.simpleQuery("insert into history_fts(history_fts, rank) values('integrity-check', 1)");
+    }
+    catch (std::exception& e)
+    {
+        ASSERT_CHAT_TEST(false, std::string("The index doesn't match the history: ") + e.what());
+    }
+    ASSERT_CHAT_TEST(ChatdSqliteDb::indexHistory(db, kBatch), "History not indexed after the last batch");
+
+    // what opening the db took when the whole history was indexed at once
+    start = std::chrono::steady_clock::now();
+    db.simpleQuery("insert into history_fts(history_fts) values('rebuild')");
+    double rebuildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    auto search = [&db](bool withIndex, karere::Id chatid, const std::string& query, double& time)
+    {
+        std::vector<ChatdSqliteDb::SearchResult> results;
+        auto searchStart = std::chrono::steady_clock::now();
+        ChatdSqliteDb::searchHistory(db, withIndex, chatid, query, kMessages, 0, results);
+        time += std::chrono::duration<double>(std::chrono::steady_clock::now() - searchStart).count();
+        std::set<uint64_t> msgids;
+        for (auto& result: results)
+        {
+            msgids.insert(result.msg->id().val);
+        }
+        return msgids;
+    };
+    std::vector<std::string> queries = { "kwnew", "kwedit", word(7) };
+    for (int i = 0; i < 20; i++)
+    {
+        queries.push_back(word(rng() % kWords) + " " + word(rng() % kWords));
+    }
+    double indexSearchTime = 0;
+    double scanSearchTime = 0;
+    for (auto& query: queries)
+    {
+        for (karere::Id chatid: { karere::Id::inval(), karere::Id(3) })
+        {
+            std::set<uint64_t> found = search(true, chatid, query, indexSearchTime);
+            ASSERT_CHAT_TEST(found == search(false, chatid, query, scanSearchTime), "The index and a scan found different messages for '" + query + "'");
+            ASSERT_CHAT_TEST(!found.empty() || chatid.isValid(), "Nothing found for '" + query + "'");
+        }
+    }
+    db.close();
+    remove(path.c_str());
+
+    size_t searches = queries.size() * 2;
+    postLog("Full-text index of " + std::to_string(kMessages) + " messages: created in " + std::to_string(initTime * 1000)
+            + " ms, indexed in " + std::to_string(batches) + " batches of " + std::to_string(kBatch) + " (" + std::to_string(indexTime * 1000)
+            + " ms, the longest one " + std::to_string(maxBatchTime * 1000) + " ms), instead of "
+            + std::to_string(rebuildTime * 1000) + " ms at once. Search: " + std::to_string(indexSearchTime * 1000 / searches)
+            + " ms with the index, " + std::to_string(scanSearchTime * 1000 / searches) + " ms scanning the history");
+}
+
+// the connection of a chat that never connects, to create a chatd::Chat without chatd::Client::createChat()
+class UnitTestConnection : public chatd::Connection
+{
+public:
+    UnitTestConnection(chatd::Client& chatdClient) : chatd::Connection(chatdClient, 0)
+    {
+        // already disconnected, so its destruction doesn't start a reconnection timer
+        mState = kStateDisconnected;
+    }
+};
+
+// a group chat that receives the new messages of a history fetch, as if they came from chatd
+class UnitTestChat : public chatd::Chat
+{
+public:
+    UnitTestChat(chatd::Connection& conn, karere::Id chatid, chatd::Listener* listener,
+                 const karere::SetOfIds& users, chatd::ICrypto* crypto)
+        : chatd::Chat(conn, chatid, listener, users, 0, crypto, true)
+    {}
+    using chatd::Chat::msgIncoming;
+    void setFetchingNewFromServer() { mServerFetchState = chatd::kHistFetchingNewFromServer; }
+};
+
+// decrypts in the background the messages received during a fetch, when the test says so
+class UnitTestCrypto : public chatd::ICrypto
+{
+public:
+    std::map<karere::Id, std::pair<chatd::Message*, promise::Promise<chatd::Message*>>> pending;
+
+    UnitTestCrypto() : chatd::ICrypto(nullptr) {}
+    void decrypt(karere::Id msgid)
+    {
+        auto it = pending.find(msgid);
+        chatd::Message* msg = it->second.first;
+        promise::Promise<chatd::Message*> pms = it->second.second;
+        pending.erase(it);
+        msg->setEncrypted(chatd::Message::kNotEncrypted);
+        pms.resolve(msg);
+    }
+    virtual promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* msg)
+    {
+        msg->setEncrypted(chatd::Message::kNotEncrypted);
+        return msg;
+    }
+    virtual promise::Promise<chatd::Message*> msgDecryptInBackground(chatd::Message* msg)
+    {
+        auto& entry = pending[msg->id()];
+        entry.first = msg;
+        return entry.second;
+    }
+    virtual void setUsers(karere::SetOfIds*) {}
+    virtual promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
+    msgEncrypt(chatd::Message*, const karere::SetOfIds&, chatd::MsgCommand*) { return ::promise::Error("Not supported"); }
+    virtual void onKeyReceived(chatd::KeyId, karere::Id, karere::Id, const char*, uint16_t) {}
+    virtual void onKeyConfirmed(chatd::KeyId, chatd::KeyId) {}
+    virtual void onKeyRejected() {}
+    virtual void resetSendKey() {}
+    virtual bool handleLegacyKeys(chatd::Message&) { return false; }
+    virtual void randomBytes(void* buf, size_t bufsize) const { randombytes_buf(buf, bufsize); }
+    virtual promise::Promise<std::shared_ptr<Buffer>>
+    encryptChatTitle(const std::string&, uint64_t, bool) { return ::promise::Error("Not supported"); }
+    virtual promise::Promise<chatd::KeyCommand*>
+    encryptUnifiedKeyForAllParticipants(uint64_t) { return ::promise::Error("Not supported"); }
+    virtual promise::Promise<std::string> decryptChatTitleFromApi(const Buffer&) { return ::promise::Error("Not supported"); }
+    virtual promise::Promise<std::string> encryptUnifiedKeyToUser(karere::Id) { return ::promise::Error("Not supported"); }
+    virtual promise::Promise<std::string>
+    decryptUnifiedKey(std::shared_ptr<Buffer>&, uint64_t, uint64_t) { return ::promise::Error("Not supported"); }
+    virtual promise::Promise<std::shared_ptr<std::string>> getUnifiedKey() { return ::promise::Error("Not supported"); }
+    virtual bool previewMode() { return false; }
+    virtual bool isPublicChat() { return false; }
+    virtual void setPrivateChatMode() {}
+    virtual void onHistoryReload() {}
+    virtual uint64_t getPublicHandle() const { return karere::Id::inval().val; }
+    virtual void setPublicHandle(const uint64_t) {}
+};
+
+// records the new messages notified to the app, in the order they are notified
+class UnitTestChatListener : public chatd::Listener
+{
+public:
+    SqliteDb& mDb;
+    std::vector<karere::Id> received;
+
+    UnitTestChatListener(SqliteDb& db) : mDb(db) {}
+    virtual void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf) { dbIntf = new ChatdSqliteDb(chat, mDb); }
+    virtual void onOnlineStateChange(chatd::ChatState) {}
+    virtual void onRecvNewMessage(chatd::Idx, chatd::Message& msg, chatd::Message::Status) { received.push_back(msg.id()); }
+};
+
+/**
+ * @brief TEST_DecryptionOrder
+ *
+ * This test does the following:
+ *
+ * - Receive 100 new messages in a chat that is fetching history from server, with a crypto
+ * module that decrypts them in the background when the test says so
+ * + Check decryption halts at the first message, and the rest are started in the background
+ * - Decrypt the messages from the last one to the second one, except the one in the middle
+ * + Check none is notified to the app while the first one is not decrypted
+ * - Decrypt the first message
+ * + Check the messages up to the middle one are notified, in order
+ * - Decrypt the middle message
+ * + Check the rest are notified, in order
+ */
+void MegaChatUnitTest::TEST_DecryptionOrder()
+{
+    static const uint64_t kChatid = 0x3001;
+    static const uint64_t kSender = 0x1001;
+    static const uint64_t kMessages = 100;
+    static const uint64_t kMiddle = kMessages / 2;
+
+    ::mega::Mutex mutex(true);
+    ::mega::MegaApi *megaApi = new ::mega::MegaApi("MBoVFSyZ", LOCAL_PATH.c_str(), "MEGAChatUnitTest");
+    UnitTestWebsocketsIO *websocketsIO = new UnitTestWebsocketsIO(&mutex, megaApi);
+    UnitTestApp app;
+    karere::Client *client = new karere::Client(*megaApi, websocketsIO, app, LOCAL_PATH, 0);
+    ASSERT_CHAT_TEST(client->initWithAnonymousSession() == karere::Client::kInitAnonymousMode, "Can't init the client");
+
+    {
+        UnitTestConnection connection(*client->mChatdClient);
+        UnitTestChatListener listener(client->db);
+        UnitTestCrypto* crypto = new UnitTestCrypto;   // owned by the chat
+        karere::SetOfIds users;
+        users.insert(karere::Id(kSender));
+        UnitTestChat chat(connection, karere::Id(kChatid), &listener, users, crypto);
+
+        std::vector<karere::Id> expected;
+        chat.setFetchingNewFromServer();
+        for (uint64_t i = 1; i <= kMessages; i++)
+        {
+            std::string text = "message " + std::to_string(i);
+            chatd::Message* msg = new chatd::Message(karere::Id(i), karere::Id(kSender), (uint32_t)i, 0,
+                                                     text.c_str(), text.size(), false, 0, chatd::Message::kMsgNormal);
+            msg->setEncrypted(chatd::Message::kEncryptedPending);
+            chat.msgIncoming(true, msg);
+            expected.push_back(karere::Id(i));
+        }
+        ASSERT_CHAT_TEST(crypto->pending.size() == kMessages, "Decryption of the queued messages not started in the background: "
+                         + std::to_string(crypto->pending.size()) + " started");
+        ASSERT_CHAT_TEST(listener.received.empty(), "Messages notified before being decrypted");
+
+        // in the background, they may finish in any order
+        for (uint64_t i = kMessages; i > 1; i--)
+        {
+            if (i != kMiddle)
+            {
+                crypto->decrypt(karere::Id(i));
+            }
+        }
+        ASSERT_CHAT_TEST(listener.received.empty(), "Messages notified before the first one");
+
+        crypto->decrypt(karere::Id(1));
+        ASSERT_CHAT_TEST(listener.received == std::vector<karere::Id>(expected.begin(), expected.begin() + kMiddle - 1),
+                         "Wrong messages notified after decrypting the first one: " + std::to_string(listener.received.size()));
+
+        crypto->decrypt(karere::Id(kMiddle));
+        ASSERT_CHAT_TEST(listener.received == expected, "Messages not notified in order: " + std::to_string(listener.received.size()));
+        ASSERT_CHAT_TEST(crypto->pending.empty(), "Messages left pending");
+    }
+
+    client->terminate();
+    delete client;
+    delete websocketsIO;
+    delete megaApi;
+}
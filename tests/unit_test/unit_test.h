@@ -0,0 +1,116 @@
+/**
+ * @file tests/unit_test.h
+ * @brief MEGAchat unit tests and microbenchmarks
+ *
+ * (c) 2016 by Mega Limited, Wellsford, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+
+#ifndef CHATUNITTEST_H
+#define CHATUNITTEST_H
+
+#include <iostream>
+#include <string>
+
+// Tests of this executable don't need accounts nor connectivity. Tests that need them go to sdk_test
+
+class ChatTestException : public std::exception
+{
+public:
+    ChatTestException(const std::string& file, int line, const std::string &msg);
+
+    virtual const char *what() const throw();
+    virtual const char *msg() const throw();
+
+private:
+    int mLine;
+    std::string mFile;
+    std::string mExceptionText;
+    std::string mMsg;
+};
+
+// do-while is used to forze add semicolon at the end of sentence
+#define ASSERT_CHAT_TEST(a, msg) \
+    do { \
+        if (!(a) && !this->testHasFailed) \
+        { \
+            throw ChatTestException(__FILE__, __LINE__, msg); \
+        } \
+    } \
+    while(false) \
+
+#define EXECUTE_TEST(test, title) \
+    do { \
+        try \
+        { \
+            t.testHasFailed = false; \
+            std::cout << "[" << " RUN    " << "] " << title << std::endl; \
+            test; \
+            std::cout << "[" << "     OK " << "] " << title << std::endl; \
+            t.mOKTests ++; \
+        } \
+        catch(ChatTestException e) \
+        { \
+            t.testHasFailed = true; \
+            std::cout << e.what() << std::endl; \
+            if (e.msg()) \
+            { \
+                std::cout << e.msg() << std::endl; \
+            } \
+            std::cout << "[" << " FAILED " << "] " << title << std::endl; \
+            t.mFailedTests ++; \
+        } \
+    } \
+    while(false) \
+
+class MegaChatUnitTest
+{
+public:
+    MegaChatUnitTest();
+
+    // Global test environment initialization
+    void init();
+    // Global test environment clear up
+    void terminate();
+
+    // benchmark results and other details, printed under the running test
+    void postLog(const std::string &msg);
+
+    void TEST_DbQueryPlans();
+    void TEST_UrlDetection();
+    void TEST_MarshallCallThroughput();
+    void TEST_IdMapVsStdMap();
+    void TEST_IdMapEraseHeldIterator();
+    void TEST_IdMapLookupHeldIterator();
+    void TEST_ParallelSignatureVerification();
+    void TEST_TraceSpans();
+    void TEST_AsyncLogger();
+    void TEST_DatabaseWalMode();
+    void TEST_HistoryInsertBatching();
+    void TEST_UserAttrCache();
+    void TEST_FrameReassembly();
+    void TEST_SendKeyCache();
+    void TEST_SearchIndex();
+    void TEST_DecryptionOrder();
+
+    unsigned mOKTests;
+    unsigned mFailedTests;
+    bool testHasFailed = false;
+
+    static const std::string LOCAL_PATH;
+};
+
+#endif // CHATUNITTEST_H